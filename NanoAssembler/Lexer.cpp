@@ -0,0 +1,140 @@
+#include "Lexer.h"
+#include <fstream>
+#include <iterator>
+
+#ifdef NANOASSEMBLER_MAPPED_SOURCE
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <unistd.h>
+#endif
+
+SourceFile::SourceFile(const std::string& file) : text(nullptr), length(0), mapped(false), opened(false) {
+#ifdef NANOASSEMBLER_MAPPED_SOURCE
+	int descriptor = open(file.c_str(), O_RDONLY | O_CLOEXEC);
+	if (descriptor >= 0) {
+		struct stat status;
+		if (fstat(descriptor, &status) == 0 && S_ISREG(status.st_mode)) {
+			length = static_cast<size_t>(status.st_size);
+			// Private mapping so lowercasing does not write to the file. Empty files can not be mapped
+			void* pages = length ? mmap(nullptr, length, PROT_READ | PROT_WRITE, MAP_PRIVATE, descriptor, 0) : nullptr;
+			if (pages != MAP_FAILED) {
+				text = static_cast<char*>(pages);
+				mapped = length != 0;
+				opened = true;
+			}
+		}
+		close(descriptor);
+		if (opened) {
+			return;
+		}
+	}
+#endif
+	// Files that can not be mapped e.g. pipes are read
+	std::ifstream f(file, std::ios::in | std::ios::binary);
+	if (f.is_open()) {
+		buffer.assign(std::istreambuf_iterator<char>(f), std::istreambuf_iterator<char>());
+		text = &buffer[0];
+		length = buffer.size();
+		opened = true;
+	}
+}
+
+SourceFile::~SourceFile() {
+#ifdef NANOASSEMBLER_MAPPED_SOURCE
+	if (mapped) {
+		munmap(text, length);
+	}
+#endif
+}
+
+bool SourceFile::IsOpen() const {
+	return opened;
+}
+
+char* SourceFile::data() {
+	return text;
+}
+
+size_t SourceFile::size() const {
+	return length;
+}
+
+Lexer::Lexer(char* text, size_t size) : position(text), end(text + size), lineNumber(1) {
+
+}
+
+/**
+ * @return True if the character separates tokens
+*/
+static inline bool isSeparator(char c) {
+	return c == ' ' || c == '\t' || c == '\r' || c == ',' || c == '\v' || c == '\f';
+}
+
+bool Lexer::next(SourceLine& line) {
+	while (position < end) {
+		char* lineStart = position;
+		char* textStart = nullptr;
+		char* textEnd = nullptr;
+		line.tokenCount = 0;
+		line.lineNumber = lineNumber;
+		while (position < end && *position != '\n') {
+			char c = *position;
+			if (isSeparator(c)) {
+				position++;
+				continue;
+			}
+			if (c == ';') {
+				// The comment runs to the end of the line
+				while (position < end && *position != '\n') {
+					position++;
+				}
+				break;
+			}
+			char* tokenStart = position;
+			bool quoted = false;
+			while (position < end && *position != '\n') {
+				c = *position;
+				if (quoted) {
+					// Character literals keep their case and may contain separators and escaped quotes
+					if (c == '\\' && position + 1 < end && position[1] != '\n') {
+						position++;
+					}
+					else if (c == '\'') {
+						quoted = false;
+					}
+				}
+				else if (c == '\'') {
+					quoted = true;
+				}
+				else if (isSeparator(c) || c == ';') {
+					break;
+				}
+				else if (c >= 'A' && c <= 'Z') {
+					// Only written when needed so that mapped pages without upper case characters are not copied
+					*position = c - 'A' + 'a';
+				}
+				position++;
+			}
+			if (line.tokenCount < MAX_LINE_TOKENS) {
+				line.tokens[line.tokenCount].text = std::string_view(tokenStart, position - tokenStart);
+				line.tokens[line.tokenCount].column = static_cast<unsigned int>(tokenStart - lineStart + 1);
+			}
+			line.tokenCount++;
+			if (!textStart) {
+				textStart = tokenStart;
+			}
+			textEnd = position;
+		}
+		// Skip the line feed
+		if (position < end) {
+			position++;
+		}
+		lineNumber++;
+		if (line.tokenCount) {
+			line.text = std::string_view(textStart, textEnd - textStart);
+			return true;
+		}
+	}
+	return false;
+}
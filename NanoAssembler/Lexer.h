@@ -0,0 +1,77 @@
+#pragma once
+#include <string>
+#include "Types.h"
+
+#if (defined(__unix__) || defined(__APPLE__)) && !defined(NANOASSEMBLER_NO_MAPPED_SOURCE)
+#define NANOASSEMBLER_MAPPED_SOURCE
+#endif
+
+/**
+ * \brief SourceFile holds the text of an assembler file while it is assembled
+ *
+ * On POSIX hosts the file is mapped copy-on-write instead of read. The lexer lowercases the tokens in place so only
+ * the pages holding upper case characters are copied. The tokens are views in to the text so the file has to outlive them
+*/
+class SourceFile {
+public:
+	/**
+	 * Maps or reads the file
+	 * @param file Path of the assembler file
+	*/
+	SourceFile(const std::string& file);
+
+	/**
+	 * Unmaps the file
+	*/
+	~SourceFile();
+
+	SourceFile(const SourceFile&) = delete;
+	SourceFile& operator=(const SourceFile&) = delete;
+
+	/**
+	 * @return True if the file could be read
+	*/
+	bool IsOpen() const;
+
+	/**
+	 * @return Text of the file. Writable so that the lexer can lowercase it
+	*/
+	char* data();
+
+	/**
+	 * @return Size of the text
+	*/
+	size_t size() const;
+private:
+	char* text; /**< Text of the file */
+	size_t length; /**< Size of the text */
+	bool mapped; /**< Was the file mapped */
+	bool opened; /**< Could the file be read */
+	std::string buffer; /**< Text of the file when it was read instead of mapped */
+};
+
+/**
+ * \brief Lexer splits assembler source in to lines of tokens in a single pass without allocating
+ *
+ * Tokens are separated by whitespace and commas and ';' starts a comment which runs to the end of the line. Character
+ * literals e.g. ' ' and ';' are single tokens. The tokens are lowercased in place except for the character literals
+*/
+class Lexer {
+public:
+	/**
+	 * @param text Text to split. Modified in place
+	 * @param size Size of the text
+	*/
+	Lexer(char* text, size_t size);
+
+	/**
+	 * Reads the next line which has at least one token. Empty lines and comments are skipped
+	 * @param[out] line Line to be updated
+	 * @return True if a line was read, false at the end of the text
+	*/
+	bool next(SourceLine& line);
+private:
+	char* position; /**< Next character to read */
+	char* end; /**< End of the text */
+	unsigned int lineNumber; /**< Number of the line at position */
+};
@@ -1,4 +1,5 @@
 #include "Mapper.h"
+#include <charconv>
 
 Mapper::Mapper() {
 	registerMap["reg0"] = 0x00;
@@ -44,207 +45,83 @@ Mapper::Mapper() {
 	opcodeMap["printc"] = std::make_pair(29, 1);
 	opcodeMap["syscall"] = std::make_pair(30, 1);
 	opcodeMap["memcpy"]= std::make_pair(31, 1);
-}
-
-Mapper::~Mapper() {
+	// Bulk memory operations share the memcpy opcode and are selected by the destination register bits
+	opcodeMap["memset"] = std::make_pair(31 | (1 << 5), 1);
+	opcodeMap["memcmp"] = std::make_pair(31 | (2 << 5), 1);
+	opcodeMap["memchr"] = std::make_pair(31 | (3 << 5), 1);
 
+	// Vector opcode byte holds the opcode in the low 4 bits and the lane size in the next 2 bits
+	const char* vadd[] = { "vadd8", "vadd16", "vadd32", "vadd64" };
+	const char* vsub[] = { "vsub8", "vsub16", "vsub32", "vsub64" };
+	const char* vcmpeq[] = { "vcmpeq8", "vcmpeq16", "vcmpeq32", "vcmpeq64" };
+	const char* vcmpgt[] = { "vcmpgt8", "vcmpgt16", "vcmpgt32", "vcmpgt64" };
+	for (unsigned char lane = 0; lane < 4; lane++) {
+		vectorOpcodeMap[vadd[lane]] = std::make_pair(0 | (lane << 4), VectorRegisters);
+		vectorOpcodeMap[vsub[lane]] = std::make_pair(1 | (lane << 4), VectorRegisters);
+		vectorOpcodeMap[vcmpeq[lane]] = std::make_pair(5 | (lane << 4), VectorRegisters);
+		vectorOpcodeMap[vcmpgt[lane]] = std::make_pair(6 | (lane << 4), VectorRegisters);
+	}
+	vectorOpcodeMap["vand"] = std::make_pair(2, VectorRegisters);
+	vectorOpcodeMap["vor"] = std::make_pair(3, VectorRegisters);
+	vectorOpcodeMap["vxor"] = std::make_pair(4, VectorRegisters);
+	vectorOpcodeMap["vload"] = std::make_pair(7, VectorLoad);
+	vectorOpcodeMap["vstore"] = std::make_pair(8, VectorStore);
 }
 
-bool Mapper::canMapLabel(std::string label, unsigned int instructionIndex, std::unordered_map<std::string, size_t> labelMap,
-	std::vector<AssemberInstruction> instructions) {
-
-	size_t labelIndex;
-	try {
-		labelIndex = labelMap.at(label);
-	}
-	catch (std::out_of_range) {
-		return false;
-	}
-	if (labelIndex == instructionIndex) {
-		return true;
-	}
-	if (labelIndex > instructionIndex) {
-		for (int i = instructionIndex; i < labelIndex; i++) {
-			if (!instructions[i].length) {
-				return false;
-			}
-		}
-	}
-	else {
-		for (int i = instructionIndex - 1; i >= labelIndex && i > 0; i--) {
-			if (!instructions[i].length) {
-				return false;
-			}
-			if (i == 0)
-				return true;
-		}
-	}
-	return true;
-}
-
-int Mapper::calculateSizeRequirement(std::string label, unsigned int instructionIndex, std::unordered_map<std::string, size_t> labelMap,
-	std::vector<AssemberInstruction> instructions) {
+Mapper::~Mapper() {
 
-	size_t labelIndex;
-	try {
-		labelIndex = labelMap.at(label);
-	}
-	catch (std::out_of_range) {
-		return 0;
-	}
-	if (labelIndex == instructionIndex) {
-		return 0;
-	}
-	int64_t delta;
-	if (labelIndex > instructionIndex) {
-		delta = sizeof(uint64_t) + 2; // assume max length for the jump instruction (10 bytes)
-		for (unsigned int i = instructionIndex + 1; i < labelIndex; i++) {
-			size_t instructionLength = instructions[i].length;
-			int unAssembled = 0;
-			if (instructionLength == 0) {
-				// Instruction hasn't been assembled yet because it contains label that hasn't been resolved, thus it's length is unknown
-				unAssembled++;
-			}
-			else {
-				delta += instructionLength;
-			}
-			if (unAssembled) {
-				// assume the unassembled instructions will take max space
-				delta += (unAssembled * (2 + sizeof(uint64_t)));
-			}
-		}
-	}
-	else {
-		delta = 0;
-		for (unsigned int i = instructionIndex - 1; i >= labelIndex; i--) {
-			size_t instructionLength = instructions[i].length;
-			int unAssembled = 0;
-			if (instructionLength == 0) {
-				// Instruction hasn't been assembled yet because it contains label that hasn't been resolved, thus it's length is unknown
-				unAssembled++;
-			}
-			else {
-				delta += instructionLength;
-			}
-			if (unAssembled) {
-				// assume the unassembled instructions will take max space
-				delta += (unAssembled * (2 + sizeof(uint64_t)));
-			}
-			if (i == 0)
-				break;
-		}
-		delta = -delta;
-	}
-	if (SCHAR_MIN <= delta && delta <= SCHAR_MAX) {
-		return (delta > 0) ? (sizeof(int8_t) + 2) : sizeof(int8_t);
-	}
-	else if (SHRT_MIN <= delta && delta <= SHRT_MAX) {
-		return (delta > 0) ? (sizeof(int16_t) + 2) : sizeof(int16_t);
-	}
-	else if (INT32_MIN <= delta && delta <= INT32_MAX) {
-		return (delta > 0) ? (sizeof(int32_t) + 2) : sizeof(int32_t);
-	}
-	return (delta > 0) ? (2 + sizeof(int64_t)) : sizeof(int64_t);
 }
 
-unsigned int Mapper::mapLabel(std::string label, unsigned int instructionIndex, std::unordered_map<std::string, size_t> labelMap,
-	std::vector<AssemberInstruction> &instructions, int64_t &value) {
-
-	size_t labelIndex;
-	try {
-		labelIndex = labelMap.at(label);
-	}
-	catch (std::out_of_range) {
-		return 0;
-	}
-	if (labelIndex == instructionIndex) {
-		return 0;
-	}
-	int64_t delta;
-	if (labelIndex > instructionIndex) {
-		delta = (instructions[instructionIndex].length) ? instructions[instructionIndex].length : sizeof(uint64_t) + 2; // assume max length for the jump instruction (10 bytes)
-		for (unsigned int i = instructionIndex + 1; i < labelIndex; i++) {
-			size_t instructionLength = instructions[i].length;
-			int unAssembled = 0;
-			if (instructionLength == 0) {
-				// Instruction hasn't been assembled yet because it contains label that hasn't been resolved, thus it's length is unknown
-				unAssembled++;
-				return 0;
-			}
-			else {
-				delta += instructionLength;
-			}
-			if (unAssembled) {
-				// assume the unassembled instructions will take max space
-				delta += (unAssembled * (2 + sizeof(uint64_t)));
-			}
-		}
-	}
-	else {
-		delta = 0; // assume max length for the jump instruction (10 bytes)
-		for (unsigned int i = instructionIndex - 1; i >= labelIndex; i--) {
-			size_t instructionLength = instructions[i].length;
-			int unAssembled = 0;
-			if (instructionLength == 0) {
-				// Instruction hasn't been assembled yet because it contains label that hasn't been resolved, thus it's length is unknown
-				unAssembled++;
-				return 0;
-			}
-			else {
-				delta += instructionLength;
-			}
-			if (unAssembled) {
-				// assume the unassembled instructions will take max space
-				delta += (unAssembled * (2 + sizeof(uint64_t)));
-			}
-			if (i == 0)
-				break;
-		}
-		delta = -delta;
-	}
-	value = delta;
-	std::cout << "delta " << delta << std::endl;
-	if (instructions[instructionIndex].length) {
-		return instructions[instructionIndex].length - 2;
-	}
-	if (SCHAR_MIN <= value && value <= SCHAR_MAX) {
-		if (delta > 0)
-			value -= (sizeof(int64_t) - sizeof(int8_t));
+unsigned int Mapper::labelSize(int64_t delta) {
+	if (INT8_MIN <= delta && delta <= INT8_MAX) {
 		return sizeof(int8_t);
 	}
-	else if (SHRT_MIN <= value && value <= SHRT_MAX - 1) {
-		if (delta > 0)
-			value -= sizeof(int16_t) - sizeof(int8_t);
+	else if (INT16_MIN <= delta && delta <= INT16_MAX) {
 		return sizeof(int16_t);
 	}
-	else if (INT32_MIN <= value && value <= INT32_MAX - 1) {
-		if (delta > 0)
-			value -= sizeof(int32_t) - sizeof(int8_t);
+	else if (INT32_MIN <= delta && delta <= INT32_MAX) {
 		return sizeof(int32_t);
 	}
 	return sizeof(int64_t);
 }
 
-bool Mapper::mapRegister(std::string regName, unsigned char& reg) {
-	try {
-		reg = registerMap.at(regName);
-		return true;
+bool Mapper::mapRegister(std::string_view regName, unsigned char& reg) {
+	auto registerNumber = registerMap.find(regName);
+	if (registerNumber == registerMap.end()) {
+		return false;
 	}
-	catch (std::out_of_range) {
+	reg = registerNumber->second;
+	return true;
+}
+
+bool Mapper::mapVectorRegister(std::string_view regName, unsigned char& reg, bool& wide) {
+	if (regName.length() != 2 || (regName[0] != 'x' && regName[0] != 'y') || regName[1] < '0' || regName[1] > '7') {
 		return false;
 	}
+	reg = regName[1] - '0';
+	wide = regName[0] == 'y';
+	return true;
 }
 
-bool Mapper::mapOpcode(std::string opcodeName, AssemberInstruction&instruction) {
-	try {
-		std::pair<unsigned char, unsigned int> opcode = opcodeMap[opcodeName];
-		instruction.opcode = opcode.first;
-		instruction.operands = opcode.second;
-		return true;
+bool Mapper::mapVectorOpcode(std::string_view opcodeName, AssemberInstruction& instruction, VectorOperands& form) {
+	auto vectorOpcode = vectorOpcodeMap.find(opcodeName);
+	if (vectorOpcode == vectorOpcodeMap.end()) {
+		return false;
 	}
-	catch (std::out_of_range) {
+	instruction.opcode = vectorOpcode->second.first;
+	instruction.operands = 2;
+	form = vectorOpcode->second.second;
+	return true;
+}
+
+bool Mapper::mapOpcode(std::string_view opcodeName, AssemberInstruction&instruction) {
+	auto opcode = opcodeMap.find(opcodeName);
+	if (opcode == opcodeMap.end()) {
 		return false;
 	}
+	instruction.opcode = opcode->second.first;
+	instruction.operands = opcode->second.second;
+	return true;
 }
 
 template<typename T> void Mapper::mapImmediate(unsigned char* bytes, T value) {
@@ -259,12 +136,12 @@ int Mapper::mapInteger(int64_t value64, unsigned char* bytes, unsigned int &leng
 		length = sizeof(int8_t);
 		return Byte;
 	}
-	else if (length == sizeof(int16_t) || (INT16_MIN <= value64 && value64 <= INT16_MAX)) {
+	else if (length == sizeof(int16_t) || (!length && INT16_MIN <= value64 && value64 <= INT16_MAX)) {
 		*reinterpret_cast<int16_t*>(bytes) = static_cast<int16_t>(value64);
 		length = sizeof(int16_t);
 		return Short;
 	}
-	else if (length == sizeof(int32_t) || (INT32_MIN <= value64 && value64 <= INT32_MAX)) {
+	else if (length == sizeof(int32_t) || (!length && INT32_MIN <= value64 && value64 <= INT32_MAX)) {
 		*reinterpret_cast<int32_t*>(bytes) = static_cast<int32_t>(value64);
 		length = sizeof(int32_t);
 		return Dword;
@@ -276,94 +153,109 @@ int Mapper::mapInteger(int64_t value64, unsigned char* bytes, unsigned int &leng
 	}
 }
 
-int Mapper::mapImmediate(std::string value, unsigned char* bytes, unsigned int &length) {
-	if (value.empty() || (value.length() == 1 && value[0] == '-'))
+/**
+ * Parses a character literal e.g. 'a' or '\n'
+ * @param text Text to parse
+ * @param[out] value Value of the character
+ * @return True if the text is a character literal
+*/
+static bool parseCharacter(std::string_view text, uint64_t& value) {
+	if (text.length() < 3 || text.front() != '\'' || text.back() != '\'') {
+		return false;
+	}
+	text = text.substr(1, text.length() - 2);
+	if (text.length() == 1) {
+		value = static_cast<unsigned char>(text[0]);
+		return true;
+	}
+	if (text.length() != 2 || text[0] != '\\') {
+		return false;
+	}
+	switch (text[1]) {
+	case 'n':
+		value = '\n';
+		return true;
+	case 'r':
+		value = '\r';
+		return true;
+	case 't':
+		value = '\t';
+		return true;
+	case '0':
+		value = '\0';
+		return true;
+	case '\\':
+	case '\'':
+		value = static_cast<unsigned char>(text[1]);
+		return true;
+	default:
+		return false;
+	}
+}
+
+/**
+ * Parses an unsigned integer. Hexadecimal values have 0x prefix and octal values 0 prefix
+ * @param text Text to parse
+ * @param[out] value Value of the integer
+ * @return 0 if the whole text is an integer, -1 if it is not an integer and -2 if it does not fit in 64 bits
+*/
+static int parseUnsigned(std::string_view text, uint64_t& value) {
+	int base = 10;
+	if (text.length() > 2 && text[0] == '0' && text[1] == 'x') {
+		base = 16;
+		text.remove_prefix(2);
+	}
+	else if (text.length() > 1 && text[0] == '0') {
+		base = 8;
+		text.remove_prefix(1);
+	}
+	if (text.empty()) {
 		return -1;
-	try {
-		if (value[0] == '-')
-		{
-			int64_t value64;
-			if (value.length() > 3 && value[1] == '\'' && value[value.length() - 1] == '\'') {
-				size_t diff = value.length() - 1 - 2;
-				if (diff == 1) {
-					value64 = -static_cast<int64_t>(value[2]);
-				}
-				else if (diff == 2 && value[2] == '\\') {
-					switch (value[3]) {
-					case 'n':
-						value64 = -'\n';
-						break;
-					case 'r':
-						value64 = -'\r';
-						break;
-					case 't':
-						value64 = -'t';
-						break;
-					default:
-						return -1;
-					}
+	}
+	std::from_chars_result result = std::from_chars(text.data(), text.data() + text.length(), value, base);
+	if (result.ec == std::errc::result_out_of_range) {
+		return -2;
+	}
+	return (result.ec == std::errc() && result.ptr == text.data() + text.length()) ? 0 : -1;
+}
 
-				}
-				else
-					return -1;
-			}
-			else
-				value64 = std::stoll(value, nullptr,0);
-			return mapInteger(value64, bytes, length);
+int Mapper::mapImmediate(std::string_view value, unsigned char* bytes, unsigned int &length) {
+	bool negative = !value.empty() && value[0] == '-';
+	if (negative) {
+		value.remove_prefix(1);
+	}
+	uint64_t value64;
+	if (!parseCharacter(value, value64)) {
+		int status = parseUnsigned(value, value64);
+		if (status) {
+			return status;
 		}
-		else {
-			uint64_t value64;
-			if (value.length() > 2 && value[0] == '\'' && value[value.length() - 1] == '\'') {
-				size_t diff = value.length() - 2;
-				if (diff == 1) {
-					value64 = static_cast<uint64_t>(value[1]);
-				}
-				else if (diff == 2 && value[1] == '\\') {
-					switch (value[2]) {
-					case 'n':
-						value64 = '\n';
-						break;
-					case 'r':
-						value64 = '\r';
-						break;
-					case 't':
-						value64 = 't';
-						break;
-					default:
-						return -1;
-					}
-				}
-				else
-					return -1;
-			}
-			else
-				value64 = std::stoull(value, nullptr, 0);
-			if (value64 <= UINT8_MAX) {
-				*reinterpret_cast<uint8_t*>(bytes) = static_cast<uint8_t>(value64);
-				length = sizeof(uint8_t);
-				return Byte;
-			}
-			else if (value64 <= UINT16_MAX) {
-				*reinterpret_cast<uint16_t*>(bytes) = static_cast<uint16_t>(value64);
-				length = sizeof(uint16_t);
-				return Short;
-			}
-			else if (value64 <= UINT32_MAX) {
-				*reinterpret_cast<uint32_t*>(bytes) = static_cast<uint32_t>(value64);
-				length = sizeof(uint32_t);
-				return Dword;
-			}
-			else {
-				*reinterpret_cast<uint64_t*>(bytes) = static_cast<uint64_t>(value64);
-				length = sizeof(uint64_t);
-				return Qword;
-			}
+	}
+	if (negative) {
+		// The magnitude of a negative value has to fit in a signed 64bit integer
+		if (value64 > static_cast<uint64_t>(INT64_MAX) + 1) {
+			return -2;
 		}
+		return mapInteger(static_cast<int64_t>(0 - value64), bytes, length);
 	}
-	catch (std::invalid_argument) {
-		return -1;
+	if (value64 <= UINT8_MAX) {
+		*reinterpret_cast<uint8_t*>(bytes) = static_cast<uint8_t>(value64);
+		length = sizeof(uint8_t);
+		return Byte;
 	}
-	catch (std::out_of_range) {
-		return -2;
+	else if (value64 <= UINT16_MAX) {
+		*reinterpret_cast<uint16_t*>(bytes) = static_cast<uint16_t>(value64);
+		length = sizeof(uint16_t);
+		return Short;
+	}
+	else if (value64 <= UINT32_MAX) {
+		*reinterpret_cast<uint32_t*>(bytes) = static_cast<uint32_t>(value64);
+		length = sizeof(uint32_t);
+		return Dword;
 	}
-}
\ No newline at end of file
+	else {
+		*reinterpret_cast<uint64_t*>(bytes) = static_cast<uint64_t>(value64);
+		length = sizeof(uint64_t);
+		return Qword;
+	}
+}
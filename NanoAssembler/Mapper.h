@@ -3,6 +3,7 @@
 #include <vector>
 #include <unordered_map>
 #include <string>
+#include <string_view>
 #include <climits>
 #include "Types.h"
 
@@ -31,62 +32,56 @@ public:
 	 * @param[out] instruction Instruction struct reference to update with opcode value
 	 * @return True if opcode was resolved, false if the opcode was unknown
 	*/
-	bool mapOpcode(std::string opcodeName, AssemberInstruction& instruction);
+	bool mapOpcode(std::string_view opcodeName, AssemberInstruction& instruction);
 
 	/**
 	 * Maps a text representation of register to its corresponding register value
 	 * @param[out] reg Reference to the value to hold the resolved register value
 	 * @return True if register name was resolved, false if the name was unknown
 	*/
-	bool mapRegister(std::string regName, unsigned char& reg);
+	bool mapRegister(std::string_view regName, unsigned char& reg);
 
 	/**
-	 * Maps a text representation of immediate value to bytes
-	 * @param value Text representation of integer
-	 * @param[out] bytes Pointer to array to hold the bytes of the integer
-	 * @param[out] length Reference to integer to hold the amount of bytes of the resolved immediate value
+	 * Maps a text representation of vector instruction to the vector opcode byte following EXTENDED_OPCODE
+	 * @param opcodeName Text representation of the vector instruction e.g. vadd32
+	 * @param[out] instruction Instruction struct reference to update with the vector opcode and lane size
+	 * @param[out] form Reference to hold the operand form of the instruction
+	 * @return True if the vector instruction was resolved, false if the name is not a vector instruction
 	*/
-	int mapImmediate(std::string value, unsigned char* bytes, unsigned int& length);
+	bool mapVectorOpcode(std::string_view opcodeName, AssemberInstruction& instruction, VectorOperands& form);
 
 	/**
-	 * Checks if the given text label can be resolved as relative address from the given instruction
-	 * @param label Name of the label to try mapping to address
-	 * @param instructionIndex The index of the instruction we try to resolve the relative label address from
-	 * @param labelMap Map structure holding all labels
-	 * @param instructions List of all the instructions
-	 * @return True if the label can be resolved to relative address from the current instruction, false if not
+	 * Maps a text representation of vector register to its number. xN registers are 128 bits wide and yN 256 bits wide,
+	 * xN is the lower half of yN
+	 * @param[out] reg Reference to the value to hold the resolved register number
+	 * @param[out] wide Reference to hold whether the register is 256 bits wide
+	 * @return True if register name was resolved, false if the name was unknown
 	*/
-	bool canMapLabel(std::string label, unsigned int instructionIndex, std::unordered_map<std::string, size_t> labelMap,
-		std::vector<AssemberInstruction> instructions);
-	
+	bool mapVectorRegister(std::string_view regName, unsigned char& reg, bool& wide);
+
 	/**
-	 * Calculate the size requirement in bytes for the relative label address from the current instruction.
-	 * Should be called only if canMapLabel() returns true
-     * @param label Name of the label to try mapping to address
-	 * @param instructionIndex The index of the instruction we try to resolve the relative label address from
-	 * @param labelMap Map structure holding all labels
-	 * @param instructions List of all the instructions
-	 * @return Size of the relative address in bytes
+	 * Maps a text representation of immediate value to bytes
+	 * @param value Text representation of integer: decimal, hexadecimal with 0x prefix, octal with 0 prefix or a character
+	 * literal, optionally negated with '-'
+	 * @param[out] bytes Pointer to array to hold the bytes of the integer
+	 * @param[out] length Reference to integer to hold the amount of bytes of the resolved immediate value
+	 * @return Size mask of the immediate value, -1 if the text is not an integer and -2 if it does not fit in 64 bits
 	*/
-	int calculateSizeRequirement(std::string label, unsigned int instructionIndex, std::unordered_map<std::string, size_t> labelMap,
-		std::vector<AssemberInstruction> instructions);
+	int mapImmediate(std::string_view value, unsigned char* bytes, unsigned int& length);
 
 	/**
-	 * Maps label to relative address from the current instruction. Should noly be called if canMapLabel returns true
-	 * @param label Name of the label to try mapping to address
-	 * @param instructionIndex The index of the instruction we try to resolve the relative label address from
-	 * @param labelMap Map structure holding all labels
-	 * @param[out] instructions[out] Reference to the list of all the instructions. Corresponding instructions will be updated with the relative address
-	 * @return Size of the resolved relative address
+	 * Calculates the size of the shortest immediate value that holds the relative address of a label
+	 * @param delta Distance in bytes from the beginning of the instruction to the label
+	 * @return Size of the relative address in bytes
 	*/
-	unsigned int mapLabel(std::string label, unsigned int instructionIndex, std::unordered_map<std::string, size_t> labelMap,
-		std::vector<AssemberInstruction> &instructions, int64_t &value);
-	
+	unsigned int labelSize(int64_t delta);
+
 	/**
 	 * Maps integer to bytes with minimum required bytes
 	 * @param value64 64-bit signed integer representing the value to be mapped in bytes
 	 * @param[out] bytes Pointer to array that will be updated with the integer bytes
-	 * @param[out] length Reference that will hold the number of bytes that were stored in the array
+	 * @param[out] length Reference that will hold the number of bytes that were stored in the array. If it is not 0 the value
+	 * is stored in that many bytes
 	 * @return Size mask for the instruction bytes to use for setting the size of immediate value
 	*/
 	int mapInteger(int64_t value64, unsigned char* bytes, unsigned int &length);
@@ -99,6 +94,7 @@ public:
 	template<typename T> void mapImmediate(unsigned char *bytes, T value);
 
 private:
-	std::unordered_map<std::string, std::pair<unsigned char, unsigned int>> opcodeMap; /**< Map between all the opcodes text representation and corresponding values */
-	std::unordered_map<std::string, unsigned char> registerMap; /**< Map between register text representations and register number */
+	std::unordered_map<std::string_view, std::pair<unsigned char, unsigned int>> opcodeMap; /**< Map between all the opcodes text representation and corresponding values */
+	std::unordered_map<std::string_view, unsigned char> registerMap; /**< Map between register text representations and register number */
+	std::unordered_map<std::string_view, std::pair<unsigned char, VectorOperands>> vectorOpcodeMap; /**< Map between vector instructions and their vector opcode byte and operand form */
 };
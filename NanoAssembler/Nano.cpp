@@ -3,12 +3,15 @@
 
 int main(int argc, char* argv[])
 {
-	if (argc <= 1) {
-		std::cout << "Usage NanoAssembler.exe [FILE]" << std::endl;
+	// -O before the file enables the peephole optimizer
+	bool optimize = argc > 1 && std::string(argv[1]) == "-O";
+	if (argc <= 1 + optimize) {
+		std::cout << "Usage NanoAssembler.exe [-O] [FILE]" << std::endl;
 		return 0;
 	}
 	NanoAssembler assembler;
-	std::string input = argv[1];
+	assembler.setOptimize(optimize);
+	std::string input = argv[1 + optimize];
 	std::string output = input.substr(0, input.find_last_of('.')) + ".nanoc";
 	AssemblerReturnValues ret = assembler.assembleToFile(input, output);
 	switch (ret) {
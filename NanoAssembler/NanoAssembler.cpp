@@ -1,6 +1,6 @@
 ﻿#include "NanoAssembler.h"
 
-NanoAssembler::NanoAssembler() : mapper() {
+NanoAssembler::NanoAssembler() : mapper(), optimizeCode(false) {
 	// Constructor
 }
 
@@ -8,73 +8,69 @@ NanoAssembler::~NanoAssembler() {
 	// Destructor
 }
 
-bool NanoAssembler::readLines(std::string file, std::vector<AssemberInstruction> &lines, std::unordered_map<std::string, size_t> &labelMap) {
-	std::string line;
-	std::ifstream f(file);
-	unsigned int lineNumber = 1;
-	if (f.is_open()) {
-		while (std::getline(f, line)) {
-			AssemberInstruction instruction;
-			instruction.assembled = false;
-			instruction.length = 0;
-			instruction.lineNumber = lineNumber;
-			lineNumber++;
-			// remove comments
-			size_t index = line.find(";");
-			if (index != -1) {
-				if (index == 0) {
-					continue;
-				}
-				line = line.substr(0, index);
-			}
-			line = std::regex_replace(line, std::regex("^\\s+|\\s+$"), ""); // trim leading and trailing whitespaces
-			if (line.empty()) // Skip empty lines and comments (prefix ";")
-			{
-				continue;
-			}
-			if (line[0] == ':' && line.length() > 1) {
-				// label
-				labelMap[line.substr(1)] = lines.size();
-				std::cout << "Label: " << line << std::endl;
-				continue;
+bool NanoAssembler::readLines(SourceFile& file, std::vector<AssemberInstruction> &lines, std::unordered_map<std::string_view, size_t> &labelMap) {
+	Lexer lexer(file.data(), file.size());
+	AssemberInstruction instruction;
+	instruction.assembled = false;
+	instruction.length = 0;
+	instruction.labelIndex = NO_LABEL;
+	while (lexer.next(instruction.source)) {
+		std::string_view first = instruction.source.tokens[0].text;
+		if (first[0] == ':' && first.length() > 1) {
+			// label
+			if (instruction.source.tokenCount > 1) {
+				reportError(instruction, 1);
+				std::cout << "Unexpected text after label \"" << first << "\"" << std::endl;
+				return false;
 			}
-			instruction.line = std::regex_replace(line, std::regex("\\s{2,}"), " "); // replace all consecutive whitespaces with single space
-			instruction.line.erase(std::remove(instruction.line.begin(), instruction.line.end(), ','), instruction.line.end()); // Remove ','
-			std::transform(instruction.line.begin(), instruction.line.end(), instruction.line.begin(), ::tolower); // to lowercase
-			lines.push_back(instruction);
-		}
-		if (!lines.empty() && lines.at(lines.size() - 1).line != "halt") {
-			std::cout << "Adding line \"halt\" to the end of file!" << std::endl;
-			AssemberInstruction instruction;
-			instruction.assembled = false;
-			instruction.length = 0;
-			instruction.lineNumber = lineNumber;
-			instruction.line = "halt";
-			lines.push_back(instruction);
+			labelMap[first.substr(1)] = lines.size();
+			std::cout << "Label: " << first << "\n";
+			continue;
 		}
-		return true;
+		lines.push_back(instruction);
+	}
+	if (!lines.empty() && lines.back().source.text != "halt") {
+		std::cout << "Adding line \"halt\" to the end of file!" << std::endl;
+		instruction.source.text = "halt";
+		instruction.source.tokens[0] = { instruction.source.text, 1 };
+		instruction.source.tokenCount = 1;
+		instruction.source.lineNumber = lines.back().source.lineNumber + 1;
+		lines.push_back(instruction);
 	}
-	return false;
+	return true;
 }
 
-int NanoAssembler::assembleInstruction(int i, std::vector<AssemberInstruction> &instructionBytes, std::unordered_map<std::string, size_t> labelMap, bool initial) {
+void NanoAssembler::reportError(const AssemberInstruction& instruction, unsigned int token) {
+	const SourceLine& source = instruction.source;
+	token = std::min(token, std::min(source.tokenCount, MAX_LINE_TOKENS) - 1);
+	std::cout << "Error on line " << source.lineNumber << ", column " << source.tokens[token].column << ": " << source.text << std::endl;
+}
+
+int NanoAssembler::assembleInstruction(int i, std::vector<AssemberInstruction> &instructionBytes, const std::unordered_map<std::string_view, size_t>& labelMap) {
 	// Skip already assembled instructions
 	if (instructionBytes[i].assembled)
 		return 1;
-	std::istringstream iss(instructionBytes[i].line);
-	std::vector<std::string> parts(std::istream_iterator<std::string>{iss}, std::istream_iterator<std::string>());
 	AssemberInstruction&instruction = instructionBytes[i];
+	// The tokens are views in to the source
+	std::array<std::string_view, MAX_LINE_TOKENS> parts;
+	for (unsigned int j = 0; j < MAX_LINE_TOKENS; j++)
+		parts[j] = (j < instruction.source.tokenCount) ? instruction.source.tokens[j].text : std::string_view();
+	// Vector instructions have their own encoding e.g. 'vadd32 y0, y1'
+	VectorOperands form;
+	if (mapper.mapVectorOpcode(parts[0], instruction, form)) {
+		return assembleVectorInstruction(instruction, parts, form);
+	}
 	// Check that the instruction is valid e.g. 'mov'
 	if (!mapper.mapOpcode(parts[0], instruction)) {
-		std::cout << "Error on line (" << i << "): " << instructionBytes[i].line << std::endl;
+		reportError(instruction, 0);
 		std::cout << "Unknown instruction \"" << parts[0] << std::endl;
 		return 0;
 	}
 	// Check that there are required amount of parameters for the instruction e.g. 'mov reg0,reg1' requires 2
-	if (instruction.operands != parts.size() - 1) {
-		std::cout << "Error on line (" << i << "): " << instructionBytes[i].line << std::endl;
+	if (instruction.operands != instruction.source.tokenCount - 1) {
+		reportError(instruction, 0);
 		std::cout << "Invalid amount of parameters for instruction \"" << parts[0] << "\" expected: " << instruction.operands
-			<< " but received: " << (parts.size() - 1) << std::endl;
+			<< " but received: " << (instruction.source.tokenCount - 1) << std::endl;
 		return 0;
 	}
 	// assemble instruction with two operands
@@ -92,7 +88,7 @@ int NanoAssembler::assembleInstruction(int i, std::vector<AssemberInstruction> &
 		}
 		// parse destination register
 		if (!mapper.mapRegister(parts[1], dstReg)) {
-			std::cout << "Error on line (" << i << "): " << instructionBytes[i].line << std::endl;
+			reportError(instruction, 1);
 			std::cout << "Invalid register name: \"" << parts[1] << "\"" << std::endl;
 			return 0;
 		}
@@ -112,16 +108,18 @@ int NanoAssembler::assembleInstruction(int i, std::vector<AssemberInstruction> &
 			int size = mapper.mapImmediate(parts[2], instruction.bytecode + 2, length);
 			if (size == -1) {
 				// parameter was not integer or register
+				reportError(instruction, 2);
 				if (labelMap.find(parts[2]) == labelMap.end()) {
-					std::cout << "Error on line (" << i << "): " << instructionBytes[i].line << std::endl;
-					std::cout << "Unknown parameter: \"" << parts[2] << "\"";
-					return 0;
+					std::cout << "Unknown parameter: \"" << parts[2] << "\"" << std::endl;
 				}
-				
+				else {
+					std::cout << "Labels can only be used with single operand instructions: \"" << parts[2] << "\"" << std::endl;
+				}
+				return 0;
 			}
 			else if (size == -2) {
 				// immediate value couldn't fit in 64bit unsinged integer...
-				std::cout << "Error on line (" << i << "): " << instructionBytes[i].line << std::endl;
+				reportError(instruction, 2);
 				std::cout << "Integer too large: " << parts[2] << std::endl;
 				return 0;
 			}
@@ -137,10 +135,10 @@ int NanoAssembler::assembleInstruction(int i, std::vector<AssemberInstruction> &
 		instruction.length = 1;
 		instruction.assembled = true;
 		// Check if the instruction has register parameter
-		if (parts.size() == 2) {
+		if (instruction.source.tokenCount == 2) {
 			unsigned char dstReg;
 			if (!mapper.mapRegister(parts[1], dstReg)) {
-				std::cout << "Error on line (" << i << "): " << instructionBytes[i].line << std::endl;
+				reportError(instruction, 1);
 				std::cout << "Invalid register name: \"" << parts[1] << "\"" << std::endl;
 				return 0;
 			}
@@ -173,42 +171,19 @@ int NanoAssembler::assembleInstruction(int i, std::vector<AssemberInstruction> &
 			if (size == -1) {
 				// parameter was not integer or register
 				if (labelMap.find(parts[1]) == labelMap.end()) {
-					std::cout << "Error on line (" << i << "): " << instructionBytes[i].line << std::endl;
+					reportError(instruction, 1);
 					std::cout << "Unknown parameter: \"" << parts[1] << "\"" << std::endl;
 					return 0;
 				}
-				// Check if the label can already be mapped to an immediate value
-				if (mapper.canMapLabel(parts[1], i, labelMap, instructionBytes)) {
-					// Assemble the instruction
-					int64_t value;
-					length = mapper.mapLabel(parts[1], i, labelMap, instructionBytes, value);
-					if (length == 0) {
-						std::cout << "Error on line (" << i << "): " << instructionBytes[i].line << std::endl;
-						std::cout << "Failed to map label: \"" << parts[1] << "\"" << std::endl;
-						return 0;
-					}
-					std::cout << "Mapped to " << value << std::endl;
-					size = mapper.mapInteger(value, instruction.bytecode + 2, length);
-				}
-				else if (initial) {
-					return -1;
-				}
-				else {
-					size = mapper.calculateSizeRequirement(parts[1], i, labelMap, instructionBytes);
-					if (size == 0) {
-						std::cout << "Error on line (" << i << "): " << instructionBytes[i].line << std::endl;
-						std::cout << "Failed to map label: \"" << parts[1] << "\"" << std::endl;
-						return 0;
-					}
-					instruction.length = size;
-					std::cout << parts[1] << " require " << size << " bytes" << std::endl;
-					std::cout << "Did not map label but defined size requirement" << std::endl;
-					return -1;
-				}
+				// The relative address is resolved by assemble() when the sizes of all the instructions are known.
+				// Start from the shortest encoding
+				instruction.labelIndex = labelMap.at(parts[1]);
+				length = sizeof(int8_t);
+				size = Byte;
 			}
 			else if (size == -2) {
 				// immediate value couldn't fit in 64bit unsinged integer...
-				std::cout << "Error on line (" << i << "): " << instructionBytes[i].line << std::endl;
+				reportError(instruction, 1);
 				std::cout << "Integer too large: " << parts[1] << std::endl;
 				return 0;
 			}
@@ -221,48 +196,347 @@ int NanoAssembler::assembleInstruction(int i, std::vector<AssemberInstruction> &
 	return 1;
 }
 
-bool NanoAssembler::assemble(std::vector<AssemberInstruction> &instruction, std::unordered_map<std::string, size_t> &labelMap) {
-	int rounds = 3;
-	// Iterate over all instructions 3 times if needed because instructions with labels need other instructions to be assembled to calculate
-	// relative distance from itself to the label
-	bool reiterate = true;
-	while (rounds-- && reiterate) {
-		reiterate = false;
-		bool ready = true;
-		for (int i = 0; i < instruction.size(); i++) {
-			int success = assembleInstruction(i, instruction, labelMap, rounds == 2);
-			if (instruction[i].assembled)
-				continue;
-			ready &= success == 1;
-			if (success == 0)
-				return false;
-			if (success == -1) {
-				reiterate = true;
-				std::cout << "require reiteration for mapping label" << std::endl;
+int NanoAssembler::assembleVectorInstruction(AssemberInstruction& instruction, std::array<std::string_view, MAX_LINE_TOKENS>& parts, VectorOperands form) {
+	if (instruction.source.tokenCount != 3) {
+		reportError(instruction, 0);
+		std::cout << "Invalid amount of parameters for instruction \"" << parts[0] << "\" expected: 2 but received: "
+			<< (instruction.source.tokenCount - 1) << std::endl;
+		return 0;
+	}
+	// Load and store address the memory with a register e.g. 'vload y0, @reg1' and 'vstore @reg1, y0'
+	std::string_view vectorName = (form == VectorStore) ? parts[2] : parts[1];
+	std::string_view otherName = (form == VectorStore) ? parts[1] : parts[2];
+	unsigned char vectorReg, otherReg;
+	bool wide, otherWide;
+	if (!mapper.mapVectorRegister(vectorName, vectorReg, wide)) {
+		reportError(instruction, (form == VectorStore) ? 2 : 1);
+		std::cout << "Invalid vector register name: \"" << vectorName << "\"" << std::endl;
+		return 0;
+	}
+	if (form == VectorRegisters) {
+		if (!mapper.mapVectorRegister(otherName, otherReg, otherWide) || otherWide != wide) {
+			reportError(instruction, (form == VectorStore) ? 1 : 2);
+			std::cout << "Expected a vector register of the same width: \"" << otherName << "\"" << std::endl;
+			return 0;
+		}
+	}
+	else if (otherName[0] != '@' || !mapper.mapRegister(otherName.substr(1), otherReg)) {
+		reportError(instruction, (form == VectorStore) ? 1 : 2);
+		std::cout << "Expected a memory address in a register: \"" << otherName << "\"" << std::endl;
+		return 0;
+	}
+	unsigned char dstReg = (form == VectorStore) ? otherReg : vectorReg;
+	unsigned char srcReg = (form == VectorStore) ? vectorReg : otherReg;
+	instruction.bytecode[0] = EXTENDED_OPCODE;
+	instruction.bytecode[1] = instruction.opcode | (wide ? VECTOR_WIDE : 0);
+	instruction.bytecode[2] = dstReg | (srcReg << 3);
+	instruction.length = 3;
+	instruction.assembled = true;
+	return 1;
+}
+
+bool NanoAssembler::assemble(std::vector<AssemberInstruction> &instruction, const std::unordered_map<std::string_view, size_t> &labelMap) {
+	// Instructions with a label operand start with a byte sized relative address
+	std::vector<size_t> labelled;
+	for (size_t i = 0; i < instruction.size(); i++) {
+		if (!assembleInstruction(static_cast<int>(i), instruction, labelMap))
+			return false;
+		if (instruction[i].labelIndex != NO_LABEL)
+			labelled.push_back(i);
+	}
+	// Branch relaxation: grow the relative addresses that do not fit until every one does. Addresses never shrink so the
+	// distances only grow as well and each instruction grows at most three times, which guarantees convergence
+	std::vector<int64_t> offsets(instruction.size() + 1, 0);
+	bool grown = true;
+	while (grown) {
+		grown = false;
+		for (size_t i = 0; i < instruction.size(); i++) {
+			offsets[i + 1] = offsets[i] + instruction[i].length;
+		}
+		for (size_t i : labelled) {
+			unsigned int length = mapper.labelSize(offsets[instruction[i].labelIndex] - offsets[i]);
+			if (length > instruction[i].length - 2) {
+				instruction[i].length = 2 + length;
+				grown = true;
 			}
 		}
-		if (ready)
+	}
+	// The offsets are final so the relative addresses can be written. They are relative to the jumping instruction
+	for (size_t i : labelled) {
+		unsigned int length = instruction[i].length - 2;
+		int size = mapper.mapInteger(offsets[instruction[i].labelIndex] - offsets[i], instruction[i].bytecode + 2, length);
+		instruction[i].bytecode[1] = (instruction[i].bytecode[1] & ~SRC_SIZE) | size;
+	}
+	return true;
+}
+
+/**
+ * @return Value of the immediate operand as the VM reads it i.e. zero extended from the encoded size
+*/
+static uint64_t immediateValue(const AssemberInstruction& instruction) {
+	uint64_t value = 0;
+	for (unsigned int i = instruction.length; i > 2; i--)
+		value = (value << 8) | instruction.bytecode[i - 1];
+	return value;
+}
+
+/**
+ * @return Exponent of the value if it is a power of two, -1 otherwise
+*/
+static int powerOfTwo(uint64_t value) {
+	if (!value || (value & (value - 1)))
+		return -1;
+	int bits = 0;
+	while (value >>= 1)
+		bits++;
+	return bits;
+}
+
+/**
+ * @return Text of the shift count or the mask of the given amount of bits. The texts are static so that the tokens can refer to them
+*/
+static std::string_view constantText(int bits, bool mask) {
+	static const std::array<std::array<std::string, 64>, 2> texts = [] {
+		std::array<std::array<std::string, 64>, 2> texts;
+		for (unsigned int i = 0; i < 64; i++) {
+			texts[0][i] = std::to_string(i);
+			texts[1][i] = std::to_string((uint64_t(1) << i) - 1);
+		}
+		return texts;
+	}();
+	return texts[mask][bits];
+}
+
+/**
+ * @return True if the instruction is a scalar instruction with the given mnemonic
+*/
+static bool isInstruction(const AssemberInstruction& instruction, std::string_view mnemonic) {
+	return instruction.bytecode[0] != EXTENDED_OPCODE && instruction.source.tokens[0].text == mnemonic;
+}
+
+/**
+ * @return True if the instruction is a conditional or an unconditional jump
+*/
+static bool isJump(const AssemberInstruction& instruction) {
+	return isInstruction(instruction, "jmp") || isInstruction(instruction, "jz") || isInstruction(instruction, "jnz") ||
+		isInstruction(instruction, "jg") || isInstruction(instruction, "js");
+}
+
+/**
+ * @return True if the instruction is a jump or a call to a label. Jumps to addresses in registers or memory are not changed
+*/
+static bool isLabelJump(const AssemberInstruction& instruction) {
+	return instruction.labelIndex != NO_LABEL && !(instruction.bytecode[1] & SRC_MEM);
+}
+
+void NanoAssembler::setOptimize(bool enabled) {
+	optimizeCode = enabled;
+}
+
+bool NanoAssembler::rewrite(size_t i, std::vector<AssemberInstruction>& lines, const std::unordered_map<std::string_view, size_t>& labelMap,
+	std::string_view mnemonic, std::string_view first, std::string_view second) {
+	SourceLine& source = lines[i].source;
+	source.tokens[0].text = mnemonic;
+	source.tokens[1].text = first;
+	source.tokens[2].text = second;
+	source.tokenCount = first.empty() ? 1 : second.empty() ? 2 : 3;
+	lines[i].assembled = false;
+	lines[i].labelIndex = NO_LABEL;
+	return assembleInstruction(static_cast<int>(i), lines, labelMap);
+}
+
+unsigned int NanoAssembler::simplifyArithmetic(std::vector<AssemberInstruction>& lines, const std::unordered_map<std::string_view, size_t>& labelMap, std::vector<bool>& removed) {
+	unsigned int changes = 0;
+	for (size_t i = 0; i < lines.size(); i++) {
+		AssemberInstruction& instruction = lines[i];
+		// Only whole register destinations, memory destinations are written with the size of the source
+		if (instruction.bytecode[0] == EXTENDED_OPCODE || instruction.operands != 2 || (instruction.bytecode[1] & (DST_MEM | SRC_MEM)))
+			continue;
+		std::string_view mnemonic = instruction.source.tokens[0].text;
+		std::string_view dst = instruction.source.tokens[1].text;
+		if ((instruction.bytecode[1] & SRC_TYPE) == DataType::Reg) {
+			// mov, and, or of a register with itself do not change it
+			bool sameRegister = (instruction.bytecode[0] >> 5) == (instruction.bytecode[1] & 0x07);
+			if (sameRegister && (mnemonic == "mov" || mnemonic == "and" || mnemonic == "or")) {
+				removed[i] = true;
+				changes++;
+			}
+			continue;
+		}
+		bool changed = true;
+		uint64_t value = immediateValue(instruction);
+		int bits = powerOfTwo(value);
+		if (value == 0 && (mnemonic == "add" || mnemonic == "sub" || mnemonic == "or" || mnemonic == "xor" || mnemonic == "sal" || mnemonic == "sar"))
+			removed[i] = true;
+		else if (value == 1 && (mnemonic == "mul" || mnemonic == "div"))
+			removed[i] = true;
+		else if ((value == 0 && (mnemonic == "mov" || mnemonic == "mul")) || (value == 1 && mnemonic == "mod"))
+			rewrite(i, lines, labelMap, "xor", dst, dst);
+		else if (value == 1 && mnemonic == "add")
+			rewrite(i, lines, labelMap, "inc", dst);
+		else if (value == 1 && mnemonic == "sub")
+			rewrite(i, lines, labelMap, "dec", dst);
+		// The VM divides unsigned and shifts right logically so division and modulo by a power of two are shifts and masks
+		else if (bits > 0 && mnemonic == "mul")
+			rewrite(i, lines, labelMap, "sal", dst, constantText(bits, false));
+		else if (bits > 0 && mnemonic == "div")
+			rewrite(i, lines, labelMap, "sar", dst, constantText(bits, false));
+		else if (bits > 0 && mnemonic == "mod")
+			rewrite(i, lines, labelMap, "and", dst, constantText(bits, true));
+		else
+			changed = false;
+		changes += changed;
+	}
+	return changes;
+}
+
+unsigned int NanoAssembler::simplifyJumps(std::vector<AssemberInstruction>& lines, const std::unordered_map<std::string_view, size_t>& labelMap, std::vector<bool>& removed) {
+	// Instructions a label operand points to. Rewriting only copies label operands so no new instructions become targets
+	std::vector<bool> targets(lines.size() + 1, false);
+	for (const AssemberInstruction& instruction : lines) {
+		if (instruction.labelIndex != NO_LABEL)
+			targets[instruction.labelIndex] = true;
+	}
+	unsigned int changes = 0;
+	for (size_t i = 0; i < lines.size(); i++) {
+		AssemberInstruction& instruction = lines[i];
+		bool jump = isJump(instruction);
+		if (!isLabelJump(instruction) || !(jump || isInstruction(instruction, "call")))
+			continue;
+		size_t target = instruction.labelIndex;
+		if (target >= lines.size())
+			continue;
+		const AssemberInstruction& destination = lines[target];
+		bool inverted = isInstruction(instruction, "jz") || isInstruction(instruction, "jnz");
+		// Follow the jumps the jump lands on. A chain of jumps which loops forever is left as it is
+		size_t last = NO_LABEL;
+		size_t steps = 0;
+		for (size_t next = target; isInstruction(lines[next], "jmp") && isLabelJump(lines[next]) && lines[next].labelIndex < lines.size(); next = lines[next].labelIndex) {
+			if (++steps > lines.size())
+				break;
+			last = next;
+		}
+		if (last != NO_LABEL && steps <= lines.size()) {
+			// Jumps do not change the flags so the jump can go directly to the end of the chain
+			std::string_view label = lines[last].source.tokens[1].text;
+			rewrite(i, lines, labelMap, instruction.source.tokens[0].text, label);
+		}
+		else if (isInstruction(instruction, "jmp") && (isInstruction(destination, "halt") || isInstruction(destination, "ret"))) {
+			rewrite(i, lines, labelMap, destination.source.tokens[0].text);
+		}
+		else if (jump && target == i + 1) {
+			removed[i] = true;
+		}
+		else if (inverted && target == i + 2 && !targets[i + 1] && isInstruction(lines[i + 1], "jmp") && isLabelJump(lines[i + 1])) {
+			// 'jz skip; jmp other; :skip' is 'jnz other'
+			std::string_view label = lines[i + 1].source.tokens[1].text;
+			rewrite(i, lines, labelMap, isInstruction(instruction, "jz") ? "jnz" : "jz", label);
+			removed[++i] = true;
+		}
+		else {
+			continue;
+		}
+		changes++;
+	}
+	return changes;
+}
+
+unsigned int NanoAssembler::removeUnreachable(std::vector<AssemberInstruction>& lines, std::vector<bool>& removed) {
+	// The program starts from the first instruction and the rest are reached by falling through or with a label operand
+	std::vector<bool> targets(lines.size() + 1, false);
+	targets[0] = true;
+	for (const AssemberInstruction& instruction : lines) {
+		if (instruction.labelIndex != NO_LABEL)
+			targets[instruction.labelIndex] = true;
+	}
+	unsigned int changes = 0;
+	bool reachable = true;
+	for (size_t i = 0; i < lines.size(); i++) {
+		reachable = reachable || targets[i];
+		if (!reachable) {
+			removed[i] = true;
+			changes++;
+		}
+		else if (isInstruction(lines[i], "jmp") || isInstruction(lines[i], "ret") || isInstruction(lines[i], "halt")) {
+			reachable = false;
+		}
+	}
+	return changes;
+}
+
+void NanoAssembler::removeInstructions(std::vector<AssemberInstruction>& lines, std::unordered_map<std::string_view, size_t>& labelMap, std::vector<bool>& removed) {
+	std::vector<size_t> index(lines.size() + 1);
+	size_t kept = 0;
+	for (size_t i = 0; i < lines.size(); i++) {
+		index[i] = kept;
+		if (!removed[i])
+			lines[kept++] = lines[i];
+	}
+	index[lines.size()] = kept;
+	lines.resize(kept);
+	for (auto& label : labelMap)
+		label.second = index[label.second];
+	for (AssemberInstruction& instruction : lines) {
+		if (instruction.labelIndex != NO_LABEL)
+			instruction.labelIndex = index[instruction.labelIndex];
+	}
+	removed.assign(kept, false);
+}
+
+bool NanoAssembler::optimize(std::vector<AssemberInstruction>& lines, std::unordered_map<std::string_view, size_t>& labelMap) {
+	// The passes look at the assembled instructions. Errors are reported for the source as written
+	for (size_t i = 0; i < lines.size(); i++) {
+		if (!assembleInstruction(static_cast<int>(i), lines, labelMap))
+			return false;
+	}
+	// The relative addresses of jumps to numbers, registers and memory change when the code between is changed
+	for (const AssemberInstruction& instruction : lines) {
+		if ((isJump(instruction) || isInstruction(instruction, "call")) && !isLabelJump(instruction)) {
+			std::cout << "Not optimized: line " << instruction.source.lineNumber << " jumps to an address which is not a label" << std::endl;
 			return true;
+		}
 	}
-	return false;
+	size_t count = lines.size();
+	unsigned int changes = 0;
+	std::vector<bool> removed(lines.size(), false);
+	// Every pass either removes instructions or rewrites them to a form the pass does not rewrite again so the loop ends
+	for (unsigned int passChanges = 1; passChanges; ) {
+		passChanges = simplifyArithmetic(lines, labelMap, removed);
+		removeInstructions(lines, labelMap, removed);
+		passChanges += simplifyJumps(lines, labelMap, removed);
+		removeInstructions(lines, labelMap, removed);
+		passChanges += removeUnreachable(lines, removed);
+		removeInstructions(lines, labelMap, removed);
+		changes += passChanges;
+	}
+	std::cout << "Optimized: " << changes << " changes, " << (count - lines.size()) << " of " << count << " instructions removed" << std::endl;
+	return true;
 }
 
 AssemblerReturnValues NanoAssembler::assembleToFile(std::string inputFile, std::string outputFile) {
 	std::vector<AssemberInstruction> lines;
-	std::unordered_map<std::string, size_t> labelMap;
-	// Load file from disk
-	if (!readLines(inputFile, lines, labelMap)) {
+	std::unordered_map<std::string_view, size_t> labelMap;
+	// Load file from disk. The lines refer to the source so it is kept until the bytecode is written
+	SourceFile source(inputFile);
+	if (!source.IsOpen()) {
 		return AssemblerReturnValues::IOError;
 	}
 	// Compile the file to bytecode
-	if (assemble(lines, labelMap)) {
-		// Write to disk
+	if (readLines(source, lines, labelMap) && (!optimizeCode || optimize(lines, labelMap)) && assemble(lines, labelMap)) {
+		std::vector<unsigned char> code;
+		for (const AssemberInstruction& inst : lines)
+			code.insert(code.end(), inst.bytecode, inst.bytecode + inst.length);
+		// Write to disk as a container. The code section starts at the next aligned offset after the header
+		NanocHeader header;
+		nanocHeader(header, 0, code.data(), code.size(), 0);
+		std::vector<char> padding(static_cast<size_t>(header.codeOffset - sizeof(header)), 0x00);
 		std::ofstream file(outputFile, std::ios::out | std::ios::binary);
 		if (file.is_open()) {
-			for (AssemberInstruction inst : lines)
-				file.write((const char*)& inst.bytecode[0], inst.length);
+			file.write((const char*)& header, sizeof(header));
+			file.write(padding.data(), padding.size());
+			file.write((const char*)code.data(), code.size());
 			file.close();
-			return AssemblerReturnValues::Success;
+			return file ? AssemblerReturnValues::Success : AssemblerReturnValues::IOError;
 		}
 		return AssemblerReturnValues::IOError;
 	}
@@ -271,16 +545,17 @@ AssemblerReturnValues NanoAssembler::assembleToFile(std::string inputFile, std::
 
 AssemblerReturnValues NanoAssembler::assembleToMemory(std::string inputFile, unsigned char*& bytecodeBuffer, unsigned int& size) {
 	std::vector<AssemberInstruction> lines;
-	std::unordered_map<std::string, size_t> labelMap;
-	// Load assembler file from disk
-	if (!readLines(inputFile, lines, labelMap)) {
+	std::unordered_map<std::string_view, size_t> labelMap;
+	// Load assembler file from disk. The lines refer to the source so it is kept until the bytecode is copied
+	SourceFile source(inputFile);
+	if (!source.IsOpen()) {
 		return AssemblerReturnValues::IOError;
 	}
 	// Compile to bytecode
-	if (assemble(lines, labelMap)) {
+	if (readLines(source, lines, labelMap) && (!optimizeCode || optimize(lines, labelMap)) && assemble(lines, labelMap)) {
 		size = 0;
 		// Calculate the resulting bytecode size
-		for (AssemberInstruction inst : lines) {
+		for (const AssemberInstruction& inst : lines) {
 			size += inst.length;
 		}
 		// Allocate buffer to store the bytecode
@@ -288,7 +563,7 @@ AssemblerReturnValues NanoAssembler::assembleToMemory(std::string inputFile, uns
 		if (bytecodeBuffer) {
 			unsigned int index = 0;
 			// Copy the bytecode to output buffer
-			for (AssemberInstruction inst : lines) {
+			for (const AssemberInstruction& inst : lines) {
 				memcpy(bytecodeBuffer + index, inst.bytecode, inst.length);
 				index += inst.length;
 			}
@@ -3,13 +3,12 @@
 #include <fstream>
 #include <vector>
 #include <string>
-#include <regex>
 #include <algorithm>
-#include <sstream>
-#include <iterator>
 #include <cstring>
 #include "Types.h"
 #include "Mapper.h"
+#include "Lexer.h"
+#include "../NanoVM/NanocFormat.h"
 
 /**
  * NanoAssembler instance handles loading assembler files and compiling those to bytecode format
@@ -23,7 +22,7 @@ public:
 	 * \brief Assembles input file and writes the resulting bytecode to a file on disk
 	 *
 	 * NanoAssembler loads the input file containing assembler instructions, compiles those in to binary format
-	 * and writes them to a binary file on disk
+	 * and writes them to a .nanoc container on disk. See NanocFormat.h
 	 * @param inputFile Points to the assembler file to load
 	 * @param outputFile Points to the file where the compiled bytecode will be written
 	 * @return 1 on success and anything else meaning failure
@@ -41,10 +40,72 @@ public:
 	 * @return 1 on success and anything else meaning failure
 	*/
 	AssemblerReturnValues assembleToMemory(std::string inputFile, unsigned char*& bytecodeBuffer, unsigned int &size);
+
+	/**
+	 * \brief Enables the peephole optimizer
+	 *
+	 * The optimizer rewrites instructions to shorter and faster equivalents, threads jumps to jumps and removes
+	 * no-ops and unreachable code before the labels are resolved. Programs which jump to numbers, registers or memory
+	 * are not changed. Code is assumed to be reached only through labels so programs which compute code addresses must
+	 * not be optimized
+	 * @param enabled True to optimize the assembled programs, false by default
+	*/
+	void setOptimize(bool enabled);
 private:
-	bool readLines(std::string file, std::vector<AssemberInstruction>& lines, std::unordered_map<std::string, size_t>& labelMap);
-	int assembleInstruction(int i, std::vector<AssemberInstruction>& instructionBytes, std::unordered_map<std::string, size_t> labelMap, bool initial);
-	bool assemble(std::vector<AssemberInstruction>& instruction, std::unordered_map<std::string, size_t>& labelMap);
+	bool readLines(SourceFile& file, std::vector<AssemberInstruction>& lines, std::unordered_map<std::string_view, size_t>& labelMap);
+	int assembleInstruction(int i, std::vector<AssemberInstruction>& instructionBytes, const std::unordered_map<std::string_view, size_t>& labelMap);
+	int assembleVectorInstruction(AssemberInstruction& instruction, std::array<std::string_view, MAX_LINE_TOKENS>& parts, VectorOperands form);
+	bool assemble(std::vector<AssemberInstruction>& instruction, const std::unordered_map<std::string_view, size_t>& labelMap);
+
+	/**
+	 * Runs the peephole passes until none of them changes the program. The flags are only written by cmp and the
+	 * bulk memory operations which are never changed, so the flags read by the branches stay the same
+	 * @param lines Instructions to optimize
+	 * @param labelMap Labels of the instructions. Updated when instructions are removed
+	 * @return False if the source has an error, which is reported before anything is changed
+	*/
+	bool optimize(std::vector<AssemberInstruction>& lines, std::unordered_map<std::string_view, size_t>& labelMap);
+
+	/**
+	 * Replaces arithmetic with an immediate value by a shorter or cheaper instruction e.g. 'mul reg0, 8' by
+	 * 'sal reg0, 3' and marks no-ops like 'add reg0, 0' removed
+	 * @return Number of instructions rewritten or removed
+	*/
+	unsigned int simplifyArithmetic(std::vector<AssemberInstruction>& lines, const std::unordered_map<std::string_view, size_t>& labelMap, std::vector<bool>& removed);
+
+	/**
+	 * Threads jumps to jumps, replaces jumps to halt and ret by the target instruction, inverts 'jz a; jmp b; :a'
+	 * and marks jumps to the next instruction removed
+	 * @return Number of instructions rewritten or removed
+	*/
+	unsigned int simplifyJumps(std::vector<AssemberInstruction>& lines, const std::unordered_map<std::string_view, size_t>& labelMap, std::vector<bool>& removed);
+
+	/**
+	 * Marks the instructions after jmp, ret and halt removed up to the next instruction a label operand points to
+	 * @return Number of instructions removed
+	*/
+	unsigned int removeUnreachable(std::vector<AssemberInstruction>& lines, std::vector<bool>& removed);
+
+	/**
+	 * Replaces the tokens of an instruction and assembles it again
+	 * @return True if the instruction was assembled
+	*/
+	bool rewrite(size_t i, std::vector<AssemberInstruction>& lines, const std::unordered_map<std::string_view, size_t>& labelMap,
+		std::string_view mnemonic, std::string_view first = std::string_view(), std::string_view second = std::string_view());
+
+	/**
+	 * Removes the marked instructions. The labels and the label operands pointing to a removed instruction point to
+	 * the next instruction which is kept
+	*/
+	void removeInstructions(std::vector<AssemberInstruction>& lines, std::unordered_map<std::string_view, size_t>& labelMap, std::vector<bool>& removed);
+
+	/**
+	 * Prints the line and the column of an error. The description of the error is printed after it
+	 * @param instruction Instruction with the error
+	 * @param token Index of the token the error is at
+	*/
+	void reportError(const AssemberInstruction& instruction, unsigned int token);
 
 	Mapper mapper;
+	bool optimizeCode; /**< Run the peephole optimizer */
 };
\ No newline at end of file
@@ -1,12 +1,27 @@
 #pragma once
 #include <iostream>
 #include <cstdint>
+#include <string_view>
+#include <array>
 
 constexpr uint8_t SRC_TYPE = 0b10000000;
 constexpr uint8_t SRC_SIZE = 0b01100000;
 constexpr uint8_t DST_MEM =  0b00010000;
 constexpr uint8_t SRC_MEM =  0b00001000;
 
+// Vector instructions are the prefix byte followed by the vector opcode byte and the register byte
+constexpr uint8_t EXTENDED_OPCODE = 0xFF;
+constexpr uint8_t VECTOR_WIDE = 0b01000000;
+
+/**
+ * VectorOperands enum holds the operand forms of the vector instructions
+*/
+enum VectorOperands {
+	VectorRegisters, // two vector registers e.g. vadd8 y0, y1
+	VectorLoad, // vector register and a memory address in a register e.g. vload y0, @reg0
+	VectorStore // memory address in a register and a vector register e.g. vstore @reg0, y0
+};
+
 #ifndef TYPE_H
 #define TYPE_H
 
@@ -26,16 +41,44 @@ enum Size {
 };
 #endif
 
+/**
+ * Number of tokens stored of a line: the mnemonic, two operands and one more to report lines with too many operands
+*/
+constexpr unsigned int MAX_LINE_TOKENS = 4;
+
+/**
+ * Token is a word of the source e.g. a mnemonic, a register or an immediate value
+*/
+struct Token {
+	std::string_view text; // Text of the token in the source
+	unsigned int column; // Column of the first character, starting from 1
+};
+
+/**
+ * SourceLine holds the tokens of a line of the source
+*/
+struct SourceLine {
+	std::string_view text; // Text of the line from the first token to the end of the last one
+	std::array<Token, MAX_LINE_TOKENS> tokens; // First tokens of the line
+	unsigned int tokenCount; // Number of tokens on the line, may be larger than MAX_LINE_TOKENS
+	unsigned int lineNumber; // Number of the line, starting from 1
+};
+
+/**
+ * Value of AssemberInstruction::labelIndex when the operand is not a label
+*/
+constexpr size_t NO_LABEL = SIZE_MAX;
+
 /**
  * Instruction represent a single instruction to be assembled
 */
 struct AssemberInstruction {
-	std::string line;
+	SourceLine source;
 	unsigned char bytecode[2 + sizeof(int64_t)];
 	unsigned char opcode;
 	unsigned int operands;
 	unsigned int length;
-	unsigned int lineNumber;
+	size_t labelIndex; // Index of the instruction the label operand points to, NO_LABEL if the operand is not a label
 	bool assembled;
 };
 typedef struct AssemberInstruction AssemberInstruction;
@@ -0,0 +1,480 @@
+#include "../NanoAssembler/NanoAssembler.h"
+#include "../NanoVM/NanoVM.h"
+#include "../NanoVM/NanoProgram.h"
+#include "../NanoVM/VectorUnit.h"
+#include <algorithm>
+#include <chrono>
+#include <cmath>
+#include <filesystem>
+#include <fstream>
+#include <iomanip>
+#include <iostream>
+#include <sstream>
+namespace fs = std::filesystem;
+
+/**
+ * This file contains the benchmark harness of NanoVM.
+ * The kernels are Nano assembler files (.nano file extension) which are assembled and run with each execution engine.
+ * Every run after the warmup runs is timed separately and the report contains the wall time statistics and the
+ * throughput in VM instructions. The kernels may contain NANO_TEST_EXPECT_RETURN like the unit tests in which case
+ * every run is checked to return the expected value.
+ * With --assembler the harness times the assembler instead, on a generated source of the given number of lines.
+*/
+
+#ifndef NANOBENCH_KERNEL_DIR
+#define NANOBENCH_KERNEL_DIR "kernels"
+#endif
+
+#ifndef NANOBENCH_BUILD_TYPE
+#define NANOBENCH_BUILD_TYPE ""
+#endif
+
+/**
+ * DiscardSink drops the output of the print instructions so that the terminal does not limit the throughput.
+ * The integers are still formatted
+*/
+class DiscardSink : public OutputSink {
+public:
+	void write(const char*, size_t) override {}
+};
+
+/**
+ * \brief CountingVM counts the instructions a program executes
+ *
+ * The program is stepped through one instruction at a time without fusion so that every VM instruction is counted
+ * once no matter how the execution engines group them
+*/
+class CountingVM : public NanoVM {
+public:
+	CountingVM(std::shared_ptr<const NanoProgram> program, const NanoVMOptions& options) : NanoVM(program, options) {
+		SetFusion(false);
+	}
+
+	/**
+	 * Runs the program counting the executed instructions
+	 * @param[out] instructions Number of executed instructions including the halt
+	 * @param[out] returnValue Return value of the program
+	 * @return True if the program halted, false if it stopped with an error
+	*/
+	bool Count(uint64_t& instructions, uint64_t& returnValue) {
+		instructions = 0;
+		while (cpu.registers[ip] < cpu.codeSize) {
+			Instruction& inst = instructionCache[cpu.registers[ip]];
+			if (!inst.instructionSize && !decode(cpu.registers[ip], inst)) {
+				return false;
+			}
+			instructions++;
+			if (inst.opcode == Halt) {
+				returnValue = cpu.registers[Reg0];
+				return true;
+			}
+			if (!execute(inst)) {
+				return false;
+			}
+		}
+		return false;
+	}
+};
+
+/**
+ * BenchMode is an execution engine and memory mode combination the kernels are run with
+*/
+struct BenchMode {
+	std::string name; /**< Name of the mode in the report */
+	ExecutionMode mode; /**< Execution engine */
+	MemoryMode memory; /**< Memory mode */
+};
+
+const BenchMode benchModes[] = {
+	{ "interpreter", ExecutionMode::Interpreter, MemoryMode::Checked },
+	{ "threaded", ExecutionMode::Threaded, MemoryMode::Checked },
+	{ "threaded-guarded", ExecutionMode::Threaded, MemoryMode::Guarded },
+	{ "jit", ExecutionMode::Jit, MemoryMode::Checked }
+};
+
+/**
+ * Kernel is an assembled benchmark program
+*/
+struct Kernel {
+	std::string name; /**< File name without the extension */
+	std::shared_ptr<const NanoProgram> program; /**< Assembled program */
+	bool hasExpectedValue; /**< Does the kernel define NANO_TEST_EXPECT_RETURN */
+	uint64_t expectedValue; /**< Value every run has to return */
+	uint64_t instructions; /**< Number of instructions one run executes */
+};
+
+/**
+ * BenchResult holds the timings of one kernel in one mode
+*/
+struct BenchResult {
+	const Kernel* kernel; /**< Benchmarked kernel */
+	const BenchMode* mode; /**< Mode the kernel was run with */
+	bool valid; /**< Did every run return the expected value */
+	uint64_t returnValue; /**< Value returned by the last run */
+	double mean; /**< Mean wall time of a run in nanoseconds */
+	double median; /**< Median wall time of a run in nanoseconds */
+	double min; /**< Shortest wall time of a run in nanoseconds */
+	double max; /**< Longest wall time of a run in nanoseconds */
+	double stddev; /**< Sample standard deviation of the wall times in nanoseconds */
+};
+
+/**
+ * Assembles a kernel and counts its instructions
+ * @param assembler Assembler to use
+ * @param path Path of the .nano file
+ * @param[out] kernel Kernel to be updated
+ * @return True if the kernel was assembled and halted when counting its instructions
+*/
+static bool loadKernel(NanoAssembler& assembler, const std::string& path, Kernel& kernel) {
+	// The assembler reports its progress on stdout which would be mixed with the report
+	std::ostringstream discarded;
+	std::streambuf* previous = std::cout.rdbuf(discarded.rdbuf());
+	unsigned char* bytecode = nullptr;
+	unsigned int length = 0;
+	AssemblerReturnValues result = assembler.assembleToMemory(path, bytecode, length);
+	std::cout.rdbuf(previous);
+	if (result != AssemblerReturnValues::Success) {
+		std::cerr << "Failed to assemble " << path << std::endl;
+		return false;
+	}
+	kernel.name = fs::path(path).stem().string();
+	kernel.program = std::make_shared<NanoProgram>(bytecode, length);
+	delete[] bytecode;
+	// Read the expected return value
+	std::ifstream file(path);
+	std::stringstream content;
+	content << file.rdbuf();
+	std::string expectedReturnKey = "NANO_TEST_EXPECT_RETURN=";
+	size_t index = content.str().find(expectedReturnKey);
+	kernel.hasExpectedValue = index != std::string::npos;
+	kernel.expectedValue = kernel.hasExpectedValue ? std::stoull(content.str().substr(index + expectedReturnKey.length())) : 0;
+	DiscardSink sink;
+	CountingVM vm(kernel.program, NanoVMOptions());
+	vm.SetOutput(sink);
+	uint64_t returnValue;
+	if (!vm.Count(kernel.instructions, returnValue)) {
+		std::cerr << "Kernel " << path << " did not halt" << std::endl;
+		return false;
+	}
+	return true;
+}
+
+/**
+ * Calculates the statistics of the timed runs
+ * @param samples Wall times of the runs in nanoseconds. Sorted in place
+*/
+static void summarize(std::vector<double>& samples, double& mean, double& median, double& min, double& max, double& stddev) {
+	std::sort(samples.begin(), samples.end());
+	double sum = 0;
+	for (double sample : samples) {
+		sum += sample;
+	}
+	mean = sum / samples.size();
+	median = (samples.size() % 2) ? samples[samples.size() / 2] : (samples[samples.size() / 2 - 1] + samples[samples.size() / 2]) / 2;
+	min = samples.front();
+	max = samples.back();
+	double squares = 0;
+	for (double sample : samples) {
+		squares += (sample - mean) * (sample - mean);
+	}
+	stddev = (samples.size() > 1) ? std::sqrt(squares / (samples.size() - 1)) : 0;
+}
+
+/**
+ * Runs a kernel with the given mode. The VM is reset between the runs and only Run() is timed
+ * @param kernel Kernel to run
+ * @param mode Mode to run the kernel with
+ * @param warmup Number of untimed runs before the timed ones. Lets the JIT compile and the caches warm up
+ * @param repetitions Number of timed runs
+ * @return Timings of the runs
+*/
+static BenchResult runKernel(const Kernel& kernel, const BenchMode& mode, unsigned int warmup, unsigned int repetitions) {
+	BenchResult result = { &kernel, &mode, true, 0, 0.0, 0.0, 0.0, 0.0, 0.0 };
+	NanoVMOptions options;
+	options.memoryMode = mode.memory;
+	NanoVM vm(kernel.program, options);
+	DiscardSink sink;
+	vm.SetOutput(sink);
+	std::vector<double> samples;
+	for (unsigned int i = 0; i < warmup + repetitions; i++) {
+		auto start = std::chrono::steady_clock::now();
+		result.returnValue = vm.Run(mode.mode);
+		auto end = std::chrono::steady_clock::now();
+		vm.Reset();
+		if (kernel.hasExpectedValue && result.returnValue != kernel.expectedValue) {
+			result.valid = false;
+		}
+		if (i >= warmup) {
+			samples.push_back(std::chrono::duration<double, std::nano>(end - start).count());
+		}
+	}
+	summarize(samples, result.mean, result.median, result.min, result.max, result.stddev);
+	return result;
+}
+
+/**
+ * AssemblerResult holds the timings of assembling the generated source
+*/
+struct AssemblerResult {
+	uint64_t lines; /**< Number of lines in the source */
+	uint64_t bytes; /**< Size of the source */
+	bool valid; /**< Did every run assemble the source */
+	double mean; /**< Mean wall time of a run in nanoseconds */
+	double median; /**< Median wall time of a run in nanoseconds */
+	double min; /**< Shortest wall time of a run in nanoseconds */
+	double max; /**< Longest wall time of a run in nanoseconds */
+	double stddev; /**< Sample standard deviation of the wall times in nanoseconds */
+};
+
+/**
+ * Writes an assembler source with the given number of lines. The blocks mix the operand forms, comments, character
+ * literals, upper case and jumps to blocks all over the file so the labels need every size of relative address
+ * @param path File to write
+ * @param lines Number of lines to write
+ * @return Number of lines written
+*/
+static uint64_t writeAssemblerSource(const std::string& path, uint64_t lines) {
+	const uint64_t blockLines = 10;
+	uint64_t blocks = std::max<uint64_t>(1, lines / blockLines);
+	std::ofstream file(path, std::ios::out | std::ios::binary);
+	// Fixed seed so that every run assembles the same source
+	uint64_t random = 0x9E3779B97F4A7C15ull;
+	for (uint64_t i = 0; i < blocks; i++) {
+		random = random * 6364136223846793005ull + 1442695040888963407ull;
+		file << ":block" << i << "\n";
+		file << "mov reg0, 0x" << std::hex << (random >> 16) << std::dec << " ; load a 64 bit constant\n";
+		file << "ADD reg1, reg0\n";
+		file << "mov @reg2, -" << (random >> 48) << "\n";
+		file << "printc ' '\n";
+		file << "vadd32 y0, y1\n";
+		file << "push 'a'\n";
+		file << "cmp reg1, " << i << "\n";
+		file << "jnz block" << (random >> 33) % blocks << "\n";
+		file << "call block" << (i * 7919) % blocks << "\n";
+	}
+	file << "halt\n";
+	return blocks * blockLines + 1;
+}
+
+/**
+ * Assembles a generated source to memory
+ * @param lines Number of lines in the source
+ * @param warmup Number of untimed runs before the timed ones
+ * @param repetitions Number of timed runs
+ * @return Timings of the runs
+*/
+static AssemblerResult runAssembler(uint64_t lines, unsigned int warmup, unsigned int repetitions) {
+	AssemblerResult result = { 0, 0, true, 0.0, 0.0, 0.0, 0.0, 0.0 };
+	std::string path = (fs::temp_directory_path() / "NanoBench.nano").string();
+	result.lines = writeAssemblerSource(path, lines);
+	result.bytes = fs::file_size(path);
+	NanoAssembler assembler;
+	std::vector<double> samples;
+	for (unsigned int i = 0; i < warmup + repetitions; i++) {
+		// The labels are reported on stdout which would be mixed with the report
+		std::ostringstream discarded;
+		std::streambuf* previous = std::cout.rdbuf(discarded.rdbuf());
+		unsigned char* bytecode = nullptr;
+		unsigned int length = 0;
+		auto start = std::chrono::steady_clock::now();
+		AssemblerReturnValues status = assembler.assembleToMemory(path, bytecode, length);
+		auto end = std::chrono::steady_clock::now();
+		std::cout.rdbuf(previous);
+		delete[] bytecode;
+		result.valid &= status == AssemblerReturnValues::Success;
+		if (i >= warmup) {
+			samples.push_back(std::chrono::duration<double, std::nano>(end - start).count());
+		}
+	}
+	fs::remove(path);
+	summarize(samples, result.mean, result.median, result.min, result.max, result.stddev);
+	return result;
+}
+
+/**
+ * @return Text with the JSON special characters escaped
+*/
+static std::string jsonString(const std::string& text) {
+	std::string escaped = "\"";
+	for (char c : text) {
+		if (c == '"' || c == '\\') {
+			escaped += '\\';
+		}
+		escaped += c;
+	}
+	return escaped + "\"";
+}
+
+/**
+ * Writes the results as JSON. Times are in nanoseconds
+*/
+static void printJson(const std::vector<BenchResult>& results, unsigned int warmup, unsigned int repetitions) {
+	std::cout << std::setprecision(10);
+	std::cout << "{\n";
+	std::cout << "  \"buildType\": " << jsonString(NANOBENCH_BUILD_TYPE) << ",\n";
+	std::cout << "  \"vectorInstructionSet\": " << jsonString(VectorUnit::InstructionSet()) << ",\n";
+	std::cout << "  \"warmup\": " << warmup << ",\n";
+	std::cout << "  \"repetitions\": " << repetitions << ",\n";
+	std::cout << "  \"results\": [";
+	for (size_t i = 0; i < results.size(); i++) {
+		const BenchResult& result = results[i];
+		std::cout << ((i == 0) ? "\n" : ",\n");
+		std::cout << "    {\n";
+		std::cout << "      \"kernel\": " << jsonString(result.kernel->name) << ",\n";
+		std::cout << "      \"mode\": " << jsonString(result.mode->name) << ",\n";
+		std::cout << "      \"valid\": " << (result.valid ? "true" : "false") << ",\n";
+		std::cout << "      \"returnValue\": " << result.returnValue << ",\n";
+		std::cout << "      \"instructions\": " << result.kernel->instructions << ",\n";
+		std::cout << "      \"wallTimeNs\": { \"mean\": " << result.mean << ", \"median\": " << result.median << ", \"min\": " << result.min
+			<< ", \"max\": " << result.max << ", \"stddev\": " << result.stddev << " },\n";
+		std::cout << "      \"nsPerInstruction\": " << result.mean / result.kernel->instructions << ",\n";
+		std::cout << "      \"instructionsPerSecond\": " << result.kernel->instructions / (result.mean / 1e9) << "\n";
+		std::cout << "    }";
+	}
+	std::cout << "\n  ]\n}" << std::endl;
+}
+
+/**
+ * Writes the results as a table
+*/
+static void printTable(const std::vector<BenchResult>& results, unsigned int warmup, unsigned int repetitions) {
+	std::cout << "Warmup runs: " << warmup << ", timed runs: " << repetitions << ", vector instructions: " << VectorUnit::InstructionSet() << "\n";
+	std::cout << std::left << std::setw(14) << "kernel" << std::setw(18) << "mode" << std::right << std::setw(14) << "instructions"
+		<< std::setw(12) << "mean ms" << std::setw(10) << "stddev %" << std::setw(12) << "min ms" << std::setw(10) << "ns/inst"
+		<< std::setw(10) << "MIPS" << "\n";
+	std::cout << std::fixed;
+	for (const BenchResult& result : results) {
+		std::cout << std::left << std::setw(14) << result.kernel->name << std::setw(18) << result.mode->name << std::right
+			<< std::setw(14) << result.kernel->instructions << std::setprecision(3) << std::setw(12) << result.mean / 1e6
+			<< std::setprecision(1) << std::setw(10) << 100 * result.stddev / result.mean << std::setprecision(3) << std::setw(12)
+			<< result.min / 1e6 << std::setw(10) << result.mean / result.kernel->instructions << std::setprecision(1) << std::setw(10)
+			<< result.kernel->instructions / (result.mean / 1e3) << (result.valid ? "" : "  INVALID RETURN VALUE") << "\n";
+	}
+	std::cout.flush();
+}
+
+/**
+ * Writes the assembler timings as JSON or as a table. Times are in nanoseconds in the JSON
+*/
+static void printAssembler(const AssemblerResult& result, unsigned int warmup, unsigned int repetitions, bool json) {
+	double megabytes = result.bytes / 1e6;
+	if (json) {
+		std::cout << std::setprecision(10);
+		std::cout << "{\n";
+		std::cout << "  \"buildType\": " << jsonString(NANOBENCH_BUILD_TYPE) << ",\n";
+		std::cout << "  \"warmup\": " << warmup << ",\n";
+		std::cout << "  \"repetitions\": " << repetitions << ",\n";
+		std::cout << "  \"assembler\": {\n";
+		std::cout << "    \"valid\": " << (result.valid ? "true" : "false") << ",\n";
+		std::cout << "    \"lines\": " << result.lines << ",\n";
+		std::cout << "    \"bytes\": " << result.bytes << ",\n";
+		std::cout << "    \"wallTimeNs\": { \"mean\": " << result.mean << ", \"median\": " << result.median << ", \"min\": " << result.min
+			<< ", \"max\": " << result.max << ", \"stddev\": " << result.stddev << " },\n";
+		std::cout << "    \"megabytesPerSecond\": " << megabytes / (result.mean / 1e9) << ",\n";
+		std::cout << "    \"linesPerSecond\": " << result.lines / (result.mean / 1e9) << "\n";
+		std::cout << "  }\n}" << std::endl;
+		return;
+	}
+	std::cout << "Warmup runs: " << warmup << ", timed runs: " << repetitions << "\n";
+	std::cout << std::right << std::setw(12) << "lines" << std::setw(10) << "MB" << std::setw(12) << "mean ms" << std::setw(10) << "stddev %"
+		<< std::setw(12) << "min ms" << std::setw(10) << "MB/s" << std::setw(14) << "lines/s" << "\n";
+	std::cout << std::fixed << std::setw(12) << result.lines << std::setprecision(2) << std::setw(10) << megabytes << std::setprecision(3)
+		<< std::setw(12) << result.mean / 1e6 << std::setprecision(1) << std::setw(10) << 100 * result.stddev / result.mean
+		<< std::setprecision(3) << std::setw(12) << result.min / 1e6 << std::setprecision(1) << std::setw(10) << megabytes / (result.mean / 1e9)
+		<< std::setprecision(0) << std::setw(14) << result.lines / (result.mean / 1e9) << (result.valid ? "" : "  ASSEMBLY FAILED") << "\n";
+	std::cout.flush();
+}
+
+// main
+int main(int argc, char* argv[]) {
+	unsigned int warmup = 2;
+	unsigned int repetitions = 10;
+	bool json = false;
+	uint64_t assemblerLines = 0;
+	std::vector<const BenchMode*> modes;
+	std::vector<std::string> paths;
+	for (int i = 1; i < argc; i++) {
+		std::string argument = argv[i];
+		if (argument == "--warmup" && i + 1 < argc) {
+			warmup = std::stoul(argv[++i]);
+		}
+		else if (argument == "--repetitions" && i + 1 < argc) {
+			repetitions = std::max(1ul, std::stoul(argv[++i]));
+		}
+		else if (argument == "--mode" && i + 1 < argc) {
+			std::string name = argv[++i];
+			auto mode = std::find_if(std::begin(benchModes), std::end(benchModes), [&](const BenchMode& mode) { return mode.name == name; });
+			if (mode == std::end(benchModes)) {
+				std::cerr << "Unknown mode: " << name << std::endl;
+				return 1;
+			}
+			modes.push_back(&*mode);
+		}
+		else if (argument == "--json") {
+			json = true;
+		}
+		else if (argument == "--assembler" && i + 1 < argc) {
+			assemblerLines = std::stoull(argv[++i]);
+		}
+		else if (argument[0] == '-') {
+			std::cerr << "Usage NanoBench [--warmup N] [--repetitions N] [--mode interpreter|threaded|threaded-guarded|jit]... [--json] [KERNEL|DIRECTORY]..." << std::endl;
+			std::cerr << "      NanoBench [--warmup N] [--repetitions N] [--json] --assembler LINES" << std::endl;
+			return 1;
+		}
+		else {
+			paths.push_back(argument);
+		}
+	}
+	if (assemblerLines) {
+		AssemblerResult result = runAssembler(assemblerLines, warmup, repetitions);
+		printAssembler(result, warmup, repetitions, json);
+		return result.valid ? 0 : 2;
+	}
+	if (modes.empty()) {
+		for (const BenchMode& mode : benchModes) {
+			modes.push_back(&mode);
+		}
+	}
+	if (paths.empty()) {
+		paths.push_back(NANOBENCH_KERNEL_DIR);
+	}
+	// Directories are expanded to their .nano files in name order
+	std::vector<std::string> files;
+	for (const std::string& path : paths) {
+		if (fs::is_directory(path)) {
+			std::vector<std::string> directoryFiles;
+			for (const auto& entry : fs::directory_iterator(path)) {
+				if (entry.path().extension() == ".nano") {
+					directoryFiles.push_back(entry.path().string());
+				}
+			}
+			std::sort(directoryFiles.begin(), directoryFiles.end());
+			files.insert(files.end(), directoryFiles.begin(), directoryFiles.end());
+		}
+		else {
+			files.push_back(path);
+		}
+	}
+	NanoAssembler assembler;
+	std::vector<Kernel> kernels(files.size());
+	for (size_t i = 0; i < files.size(); i++) {
+		if (!loadKernel(assembler, files[i], kernels[i])) {
+			return 1;
+		}
+	}
+	std::vector<BenchResult> results;
+	bool valid = true;
+	for (const Kernel& kernel : kernels) {
+		for (const BenchMode* mode : modes) {
+			results.push_back(runKernel(kernel, *mode, warmup, repetitions));
+			valid &= results.back().valid;
+		}
+	}
+	if (json) {
+		printJson(results, warmup, repetitions);
+	}
+	else {
+		printTable(results, warmup, repetitions);
+	}
+	return valid ? 0 : 2;
+}
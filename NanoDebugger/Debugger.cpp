@@ -2,11 +2,34 @@
 
 int main(int argc, char *argv[])
 {
-	if (argc < 1) {
-		std::cout << "Usage NanoDebugger.exe [FILE]" << std::endl;
+	if (argc < 2) {
+		std::cout << "Usage NanoDebugger.exe [FILE] [--no-fusion] [--snapshot-interval INSTRUCTIONS] [--snapshot-memory MB]" << std::endl;
+		std::cout << "      NanoDebugger.exe [FILE] --profile [PROFILE]" << std::endl;
+		return 0;
 	}
 	std::string file = (argv[1]);
 	NanoDebugger debugger(file);
+	uint64_t snapshotInterval = DEFAULT_SNAPSHOT_INTERVAL;
+	uint64_t snapshotMemory = DEFAULT_SNAPSHOT_MEMORY;
+	for (int i = 2; i < argc; i++) {
+		std::string argument = argv[i];
+		// Instruction fusion executes multiple instructions in a single step
+		if (argument == "--no-fusion") {
+			debugger.SetFusion(false);
+		}
+		// Moving back in time executes at most the interval again. The snapshots are thinned out to fit in the memory
+		else if (argument == "--snapshot-interval" && i + 1 < argc) {
+			snapshotInterval = std::stoull(argv[++i]);
+		}
+		else if (argument == "--snapshot-memory" && i + 1 < argc) {
+			snapshotMemory = std::stoull(argv[++i]) * 1024 * 1024;
+		}
+		// Annotate a profile of the program instead of debugging it
+		else if (argument == "--profile" && i + 1 < argc) {
+			return debugger.annotateProfile(argv[i + 1]) ? 0 : 1;
+		}
+	}
+	debugger.SetSnapshots(snapshotInterval, snapshotMemory);
 	debugger.debug();
 	return 0;
 }
\ No newline at end of file
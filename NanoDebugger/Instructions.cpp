@@ -2,4 +2,8 @@
 
 const char *instructionStr[] = { "mov","add", "sub","and", "or", "xor", "sar", "sal", "ror", "rol", "mul",
    "div", "mod", "cmp", "jz", "jnz", "jg", "js", "jmp", "not", "inc", "dec", "ret", "call", "push", "pop", "halt",
-   "printi", "prints", "printc", "syscall", "memcpy" };
\ No newline at end of file
+   "printi", "prints", "printc", "syscall", "memcpy" };
+
+const char *bulkOperationStr[] = { "memcpy", "memset", "memcmp", "memchr" };
+
+const char *vectorInstructionStr[] = { "vadd", "vsub", "vand", "vor", "vxor", "vcmpeq", "vcmpgt", "vload", "vstore" };
\ No newline at end of file
@@ -1,3 +1,5 @@
 #pragma once
 
-extern const char *instructionStr[];
\ No newline at end of file
+extern const char *instructionStr[];
+extern const char *bulkOperationStr[];
+extern const char *vectorInstructionStr[];
\ No newline at end of file
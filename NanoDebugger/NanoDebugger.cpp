@@ -1,23 +1,130 @@
 #include "NanoDebugger.h"
+#include <algorithm>
 
-NanoDebugger::NanoDebugger(std::string file) : NanoVM(file) {
+/**
+ * @return Options of the debugged VM. Guarded memory lets the watchpoints protect the watched pages
+*/
+static NanoVMOptions debuggerOptions() {
+	NanoVMOptions options;
+	options.memoryMode = MemoryMode::Guarded;
+	return options;
+}
+
+NanoDebugger::NanoDebugger(std::string file) : NanoVM(file, debuggerOptions()), timeline(DEFAULT_SNAPSHOT_INTERVAL, DEFAULT_SNAPSHOT_MEMORY) {
 	run = false;
+	traveled = false;
+	position = 0;
+	// The output is written right away so it appears between the steps
+	SetOutput(StdoutSink::instance());
+#ifdef NANOVM_PROFILE
+	// The debugger would overwrite the profile it annotates
+	profileFile.clear();
+#endif
 }
 
-NanoDebugger::NanoDebugger(unsigned char *bytecode, uint64_t size) : NanoVM(bytecode, size) {
+NanoDebugger::NanoDebugger(unsigned char *bytecode, uint64_t size) : NanoVM(bytecode, size, debuggerOptions()), timeline(DEFAULT_SNAPSHOT_INTERVAL, DEFAULT_SNAPSHOT_MEMORY) {
 	run = false;
+	traveled = false;
+	position = 0;
+	// The output is written right away so it appears between the steps
+	SetOutput(StdoutSink::instance());
+#ifdef NANOVM_PROFILE
+	// The debugger would overwrite the profile it annotates
+	profileFile.clear();
+#endif
 }
 
 NanoDebugger::~NanoDebugger() {
 
 }
 
+void NanoDebugger::SetFusion(bool enabled) {
+	// The fused sequences are split again at the breakpoints so that they are hit
+	NanoVM::SetFusion(enabled);
+}
+
+void NanoDebugger::SetSnapshots(uint64_t interval, uint64_t memoryBudget) {
+	timeline.configure(interval, memoryBudget);
+}
+
+bool NanoDebugger::annotateProfile(const std::string& file, size_t blockCount) {
+	Profile profile;
+	if (!profile.Load(file)) {
+		std::cout << "Unable to load the profile " << file << std::endl;
+		return false;
+	}
+	const char* sizeStr[] = { "byte", "short", "dword", "qword" };
+	std::cout << "Executed instructions: " << profile.instructions << "\n\nOpcodes:\n";
+	// Opcode and size combinations by the number of executions
+	std::vector<std::pair<uint64_t, uint32_t>> opcodes;
+	for (uint32_t opcode = 0; opcode < PROFILE_OPCODE_COUNT; opcode++) {
+		for (uint32_t size = 0; size < 4; size++) {
+			if (profile.opcodeCounts[opcode][size]) {
+				opcodes.push_back({ profile.opcodeCounts[opcode][size], opcode * 4 + size });
+			}
+		}
+	}
+	std::sort(opcodes.begin(), opcodes.end(), std::greater<std::pair<uint64_t, uint32_t>>());
+	for (const auto& opcode : opcodes) {
+		uint32_t value = opcode.second / 4;
+		const char* name = (value < VECTOR_OPCODE_BASE) ? instructionStr[value] : vectorInstructionStr[value - VECTOR_OPCODE_BASE];
+		std::printf("%-8s %-6s %16llu %6.2f%%\n", name, sizeStr[opcode.second % 4], static_cast<unsigned long long>(opcode.first),
+			100.0 * opcode.first / profile.instructions);
+	}
+	// The hottest blocks are printed in the order they are in the bytecode so that nested loops stay together
+	uint64_t totalTime = 0;
+	std::vector<uint64_t> blocks;
+	for (uint64_t offset = 0; offset < profile.blockEntries.size(); offset++) {
+		if (profile.blockEntries[offset]) {
+			blocks.push_back(offset);
+			totalTime += profile.blockTime[offset];
+		}
+	}
+	std::sort(blocks.begin(), blocks.end(), [&](uint64_t a, uint64_t b) { return profile.blockTime[a] > profile.blockTime[b]; });
+	blocks.resize(std::min(blocks.size(), blockCount));
+	std::sort(blocks.begin(), blocks.end());
+	std::cout << "\nHottest blocks (time in " << profile.timeUnit << "):\n";
+	uint64_t savedIp = cpu.registers[ip];
+	for (uint64_t offset : blocks) {
+		std::printf("\nBlock at %llu: entered %llu times, time %llu (%.2f%%)\n", static_cast<unsigned long long>(offset),
+			static_cast<unsigned long long>(profile.blockEntries[offset]), static_cast<unsigned long long>(profile.blockTime[offset]),
+			totalTime ? 100.0 * profile.blockTime[offset] / totalTime : 0.0);
+		// A block continues through the conditional jumps until the program leaves it or jumps unconditionally
+		for (int i = 0; i < 64; i++) {
+			Instruction ins;
+			std::string instruction;
+			cpu.registers[ip] = offset;
+			if (!decode(offset, ins) || !ins.instructionSize || !disassembleInstruction(instruction)) {
+				break;
+			}
+			uint64_t hits = (offset < profile.hits.size()) ? profile.hits[offset] : 0;
+			std::printf("%16llu  %llu. %s\n", static_cast<unsigned long long>(hits), static_cast<unsigned long long>(offset), instruction.c_str());
+			offset += ins.instructionSize;
+			uint64_t nextHits = (offset < profile.hits.size()) ? profile.hits[offset] : 0;
+			bool isConditional = ins.opcode == Opcodes::Jz || ins.opcode == Opcodes::Jnz || ins.opcode == Opcodes::Jg || ins.opcode == Opcodes::Js;
+			if (ins.opcode == Opcodes::Jmp || ins.opcode == Opcodes::Ret || ins.opcode == Opcodes::Halt || !nextHits || (isConditional && nextHits < hits)) {
+				break;
+			}
+		}
+	}
+	cpu.registers[ip] = savedIp;
+	return true;
+}
+
 bool NanoDebugger::disassembleInstruction(std::string &instruction) {
 	Instruction ins;
 	if (!fetch(ins)) {
 		return false;
 	}
+	if (ins.opcode >= VECTOR_OPCODE_BASE) {
+		disassembleVectorInstruction(ins, instruction);
+		return true;
+	}
 	std::string opcode = instructionStr[ins.opcode];
+	// The destination register bits of memcpy select the bulk memory operation
+	if (ins.opcode == Opcodes::Memcpy) {
+		opcode = (ins.dstReg <= BulkOperation::BulkSearch) ? bulkOperationStr[ins.dstReg] : "memcpy." + std::to_string(ins.dstReg);
+	}
 	if (ins.opcode == Opcodes::Halt || ins.opcode == Opcodes::Ret) {
 		instruction = opcode;
 		return true;
@@ -26,7 +133,7 @@ bool NanoDebugger::disassembleInstruction(std::string &instruction) {
 	if (ins.opcode == Opcodes::Jg || ins.opcode == Opcodes::Js || ins.opcode == Opcodes::Jnz || ins.opcode == Opcodes::Jz ||
 		ins.opcode == Opcodes::Jmp || ins.opcode == Opcodes::Push || ins.opcode == Opcodes::Pop || ins.opcode == Opcodes::Call ||
 		ins.opcode == Opcodes::Dec || ins.opcode == Opcodes::Inc || ins.opcode == Opcodes::Printc || ins.opcode == Opcodes::Printi ||
-		ins.opcode == Opcodes::Prints) {
+		ins.opcode == Opcodes::Prints || ins.opcode == Opcodes::Syscall || ins.opcode == Opcodes::Memcpy) {
 		if (ins.srcType == DataType::Reg) {
 			instruction = opcode + ((ins.isSrcMem) ? " @reg" : " reg") + std::to_string(ins.srcReg);
 		}
@@ -48,6 +155,25 @@ bool NanoDebugger::disassembleInstruction(std::string &instruction) {
 	return true;
 }
 
+void NanoDebugger::disassembleVectorInstruction(const Instruction& ins, std::string& instruction) {
+	unsigned int opcode = ins.opcode - VECTOR_OPCODE_BASE;
+	std::string name = vectorInstructionStr[opcode];
+	// Lane size is part of the name of the lane wise instructions e.g. vadd32
+	if (opcode == VAdd || opcode == VSub || opcode == VCmpEq || opcode == VCmpGt) {
+		name += std::to_string(8 << ins.srcSize);
+	}
+	std::string prefix = (ins.immediate == VECTOR_REGISTER_SIZE) ? "y" : "x";
+	if (opcode == VLoad) {
+		instruction = name + " " + prefix + std::to_string(ins.dstReg) + ", @reg" + std::to_string(ins.srcReg);
+	}
+	else if (opcode == VStore) {
+		instruction = name + " @reg" + std::to_string(ins.dstReg) + ", " + prefix + std::to_string(ins.srcReg);
+	}
+	else {
+		instruction = name + " " + prefix + std::to_string(ins.dstReg) + ", " + prefix + std::to_string(ins.srcReg);
+	}
+}
+
 bool NanoDebugger::handleInteractive() {
 	int value = 0;
 	do {
@@ -56,36 +182,98 @@ bool NanoDebugger::handleInteractive() {
 			std::cout << "Failed to fetch instruction: IP out of bounds! IP: " << cpu.registers[ip] << std::endl;
 			return false;
 		}
-		std::cout << cpu.registers[ip] << ". " << instruction << std::endl;
+		std::cout << "#" << position << " " << cpu.registers[ip] << ". " << instruction;
+		if (instructionCache[cpu.registers[ip]].fusedSize) {
+			std::cout << " (fused, " << static_cast<int>(instructionCache[cpu.registers[ip]].fusedSize) << " bytes)";
+		}
+		std::cout << std::endl;
 		std::cout << "> ";
 		value = getchar();
 		std::cout << "\b\b";
 		if (value == 'h') {
-			std::cout << "\n(s)tack\nr(e)gisters\n(b)reakpoint\n(r)un\n(c)lean breakpoint\n(q)uit" << std::endl;
+			std::cout << "\n(s)tack\nr(e)gisters\n(b)reakpoint\n(r)un\n(c)lean breakpoint\n(f)usion on/off\n(p)revious instruction\nre(v)erse run\n(g)o to instruction #\n(w)atchpoint\nremove watchpoint (x)\n(q)uit" << std::endl;
 		}
 		else if (value == 'e') {
 			std::cout << "\nRegisters:\n";
 			for (int i = 0; i < 8; i++) {
 				std::cout << "reg" << i << ": " << cpu.registers[i] << std::endl;
 			}
+			std::cout << "Vector registers (" << VectorUnit::InstructionSet() << "):\n";
+			for (uint32_t i = 0; i < VECTOR_REGISTER_COUNT; i++) {
+				std::printf("y%u:", i);
+				// Highest byte first like the register is written in hex
+				for (int j = VECTOR_REGISTER_SIZE - 1; j >= 0; j--) {
+					std::printf("%s%02X", (j % 8 == 7) ? " " : "", cpu.vectorRegisters[i][j]);
+				}
+				std::printf("\n");
+			}
 		}
 		else if (value == 'r') {
 			run = true;
 			return true;
 		}
+		else if (value == 'p' || value == 'v' || value == 'g') {
+			uint64_t target = position;
+			if (value == 'g') {
+				std::cout << "Go to instruction #: ";
+				std::cin >> target;
+			}
+			else if (value == 'p' && position) {
+				target = position - 1;
+			}
+			bool found = (value == 'v') ? reverseContinue() : seek(target);
+			if (value == 'v' && !found) {
+				std::cout << "No breakpoint before, moved to the start!" << std::endl;
+			}
+			else if (value != 'v' && (!found || position != target)) {
+				std::cout << "Program ended at instruction #" << position << std::endl;
+			}
+			run = false;
+			traveled = true;
+			return true;
+		}
 		else if (value == 'b') {
 			std::cout << "Breakpoint where (offset): ";
 			int offset;
 			std::cin >> offset;
-			breakpoints.insert(offset);
+			if (!setBreakpoint(offset, true)) {
+				std::cout << "Offset outside of the code pages!" << std::endl;
+			}
+		}
+		else if (value == 'w') {
+			std::cout << "Watch (r)ead, (w)rite or (c)hange, offset and size: ";
+			char kind;
+			uint64_t offset;
+			uint64_t size;
+			std::cin >> kind >> offset >> size;
+			if (kind != 'r' && kind != 'w' && kind != 'c') {
+				std::cout << "Unknown watchpoint kind!" << std::endl;
+			}
+			else if (!addWatchpoint(offset, size, (kind == 'r') ? WatchKind::Read : (kind == 'w') ? WatchKind::Write : WatchKind::Change)) {
+				std::cout << "Range outside of the memory or the memory is not guarded!" << std::endl;
+			}
+		}
+		else if (value == 'x') {
+			std::cout << "Remove watchpoint where (offset): ";
+			uint64_t offset;
+			std::cin >> offset;
+			if (!removeWatchpoints(offset)) {
+				std::cout << "No watchpoint was placed here!" << std::endl;
+			}
+			else {
+				std::cout << "Watchpoint removed!" << std::endl;
+			}
+		}
+		else if (value == 'f') {
+			SetFusion(!fusion);
+			std::cout << "Fusion " << (fusion ? "enabled" : "disabled") << std::endl;
 		}
 		else if (value == 'c') {
-			auto a = breakpoints.find(cpu.registers[ip]);
-			if (a == breakpoints.end()) {
+			if (!isBreakpoint(cpu.registers[ip])) {
 				std::cout << "No breakpoint was placed here!" << std::endl;
 			}
 			else {
-				breakpoints.erase(a);
+				setBreakpoint(cpu.registers[ip], false);
 				std::cout << "Breakpoint removed!" << std::endl;
 			}
 		}
@@ -125,41 +313,338 @@ void NanoDebugger::printStack() {
 	std::printf("\n");
 }
 
-bool NanoDebugger::debug() {
-	run = false;
-	while (cpu.registers[ip] < cpu.bytecodeSize) {
+bool NanoDebugger::advance(uint64_t target, bool stopAtBreakpoints, bool stopAtWatchpoints) {
+	uint64_t start = position;
+	while (position < target && !errorFlag) {
+		if (position >= timeline.nextPosition()) {
+			takeSnapshot();
+		}
+		uint64_t offset = cpu.registers[ip];
 		Instruction inst;
-		if (fetch(inst)) {
-			if (breakpoints.find(cpu.registers[ip]) != breakpoints.end()) {
-				std::cout << "Breakpoint triggered! " << cpu.registers[ip] << std::endl;
-				run = false;
-				handleInteractive();
+		// The program halted or the IP left the code
+		if (offset >= cpu.bytecodeSize || !decode(offset, inst) || inst.opcode == Halt) {
+			break;
+		}
+		if (stopAtBreakpoints && position > start && isBreakpoint(offset)) {
+			break;
+		}
+		// A fused sequence may run two instructions past the limit of the engine so the engine stops two instructions before
+		// the target at the latest. Only the target has to be reached exactly, a snapshot may be taken a few instructions late
+		uint64_t limit = std::min(timeline.nextPosition(), (target > 2) ? target - 2 : 0);
+		if (limit > position && !isBreakpoint(offset)) {
+			instructionCount = position;
+			instructionLimit = limit;
+			uint64_t result;
+			if (stopAtBreakpoints) {
+				runToBreakpoint(result);
 			}
-			else if (!run) {
-				handleInteractive();
+			else {
+				Run(ExecutionMode::Threaded);
 			}
-			if (inst.opcode == Halt) {
-				std::cout << "VM halted!" << std::endl;
-				handleInteractive();
+			instructionLimit = NO_INSTRUCTION_LIMIT;
+			position = instructionCount;
+			offset = watchedInstruction;
+		}
+		// The last instructions before the target are not fused so that it is reached exactly
+		else if (stopAtWatchpoints ? executeWatched(inst) : execute(inst)) {
+			position++;
+		}
+		else {
+			break;
+		}
+		// Every access to a watched page stops the engine. The run continues if no watchpoint was hit
+		if (watchFaultCount) {
+			if (stopAtWatchpoints && reportWatchpoints(offset)) {
+				run = false;
 				break;
 			}
-			if (!execute(inst)) {
-				switch (errorFlag) {
-				case MEMORY_ACCESS:
-					std::cout << "Tried to read/write memory outside of VM!" << std::endl;
+			watchFaultCount = 0;
+		}
+	}
+	return !errorFlag;
+}
+
+void NanoDebugger::takeSnapshot() {
+	timeline.add(position, cpu, cpu.codeBase, cpu.codeSize + cpu.stackSize);
+}
+
+void NanoDebugger::restore(const TimelineSnapshot& snapshot) {
+	// The stack grows and shrinks through the same sizes so it gets back to the size it had
+	if (cpu.stackSize < snapshot.cpu.stackSize) {
+		growStack(cpu.codeSize + snapshot.cpu.stackSize - 1, 1);
+	}
+	else {
+		shrinkStack(snapshot.cpu.stackSize);
+	}
+	for (uint64_t i = 0; i < snapshot.pages.size(); i++) {
+		unsigned char* page = cpu.codeBase + i * NANOVM_PAGE_SIZE;
+		if (!memcmp(page, snapshot.pages[i]->data(), NANOVM_PAGE_SIZE)) {
+			continue;
+		}
+		memcpy(page, snapshot.pages[i]->data(), NANOVM_PAGE_SIZE);
+		if (i * NANOVM_PAGE_SIZE < cpu.codeSize) {
+			invalidate(i * NANOVM_PAGE_SIZE, NANOVM_PAGE_SIZE);
+		}
+	}
+	memcpy(cpu.registers, snapshot.cpu.registers, sizeof(cpu.registers));
+	memcpy(cpu.vectorRegisters, snapshot.cpu.vectorRegisters, sizeof(cpu.vectorRegisters));
+	errorFlag = 0;
+	position = snapshot.position;
+}
+
+bool NanoDebugger::seek(uint64_t target) {
+	const TimelineSnapshot* snapshot = timeline.find(target);
+	// Continue from the current position if it is nearer than the snapshot
+	if (snapshot && (target < position || snapshot->position > position)) {
+		restore(*snapshot);
+	}
+	// The output of the executed instructions was printed the first time they were executed
+	char none;
+	BufferSink discarded(&none, 0);
+	OutputSink* shown = output;
+	SetOutput(discarded);
+	bool success = advance(target, false);
+	SetOutput(*shown);
+	// The change watchpoints compare with the value at the new position
+	for (Watchpoint& watchpoint : watchpoints) {
+		watchpoint.value = watchedValue(watchpoint);
+	}
+	return success;
+}
+
+bool NanoDebugger::reverseContinue() {
+	char none;
+	BufferSink discarded(&none, 0);
+	OutputSink* shown = output;
+	SetOutput(discarded);
+	// Search the intervals between the snapshots from the latest one backwards for the last breakpoint reached
+	uint64_t hit = NO_INSTRUCTION_LIMIT;
+	for (uint64_t end = position; end && hit == NO_INSTRUCTION_LIMIT; ) {
+		const TimelineSnapshot* snapshot = timeline.find(end - 1);
+		restore(*snapshot);
+		if (isBreakpoint(cpu.registers[ip])) {
+			hit = position;
+		}
+		while (advance(end, true) && position < end && isBreakpoint(cpu.registers[ip])) {
+			hit = position;
+		}
+		end = snapshot->position;
+	}
+	SetOutput(*shown);
+	seek((hit == NO_INSTRUCTION_LIMIT) ? 0 : hit);
+	return hit != NO_INSTRUCTION_LIMIT;
+}
+
+bool NanoDebugger::debug() {
+	run = false;
+	while (true) {
+		while (cpu.registers[ip] < cpu.bytecodeSize) {
+			Instruction inst;
+			if (fetch(inst)) {
+				if (run && inst.opcode != Halt && !isBreakpoint(cpu.registers[ip])) {
+					// Run with the threaded engine until the next breakpoint. The instruction at the breakpoint the previous
+					// run stopped at has been stepped over already
+					if (!advance(NO_INSTRUCTION_LIMIT, true, true)) {
+						switch (errorFlag) {
+						case MEMORY_ACCESS:
+							std::cout << "Tried to read/write memory outside of VM!" << std::endl;
+							break;
+						default:
+							std::cout << "Unknown error!" << std::endl;
+						}
+						return false;
+					}
+					// Stopped at a breakpoint or a halt instruction, or the IP left the code
+					continue;
+				}
+				if (isBreakpoint(cpu.registers[ip])) {
+					std::cout << "Breakpoint triggered! " << cpu.registers[ip] << std::endl;
+					run = false;
+					handleInteractive();
+				}
+				else if (!run) {
+					handleInteractive();
+				}
+				if (traveled) {
+					traveled = false;
+					continue;
+				}
+				if (inst.opcode == Halt) {
+					std::cout << "VM halted!" << std::endl;
+					handleInteractive();
+					if (traveled) {
+						traveled = false;
+						continue;
+					}
 					break;
-				default:
-					std::cout << "Unknown error!" << std::endl;
 				}
+				if (position >= timeline.nextPosition()) {
+					takeSnapshot();
+				}
+				// Execute the cached instruction which may be fused with the following instructions
+				Instruction& cached = instructionCache[cpu.registers[ip]];
+				if (!cached.instructionSize) {
+					decode(cpu.registers[ip], cached);
+				}
+				// Counted before executing since the instruction may overwrite itself
+				uint64_t offset = cpu.registers[ip];
+				uint32_t executed = executedInstructions(cached);
+				if (!executeWatched(cached)) {
+					switch (errorFlag) {
+					case MEMORY_ACCESS:
+						std::cout << "Tried to read/write memory outside of VM!" << std::endl;
+						break;
+					default:
+						std::cout << "Unknown error!" << std::endl;
+					}
+					return false;
+				}
+				position += executed;
+				if (watchFaultCount) {
+					reportWatchpoints(offset);
+				}
+			}
+			else {
+				std::cout << "Invalid instruction!" << std::endl;
 				return false;
 			}
 		}
-		else {
-			std::cout << "Invalid instruction!" << std::endl;
-			return false;
+		std::cout << "VM exited with return code: " << cpu.registers[Reg0] << std::endl;
+		handleInteractive();
+		if (!traveled) {
+			return true;
 		}
+		traveled = false;
+	}
+}
+
+bool NanoDebugger::addWatchpoint(uint64_t offset, uint64_t size, WatchKind kind) {
+	uint64_t memorySize = cpu.codeSize + cpu.maxStackSize;
+	if (!size || offset >= memorySize || size > memorySize - offset) {
+		return false;
+	}
+	watchpoints.push_back({ offset, size, kind, {} });
+	watchpoints.back().value = watchedValue(watchpoints.back());
+	if (!watchPages()) {
+		watchpoints.pop_back();
+		watchPages();
+		return false;
 	}
-	std::cout << "VM exited with return code: " << cpu.registers[Reg0] << std::endl;
-	handleInteractive();
 	return true;
 }
+
+bool NanoDebugger::removeWatchpoints(uint64_t offset) {
+	size_t count = watchpoints.size();
+	watchpoints.erase(std::remove_if(watchpoints.begin(), watchpoints.end(),
+		[offset](const Watchpoint& watchpoint) { return watchpoint.offset == offset; }), watchpoints.end());
+	watchPages();
+	return watchpoints.size() != count;
+}
+
+bool NanoDebugger::watchPages() {
+	for (uint64_t page = 0; page < watchedPages.size(); page++) {
+		setPageWatch(page * NANOVM_PAGE_SIZE, PageWatch::None);
+	}
+	// Reads can only be caught by making the page inaccessible so it also catches the writes of the other watchpoints
+	for (const Watchpoint& watchpoint : watchpoints) {
+		PageWatch watch = (watchpoint.kind == WatchKind::Read) ? PageWatch::Access : PageWatch::Write;
+		for (uint64_t page = watchpoint.offset / NANOVM_PAGE_SIZE; page <= (watchpoint.offset + watchpoint.size - 1) / NANOVM_PAGE_SIZE; page++) {
+			if (page < watchedPages.size() && watchedPages[page] == PageWatch::Access) {
+				continue;
+			}
+			if (!setPageWatch(page * NANOVM_PAGE_SIZE, watch)) {
+				return false;
+			}
+		}
+	}
+	return true;
+}
+
+/**
+ * Calculates how many bytes an instruction accesses from a faulting offset
+ * @param inst Decoded instruction
+ * @param instruction Offset of the instruction
+ * @param fault Offset of the faulting access
+ * @return Number of bytes accessed from the faulting offset. Bulk memory instructions may access up to a page
+*/
+static uint64_t accessWidth(const Instruction& inst, uint64_t instruction, uint64_t fault) {
+	// The instruction itself faults when the engine decodes it from a watched code page
+	if (fault >= instruction && fault < instruction + inst.instructionSize) {
+		return instruction + inst.instructionSize - fault;
+	}
+	if (inst.opcode >= VECTOR_OPCODE_BASE) {
+		return inst.immediate;
+	}
+	switch (inst.opcode) {
+	case Opcodes::Memcpy:
+	case Opcodes::Prints:
+		return NANOVM_PAGE_SIZE;
+	case Opcodes::Call:
+	case Opcodes::Ret:
+	case Opcodes::Push:
+	case Opcodes::Pop:
+		return sizeof(uint64_t);
+	default:
+		return 1ull << inst.srcSize;
+	}
+}
+
+bool NanoDebugger::reportWatchpoints(uint64_t instruction) {
+	size_t count = std::min<size_t>(static_cast<size_t>(watchFaultCount), MAX_WATCH_FAULTS);
+	watchFaultCount = 0;
+	Instruction inst;
+	if (!decode(instruction, inst)) {
+		inst.instructionSize = 0;
+		inst.opcode = Opcodes::Memcpy;
+	}
+	bool hit = false;
+	for (Watchpoint& watchpoint : watchpoints) {
+		std::vector<unsigned char> value = watchedValue(watchpoint);
+		bool changed = value != watchpoint.value;
+		// A write may follow a read of the same page in one instruction. Only the first access to a page faults
+		bool accessed = watchpoint.kind != WatchKind::Change && changed;
+		for (size_t i = 0; i < count && !accessed; i++) {
+			uint64_t width = accessWidth(inst, instruction, watchFaults[i]);
+			accessed = watchFaults[i] < watchpoint.offset + watchpoint.size && watchpoint.offset < watchFaults[i] + width;
+		}
+		// Change watchpoints ignore the writes that keep the value
+		if ((watchpoint.kind == WatchKind::Change) ? changed : accessed) {
+			const char* kindStr[] = { "read", "write", "change" };
+			std::cout << "Watchpoint triggered! " << kindStr[static_cast<int>(watchpoint.kind)] << " " << watchpoint.offset
+				<< " (" << watchpoint.size << " bytes)";
+			if (changed) {
+				std::cout << " old value:";
+				for (unsigned char byte : watchpoint.value) {
+					std::printf(" %02X", byte);
+				}
+				std::cout << " new value:";
+				for (unsigned char byte : value) {
+					std::printf(" %02X", byte);
+				}
+			}
+			std::cout << std::endl;
+			hit = true;
+		}
+		watchpoint.value = std::move(value);
+	}
+	if (hit) {
+		std::string disassembled;
+		uint64_t savedIp = cpu.registers[ip];
+		cpu.registers[ip] = instruction;
+		if (!disassembleInstruction(disassembled)) {
+			disassembled = "?";
+		}
+		cpu.registers[ip] = savedIp;
+		std::cout << "Accessed by " << instruction << ". " << disassembled << std::endl;
+	}
+	return hit;
+}
+
+std::vector<unsigned char> NanoDebugger::watchedValue(const Watchpoint& watchpoint) const {
+	std::vector<unsigned char> value(watchpoint.size, 0);
+	uint64_t memorySize = cpu.codeSize + cpu.stackSize;
+	if (watchpoint.offset < memorySize) {
+		memcpy(value.data(), cpu.codeBase + watchpoint.offset, std::min(watchpoint.size, memorySize - watchpoint.offset));
+	}
+	return value;
+}
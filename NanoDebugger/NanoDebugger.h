@@ -1,20 +1,47 @@
 #pragma once
 #include "NanoVM.h"
+#include "VectorUnit.h"
+#include "Profile.h"
 #include "Instructions.h"
+#include "Timeline.h"
 #include <iostream>
 #include <string>
-#include <set>
 #include <vector>
 #include <fstream>
 // Windows only #include <conio.h>
 
+constexpr uint64_t DEFAULT_SNAPSHOT_INTERVAL = 1000000; /**< Instructions executed between the snapshots of the timeline */
+constexpr uint64_t DEFAULT_SNAPSHOT_MEMORY = 256 * 1024 * 1024; /**< Bytes the snapshots of the timeline may use */
+
+/**
+ * WatchKind defines the accesses a watchpoint stops at
+*/
+enum class WatchKind {
+	Read, /**< Reads and writes since a page can not be writable without being readable */
+	Write, /**< Writes. Also reads if a read watchpoint shares the page */
+	Change /**< Writes that change the value */
+};
+
+/**
+ * \brief Watchpoint watches a range of the VM memory
+*/
+struct Watchpoint {
+	uint64_t offset; /**< Offset of the watched range */
+	uint64_t size; /**< Size of the watched range */
+	WatchKind kind; /**< Accesses the watchpoint stops at */
+	std::vector<unsigned char> value; /**< Value of the range when it was last checked */
+};
+
 /**
  * \brief NanoDebugger inherits NanoVM allowing more control over the execution of the program
  *
  * NanoDebugger inherits NanoVM implementation and allows to step through the execution, dump stack, set breakpoints
  * disassembling of instructions and other debugger behavior. 
+ * The program can also be moved back in time. Snapshots are taken while it runs and an earlier instruction is reached by
+ * restoring the nearest snapshot before it and executing the instructions after the snapshot again without their output.
+ * Watchpoints protect the pages of the watched ranges so that the program runs at full speed until it accesses those pages
 */
-class NanoDebugger : NanoVM {
+class NanoDebugger : protected NanoVM {
 public:
 	/**
 	 * Initializes NanoDebugger
@@ -39,8 +66,32 @@ public:
 	 * @return True if bytecode program was executed successfully, false if error occurred
 	*/
 	bool debug();
+
+	/**
+	 * Enables or disables instruction fusion. When enabled a single step may execute a whole fused instruction sequence.
+	 * Sequences containing a breakpoint are never fused
+	 * @param enabled True to fuse the instruction sequences, false to step through every instruction
+	*/
+	void SetFusion(bool enabled);
+
+	/**
+	 * Configures the snapshots taken for moving back in time. Moving back executes at most the interval instructions again.
+	 * When the snapshots exceed the memory budget every other one is dropped and the interval doubles
+	 * @param interval Number of instructions executed between the snapshots
+	 * @param memoryBudget Number of bytes the snapshots may use
+	*/
+	void SetSnapshots(uint64_t interval, uint64_t memoryBudget);
+
+	/**
+	 * Prints a profile saved by a NANOVM_PROFILE build of the loaded program. The opcodes are listed by the number of
+	 * executions and the hottest blocks are disassembled in source order with the executions of each instruction
+	 * @param file Profile file to read
+	 * @param blockCount Number of the hottest blocks to print
+	 * @return True if the profile was loaded
+	*/
+	bool annotateProfile(const std::string& file, size_t blockCount = 10);
 	//bool disassembleToFile(std::string out);
-private:
+protected:
 
 	/**
 	 * Disassembles the next instruction pointed by IP
@@ -49,6 +100,13 @@ private:
 	*/
 	bool disassembleInstruction(std::string &instruction);
 
+	/**
+	 * Disassembles a vector instruction. 128 bit instructions name the registers xN and 256 bit instructions yN
+	 * @param ins Decoded vector instruction
+	 * @param[out] instruction String reference to hold the text representation of disassembled instruction
+	*/
+	void disassembleVectorInstruction(const Instruction& ins, std::string& instruction);
+
 	/**
 	 * Prints stack dump of the stack memory on screen
 	*/
@@ -60,6 +118,84 @@ private:
 	*/
 	bool handleInteractive();
 
-	std::set<uint64_t> breakpoints; /**< Set of all active breakpoints */
-	bool run; /**< Boolean value whether to run until breakpoint is hit or false if stepping through */
+	/**
+	 * Executes the program until the given number of instructions has been executed, it halts or the IP leaves the code.
+	 * The instructions run on the threaded engine and the last ones before the target are executed one at a time so that
+	 * exactly the target is reached. Snapshots are taken when the program runs past the latest one
+	 * @param target Position to reach, NO_INSTRUCTION_LIMIT to run until the program ends
+	 * @param stopAtBreakpoints Stop before an instruction at a breakpoint too. The instruction at the IP is stepped over
+	 * @param stopAtWatchpoints Stop after an instruction hitting a watchpoint too. Stopping ends the run of the debugger
+	 * @return True if no error occurred
+	*/
+	bool advance(uint64_t target, bool stopAtBreakpoints, bool stopAtWatchpoints = false);
+
+	/**
+	 * Adds the current state of the program to the timeline
+	*/
+	void takeSnapshot();
+
+	/**
+	 * Restores the state of the program from a snapshot. Only the pages that differ are copied and the cached instructions
+	 * of the code pages copied are decoded again
+	 * @param snapshot Snapshot to restore
+	*/
+	void restore(const TimelineSnapshot& snapshot);
+
+	/**
+	 * Moves the program to the given position from the nearest snapshot before it or from the current position if that is
+	 * nearer. The output of the executed instructions is not printed again
+	 * @param target Number of executed instructions to move to
+	 * @return True if no error occurred. The program stops before the target if it ends earlier
+	*/
+	bool seek(uint64_t target);
+
+	/**
+	 * Moves the program back to the latest position before the current one at which it reached a breakpoint. The snapshots
+	 * are searched from the latest one backwards
+	 * @return True if a breakpoint was found, false if the program was moved to its start
+	*/
+	bool reverseContinue();
+
+	/**
+	 * Adds a watchpoint and protects the pages of its range
+	 * @param offset Offset of the watched range
+	 * @param size Size of the watched range
+	 * @param kind Accesses to stop at
+	 * @return True if the range is inside the memory the stack can grow to and the memory is guarded
+	*/
+	bool addWatchpoint(uint64_t offset, uint64_t size, WatchKind kind);
+
+	/**
+	 * Removes the watchpoints starting at an offset
+	 * @param offset Offset of the watched range
+	 * @return True if a watchpoint was removed
+	*/
+	bool removeWatchpoints(uint64_t offset);
+
+	/**
+	 * Sets the protection of the pages from the watchpoints
+	 * @return True if the memory is guarded so that the pages can be protected
+	*/
+	bool watchPages();
+
+	/**
+	 * Prints the watchpoints hit by the accesses that faulted on the watched pages and clears the faults. Change
+	 * watchpoints are compared with their previous value
+	 * @param instruction Offset of the instruction that accessed the watched pages
+	 * @return True if a watchpoint was hit
+	*/
+	bool reportWatchpoints(uint64_t instruction);
+
+	/**
+	 * Reads the current value of a watched range. The part the stack has not grown to reads as zero
+	 * @param watchpoint Watchpoint of the range
+	 * @return Value of the range
+	*/
+	std::vector<unsigned char> watchedValue(const Watchpoint& watchpoint) const;
+
+	bool run; /**< Boolean value whether to run until breakpoint is hit or false if stepping through. Runs use the threaded engine */
+	bool traveled; /**< Was the program moved in time by the last interactive command */
+	uint64_t position; /**< Number of instructions executed since the start of the program */
+	Timeline timeline; /**< Snapshots for moving back in time */
+	std::vector<Watchpoint> watchpoints; /**< Watched memory ranges */
 };
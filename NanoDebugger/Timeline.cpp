@@ -0,0 +1,82 @@
+#include "Timeline.h"
+#include <algorithm>
+#include <unordered_set>
+
+Timeline::Timeline(uint64_t interval, uint64_t memoryBudget) : interval(std::max<uint64_t>(interval, 1)), memoryBudget(memoryBudget), used(0) {
+
+}
+
+void Timeline::configure(uint64_t interval, uint64_t memoryBudget) {
+	this->interval = std::max<uint64_t>(interval, 1);
+	this->memoryBudget = memoryBudget;
+	thin();
+}
+
+uint64_t Timeline::nextPosition() const {
+	return snapshots.empty() ? 0 : snapshots.back().position + interval;
+}
+
+void Timeline::add(uint64_t position, const NanoVMCpu& cpu, const unsigned char* memory, uint64_t size) {
+	TimelineSnapshot snapshot;
+	snapshot.position = position;
+	snapshot.cpu = cpu;
+	// The code and the stack are made of whole pages. The pages not written since the previous snapshot are shared with it
+	uint64_t pageCount = size / NANOVM_PAGE_SIZE;
+	snapshot.pages.reserve(pageCount);
+	const TimelineSnapshot* previous = snapshots.empty() ? nullptr : &snapshots.back();
+	for (uint64_t i = 0; i < pageCount; i++) {
+		const unsigned char* page = memory + i * NANOVM_PAGE_SIZE;
+		if (previous && i < previous->pages.size() && !memcmp(previous->pages[i]->data(), page, NANOVM_PAGE_SIZE)) {
+			snapshot.pages.push_back(previous->pages[i]);
+			continue;
+		}
+		std::shared_ptr<SnapshotPage> copy = std::make_shared<SnapshotPage>();
+		memcpy(copy->data(), page, NANOVM_PAGE_SIZE);
+		snapshot.pages.push_back(std::move(copy));
+		used += NANOVM_PAGE_SIZE;
+	}
+	used += sizeof(TimelineSnapshot) + pageCount * sizeof(snapshot.pages[0]);
+	snapshots.push_back(std::move(snapshot));
+	thin();
+}
+
+const TimelineSnapshot* Timeline::find(uint64_t position) const {
+	auto later = std::upper_bound(snapshots.begin(), snapshots.end(), position,
+		[](uint64_t position, const TimelineSnapshot& snapshot) { return position < snapshot.position; });
+	return (later == snapshots.begin()) ? nullptr : &*(later - 1);
+}
+
+size_t Timeline::size() const {
+	return snapshots.size();
+}
+
+uint64_t Timeline::memoryUsed() const {
+	return used;
+}
+
+void Timeline::thin() {
+	while (used > memoryBudget && snapshots.size() > 2) {
+		// Keep the even snapshots and the latest one so that the snapshots stay evenly spaced
+		size_t kept = 1;
+		for (size_t i = 2; i < snapshots.size() - 1; i += 2) {
+			snapshots[kept++] = std::move(snapshots[i]);
+		}
+		snapshots[kept++] = std::move(snapshots.back());
+		snapshots.resize(kept);
+		interval *= 2;
+		measure();
+	}
+}
+
+void Timeline::measure() {
+	std::unordered_set<const SnapshotPage*> pages;
+	used = 0;
+	for (const TimelineSnapshot& snapshot : snapshots) {
+		for (const auto& page : snapshot.pages) {
+			if (pages.insert(page.get()).second) {
+				used += NANOVM_PAGE_SIZE;
+			}
+		}
+		used += sizeof(TimelineSnapshot) + snapshot.pages.size() * sizeof(snapshot.pages[0]);
+	}
+}
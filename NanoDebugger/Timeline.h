@@ -0,0 +1,89 @@
+#pragma once
+#include "NanoVM.h"
+#include <array>
+#include <memory>
+#include <vector>
+
+/**
+ * Page of the VM memory held by the snapshots
+*/
+typedef std::array<unsigned char, NANOVM_PAGE_SIZE> SnapshotPage;
+
+/**
+ * \brief TimelineSnapshot holds the state of the debugged program after a number of executed instructions
+*/
+struct TimelineSnapshot {
+	uint64_t position; /**< Number of instructions executed before the snapshot was taken */
+	NanoVMCpu cpu; /**< State of the CPU. The memory pointers are not valid once the stack has grown */
+	std::vector<std::shared_ptr<const SnapshotPage>> pages; /**< Pages of the code and the stack. A page is shared with the previous snapshot if it was not written in between */
+};
+
+/**
+ * \brief Timeline keeps periodic snapshots of a debugged program so that it can be moved back in time
+ *
+ * A snapshot is taken every interval instructions. It copies only the pages written since the previous snapshot and shares
+ * the other pages with it, so a snapshot of a program writing little memory costs little more than the CPU state. Any earlier
+ * point of the execution is restored from the nearest snapshot before it by executing at most interval instructions again.
+ * When the snapshots exceed the memory budget every other one is dropped and the interval is doubled
+*/
+class Timeline {
+public:
+	/**
+	 * @param interval Number of instructions executed between the snapshots
+	 * @param memoryBudget Number of bytes the snapshots may use
+	*/
+	Timeline(uint64_t interval, uint64_t memoryBudget);
+
+	/**
+	 * Changes the interval and the memory budget. The snapshots taken before are kept unless they exceed the new budget
+	 * @param interval Number of instructions executed between the snapshots
+	 * @param memoryBudget Number of bytes the snapshots may use
+	*/
+	void configure(uint64_t interval, uint64_t memoryBudget);
+
+	/**
+	 * @return Position at which the next snapshot is due. Snapshots are only taken after the latest one
+	*/
+	uint64_t nextPosition() const;
+
+	/**
+	 * Takes a snapshot after the latest one
+	 * @param position Number of instructions executed so far
+	 * @param cpu State of the CPU
+	 * @param memory VM memory holding the code and the stack
+	 * @param size Size of the VM memory
+	*/
+	void add(uint64_t position, const NanoVMCpu& cpu, const unsigned char* memory, uint64_t size);
+
+	/**
+	 * @param position Number of executed instructions
+	 * @return Latest snapshot taken at or before the position, nullptr if there is none
+	*/
+	const TimelineSnapshot* find(uint64_t position) const;
+
+	/**
+	 * @return Number of snapshots kept
+	*/
+	size_t size() const;
+
+	/**
+	 * @return Number of bytes used by the snapshots
+	*/
+	uint64_t memoryUsed() const;
+private:
+	/**
+	 * Drops every other snapshot and doubles the interval until the snapshots fit in the memory budget. The first and the
+	 * latest snapshot are always kept
+	*/
+	void thin();
+
+	/**
+	 * Counts the memory used by the snapshots. Pages shared by several snapshots are counted once
+	*/
+	void measure();
+
+	std::vector<TimelineSnapshot> snapshots; /**< Snapshots ordered by their position */
+	uint64_t interval; /**< Number of instructions executed between the snapshots */
+	uint64_t memoryBudget; /**< Number of bytes the snapshots may use */
+	uint64_t used; /**< Number of bytes used by the snapshots */
+};
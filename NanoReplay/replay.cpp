@@ -0,0 +1,55 @@
+#include "TraceReplay.h"
+#include <string>
+
+/**
+ * This file contains NanoReplay which rebuilds the state of a VM from an execution trace recorded with
+ * NanoVM::StartTrace() or NanoVM --trace. The program is executed again step by step from the trace and every step
+ * is checked against the recorded IP, opcode and changed register. The syscalls are not executed, their recorded
+ * results are written to the registers instead.
+*/
+
+// main
+int main(int argc, char* argv[]) {
+	if (argc < 3) {
+		std::cout << "Usage NanoReplay [FILE] [TRACE] [--step N] [--memory OFFSET SIZE] [--output]" << std::endl;
+		std::cout << "Rebuilds the registers and the memory after N steps, by default after the whole trace" << std::endl;
+		return 0;
+	}
+	uint64_t stopStep = UINT64_MAX;
+	uint64_t memoryOffset = 0;
+	uint64_t memorySize = 0;
+	bool printOutput = false;
+	for (int i = 3; i < argc; i++) {
+		std::string argument = argv[i];
+		if (argument == "--step" && i + 1 < argc) {
+			stopStep = std::stoull(argv[++i]);
+		}
+		else if (argument == "--memory" && i + 2 < argc) {
+			memoryOffset = std::stoull(argv[++i], nullptr, 0);
+			memorySize = std::stoull(argv[++i], nullptr, 0);
+		}
+		else if (argument == "--output") {
+			printOutput = true;
+		}
+	}
+	TraceHeader header;
+	std::vector<TraceRecord> records;
+	if (!TraceRecorder::Read(argv[2], header, records)) {
+		std::cout << "Unable to read the trace " << argv[2] << std::endl;
+		return 1;
+	}
+	ReplayVM vm(argv[1]);
+	if (header.bytecodeSize != vm.bytecodeSize()) {
+		std::cout << "The trace was not recorded with this program" << std::endl;
+		return 1;
+	}
+	bool replayed = vm.replay(records, stopStep);
+	vm.printState(memoryOffset, memorySize);
+	if (printOutput) {
+		std::cout << "Output:\n" << vm.output.output << std::endl;
+	}
+	if (replayed && stopStep == UINT64_MAX && vm.runs) {
+		std::cout << "Last run returned " << vm.returnValue << std::endl;
+	}
+	return replayed ? 0 : 1;
+}
@@ -1,8 +1,15 @@
 #include "../NanoAssembler/NanoAssembler.h"
 #include "../NanoVM/NanoVM.h"
+#include "../NanoVM/NanoVMPool.h"
+#include "../NanoVM/BatchRunner.h"
+#include "../NanoVM/Checkpoint.h"
+#include "../NanoVM/TraceReplay.h"
+#include "../NanoDebugger/NanoDebugger.h"
 #include <fstream>
 #include <iostream>
 #include <filesystem>
+#include <algorithm>
+#include <set>
 namespace fs = std::filesystem;
 
 /**
@@ -14,7 +21,636 @@ namespace fs = std::filesystem;
  * without breaking the tests
 */
 
-int runSingleTest(NanoAssembler& assembler, std::string& path) {
+/**
+ * Syscall 1 of the tests. Sums reg1 bytes of the VM memory starting at offset reg0 in to reg0
+*/
+static bool sumBytes(NanoVM& vm, void*) {
+	const unsigned char* bytes = vm.GetMemory(vm.GetRegister(Reg0), vm.GetRegister(Reg1));
+	if (!bytes) {
+		return false;
+	}
+	uint64_t sum = 0;
+	for (uint64_t i = 0; i < vm.GetRegister(Reg1); i++) {
+		sum += bytes[i];
+	}
+	vm.SetRegister(Reg0, sum);
+	return true;
+}
+
+/**
+ * Syscall 2 of the tests. Multiplies reg0 by the factor registered as host data
+*/
+static bool multiply(NanoVM& vm, void* data) {
+	vm.SetRegister(Reg0, vm.GetRegister(Reg0) * *static_cast<uint64_t*>(data));
+	return true;
+}
+
+/**
+ * @return Options with the syscalls of the tests registered
+*/
+static NanoVMOptions testOptions() {
+	static uint64_t factor = 3;
+	NanoVMOptions options;
+	options.syscalls[1] = { sumBytes, nullptr };
+	options.syscalls[2] = { multiply, &factor };
+	return options;
+}
+
+/**
+ * VM executing the program one instruction at a time without the instruction cache. The runs of the engines are compared with it
+*/
+class ReferenceVM : public NanoVM {
+public:
+	ReferenceVM(unsigned char* code, uint64_t size, const NanoVMOptions& options) : NanoVM(code, size, options), executed(0) {}
+
+	/**
+	 * Executes the program until it halts or an instruction fails
+	 * @return Offsets of the instructions in the order they were reached. The halt or the failing instruction is the last one
+	*/
+	std::vector<uint64_t> step() {
+		std::vector<uint64_t> reached;
+		Instruction inst;
+		while (fetch(inst)) {
+			reached.push_back(cpu.registers[ip]);
+			if (inst.opcode == Opcodes::Halt || !execute(inst)) {
+				break;
+			}
+			executed++;
+		}
+		return reached;
+	}
+
+	uint64_t executed; /**< Number of instructions executed successfully */
+};
+
+/**
+ * VM stopping at the breakpoints like a debugger running from one breakpoint to the next
+*/
+class BreakpointVM : public NanoVM {
+public:
+	BreakpointVM(unsigned char* code, uint64_t size) : NanoVM(code, size, testOptions()) {}
+
+	/**
+	 * Sets a breakpoint at every byte of the bytecode and runs the program clearing each breakpoint it stops at
+	 * @param[out] stops Offsets the program stopped at, the different instructions executed
+	 * @return Return value of the program
+	*/
+	uint64_t runStopping(std::set<uint64_t>& stops) {
+		for (uint64_t offset = 0; offset < cpu.bytecodeSize; offset++) {
+			setBreakpoint(offset, true);
+		}
+		uint64_t result = 0;
+		while (runToBreakpoint(result)) {
+			stops.insert(cpu.registers[ip]);
+			setBreakpoint(cpu.registers[ip], false);
+		}
+		return result;
+	}
+};
+
+/**
+ * VM running the program in slices of a few instructions like a debugger moving to an instruction count
+*/
+class CountingVM : public NanoVM {
+public:
+	CountingVM(unsigned char* code, uint64_t size, bool fused) : NanoVM(code, size, testOptions()) {
+		SetFusion(fused);
+	}
+
+	/**
+	 * Runs the program with the threaded engine stopping after every slice of instructions
+	 * @param slice Number of instructions to run at a time. Fused sequences may run past the end of a slice
+	 * @param[out] executed Number of instructions executed
+	 * @return Return value of the program
+	*/
+	uint64_t runCounting(uint64_t slice, uint64_t& executed) {
+		uint64_t result;
+		instructionCount = 0;
+		do {
+			instructionLimit = instructionCount + slice;
+			result = Run(ExecutionMode::Threaded);
+		} while (instructionCount >= instructionLimit);
+		instructionLimit = NO_INSTRUCTION_LIMIT;
+		executed = instructionCount;
+		return result;
+	}
+};
+
+/**
+ * Debugger driven by the tests instead of the interactive commands. Snapshots are taken every few instructions so that
+ * moving back in time restores them
+*/
+class TestDebugger : public NanoDebugger {
+public:
+	TestDebugger(unsigned char* code, uint64_t size) : NanoDebugger(code, size) {
+		SetSnapshots(7, DEFAULT_SNAPSHOT_MEMORY);
+	}
+
+	/**
+	 * Runs the program until it halts or fails
+	 * @return Number of instructions executed
+	*/
+	uint64_t runToEnd() {
+		advance(NO_INSTRUCTION_LIMIT, false);
+		return position;
+	}
+
+	/**
+	 * Moves the program to a position like the debugger command
+	 * @return True if the program is at the position
+	*/
+	bool seekTo(uint64_t target) {
+		return seek(target) && position == target;
+	}
+
+	/**
+	 * Sets a breakpoint and moves the program back to the latest position it reached the breakpoint at
+	 * @return Position the program was moved to, NO_INSTRUCTION_LIMIT if the breakpoint was not found
+	*/
+	uint64_t reverseTo(uint64_t offset) {
+		setBreakpoint(offset, true);
+		return reverseContinue() ? position : NO_INSTRUCTION_LIMIT;
+	}
+
+	/**
+	 * @return Registers, stack size and memory of the program
+	*/
+	std::vector<uint64_t> state() const {
+		std::vector<uint64_t> state(cpu.registers, cpu.registers + flags + 1);
+		state.push_back(cpu.stackSize);
+		state.insert(state.end(), cpu.codeBase, cpu.codeBase + cpu.codeSize + cpu.stackSize);
+		return state;
+	}
+
+	/**
+	 * @return Offset of the next instruction
+	*/
+	uint64_t instruction() const {
+		return cpu.registers[ip];
+	}
+
+	/**
+	 * Watches a memory range and continues the program like the debugger command until the end, stopping at every watchpoint hit
+	 * @return Offsets of the instructions following the accesses that hit the watchpoint. Empty if the range can not be watched
+	*/
+	std::vector<uint64_t> runWatched(uint64_t offset, uint64_t size, WatchKind kind) {
+		std::vector<uint64_t> stops;
+		if (!addWatchpoint(offset, size, kind)) {
+			return stops;
+		}
+		Instruction inst;
+		while (advance(NO_INSTRUCTION_LIMIT, true, true) && decode(cpu.registers[ip], inst) && inst.opcode != Opcodes::Halt) {
+			stops.push_back(cpu.registers[ip]);
+		}
+		return stops;
+	}
+
+	/**
+	 * @param opcode Opcode to look for
+	 * @return Offset of the instruction following the first instruction with the opcode, 0 if there is none
+	*/
+	uint64_t after(Opcodes opcode) const {
+		Instruction inst;
+		for (uint64_t offset = 0; offset < cpu.bytecodeSize && decode(offset, inst); offset += inst.instructionSize) {
+			if (inst.opcode == opcode) {
+				return offset + inst.instructionSize;
+			}
+		}
+		return 0;
+	}
+
+	/**
+	 * @return Offset of the bottom of the stack
+	*/
+	uint64_t stackBottom() const {
+		return cpu.codeSize;
+	}
+
+	/**
+	 * @return Value of reg0, the return value once the program has halted
+	*/
+	uint64_t result() const {
+		return cpu.registers[Reg0];
+	}
+};
+
+/**
+ * VM taking a snapshot part way through the program like an embedder initializing a program once for many runs
+*/
+class SnapshotVM : public NanoVM {
+public:
+	SnapshotVM(unsigned char* code, uint64_t size, const NanoVMOptions& options) : NanoVM(code, size, options) {}
+
+	/**
+	 * Runs the first instructions of the program with the threaded engine and takes a snapshot
+	 * @param count Number of instructions to run. Fused sequences may run past it and the program may end before it
+	 * @return Snapshot of the VM after the instructions
+	*/
+	std::shared_ptr<const NanoSnapshot> runPartly(uint64_t count) {
+		instructionCount = 0;
+		instructionLimit = count;
+		Run(ExecutionMode::Threaded);
+		instructionLimit = NO_INSTRUCTION_LIMIT;
+		return Snapshot();
+	}
+
+	/**
+	 * @return Size of the code pages and the stack
+	*/
+	uint64_t memorySize() const {
+		return cpu.codeSize + cpu.stackSize;
+	}
+};
+
+/**
+ * VM running the program in the same slices as a checkpointed run so that its state can be compared with the checkpoints
+*/
+class CheckpointVM : public NanoVM {
+public:
+	CheckpointVM(std::shared_ptr<const NanoProgram> program, const NanoVMOptions& options) : NanoVM(std::move(program), options) {}
+
+	CheckpointVM(std::shared_ptr<const NanoProgram> program, const std::string& checkpoint, const NanoVMOptions& options) :
+		NanoVM(std::move(program), checkpoint, options) {}
+
+	/**
+	 * Runs the program with the threaded engine stopping every interval instructions like a checkpointed run
+	 * @param count Instruction count to stop at, a count the checkpointed run took a checkpoint at
+	 * @param interval Number of instructions between the checkpoints
+	*/
+	void runTo(uint64_t count, uint64_t interval) {
+		do {
+			instructionLimit = instructionCount + interval;
+			Run(ExecutionMode::Threaded);
+		} while (instructionCount < count && instructionCount >= instructionLimit);
+		instructionLimit = NO_INSTRUCTION_LIMIT;
+	}
+
+	/**
+	 * @return Instruction count, registers, vector registers, stack size and memory of the program
+	*/
+	std::vector<uint64_t> state() const {
+		std::vector<uint64_t> state = { instructionCount };
+		state.insert(state.end(), cpu.registers, cpu.registers + flags + 1);
+		state.insert(state.end(), &cpu.vectorRegisters[0][0], &cpu.vectorRegisters[0][0] + sizeof(cpu.vectorRegisters));
+		state.push_back(cpu.stackSize);
+		state.insert(state.end(), cpu.codeBase, cpu.codeBase + cpu.codeSize + cpu.stackSize);
+		return state;
+	}
+};
+
+/**
+ * @param vm VM to read
+ * @param size Size of the memory to read
+ * @return Registers and memory of the VM. Empty if the memory is smaller
+*/
+std::vector<uint64_t> vmState(NanoVM& vm, uint64_t size) {
+	const unsigned char* memory = vm.GetMemory(0, size);
+	if (!memory) {
+		return {};
+	}
+	std::vector<uint64_t> state;
+	for (int reg = Reg0; reg <= flags; reg++) {
+		state.push_back(vm.GetRegister(static_cast<Register>(reg)));
+	}
+	state.insert(state.end(), memory, memory + size);
+	return state;
+}
+
+/**
+ * Replays a trace like NanoReplay and compares the rebuilt registers and return value with the traced run
+ * @param tracePath Trace of the run
+ * @param program Traced program
+ * @param vm VM the run was traced on
+ * @param result Return value of the run
+ * @return True if the replay ends in the same state as the run
+*/
+bool replayTrace(const std::string& tracePath, std::shared_ptr<const NanoProgram> program, const NanoVM& vm, uint64_t result) {
+	TraceHeader header;
+	std::vector<TraceRecord> records;
+	if (!TraceRecorder::Read(tracePath, header, records)) {
+		return false;
+	}
+	ReplayVM replayed(program);
+	if (header.bytecodeSize != replayed.bytecodeSize() || !replayed.replay(records, UINT64_MAX) || replayed.runs != 1 || replayed.returnValue != result) {
+		return false;
+	}
+	for (int reg = Reg0; reg <= flags; reg++) {
+		if (replayed.GetRegister(static_cast<Register>(reg)) != vm.GetRegister(static_cast<Register>(reg))) {
+			return false;
+		}
+	}
+	return true;
+}
+
+/**
+ * Example program under test and the value it has to return
+*/
+struct TestProgram {
+	std::string path; /**< Source file of the example */
+	std::string name; /**< File name printed with the results */
+	unsigned char* bytecode; /**< Assembled program */
+	unsigned int length; /**< Size of the bytecode */
+	int expectedValue; /**< Value after NANO_TEST_EXPECT_RETURN= in the source */
+};
+
+/**
+ * Prints the result of a test pass
+ * @param test Example the pass ran
+ * @param pass Name of the pass
+ * @param passed Did the pass succeed
+ * @param failure What went wrong, printed if the pass failed
+ * @return 0 if the pass succeeded, 1 if it failed
+*/
+static int report(const TestProgram& test, const std::string& pass, bool passed, const std::string& failure) {
+	if (passed) {
+		std::cout << "Test passed (" << pass << "): " << test.name << std::endl;
+		return 0;
+	}
+	std::cout << "Test failed (" << pass << "): " << test.name << " " << failure << std::endl;
+	return 1;
+}
+
+/**
+ * Prints the result of a test pass comparing the return values of its runs with the expected value
+ * @param test Example the pass ran
+ * @param pass Name of the pass
+ * @param values Return values of the runs
+ * @param passed Did the other checks of the pass succeed
+ * @param failure What went wrong in the other checks, printed if they failed
+ * @return 0 if the pass succeeded, 1 if it failed
+*/
+static int reportValues(const TestProgram& test, const std::string& pass, const std::vector<int>& values, bool passed = true, const std::string& failure = "") {
+	auto wrong = std::find_if(values.begin(), values.end(), [&](int value) { return value != test.expectedValue; });
+	if (wrong == values.end()) {
+		return report(test, pass, passed, failure);
+	}
+	return report(test, pass, false, "Expected value: " + std::to_string(test.expectedValue) + " but was " + std::to_string(*wrong) + (passed ? "" : ", " + failure));
+}
+
+/**
+ * Runs the program with each execution engine, with and without instruction fusion, guarded memory and tracing
+ * @return Number of failed passes
+*/
+int testEngines(const TestProgram& test) {
+	const struct {
+		ExecutionMode mode;
+		bool fusion;
+		MemoryMode memory;
+		std::string name;
+		bool trace;
+	} modes[] = {
+		{ ExecutionMode::Interpreter, true, MemoryMode::Checked, "interpreter", false },
+		{ ExecutionMode::Threaded, true, MemoryMode::Checked, "threaded", false },
+		{ ExecutionMode::Threaded, false, MemoryMode::Checked, "threaded, no fusion", false },
+		{ ExecutionMode::Jit, true, MemoryMode::Checked, "jit", false },
+		{ ExecutionMode::Interpreter, true, MemoryMode::Guarded, "interpreter, guarded", false },
+		{ ExecutionMode::Threaded, true, MemoryMode::Guarded, "threaded, guarded", false },
+		{ ExecutionMode::Interpreter, true, MemoryMode::Checked, "interpreter, traced", true },
+		{ ExecutionMode::Threaded, true, MemoryMode::Checked, "threaded, traced", true }
+	};
+	int failed = 0;
+	std::string tracePath = (fs::temp_directory_path() / "NanoUnitTests.trace").string();
+	for (const auto& mode : modes) {
+		NanoVMOptions options = testOptions();
+		options.memoryMode = mode.memory;
+		NanoVM vm(test.bytecode, test.length, options);
+		vm.SetFusion(mode.fusion);
+		if (mode.trace && !vm.StartTrace(tracePath)) {
+			failed += report(test, mode.name, false, "unable to create the trace " + tracePath);
+			continue;
+		}
+		uint64_t result = vm.Run(mode.mode);
+		vm.StopTrace();
+		// The registers and the return value rebuilt from the trace must match the run
+		bool replayed = !mode.trace || replayTrace(tracePath, std::make_shared<NanoProgram>(test.bytecode, test.length), vm, result);
+		fs::remove(tracePath);
+		failed += reportValues(test, mode.name, { static_cast<int>(result) }, replayed, "replaying the trace did not rebuild the run");
+	}
+	return failed;
+}
+
+/**
+ * Assembles the program again with the peephole optimizer which must keep the result and must not grow the code
+ * @return Number of failed passes
+*/
+int testOptimizer(const TestProgram& test) {
+	NanoAssembler optimizer;
+	optimizer.setOptimize(true);
+	unsigned char* optimized;
+	unsigned int optimizedLength;
+	if (optimizer.assembleToMemory(test.path, optimized, optimizedLength) != AssemblerReturnValues::Success || optimizedLength > test.length) {
+		return report(test, "optimized", false, "could not be optimized");
+	}
+	int failed = 0;
+	const ExecutionMode optimizedModes[] = { ExecutionMode::Interpreter, ExecutionMode::Threaded, ExecutionMode::Jit };
+	for (ExecutionMode mode : optimizedModes) {
+		NanoVM vm(optimized, optimizedLength, testOptions());
+		failed += reportValues(test, "optimized", { static_cast<int>(vm.Run(mode)) });
+	}
+	delete[] optimized;
+	return failed;
+}
+
+/**
+ * Stops at every instruction once. The instructions between the breakpoints run on the threaded engine, so the program
+ * must stop exactly at the instructions the reference reaches
+ * @return Number of failed passes
+*/
+int testBreakpoints(const TestProgram& test) {
+	std::vector<uint64_t> reached = ReferenceVM(test.bytecode, test.length, testOptions()).step();
+	std::set<uint64_t> expectedStops(reached.begin(), reached.end());
+	BreakpointVM debugged(test.bytecode, test.length);
+	std::set<uint64_t> stops;
+	int value = static_cast<int>(debugged.runStopping(stops));
+	return reportValues(test, "breakpoints, " + std::to_string(stops.size()) + " stops", { value }, stops == expectedStops,
+		std::to_string(stops.size()) + " stops instead of " + std::to_string(expectedStops.size()));
+}
+
+/**
+ * Stops after every few instructions. Fused sequences count all their instructions so the count does not depend on fusion
+ * @return Number of failed passes
+*/
+int testCounting(const TestProgram& test) {
+	ReferenceVM reference(test.bytecode, test.length, testOptions());
+	reference.step();
+	CountingVM counted(test.bytecode, test.length, true);
+	CountingVM single(test.bytecode, test.length, false);
+	uint64_t countedInstructions;
+	uint64_t singleInstructions;
+	int value = static_cast<int>(counted.runCounting(7, countedInstructions));
+	single.runCounting(NO_INSTRUCTION_LIMIT - 1, singleInstructions);
+	return reportValues(test, "counted, " + std::to_string(countedInstructions) + " instructions", { value },
+		countedInstructions == singleInstructions && countedInstructions == reference.executed, std::to_string(countedInstructions) +
+		" instructions instead of " + std::to_string(singleInstructions) + " and " + std::to_string(reference.executed));
+}
+
+/**
+ * Runs to the end and moves back half way, which restores a snapshot and executes the instructions after it again. The state
+ * must be the same as when running forward to the same position. Then moves back to the latest time the instruction at
+ * that position was reached, which the reference run of the debugger options gives
+ * @return Number of failed passes
+*/
+int testTimeTravel(const TestProgram& test) {
+	TestDebugger traveled(test.bytecode, test.length);
+	TestDebugger forward(test.bytecode, test.length);
+	NanoVMOptions debuggerOptions;
+	debuggerOptions.memoryMode = MemoryMode::Guarded;
+	std::vector<uint64_t> debuggerReached = ReferenceVM(test.bytecode, test.length, debuggerOptions).step();
+	uint64_t end = traveled.runToEnd();
+	uint64_t half = end / 2;
+	bool sought = traveled.seekTo(half) && forward.seekTo(half) && traveled.state() == forward.state();
+	uint64_t offset = forward.instruction();
+	uint64_t expectedHit = half;
+	for (uint64_t position = half; position < end && position < debuggerReached.size(); position++) {
+		expectedHit = (debuggerReached[position] == offset) ? position : expectedHit;
+	}
+	traveled.runToEnd();
+	uint64_t hit = end ? traveled.reverseTo(offset) : half;
+	bool reversed = hit == expectedHit && forward.seekTo(hit) && traveled.state() == forward.state();
+	return report(test, "time travel, " + std::to_string(half) + " of " + std::to_string(end) + " instructions, breakpoint hit at " + std::to_string(hit),
+		sought && reversed, std::string(sought ? "" : "seeking back differs from running forward ") + (reversed ? "" : "reverse continue stopped at the wrong position ") +
+		"breakpoint hit at " + std::to_string(hit) + " instead of " + std::to_string(expectedHit));
+}
+
+/**
+ * Runs the program twice on the same pooled VM to check that a released VM starts from a clean state
+ * @return Number of failed passes
+*/
+int testPooled(const TestProgram& test) {
+	const struct {
+		ExecutionMode mode;
+		MemoryMode memory;
+		std::string name;
+	} pooledModes[] = {
+		{ ExecutionMode::Threaded, MemoryMode::Checked, "pooled" },
+		{ ExecutionMode::Jit, MemoryMode::Checked, "pooled, jit" },
+		{ ExecutionMode::Threaded, MemoryMode::Guarded, "pooled, guarded" }
+	};
+	int failed = 0;
+	for (const auto& mode : pooledModes) {
+		NanoVMOptions options = testOptions();
+		options.memoryMode = mode.memory;
+		NanoVMPool pool(std::make_shared<NanoProgram>(test.bytecode, test.length), options);
+		for (int run = 1; run <= 2; run++) {
+			std::unique_ptr<NanoVM> vm = pool.Acquire();
+			int value = vm ? static_cast<int>(vm->Run(mode.mode)) : -1;
+			pool.Release(std::move(vm));
+			failed += reportValues(test, mode.name + ", run " + std::to_string(run), { value });
+		}
+	}
+	return failed;
+}
+
+/**
+ * Continues from a snapshot taken part way through on a fork and on pooled VMs of the other memory mode which are
+ * restored to the snapshot when released. Each of them must start from the state of the parent at the snapshot and
+ * running the fork must not change the parent
+ * @return Number of failed passes
+*/
+int testSnapshots(const TestProgram& test) {
+	const MemoryMode snapshotModes[] = { MemoryMode::Checked, MemoryMode::Guarded };
+	int failed = 0;
+	for (MemoryMode memory : snapshotModes) {
+		NanoVMOptions options = testOptions();
+		options.memoryMode = memory;
+		SnapshotVM parent(test.bytecode, test.length, options);
+		std::shared_ptr<const NanoSnapshot> snapshot = parent.runPartly(50);
+		uint64_t size = parent.memorySize();
+		std::vector<uint64_t> snapshotState = vmState(parent, size);
+		std::unique_ptr<NanoVM> fork = parent.Fork();
+		bool copied = !snapshotState.empty() && vmState(*fork, size) == snapshotState;
+		std::vector<int> values = { static_cast<int>(fork->Run(ExecutionMode::Threaded)) };
+		copied = copied && vmState(parent, size) == snapshotState;
+		values.push_back(static_cast<int>(parent.Run(ExecutionMode::Threaded)));
+		options.memoryMode = (memory == MemoryMode::Guarded) ? MemoryMode::Checked : MemoryMode::Guarded;
+		NanoVMPool pool(snapshot, options);
+		for (int run = 1; run <= 2; run++) {
+			std::unique_ptr<NanoVM> vm = pool.Acquire();
+			copied = copied && vm && vmState(*vm, size) == snapshotState;
+			values.push_back(vm ? static_cast<int>(vm->Run(ExecutionMode::Threaded)) : -1);
+			pool.Release(std::move(vm));
+		}
+		failed += reportValues(test, (memory == MemoryMode::Guarded) ? "forked, guarded" : "forked", values, copied, "state differs from the snapshot");
+	}
+	return failed;
+}
+
+/**
+ * Checkpoints a run every few instructions, then resumes a new VM from the latest checkpoint and finishes the run again.
+ * Before running, the resumed VM must be in the state the checkpointed run was in at the latest checkpoint. Programs
+ * ending before the first checkpoint leave no checkpoint to resume, the resumed VM is not valid and starts from the entry
+ * @return Number of failed passes
+*/
+int testCheckpoints(const TestProgram& test) {
+	const MemoryMode checkpointModes[] = { MemoryMode::Checked, MemoryMode::Guarded };
+	std::shared_ptr<const NanoProgram> program = std::make_shared<NanoProgram>(test.bytecode, test.length);
+	std::string checkpointPath = (fs::temp_directory_path() / "NanoUnitTests.nanockpt").string();
+	int failed = 0;
+	for (MemoryMode memory : checkpointModes) {
+		NanoVMOptions options = testOptions();
+		options.memoryMode = memory;
+		fs::remove(checkpointPath);
+		NanoVM vm(program, options);
+		vm.StartCheckpoints(checkpointPath, 7);
+		std::vector<int> values = { static_cast<int>(vm.Run(ExecutionMode::Jit)) };
+		bool written = vm.StopCheckpoints();
+		CheckpointHeader header;
+		CheckpointRecord latest = {};
+		bool found = CheckpointWriter::Read(checkpointPath, header, [&](const CheckpointRecord& record, const std::vector<uint64_t>&, const std::vector<unsigned char>&) {
+			latest = record;
+			return true;
+		});
+		CheckpointVM resumed(program, checkpointPath, options);
+		CheckpointVM reference(program, options);
+		if (found) {
+			reference.runTo(latest.instructionCount, 7);
+		}
+		std::vector<uint64_t> state = resumed.state();
+		bool restored = resumed.IsValid() == found && state == reference.state() &&
+			(!found || (state[0] == latest.instructionCount && std::equal(latest.registers, latest.registers + flags + 1, state.begin() + 1)));
+		values.push_back(static_cast<int>(resumed.Run(ExecutionMode::Threaded)));
+		fs::remove(checkpointPath);
+		failed += reportValues(test, std::string((memory == MemoryMode::Guarded) ? "checkpointed, guarded" : "checkpointed") + ", resumed at " +
+			std::to_string(latest.instructionCount), values, written && restored, written ? "resumed VM differs from the latest checkpoint" : "checkpoints not written");
+	}
+	return failed;
+}
+
+/**
+ * Loads the program from the container written by the assembler which is mapped instead of read on POSIX hosts. The
+ * container is decoded lazily while running and verified only when asked, after which a container with a changed byte
+ * must not be valid
+ * @param assembler Assembler writing the container
+ * @return Number of failed passes
+*/
+int testContainer(NanoAssembler& assembler, const TestProgram& test) {
+	std::string containerPath = (fs::temp_directory_path() / "NanoUnitTests.nanoc").string();
+	if (assembler.assembleToFile(test.path, containerPath) != AssemblerReturnValues::Success) {
+		return report(test, "container", false, "unable to write " + containerPath);
+	}
+	std::shared_ptr<const NanoProgram> loaded = std::make_shared<NanoProgram>(containerPath);
+	const MemoryMode containerModes[] = { MemoryMode::Checked, MemoryMode::Guarded };
+	std::vector<int> values;
+	for (MemoryMode memory : containerModes) {
+		NanoVMOptions options = testOptions();
+		options.memoryMode = memory;
+		NanoVM vm(loaded, options);
+		values.push_back(static_cast<int>(vm.Run(ExecutionMode::Threaded)));
+	}
+	bool valid = loaded->IsValid() == NanoProgram(test.bytecode, test.length).IsValid();
+	// The last byte of the file is the last byte of the code section
+	std::fstream container(containerPath, std::ios::in | std::ios::out | std::ios::binary | std::ios::ate);
+	container.seekg(-1, std::ios::end);
+	char last = static_cast<char>(container.get());
+	container.seekp(-1, std::ios::end);
+	container.put(static_cast<char>(last ^ 0x01));
+	container.close();
+	bool corrupted = !NanoProgram(containerPath).IsValid();
+	fs::remove(containerPath);
+	return reportValues(test, "container", values, valid && corrupted, valid ? "changed container is valid" : "validity differs from the assembled program");
+}
+
+int runSingleTest(NanoAssembler& assembler, std::string& path, std::vector<BatchJob>& batch, std::vector<int>& expectedValues) {
 	unsigned char* bytecode;
 	unsigned int length;
 	AssemblerReturnValues ret = assembler.assembleToMemory(path, bytecode, length);
@@ -54,35 +690,188 @@ int runSingleTest(NanoAssembler& assembler, std::string& path) {
 	else {
 		return 4;
 	}
-	// Fire up the VM
-	NanoVM vm(bytecode, length);
-	int vmValue = vm.Run();
-	if (vmValue == expectedValue) {
-		std::cout << "Test passed: " << path.substr(path.find_last_of("/")) << std::endl;
-		return 0;
+	// Every pass sets up its own VMs so that one feature can not leave state behind for the next one
+	TestProgram test = { path, path.substr(path.find_last_of("/")), bytecode, length, expectedValue };
+	int failed = testEngines(test) + testOptimizer(test) + testBreakpoints(test) + testCounting(test) + testTimeTravel(test) +
+		testPooled(test) + testSnapshots(test) + testCheckpoints(test) + testContainer(assembler, test);
+	batch.push_back({ std::make_shared<NanoProgram>(bytecode, length) });
+	expectedValues.push_back(expectedValue);
+	return failed ? 5 : 0;
+}
+
+/**
+ * Watches a number in the array of the sieve. The array starts at the bottom of the stack and holds the numbers up to 300
+ * which are pushed in order. A number is cleared with 'xor @reg2, @reg2' once for each of its prime factors below it whether it is
+ * already zero or not, so 6 is written by the push and by the sieves of 2 and 3 but changed only by the push and the sieve of 2
+ * @param assembler Assembler for the examples
+ * @param path Examples directory
+ * @return Number of failed tests
+*/
+int runWatchpointTests(NanoAssembler& assembler, const std::string& path) {
+	unsigned char* bytecode;
+	unsigned int length;
+	std::string file = (fs::path(path) / "SieveOfEratosthenes.nano").string();
+	if (assembler.assembleToMemory(file, bytecode, length) != AssemblerReturnValues::Success) {
+		std::cout << "Test failed (watchpoints): unable to assemble " << file << std::endl;
+		return 1;
 	}
-	std::cout << "Test failed: " << path.substr(path.find_last_of("/")) << " Expected value: " << expectedValue << " but was " << vmValue << std::endl;
-	return 5;
+	const struct {
+		WatchKind kind;
+		std::string name;
+	} kinds[] = {
+		{ WatchKind::Write, "write" },
+		{ WatchKind::Change, "change" }
+	};
+	TestProgram test = { file, file.substr(file.find_last_of("/")), bytecode, length, 293 };
+	int failed = 0;
+	for (const auto& kind : kinds) {
+		TestDebugger debugger(bytecode, length);
+		uint64_t afterPush = debugger.after(Opcodes::Push);
+		uint64_t afterXor = debugger.after(Opcodes::Xor);
+		std::vector<uint64_t> expectedStops = { afterPush, afterXor, afterXor };
+		if (kind.kind == WatchKind::Change) {
+			expectedStops.pop_back();
+		}
+		std::vector<uint64_t> stops = debugger.runWatched(debugger.stackBottom() + 6 * sizeof(uint64_t), sizeof(uint64_t), kind.kind);
+		failed += reportValues(test, "watchpoints, " + kind.name + ", " + std::to_string(stops.size()) + " stops", { static_cast<int>(debugger.result()) },
+			stops == expectedStops, std::to_string(stops.size()) + " stops instead of " + std::to_string(expectedStops.size()));
+	}
+	return failed;
 }
 
-int runTests() {
+/**
+ * Checkpoints the sieve with a large stack. The array of the sieve fits in the first page of the stack and the program
+ * writes no other memory, so after the first checkpoint holding every page each checkpoint may only hold that page
+ * @param assembler Assembler for the examples
+ * @param path Examples directory
+ * @return Number of failed tests
+*/
+int runCheckpointPageTests(NanoAssembler& assembler, const std::string& path) {
+	unsigned char* bytecode;
+	unsigned int length;
+	std::string file = (fs::path(path) / "SieveOfEratosthenes.nano").string();
+	if (assembler.assembleToMemory(file, bytecode, length) != AssemblerReturnValues::Success) {
+		std::cout << "Test failed (checkpoint pages): unable to assemble " << file << std::endl;
+		return 1;
+	}
+	TestProgram test = { file, file.substr(file.find_last_of("/")), bytecode, length, 293 };
+	std::shared_ptr<const NanoProgram> program = std::make_shared<NanoProgram>(bytecode, length);
+	std::string checkpointPath = (fs::temp_directory_path() / "NanoUnitTests.nanockpt").string();
+	const MemoryMode checkpointModes[] = { MemoryMode::Checked, MemoryMode::Guarded };
+	int failed = 0;
+	for (MemoryMode memory : checkpointModes) {
+		NanoVMOptions options = testOptions();
+		options.memoryMode = memory;
+		options.stackSize = 64 * NANOVM_PAGE_SIZE;
+		fs::remove(checkpointPath);
+		NanoVM vm(program, options);
+		vm.StartCheckpoints(checkpointPath, 1000);
+		int value = static_cast<int>(vm.Run(ExecutionMode::Threaded));
+		bool written = vm.StopCheckpoints();
+		CheckpointHeader header;
+		uint64_t records = 0;
+		uint64_t copiedPages = 0;
+		bool dirtyOnly = true;
+		CheckpointWriter::Read(checkpointPath, header, [&](const CheckpointRecord& record, const std::vector<uint64_t>& offsets, const std::vector<unsigned char>&) {
+			if (!records++) {
+				dirtyOnly = record.pageCount == (header.codeSize + record.stackSize) / NANOVM_PAGE_SIZE;
+			}
+			else {
+				copiedPages += record.pageCount;
+				dirtyOnly = dirtyOnly && std::all_of(offsets.begin(), offsets.end(), [&](uint64_t offset) { return offset == header.codeSize; });
+			}
+			return true;
+		});
+		fs::remove(checkpointPath);
+		failed += reportValues(test, std::string((memory == MemoryMode::Guarded) ? "checkpoint pages, guarded" : "checkpoint pages") + ", " +
+			std::to_string(copiedPages) + " pages in " + std::to_string(records) + " checkpoints", { value }, written && records > 1 && dirtyOnly,
+			"checkpoints copied pages the program did not write");
+	}
+	return failed;
+}
+
+/**
+ * Runs the printing examples as one batch and compares the output captured for each job with the expected text
+ * @param assembler Assembler for the examples
+ * @param path Examples directory
+ * @return Number of failed jobs
+*/
+int runOutputTests(NanoAssembler& assembler, const std::string& path) {
+	const struct {
+		std::string file;
+		std::string output;
+	} examples[] = {
+		{ "HelloWorld.nano", "hello world" },
+		{ "fibonacciSequence.nano", "0\n1\n1\n2\n3\n5\n8\n13\n21\n34\n55\n89\n144\n233\n377\n610\n987\n1597\n2584\n4181\n" }
+	};
+	std::vector<BatchJob> batch;
+	std::vector<std::string> expectedOutputs;
+	// Every example runs twice so that the output of a job is not mixed with the previous job of the same worker
+	for (int run = 0; run < 2; run++) {
+		for (const auto& example : examples) {
+			unsigned char* bytecode;
+			unsigned int length;
+			std::string file = (fs::path(path) / example.file).string();
+			if (assembler.assembleToMemory(file, bytecode, length) != AssemblerReturnValues::Success) {
+				std::cout << "Test failed (batch output): unable to assemble " << file << std::endl;
+				return 1;
+			}
+			batch.push_back({ std::make_shared<NanoProgram>(bytecode, length) });
+			expectedOutputs.push_back(example.output);
+		}
+	}
+	BatchReport report = BatchRunner(2, ExecutionMode::Threaded, testOptions()).Run(batch);
+	int failed = 0;
+	for (size_t i = 0; i < batch.size(); i++) {
+		if (report.results[i].output == expectedOutputs[i]) {
+			std::cout << "Test passed (batch output): job " << i << std::endl;
+			continue;
+		}
+		std::cout << "Test failed (batch output): job " << i << " Expected output: " << expectedOutputs[i] << " but was " << report.results[i].output << std::endl;
+		failed++;
+	}
+	return failed;
+}
+
+int runTests(std::string path) {
 	NanoAssembler assembler;
-	std::string path = "../../../../examples";
 	std::string ending = ".nano";
 	int totalTests = 0;
 	int failedTests = 0;
+	std::vector<BatchJob> batch;
+	std::vector<int> expectedValues;
 	for (const auto& entry : fs::directory_iterator(path)) {
 		std::string path = entry.path().string();
 		std::cout << path << std::endl;
 		if (path.compare(path.length() - ending.length(), ending.length(), ending) == 0) {
 			// Run only test for files with .nano ending
-			int status = runSingleTest(assembler, path);
+			int status = runSingleTest(assembler, path, batch, expectedValues);
 			if (status) {
 				failedTests++;
 			}
 			totalTests++;
 		}
 	}
+	// Run all the tests again as one batch on several threads
+	BatchReport report = BatchRunner(4, ExecutionMode::Threaded, testOptions()).Run(batch);
+	for (size_t i = 0; i < batch.size(); i++) {
+		if (report.results[i].exitCode != static_cast<uint64_t>(expectedValues[i])) {
+			std::cout << "Test failed (batch): job " << i << " Expected value: " << expectedValues[i] << " but was " << report.results[i].exitCode << std::endl;
+			failedTests++;
+		}
+	}
+	// The exit codes are counted once per job
+	std::map<uint64_t, size_t> expectedExitCodes;
+	for (int expectedValue : expectedValues) {
+		expectedExitCodes[static_cast<uint64_t>(expectedValue)]++;
+	}
+	if (report.exitCodes != expectedExitCodes) {
+		std::cout << "Test failed (batch): exit code counts do not match the jobs" << std::endl;
+		failedTests++;
+	}
+	failedTests += runOutputTests(assembler, path);
+	failedTests += runWatchpointTests(assembler, path);
+	failedTests += runCheckpointPageTests(assembler, path);
 	if (!failedTests) {
 		// All available tests passed
 		std::cout << "All tests passed! " << totalTests << "/" << totalTests << std::endl;
@@ -94,6 +883,7 @@ int runTests() {
 
 // main
 int main(int argc, char* argv[]) {
-	runTests();
-	return 0;
+	// The examples directory can be given as parameter, default is relative to the Visual Studio build directory
+	std::string path = (argc > 1) ? argv[1] : "../../../../examples";
+	return runTests(path);
 }
\ No newline at end of file
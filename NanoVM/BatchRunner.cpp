@@ -0,0 +1,91 @@
+#include "BatchRunner.h"
+#include <algorithm>
+#include <deque>
+#include <mutex>
+#include <thread>
+
+/**
+ * Jobs of a single worker. The owner takes jobs from the front, other workers steal from the back
+*/
+struct WorkQueue {
+	std::mutex mutex;
+	std::deque<size_t> jobs;
+};
+
+/**
+ * Takes the next job of the worker, stealing from the other workers once its own queue is empty
+ * @param queues Queues of all workers
+ * @param worker Index of the worker
+ * @param[out] job Index of the taken job
+ * @return True if a job was taken, false if all queues are empty
+*/
+static bool takeJob(std::vector<WorkQueue>& queues, size_t worker, size_t& job) {
+	{
+		std::lock_guard<std::mutex> lock(queues[worker].mutex);
+		if (!queues[worker].jobs.empty()) {
+			job = queues[worker].jobs.front();
+			queues[worker].jobs.pop_front();
+			return true;
+		}
+	}
+	// Jobs are never added while running so the batch is done once every queue has been found empty
+	for (size_t i = 1; i < queues.size(); i++) {
+		WorkQueue& victim = queues[(worker + i) % queues.size()];
+		std::lock_guard<std::mutex> lock(victim.mutex);
+		if (!victim.jobs.empty()) {
+			job = victim.jobs.back();
+			victim.jobs.pop_back();
+			return true;
+		}
+	}
+	return false;
+}
+
+BatchRunner::BatchRunner(unsigned int threads, ExecutionMode mode, const NanoVMOptions& options) :
+	threads(threads ? threads : std::max(1u, std::thread::hardware_concurrency())), mode(mode), options(options) {}
+
+BatchReport BatchRunner::Run(const std::vector<BatchJob>& jobs) const {
+	BatchReport report;
+	report.results.resize(jobs.size());
+	size_t workers = std::max<size_t>(1, std::min<size_t>(threads, jobs.size()));
+	// Consecutive jobs go to the same worker so that jobs of the same program can reuse the VM
+	std::vector<WorkQueue> queues(workers);
+	for (size_t i = 0; i < jobs.size(); i++) {
+		queues[i * workers / jobs.size()].jobs.push_back(i);
+	}
+	auto work = [&](size_t worker) {
+		std::unique_ptr<NanoVM> vm;
+		const NanoProgram* program = nullptr;
+		StringSink sink;
+		size_t job;
+		while (takeJob(queues, worker, job)) {
+			if (program == jobs[job].program.get()) {
+				vm->Reset();
+			}
+			else {
+				vm = std::make_unique<NanoVM>(jobs[job].program, options);
+				vm->SetOutput(sink);
+				program = jobs[job].program.get();
+			}
+			for (size_t reg = 0; reg < jobs[job].inputs.size(); reg++) {
+				vm->SetRegister(static_cast<Register>(reg), jobs[job].inputs[reg]);
+			}
+			report.results[job].exitCode = vm->Run(mode);
+			report.results[job].output.swap(sink.output);
+			sink.output.clear();
+		}
+	};
+	std::vector<std::thread> pool;
+	for (size_t worker = 1; worker < workers; worker++) {
+		pool.emplace_back(work, worker);
+	}
+	// The calling thread is a worker as well
+	work(0);
+	for (std::thread& thread : pool) {
+		thread.join();
+	}
+	for (const BatchResult& result : report.results) {
+		report.exitCodes[result.exitCode]++;
+	}
+	return report;
+}
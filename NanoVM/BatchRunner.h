@@ -0,0 +1,56 @@
+#pragma once
+#include "NanoProgram.h"
+#include <array>
+#include <map>
+
+/**
+ * BatchJob is a single program run of a batch
+*/
+struct BatchJob {
+	std::shared_ptr<const NanoProgram> program; /**< Program to run. Must not be null */
+	std::array<uint64_t, 6> inputs = {}; /**< Values of reg0 - reg5 when the program starts */
+};
+
+/**
+ * BatchResult holds the outcome of a single job
+*/
+struct BatchResult {
+	uint64_t exitCode = 0; /**< Return value of the program */
+	std::string output; /**< Output the program printed */
+};
+
+/**
+ * BatchReport holds the outcome of a whole batch
+*/
+struct BatchReport {
+	std::vector<BatchResult> results; /**< Results in the order of the jobs */
+	std::map<uint64_t, size_t> exitCodes; /**< Number of jobs that returned each exit code */
+};
+
+/**
+ * \brief BatchRunner runs many independent programs on all cores
+ *
+ * Each worker thread has a queue of jobs and takes jobs from the back of the queues of other workers when its own
+ * queue runs empty, so a few long running programs do not leave the other cores idle. A worker keeps one VM which
+ * is reset and reused as long as the following jobs run the same program. The output of each job is captured separately.
+*/
+class BatchRunner {
+public:
+	/**
+	 * @param threads Number of worker threads. 0 uses one thread per core
+	 * @param mode Execution engine the programs are run with
+	 * @param options Settings of the VMs
+	*/
+	BatchRunner(unsigned int threads = 0, ExecutionMode mode = ExecutionMode::Threaded, const NanoVMOptions& options = NanoVMOptions());
+
+	/**
+	 * Runs the jobs and waits until all of them have finished
+	 * @param jobs Jobs to run
+	 * @return Results of the jobs and the number of jobs per exit code
+	*/
+	BatchReport Run(const std::vector<BatchJob>& jobs) const;
+private:
+	unsigned int threads; /**< Number of worker threads */
+	ExecutionMode mode; /**< Execution engine the programs are run with */
+	NanoVMOptions options; /**< Settings of the VMs */
+};
@@ -0,0 +1,165 @@
+#include "Checkpoint.h"
+#include <filesystem>
+
+#if defined(__unix__) || defined(__APPLE__)
+#include <unistd.h>
+#endif
+
+CheckpointWriter::CheckpointWriter(const std::string& fileName, const CheckpointHeader& header) :
+	fileName(fileName), header(header), file(nullptr), appended(0), failed(false), hasPending(false), writing(false), stopping(false) {
+	writer = std::thread(&CheckpointWriter::write, this);
+}
+
+CheckpointWriter::~CheckpointWriter() {
+	{
+		std::lock_guard<std::mutex> lock(mutex);
+		stopping = true;
+	}
+	changed.notify_all();
+	// The pending checkpoint is written before the thread exits
+	writer.join();
+	if (file) {
+		fclose(file);
+	}
+}
+
+bool CheckpointWriter::IsOpen() const {
+	return !failed.load(std::memory_order_relaxed);
+}
+
+void CheckpointWriter::submit(Checkpoint&& checkpoint) {
+	{
+		std::unique_lock<std::mutex> lock(mutex);
+		changed.wait(lock, [this] { return !hasPending; });
+		pending = std::move(checkpoint);
+		hasPending = true;
+	}
+	changed.notify_all();
+}
+
+void CheckpointWriter::flush() {
+	std::unique_lock<std::mutex> lock(mutex);
+	changed.wait(lock, [this] { return !hasPending && !writing; });
+}
+
+void CheckpointWriter::write() {
+	while (true) {
+		Checkpoint checkpoint;
+		{
+			std::unique_lock<std::mutex> lock(mutex);
+			changed.wait(lock, [this] { return hasPending || stopping; });
+			if (!hasPending) {
+				return;
+			}
+			checkpoint = std::move(pending);
+			hasPending = false;
+			writing = true;
+		}
+		// The VM may continue with the next checkpoint while this one is written
+		changed.notify_all();
+		update(checkpoint);
+		bool written;
+		// The first checkpoint starts the file. Once the records outgrow the memory the file is rewritten from the image
+		if (!file || appended > 2 * image.size()) {
+			written = rewrite(checkpoint.record);
+		}
+		else {
+			written = append(file, checkpoint.record, checkpoint.offsets.data(), checkpoint.pages.data());
+		}
+		if (!written) {
+			failed.store(true, std::memory_order_relaxed);
+		}
+		{
+			std::lock_guard<std::mutex> lock(mutex);
+			writing = false;
+		}
+		changed.notify_all();
+	}
+}
+
+void CheckpointWriter::update(const Checkpoint& checkpoint) {
+	// The pages the stack grows to are written before the checkpoint so they are part of it
+	image.resize(static_cast<size_t>(header.codeSize + checkpoint.record.stackSize));
+	for (size_t i = 0; i < checkpoint.offsets.size(); i++) {
+		memcpy(image.data() + checkpoint.offsets[i], checkpoint.pages.data() + i * NANOVM_PAGE_SIZE, NANOVM_PAGE_SIZE);
+	}
+}
+
+bool CheckpointWriter::rewrite(const CheckpointRecord& record) {
+	std::string temporary = fileName + ".tmp";
+	FILE* output = fopen(temporary.c_str(), "wb");
+	if (!output) {
+		return false;
+	}
+	CheckpointRecord full = record;
+	full.pageCount = image.size() / NANOVM_PAGE_SIZE;
+	std::vector<uint64_t> offsets(static_cast<size_t>(full.pageCount));
+	for (uint64_t i = 0; i < full.pageCount; i++) {
+		offsets[i] = i * NANOVM_PAGE_SIZE;
+	}
+	bool written = fwrite(&header, sizeof(header), 1, output) == 1 && append(output, full, offsets.data(), image.data());
+	fclose(output);
+	if (file) {
+		fclose(file);
+		file = nullptr;
+	}
+	// The previous file stays until the new one is complete
+	std::error_code error;
+	if (!written || (std::filesystem::rename(temporary, fileName, error), error)) {
+		std::filesystem::remove(temporary, error);
+		return false;
+	}
+	file = fopen(fileName.c_str(), "ab");
+	appended = 0;
+	return file != nullptr;
+}
+
+bool CheckpointWriter::append(FILE* output, const CheckpointRecord& record, const uint64_t* offsets, const unsigned char* pages) {
+	uint64_t checksum = checkpointChecksum(record, offsets, pages);
+	size_t pageBytes = static_cast<size_t>(record.pageCount * NANOVM_PAGE_SIZE);
+	if (fwrite(&record, sizeof(record), 1, output) != 1 ||
+		fwrite(offsets, sizeof(uint64_t), static_cast<size_t>(record.pageCount), output) != record.pageCount ||
+		fwrite(pages, 1, pageBytes, output) != pageBytes || fwrite(&checksum, sizeof(checksum), 1, output) != 1 || fflush(output)) {
+		return false;
+	}
+#if defined(__unix__) || defined(__APPLE__)
+	// The checkpoint has to survive a crash of the host, not only of the process
+	if (fsync(fileno(output))) {
+		return false;
+	}
+#endif
+	appended += sizeof(record) + record.pageCount * (sizeof(uint64_t) + NANOVM_PAGE_SIZE) + sizeof(checksum);
+	return true;
+}
+
+bool CheckpointWriter::Read(const std::string& fileName, CheckpointHeader& header,
+	const std::function<bool(const CheckpointRecord&, const std::vector<uint64_t>&, const std::vector<unsigned char>&)>& apply) {
+	FILE* file = fopen(fileName.c_str(), "rb");
+	if (!file) {
+		return false;
+	}
+	bool found = false;
+	if (fread(&header, sizeof(header), 1, file) == 1 && !memcmp(header.magic, "NANOCKPT", sizeof(header.magic)) &&
+		header.version == CHECKPOINT_VERSION && header.pageSize == NANOVM_PAGE_SIZE) {
+		CheckpointRecord record;
+		std::vector<uint64_t> offsets;
+		std::vector<unsigned char> pages;
+		uint64_t checksum;
+		// A record can not hold more pages than the memory has
+		while (fread(&record, sizeof(record), 1, file) == 1 && record.pageCount <= (header.codeSize + record.stackSize) / NANOVM_PAGE_SIZE) {
+			offsets.resize(static_cast<size_t>(record.pageCount));
+			pages.resize(static_cast<size_t>(record.pageCount * NANOVM_PAGE_SIZE));
+			if (fread(offsets.data(), sizeof(uint64_t), offsets.size(), file) != offsets.size() ||
+				fread(pages.data(), 1, pages.size(), file) != pages.size() || fread(&checksum, sizeof(checksum), 1, file) != 1 ||
+				checksum != checkpointChecksum(record, offsets.data(), pages.data())) {
+				break;
+			}
+			if (!apply(record, offsets, pages)) {
+				break;
+			}
+			found = true;
+		}
+	}
+	fclose(file);
+	return found;
+}
@@ -0,0 +1,162 @@
+#pragma once
+#include "NanoVM.h"
+#include "NanocFormat.h"
+#include <atomic>
+#include <condition_variable>
+#include <cstdio>
+#include <functional>
+#include <mutex>
+#include <string>
+#include <thread>
+
+/**
+ * Current version of the checkpoint file format
+*/
+constexpr uint32_t CHECKPOINT_VERSION = 1;
+
+/**
+ * CheckpointHeader is at the beginning of every checkpoint file and is followed by the records
+*/
+struct CheckpointHeader {
+	char magic[8]; /**< "NANOCKPT" */
+	uint32_t version; /**< CHECKPOINT_VERSION */
+	uint32_t pageSize; /**< NANOVM_PAGE_SIZE */
+	uint64_t bytecodeSize; /**< Size of the checkpointed program */
+	uint64_t codeSize; /**< Size of the code pages. The stack follows them */
+	uint64_t checksum; /**< nanocChecksum() of the bytecode. A checkpoint can only be resumed with the same program */
+};
+
+/**
+ * CheckpointRecord starts every checkpoint of the file. It is followed by the offsets of the pages, the pages and the
+ * checkpointChecksum() of all of them. The first record of a file holds every page, the following ones the pages written since
+ * the previous record
+*/
+struct CheckpointRecord {
+	uint64_t instructionCount; /**< Instructions executed when the checkpoint was taken */
+	uint64_t registers[10]; /**< CPU registers + IP and flags */
+	uint8_t vectorRegisters[VECTOR_REGISTER_COUNT][VECTOR_REGISTER_SIZE]; /**< Vector registers */
+	uint64_t stackSize; /**< Size of the stack. The pages after it are dropped */
+	uint64_t dirtyBegin; /**< Start of the code pages range that differs from the program */
+	uint64_t dirtyEnd; /**< End of the code pages range that differs from the program */
+	uint64_t pageCount; /**< Number of the pages following the record */
+};
+
+/**
+ * Calculates the checksum following a record with 64 bit FNV-1a like nanocChecksum()
+ * @param record Record of the checkpoint
+ * @param offsets Offsets of the pages. Holds record.pageCount offsets
+ * @param pages Content of the pages
+ * @return Checksum of the record, the offsets and the pages
+*/
+inline uint64_t checkpointChecksum(const CheckpointRecord& record, const uint64_t* offsets, const unsigned char* pages) {
+	const unsigned char* parts[] = { reinterpret_cast<const unsigned char*>(&record), reinterpret_cast<const unsigned char*>(offsets), pages };
+	const uint64_t sizes[] = { sizeof(record), record.pageCount * sizeof(uint64_t), record.pageCount * NANOVM_PAGE_SIZE };
+	uint64_t hash = 0xcbf29ce484222325ull;
+	for (int part = 0; part < 3; part++) {
+		for (uint64_t i = 0; i < sizes[part]; i++) {
+			hash = (hash ^ parts[part][i]) * 0x100000001b3ull;
+		}
+	}
+	return hash;
+}
+
+/**
+ * Checkpoint holds a record and its pages on the way to the file
+*/
+struct Checkpoint {
+	CheckpointRecord record; /**< Registers and sizes */
+	std::vector<uint64_t> offsets; /**< Offsets of the pages in the VM memory */
+	std::vector<unsigned char> pages; /**< Content of the pages in the order of the offsets */
+};
+
+/**
+ * \brief CheckpointWriter writes the checkpoints of a VM to a file on a background thread
+ *
+ * The VM hands over a checkpoint with the pages written since the previous one and continues running while the writer
+ * appends it to the file. If the previous checkpoint is still being written the VM waits for it. The writer keeps an image
+ * of the checkpointed memory and rewrites the file from it once the appended records outgrow the memory, so resuming reads
+ * at most a few times the memory. A rewritten file replaces the old one only when it is complete, so the file always holds
+ * the latest checkpoint that was completely written, even if the process crashes.
+*/
+class CheckpointWriter {
+public:
+	/**
+	 * Starts the writer thread. The file is created when the first checkpoint is written
+	 * @param file File to write
+	 * @param header Header of the file
+	*/
+	CheckpointWriter(const std::string& file, const CheckpointHeader& header);
+
+	/**
+	 * Writes the pending checkpoint and stops the writer thread
+	*/
+	~CheckpointWriter();
+
+	/**
+	 * @return True unless writing the file has failed
+	*/
+	bool IsOpen() const;
+
+	/**
+	 * Hands a checkpoint to the writer thread. Waits while the previous checkpoint is being written
+	 * @param checkpoint Checkpoint to write. The first one must hold every page
+	*/
+	void submit(Checkpoint&& checkpoint);
+
+	/**
+	 * Waits until the writer thread has written every checkpoint to the file
+	*/
+	void flush();
+
+	/**
+	 * Reads a checkpoint file and applies its records in order. A partially written record at the end is ignored
+	 * @param file File to read
+	 * @param[out] header Header of the file
+	 * @param apply Called for every complete record with the record, the offsets of its pages and the pages. Returns
+	 * false to stop reading
+	 * @return True if the file is a checkpoint file with at least one complete record
+	*/
+	static bool Read(const std::string& file, CheckpointHeader& header,
+		const std::function<bool(const CheckpointRecord&, const std::vector<uint64_t>&, const std::vector<unsigned char>&)>& apply);
+private:
+	/**
+	 * Writer thread. Writes the submitted checkpoints until the writer is destroyed
+	*/
+	void write();
+
+	/**
+	 * Updates the image of the checkpointed memory with a checkpoint
+	*/
+	void update(const Checkpoint& checkpoint);
+
+	/**
+	 * Writes the image as the only record of a new file and replaces the file with it
+	 * @param record Record of the latest checkpoint
+	 * @return True if the file was replaced
+	*/
+	bool rewrite(const CheckpointRecord& record);
+
+	/**
+	 * Appends a record to a file and flushes it to the disk
+	 * @param output File to append to
+	 * @param record Record of the checkpoint
+	 * @param offsets Offsets of the pages
+	 * @param pages Content of the pages
+	 * @return True if the record was written
+	*/
+	bool append(FILE* output, const CheckpointRecord& record, const uint64_t* offsets, const unsigned char* pages);
+
+	std::string fileName; /**< File the checkpoints are written to */
+	CheckpointHeader header; /**< Header of the file */
+	FILE* file; /**< File the records are appended to, nullptr until the first checkpoint is written */
+	std::vector<unsigned char> image; /**< Memory of the VM at the latest written checkpoint */
+	uint64_t appended; /**< Bytes appended since the file was last rewritten */
+	std::atomic<bool> failed; /**< Has writing the file failed */
+	std::mutex mutex; /**< Guards the pending checkpoint */
+	std::condition_variable changed; /**< Signaled when a checkpoint is submitted or written */
+	Checkpoint pending; /**< Checkpoint waiting to be written */
+	bool hasPending; /**< Is there a pending checkpoint */
+	bool writing; /**< Is the writer thread writing a checkpoint */
+	bool stopping; /**< Is the writer being destroyed */
+	std::thread writer; /**< Thread writing the checkpoints */
+};
@@ -0,0 +1,144 @@
+#include "GuardedMemory.h"
+
+#ifdef NANOVM_GUARDED_MEMORY
+#include <sys/mman.h>
+#include <signal.h>
+#include <mutex>
+
+/**
+ * Size of the whole reservation. The extra page catches accesses that start below GUARDED_ADDRESS_SPACE but end above it
+*/
+constexpr uint64_t GUARDED_RESERVATION_SIZE = GUARDED_ADDRESS_SPACE + NANOVM_PAGE_SIZE;
+
+/**
+ * @return Size rounded up to whole pages
+*/
+static uint64_t roundToPages(uint64_t size) {
+	return (size + NANOVM_PAGE_SIZE - 1) / NANOVM_PAGE_SIZE * NANOVM_PAGE_SIZE;
+}
+
+static thread_local GuardScope* activeScope = nullptr;
+static struct sigaction previousSegvAction;
+static struct sigaction previousBusAction;
+
+/**
+ * Forwards a fault that was not caused by a guarded VM to the handler that was installed before
+*/
+static void forwardFault(int signal, siginfo_t* info, void* context) {
+	struct sigaction& previous = (signal == SIGSEGV) ? previousSegvAction : previousBusAction;
+	if (previous.sa_flags & SA_SIGINFO) {
+		previous.sa_sigaction(signal, info, context);
+	}
+	else if (previous.sa_handler == SIG_DFL || previous.sa_handler == SIG_IGN) {
+		// Returning re-executes the faulting instruction which now raises the signal with the default action
+		sigaction(signal, &previous, nullptr);
+	}
+	else {
+		previous.sa_handler(signal);
+	}
+}
+
+bool GuardScope::handleFault(void* address) {
+	uint64_t offset = reinterpret_cast<uintptr_t>(address) - reinterpret_cast<uintptr_t>(vm.cpu.codeBase);
+	if (offset >= GUARDED_RESERVATION_SIZE) {
+		return false;
+	}
+	// Returning executes the faulting access again on the page the VM made accessible
+	if (offset < vm.cpu.codeSize + vm.cpu.stackSize && (vm.watchFault(offset) || vm.trackWrite(offset))) {
+		return true;
+	}
+	// Returning executes the faulting instruction again with the grown stack
+	if (offset >= vm.cpu.codeSize + vm.cpu.stackSize && vm.growStack(offset, 1)) {
+		return true;
+	}
+	// Push and call write at the stack pointer. Any other access outside of the memory is a memory access error
+	error = (offset - vm.cpu.registers[esp] < sizeof(uint64_t)) ? STACK_ERROR : MEMORY_ACCESS;
+	siglongjmp(jump, 1);
+}
+
+static void handleFault(int signal, siginfo_t* info, void* context) {
+	GuardScope* scope = activeScope;
+	if (!scope || !scope->handleFault(info->si_addr)) {
+		forwardFault(signal, info, context);
+	}
+}
+
+static void installFaultHandler() {
+	struct sigaction action;
+	memset(&action, 0x00, sizeof(action));
+	action.sa_sigaction = handleFault;
+	action.sa_flags = SA_SIGINFO;
+	sigemptyset(&action.sa_mask);
+	sigaction(SIGSEGV, &action, &previousSegvAction);
+	// Some hosts raise SIGBUS instead of SIGSEGV for pages without access rights
+	sigaction(SIGBUS, &action, &previousBusAction);
+}
+
+GuardScope::GuardScope(NanoVM& vm) : error(0), vm(vm), previous(activeScope) {
+	static std::once_flag installed;
+	std::call_once(installed, installFaultHandler);
+	activeScope = this;
+}
+
+GuardScope::~GuardScope() {
+	activeScope = previous;
+}
+
+unsigned char* GuardedMemory::allocate(uint64_t size) {
+	if (size > GUARDED_ADDRESS_SPACE) {
+		return nullptr;
+	}
+	void* memory = mmap(nullptr, GUARDED_RESERVATION_SIZE, PROT_NONE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+	if (memory == MAP_FAILED) {
+		return nullptr;
+	}
+	if (!commit(static_cast<unsigned char*>(memory), size)) {
+		munmap(memory, GUARDED_RESERVATION_SIZE);
+		return nullptr;
+	}
+	return static_cast<unsigned char*>(memory);
+}
+
+bool GuardedMemory::commit(unsigned char* memory, uint64_t size) {
+	// Pages that are already accessible keep their content
+	return mprotect(memory, roundToPages(size), PROT_READ | PROT_WRITE) == 0;
+}
+
+bool GuardedMemory::map(unsigned char* pages, uint64_t size, int file, uint64_t offset) {
+	return mmap(pages, roundToPages(size), PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_FIXED, file, static_cast<off_t>(offset)) != MAP_FAILED;
+}
+
+void GuardedMemory::discard(unsigned char* pages, uint64_t size) {
+#ifdef __linux__
+	// Private anonymous pages read as zero after they are dropped
+	madvise(pages, roundToPages(size), MADV_DONTNEED);
+#else
+	// Other hosts may keep the content of dropped pages so they are replaced with new ones
+	mmap(pages, roundToPages(size), PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE | MAP_FIXED, -1, 0);
+#endif
+}
+
+void GuardedMemory::decommit(unsigned char* pages, uint64_t size) {
+	mmap(pages, roundToPages(size), PROT_NONE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE | MAP_FIXED, -1, 0);
+}
+
+bool GuardedMemory::protect(unsigned char* pages, uint64_t size, PageWatch watch) {
+	int access = (watch == PageWatch::None) ? PROT_READ | PROT_WRITE : (watch == PageWatch::Write) ? PROT_READ : PROT_NONE;
+	return mprotect(pages, roundToPages(size), access) == 0;
+}
+
+void GuardedMemory::release(unsigned char* memory) {
+	munmap(memory, GUARDED_RESERVATION_SIZE);
+}
+
+#else
+
+unsigned char* GuardedMemory::allocate(uint64_t size) { return nullptr; }
+bool GuardedMemory::commit(unsigned char* memory, uint64_t size) { return false; }
+bool GuardedMemory::map(unsigned char* pages, uint64_t size, int file, uint64_t offset) { return false; }
+void GuardedMemory::discard(unsigned char* pages, uint64_t size) {}
+void GuardedMemory::decommit(unsigned char* pages, uint64_t size) {}
+bool GuardedMemory::protect(unsigned char* pages, uint64_t size, PageWatch watch) { return false; }
+void GuardedMemory::release(unsigned char* memory) {}
+
+#endif // NANOVM_GUARDED_MEMORY
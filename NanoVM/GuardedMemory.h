@@ -0,0 +1,107 @@
+#pragma once
+#include "NanoVM.h"
+
+#if (defined(__unix__) || defined(__APPLE__)) && !defined(NANOVM_NO_GUARDED_MEMORY)
+#define NANOVM_GUARDED_MEMORY
+#include <setjmp.h>
+#endif
+
+/**
+ * \brief GuardedMemory allocates VM memory surrounded by inaccessible guard pages
+ *
+ * The code pages and the stack are placed at the beginning of a GUARDED_ADDRESS_SPACE sized reservation. The rest of the
+ * reservation and one extra page for accesses straddling its end are mapped without any access rights. The stack grows
+ * by committing more pages of the reservation.
+*/
+class GuardedMemory {
+public:
+	/**
+	 * Allocates guarded memory. The memory is zeroed
+	 * @param size Size of the accessible memory. Rounded up to whole pages
+	 * @return Base of the memory, nullptr if the host is not supported or the address space could not be reserved
+	*/
+	static unsigned char* allocate(uint64_t size);
+
+	/**
+	 * Makes the beginning of the memory accessible. The new pages are zeroed
+	 * @param memory Base of the memory
+	 * @param size Size of the accessible memory. Rounded up to whole pages
+	 * @return True if the pages could be committed
+	*/
+	static bool commit(unsigned char* memory, uint64_t size);
+
+	/**
+	 * Maps a file over the beginning of the memory copy-on-write. The pages are shared with the page cache until written
+	 * @param pages Start of the pages. Must be page aligned
+	 * @param size Size of the mapped range. Rounded up to whole pages, the part after the end of the file reads as zero
+	 * @param file Descriptor of the file
+	 * @param offset File offset of the range. Must be a multiple of the host page size
+	 * @return True if the file could be mapped
+	*/
+	static bool map(unsigned char* pages, uint64_t size, int file, uint64_t offset);
+
+	/**
+	 * Zeroes pages by dropping them. Only the pages that have been touched cost anything
+	 * @param pages Start of the pages. Must be page aligned
+	 * @param size Size of the range. Rounded up to whole pages
+	*/
+	static void discard(unsigned char* pages, uint64_t size);
+
+	/**
+	 * Drops pages and makes them inaccessible again so they are part of the guard region
+	 * @param pages Start of the pages. Must be page aligned
+	 * @param size Size of the range. Rounded up to whole pages
+	*/
+	static void decommit(unsigned char* pages, uint64_t size);
+
+	/**
+	 * Changes the access rights of committed pages to watch the accesses to them
+	 * @param pages Start of the pages. Must be page aligned
+	 * @param size Size of the range. Rounded up to whole pages
+	 * @param watch Accesses that fault. PageWatch::None makes the pages accessible again
+	 * @return True if the access rights could be changed
+	*/
+	static bool protect(unsigned char* pages, uint64_t size, PageWatch watch);
+
+	/**
+	 * Frees memory allocated with allocate()
+	 * @param memory Base of the memory
+	*/
+	static void release(unsigned char* memory);
+};
+
+#ifdef NANOVM_GUARDED_MEMORY
+/**
+ * \brief GuardScope turns faults in the guard region of a running VM in to VM errors
+ *
+ * While the scope is alive, a fault after the stack of the VM grows the stack up to its maximum size and executes the
+ * faulting instruction again. A fault on a watched page is recorded by the VM and the access completes. Other faults inside the guarded memory of the VM jump back to where sigsetjmp() was called
+ * with the jump buffer of the scope. Scopes are per thread so several VMs can run in one process. Faults that are not caused
+ * by the VM are forwarded to the signal handler that was installed before.
+*/
+struct GuardScope {
+	/**
+	 * Installs the fault handler on first use and makes this the active scope of the calling thread
+	 * @param vm VM running in the scope
+	*/
+	GuardScope(NanoVM& vm);
+
+	/**
+	 * Restores the scope that was active before
+	*/
+	~GuardScope();
+
+	/**
+	 * Handles a fault of the thread running the scope. Records the access if the fault was on a watched page, grows the
+	 * stack if the fault was after it, otherwise jumps back to the jump buffer if the fault was inside the guarded memory of the VM
+	 * @param address Faulting address
+	 * @return True if the faulting instruction can be executed again, false if the fault was not caused by the VM
+	*/
+	bool handleFault(void* address);
+
+	sigjmp_buf jump; /**< Jump buffer the fault handler returns to */
+	volatile unsigned char error; /**< Error flag of the fault. STACK_ERROR if the fault was at the stack pointer, MEMORY_ACCESS otherwise */
+	NanoVM& vm; /**< VM running in the scope */
+	GuardScope* previous; /**< Scope that was active when this one was created */
+};
+#endif
@@ -0,0 +1,490 @@
+#pragma once
+#include "NanoVM.h"
+#include "GuardedMemory.h"
+#include "VectorUnit.h"
+#include <algorithm>
+#include <array>
+#include <type_traits>
+#include <utility>
+
+#if defined(_MSC_VER)
+#define NANOVM_INLINE __forceinline
+#else
+#define NANOVM_INLINE inline __attribute__((always_inline))
+#endif
+
+/**
+ * SizeType maps the source size of an instruction to the unsigned and signed integer types of that size
+*/
+template<Size S> struct SizeType;
+template<> struct SizeType<Size::Byte> { typedef uint8_t Unsigned; typedef int8_t Signed; };
+template<> struct SizeType<Size::Short> { typedef uint16_t Unsigned; typedef int16_t Signed; };
+template<> struct SizeType<Size::Dword> { typedef uint32_t Unsigned; typedef int32_t Signed; };
+template<> struct SizeType<Size::Qword> { typedef uint64_t Unsigned; typedef int64_t Signed; };
+
+/**
+ * Handler executes a single instruction and updates the IP. Returns false if the instruction was not valid or an error occurred
+*/
+typedef bool (*Handler)(NanoVM& vm, Instruction& instruction);
+
+/**
+ * @return True if the opcode writes to its destination operand
+*/
+constexpr bool writesDestination(Opcodes opcode) {
+	return opcode <= Opcodes::Mod || opcode == Opcodes::Pop;
+}
+
+/**
+ * @return True if the opcode writes to its source operand
+*/
+constexpr bool writesSource(Opcodes opcode) {
+	return opcode == Opcodes::Inc || opcode == Opcodes::Dec;
+}
+
+/**
+ * @return True if the conditional jump is taken with the given flags
+*/
+template<Opcodes Op> NANOVM_INLINE bool branchTaken(uint64_t flagsValue) {
+	if constexpr (Op == Opcodes::Jz) return flagsValue & ZERO_FLAG;
+	else if constexpr (Op == Opcodes::Jnz) return !(flagsValue & ZERO_FLAG);
+	else if constexpr (Op == Opcodes::Jg) return flagsValue & GREATER_FLAG;
+	else if constexpr (Op == Opcodes::Js) return flagsValue & SMALLER_FLAG;
+	else return true;
+}
+
+/**
+ * \brief Handlers implements the instruction set as a family of handlers specialized at compile time
+ *
+ * Each opcode, source size, destination memory, source memory and source type combination is its own function so the
+ * operand kind is never checked at runtime. Register and immediate operands are accessed as values which allows the
+ * compiler to turn e.g. "add reg0, reg1" in to a single host instruction.
+*/
+struct Handlers {
+	/**
+	 * Executes a single instruction
+	 * @param vm VM executing the instruction
+	 * @param inst Instruction to be executed
+	 * @param[out] instructionPointer IP to be updated. The threaded engine keeps the IP in a local variable while running
+	 * @tparam Guarded Memory is guarded (see GuardedMemory). Only offsets beyond the guard region are checked
+	 * @return True if the instruction was executed successfully, false if the instruction was not valid or an error occurred
+	*/
+	template<Opcodes Op, Size S, bool DstMem, bool SrcMem, DataType T, bool Guarded = false>
+	static NANOVM_INLINE bool execute(NanoVM& vm, Instruction& inst, uint64_t& instructionPointer) {
+		// USIZE is unsigned and SIZE is signed type => e.g. uint8_t and int8_t
+		typedef typename SizeType<S>::Unsigned USIZE;
+		typedef typename SizeType<S>::Signed SIZE;
+		// Immediate values are zero extended to the whole destination register
+		typedef typename std::conditional<T == DataType::Immediate && !DstMem, uint64_t, USIZE>::type DSTSIZE;
+		// Size of the instruction is known from the source type. A constant avoids making the next IP depend on a memory read
+		constexpr uint64_t instructionSize = (T == DataType::Immediate) ? 2 + sizeof(USIZE) : 2;
+		NanoVMCpu& cpu = vm.cpu;
+
+		if constexpr (Op == Opcodes::Halt || Op == Opcodes::Ror || Op == Opcodes::Rol || Op == Opcodes::Not) {
+			// Halt is handled by the execution engines, the rest are not implemented
+			return false;
+		}
+		else {
+			// Prints reads until the end of the string and the bulk operations access whole ranges so they check the bounds
+			// themselves also in guarded memory
+			constexpr bool guardedAccess = Guarded && Op != Opcodes::Prints && Op != Opcodes::Memcpy;
+			// Memory operands the opcode does not use are ignored
+			constexpr bool dstMemory = DstMem && accessesDestination(Op);
+			constexpr bool srcMemory = SrcMem && accessesSource(Op);
+			if constexpr (guardedAccess && (dstMemory || srcMemory || Op == Opcodes::Push || Op == Opcodes::Call)) {
+				// A fault in the guard region reports the instruction from the IP register
+				cpu.registers[ip] = instructionPointer;
+			}
+			// Do bounds check for the memory operands. Accesses past the end of the stack grow it
+			// Prints only needs the first byte of the string to be inside the memory
+			constexpr uint64_t srcAccessSize = (Op == Opcodes::Prints) ? 1 : sizeof(USIZE);
+			uint64_t dstOffset = 0;
+			uint64_t srcOffset = 0;
+			if constexpr (dstMemory) {
+				dstOffset = cpu.registers[inst.dstReg];
+				if (guardedAccess ? dstOffset >= GUARDED_ADDRESS_SPACE : dstOffset > cpu.codeSize + cpu.stackSize - sizeof(DSTSIZE)) {
+					if (guardedAccess || !vm.growStack(dstOffset, sizeof(DSTSIZE))) {
+						vm.errorFlag = MEMORY_ACCESS;
+						return false;
+					}
+				}
+			}
+			if constexpr (srcMemory) {
+				srcOffset = (T == DataType::Immediate) ? inst.immediate : cpu.registers[inst.srcReg];
+				if (guardedAccess ? srcOffset >= GUARDED_ADDRESS_SPACE : srcOffset > cpu.codeSize + cpu.stackSize - srcAccessSize) {
+					if (guardedAccess || !vm.growStack(srcOffset, srcAccessSize)) {
+						vm.errorFlag = MEMORY_ACCESS;
+						return false;
+					}
+				}
+			}
+			// Growing the stack may move the memory so the addresses are taken after the checks
+			unsigned char* dstAddress = DstMem ? cpu.codeBase + dstOffset : nullptr;
+			unsigned char* srcAddress = SrcMem ? cpu.codeBase + srcOffset : nullptr;
+			// Checked memory marks the written pages for the checkpoints, guarded memory write protects them instead
+			if constexpr (!Guarded && ((dstMemory && writesDestination(Op)) || (srcMemory && writesSource(Op)))) {
+				if (vm.trackingWrites) {
+					vm.markWritten((dstMemory && writesDestination(Op)) ? dstOffset : srcOffset, sizeof(USIZE));
+				}
+			}
+
+			auto source = [&]() -> USIZE {
+				if constexpr (SrcMem)
+					return *reinterpret_cast<USIZE*>(srcAddress);
+				else if constexpr (T == DataType::Immediate)
+					return static_cast<USIZE>(inst.immediate);
+				else
+					return static_cast<USIZE>(cpu.registers[inst.srcReg]);
+			};
+			auto destination = [&]() -> DSTSIZE {
+				if constexpr (DstMem)
+					return *reinterpret_cast<DSTSIZE*>(dstAddress);
+				else
+					return static_cast<DSTSIZE>(cpu.registers[inst.dstReg]);
+			};
+			// Writes less than 64 bits to a register keep the upper bits of the register
+			auto store = [](uint64_t& reg, auto value) {
+				typedef decltype(value) VALUESIZE;
+				if constexpr (sizeof(VALUESIZE) == sizeof(uint64_t))
+					reg = value;
+				else
+					reg = (reg & ~static_cast<uint64_t>(static_cast<VALUESIZE>(~0))) | value;
+			};
+			auto storeDestination = [&](auto value) {
+				if constexpr (DstMem)
+					*reinterpret_cast<decltype(value)*>(dstAddress) = value;
+				else
+					store(cpu.registers[inst.dstReg], value);
+			};
+
+			if constexpr (Op == Opcodes::Mov) storeDestination(static_cast<DSTSIZE>(source()));
+			else if constexpr (Op == Opcodes::Add) storeDestination(static_cast<DSTSIZE>(destination() + source()));
+			else if constexpr (Op == Opcodes::Sub) storeDestination(static_cast<DSTSIZE>(destination() - source()));
+			else if constexpr (Op == Opcodes::And) storeDestination(static_cast<DSTSIZE>(destination() & source()));
+			else if constexpr (Op == Opcodes::Or) storeDestination(static_cast<DSTSIZE>(destination() | source()));
+			else if constexpr (Op == Opcodes::Xor) storeDestination(static_cast<DSTSIZE>(destination() ^ source()));
+			else if constexpr (Op == Opcodes::Sar) storeDestination(static_cast<DSTSIZE>(destination() >> source()));
+			else if constexpr (Op == Opcodes::Sal) storeDestination(static_cast<DSTSIZE>(destination() << source()));
+			else if constexpr (Op == Opcodes::Mul) storeDestination(static_cast<DSTSIZE>(destination() * source()));
+			else if constexpr (Op == Opcodes::Div) storeDestination(static_cast<DSTSIZE>(destination() / source()));
+			else if constexpr (Op == Opcodes::Mod) storeDestination(static_cast<DSTSIZE>(destination() % source()));
+			else if constexpr (Op == Opcodes::Cmp) {
+				USIZE dst = static_cast<USIZE>(destination());
+				USIZE src = source();
+				if (dst == src)
+					cpu.registers[flags] = ZERO_FLAG;
+				else if (dst > src)
+					cpu.registers[flags] = GREATER_FLAG;
+				else
+					cpu.registers[flags] = SMALLER_FLAG;
+			}
+			else if constexpr (Op == Opcodes::Jz || Op == Opcodes::Jnz || Op == Opcodes::Jg || Op == Opcodes::Js || Op == Opcodes::Jmp) {
+				// The target is read also when the branch is not taken so that a memory target faults the same way in guarded memory
+				SIZE target = static_cast<SIZE>(source());
+				if (branchTaken<Op>(cpu.registers[flags])) {
+					instructionPointer += target;
+					return true;
+				}
+			}
+			else if constexpr (Op == Opcodes::Inc || Op == Opcodes::Dec) {
+				USIZE value = static_cast<USIZE>((Op == Opcodes::Inc) ? source() + 1 : source() - 1);
+				if constexpr (SrcMem)
+					*reinterpret_cast<USIZE*>(srcAddress) = value;
+				else if constexpr (T == DataType::Reg)
+					store(cpu.registers[inst.srcReg], value);
+				// Incrementing an immediate value has no effect
+			}
+			else if constexpr (Op == Opcodes::Call) {
+				// The target is read before pushing because growing the stack may move the memory
+				SIZE target = static_cast<SIZE>(source());
+				if (!vm.push<uint64_t, guardedAccess>(instructionPointer + instructionSize)) {
+					return false;
+				}
+				instructionPointer += target;
+				return true;
+			}
+			else if constexpr (Op == Opcodes::Ret) {
+				return vm.pop<uint64_t>(instructionPointer);
+			}
+			else if constexpr (Op == Opcodes::Push) {
+				if (!vm.push<USIZE, guardedAccess>(source())) {
+					return false;
+				}
+			}
+			else if constexpr (Op == Opcodes::Pop) {
+				USIZE value;
+				if (!vm.pop<USIZE>(value)) {
+					return false;
+				}
+				storeDestination(value);
+			}
+			else if constexpr (Op == Opcodes::Printi) vm.output->writeInteger(static_cast<uint64_t>(source()));
+			else if constexpr (Op == Opcodes::Printc) {
+				char character = static_cast<char>(source());
+				vm.output->write(&character, 1);
+			}
+			else if constexpr (Op == Opcodes::Syscall) {
+				// The table has a fixed size so the dispatch is a single bounds check and an array lookup
+				uint64_t number = source();
+				const SyscallEntry* syscall = (number < NANOVM_SYSCALL_COUNT) ? &vm.syscalls[number] : nullptr;
+				// The host function sees the IP of the syscall instruction
+				cpu.registers[ip] = instructionPointer;
+				if (!syscall || !syscall->function || !syscall->function(vm, syscall->data)) {
+					vm.errorFlag = SYSCALL_ERROR;
+					return false;
+				}
+			}
+			else if constexpr (Op == Opcodes::Memcpy) {
+				if (!executeBulk(vm, inst.dstReg, source())) {
+					return false;
+				}
+			}
+			else if constexpr (Op == Opcodes::Prints) {
+				if constexpr (SrcMem) {
+					// Stop at the end of the VM memory if the string is not terminated
+					size_t limit = static_cast<size_t>(cpu.codeSize + cpu.stackSize - (srcAddress - cpu.codeBase));
+					const char* text = reinterpret_cast<char*>(srcAddress);
+					vm.output->write(text, strnlen(text, limit));
+				}
+				else {
+					// Register and immediate strings are at most 8 characters
+					const char* text = reinterpret_cast<char*>((T == DataType::Immediate) ? &inst.immediate : &cpu.registers[inst.srcReg]);
+					vm.output->write(text, strnlen(text, sizeof(uint64_t)));
+				}
+			}
+
+			instructionPointer += instructionSize;
+			// Writes to code pages make the cached instructions stale. Invalidation is done after the IP has been updated
+			if constexpr ((DstMem && writesDestination(Op)) || (SrcMem && writesSource(Op))) {
+				unsigned char* written = (DstMem && writesDestination(Op)) ? dstAddress : srcAddress;
+				if (written < cpu.codeBase + cpu.codeSize) {
+					vm.invalidate(written - cpu.codeBase, sizeof(uint64_t));
+				}
+			}
+			return true;
+		}
+	}
+
+	/**
+	 * Executes a vector instruction. The arithmetic instructions call the kernel selected for the host CPU (see VectorUnit)
+	 * @param vm VM executing the instruction
+	 * @param inst Instruction to be executed
+	 * @param[out] instructionPointer IP to be updated
+	 * @tparam Guarded Memory is guarded (see GuardedMemory). Only offsets beyond the guard region are checked
+	 * @return True if the instruction was executed successfully, false if the memory access was outside of the memory
+	*/
+	template<VectorOpcodes Op, Size Lane, bool Wide, bool Guarded = false>
+	static NANOVM_INLINE bool executeVector(NanoVM& vm, Instruction& inst, uint64_t& instructionPointer) {
+		constexpr uint64_t width = Wide ? VECTOR_REGISTER_SIZE : VECTOR_REGISTER_SIZE / 2;
+		NanoVMCpu& cpu = vm.cpu;
+		if constexpr (Op == VLoad || Op == VStore) {
+			// The general purpose register holding the offset is the source of loads and the destination of stores
+			uint8_t* reg = cpu.vectorRegisters[(Op == VLoad) ? inst.dstReg : inst.srcReg];
+			uint64_t offset = cpu.registers[(Op == VLoad) ? inst.srcReg : inst.dstReg];
+			if constexpr (Guarded) {
+				// A fault in the guard region reports the instruction from the IP register
+				cpu.registers[ip] = instructionPointer;
+			}
+			if (Guarded ? offset >= GUARDED_ADDRESS_SPACE : offset > cpu.codeSize + cpu.stackSize - width) {
+				if (Guarded || !vm.growStack(offset, width)) {
+					vm.errorFlag = MEMORY_ACCESS;
+					return false;
+				}
+			}
+			if constexpr (!Guarded && Op == VStore) {
+				if (vm.trackingWrites) {
+					vm.markWritten(offset, width);
+				}
+			}
+			if constexpr (Op == VLoad) {
+				memcpy(reg, cpu.codeBase + offset, width);
+			}
+			else {
+				memcpy(cpu.codeBase + offset, reg, width);
+			}
+			instructionPointer += VECTOR_INSTRUCTION_SIZE;
+			// Writes to code pages make the cached instructions stale. Invalidation is done after the IP has been updated
+			if (Op == VStore && offset < cpu.codeSize) {
+				vm.invalidate(offset, width);
+			}
+		}
+		else {
+			VectorUnit::kernels[vectorKernelIndex(Op, Lane, Wide)](cpu.vectorRegisters[inst.dstReg], cpu.vectorRegisters[inst.srcReg]);
+			instructionPointer += VECTOR_INSTRUCTION_SIZE;
+		}
+		// 128 bit instructions zero the upper half of the destination register
+		if constexpr (!Wide && Op != VStore) {
+			memset(cpu.vectorRegisters[inst.dstReg] + width, 0x00, width);
+		}
+		return true;
+	}
+
+	/**
+	 * Checks that a memory range is inside the VM memory. Ranges past the end of the stack grow it
+	 * @return True if the range is inside the memory
+	*/
+	static bool rangeInMemory(NanoVM& vm, uint64_t offset, uint64_t size) {
+		NanoVMCpu& cpu = vm.cpu;
+		if (offset <= cpu.codeSize + cpu.stackSize && size <= cpu.codeSize + cpu.stackSize - offset) {
+			return true;
+		}
+		return size <= cpu.codeSize + cpu.maxStackSize && vm.growStack(offset, size);
+	}
+
+	/**
+	 * Executes a bulk memory operation (see BulkOperation). The ranges are checked once and the operation is done by the
+	 * memory routines of the C library which pick the vector instructions of the host CPU at runtime
+	 * @param vm VM executing the instruction
+	 * @param operation Bulk operation to execute
+	 * @param count Number of bytes
+	 * @return True if the operation was executed successfully, false if a range is outside of the memory or the operation is unknown
+	*/
+	static bool executeBulk(NanoVM& vm, unsigned int operation, uint64_t count) {
+		NanoVMCpu& cpu = vm.cpu;
+		uint64_t first = cpu.registers[Reg0];
+		uint64_t second = cpu.registers[Reg1];
+		if (operation > BulkOperation::BulkSearch) {
+			return false;
+		}
+		bool secondRange = operation == BulkOperation::BulkCopy || operation == BulkOperation::BulkCompare;
+		if (!rangeInMemory(vm, first, count) || (secondRange && !rangeInMemory(vm, second, count))) {
+			vm.errorFlag = MEMORY_ACCESS;
+			return false;
+		}
+		// Growing the stack may move the memory so the addresses are taken after the checks
+		unsigned char* memory = cpu.codeBase;
+		if (vm.trackingWrites && (operation == BulkOperation::BulkCopy || operation == BulkOperation::BulkFill)) {
+			vm.markWritten(first, count);
+		}
+		switch (operation) {
+		case BulkOperation::BulkCopy:
+			memmove(memory + first, memory + second, count);
+			break;
+		case BulkOperation::BulkFill:
+			memset(memory + first, static_cast<unsigned char>(second), count);
+			break;
+		case BulkOperation::BulkCompare: {
+			int result = memcmp(memory + first, memory + second, count);
+			cpu.registers[flags] = (result == 0) ? ZERO_FLAG : (result > 0) ? GREATER_FLAG : SMALLER_FLAG;
+			return true;
+		}
+		case BulkOperation::BulkSearch: {
+			const void* found = memchr(memory + first, static_cast<unsigned char>(second), count);
+			if (found) {
+				cpu.registers[Reg0] = static_cast<const unsigned char*>(found) - memory;
+				cpu.registers[flags] = ZERO_FLAG;
+			}
+			else {
+				cpu.registers[flags] = 0;
+			}
+			return true;
+		}
+		}
+		// Copy and fill may write to the code pages
+		if (first < cpu.codeSize && count) {
+			vm.invalidate(first, count);
+		}
+		return true;
+	}
+
+	/**
+	 * Executes a fused [inc/dec] + cmp + jz/jnz/jg/js sequence. The instructions following the first one are read
+	 * from the instruction cache. The flags are updated exactly like when executing the instructions one by one
+	 * @param vm VM executing the instruction sequence
+	 * @param inst First instruction of the sequence
+	 * @param[out] instructionPointer IP to be updated
+	 * @return True, fused instructions can not fail
+	*/
+	template<Opcodes Step, Opcodes Branch, Size S, DataType T>
+	static NANOVM_INLINE bool executeCompareBranch(NanoVM& vm, Instruction& inst, uint64_t& instructionPointer) {
+		uint64_t start = instructionPointer;
+		if constexpr (Step == Opcodes::Cmp) {
+			execute<Opcodes::Cmp, S, false, false, T>(vm, inst, instructionPointer);
+		}
+		else {
+			execute<Step, Size::Qword, false, false, DataType::Reg>(vm, inst, instructionPointer);
+			execute<Opcodes::Cmp, S, false, false, T>(vm, vm.instructionCache[instructionPointer], instructionPointer);
+		}
+		instructionPointer = start + (branchTaken<Branch>(vm.cpu.registers[flags]) ? static_cast<int64_t>(inst.branchOffset) : inst.fusedSize);
+		return true;
+	}
+
+	/**
+	 * Executes a fused mov + add sequence. The add instruction is read from the instruction cache
+	 * @param vm VM executing the instruction sequence
+	 * @param inst First instruction of the sequence
+	 * @param[out] instructionPointer IP to be updated
+	 * @return True, fused instructions can not fail
+	*/
+	template<DataType MovType, DataType AddType>
+	static NANOVM_INLINE bool executeMoveAdd(NanoVM& vm, Instruction& inst, uint64_t& instructionPointer) {
+		// Immediate values are zero extended so the source size does not change the result
+		uint64_t start = instructionPointer;
+		execute<Opcodes::Mov, Size::Qword, false, false, MovType>(vm, inst, instructionPointer);
+		execute<Opcodes::Add, Size::Qword, false, false, AddType>(vm, vm.instructionCache[start + inst.instructionSize], instructionPointer);
+		instructionPointer = start + inst.fusedSize;
+		return true;
+	}
+
+	/**
+	 * Executes a single instruction updating the IP register of the VM
+	*/
+	template<Opcodes Op, Size S, bool DstMem, bool SrcMem, DataType T, bool Guarded>
+	static bool executeInstruction(NanoVM& vm, Instruction& inst) {
+		return execute<Op, S, DstMem, SrcMem, T, Guarded>(vm, inst, vm.cpu.registers[ip]);
+	}
+
+	template<Opcodes Step, Opcodes Branch, Size S, DataType T>
+	static bool executeCompareBranchInstruction(NanoVM& vm, Instruction& inst) {
+		return executeCompareBranch<Step, Branch, S, T>(vm, inst, vm.cpu.registers[ip]);
+	}
+
+	template<DataType MovType, DataType AddType>
+	static bool executeMoveAddInstruction(NanoVM& vm, Instruction& inst) {
+		return executeMoveAdd<MovType, AddType>(vm, inst, vm.cpu.registers[ip]);
+	}
+
+	template<VectorOpcodes Op, Size Lane, bool Wide, bool Guarded>
+	static bool executeVectorInstruction(NanoVM& vm, Instruction& inst) {
+		return executeVector<Op, Lane, Wide, Guarded>(vm, inst, vm.cpu.registers[ip]);
+	}
+
+	/**
+	 * @return Handler for the opcode and operand kind combination encoded in the given handlerIndex(), compareBranchIndex(),
+	 * moveAddIndex() or vectorIndex()
+	*/
+	template<size_t Index, bool Guarded> static constexpr Handler handler() {
+		if constexpr (Index < HANDLER_COUNT) {
+			return &executeInstruction<static_cast<Opcodes>(Index >> 5), static_cast<Size>((Index >> 3) & 3), ((Index >> 2) & 1) != 0,
+				((Index >> 1) & 1) != 0, static_cast<DataType>(Index & 1), Guarded>;
+		}
+		else if constexpr (Index < moveAddIndex(false, false)) {
+			constexpr size_t fused = Index - HANDLER_COUNT;
+			constexpr Opcodes steps[] = { Opcodes::Cmp, Opcodes::Inc, Opcodes::Dec };
+			return &executeCompareBranchInstruction<steps[fused >> 5], static_cast<Opcodes>(Opcodes::Jz + ((fused >> 3) & 3)),
+				static_cast<Size>((fused >> 1) & 3), static_cast<DataType>(fused & 1)>;
+		}
+		else if constexpr (Index < vectorIndex(0, 0, false)) {
+			constexpr size_t fused = Index - moveAddIndex(false, false);
+			return &executeMoveAddInstruction<static_cast<DataType>(fused >> 1), static_cast<DataType>(fused & 1)>;
+		}
+		else {
+			constexpr size_t vector = Index - vectorIndex(0, 0, false);
+			return &executeVectorInstruction<static_cast<VectorOpcodes>(vector >> 3), static_cast<Size>((vector >> 1) & 3),
+				(vector & 1) != 0, Guarded>;
+		}
+	}
+
+	template<bool Guarded, size_t... Index> static constexpr std::array<Handler, TOTAL_HANDLER_COUNT> table(std::index_sequence<Index...>) {
+		return { { handler<Index, Guarded>()... } };
+	}
+};
+
+/**
+ * Table of all handlers indexed by handlerIndex(), compareBranchIndex(), moveAddIndex() and vectorIndex(). Built at compile time
+*/
+inline constexpr std::array<Handler, TOTAL_HANDLER_COUNT> handlerTable = Handlers::table<false>(std::make_index_sequence<TOTAL_HANDLER_COUNT>());
+
+/**
+ * Table of the handlers for guarded memory. Fused handlers do not access memory so they are the same as in handlerTable
+*/
+inline constexpr std::array<Handler, TOTAL_HANDLER_COUNT> guardedHandlerTable = Handlers::table<true>(std::make_index_sequence<TOTAL_HANDLER_COUNT>());
@@ -0,0 +1,697 @@
+#include "JitCompiler.h"
+#include <cstddef>
+
+#ifdef NANOVM_JIT
+#ifdef _WIN32
+#include <windows.h>
+#else
+#include <sys/mman.h>
+#include <unistd.h>
+#endif
+
+// Host registers with a fixed purpose in the compiled code
+constexpr X64Register CONTEXT = RBP;
+constexpr X64Register MEMORY = RBX;
+constexpr X64Register FLAGS = RSI;
+constexpr X64Register STACK_POINTER = R15;
+
+// Size of the executable memory and the space reserved for compiling a single block
+constexpr size_t JIT_CODE_SIZE = 16 * 1024 * 1024;
+constexpr size_t JIT_BLOCK_RESERVE = 128 * 1024;
+constexpr unsigned int MAX_BLOCK_INSTRUCTIONS = 256;
+
+typedef uint32_t (*JitEntry)(JitContext* context, uint8_t* block);
+
+/**
+ * @return Host register holding the given VM register. Reg0 - esp are kept in R8 - R15
+*/
+static X64Register vmRegister(unsigned int reg) {
+	return static_cast<X64Register>(R8 + reg);
+}
+
+/**
+ * @return True if the compiler can compile the instruction. The rest are executed with the interpreter
+*/
+static bool isCompilable(const Instruction& inst) {
+	// Vector instructions are interpreted
+	if (inst.opcode >= VECTOR_OPCODE_BASE) {
+		return false;
+	}
+	switch (inst.opcode) {
+	case Opcodes::Ror:
+	case Opcodes::Rol:
+	case Opcodes::Not:
+	case Opcodes::Printi:
+	case Opcodes::Prints:
+	case Opcodes::Printc:
+	case Opcodes::Syscall:
+	case Opcodes::Memcpy:
+		return false;
+	default:
+		return true;
+	}
+}
+
+/**
+ * @return Offset of the jump target from the jump instruction. The immediate value is sign extended from the source size
+*/
+static int64_t jumpOffset(const Instruction& inst) {
+	switch (inst.srcSize) {
+	case Byte:
+		return static_cast<int8_t>(inst.immediate);
+	case Short:
+		return static_cast<int16_t>(inst.immediate);
+	case Dword:
+		return static_cast<int32_t>(inst.immediate);
+	default:
+		return static_cast<int64_t>(inst.immediate);
+	}
+}
+
+/**
+ * Allocates the code memory writable but not executable. It is made executable once the code is emitted
+*/
+static void* allocateCode(size_t size) {
+#ifdef _WIN32
+	return VirtualAlloc(nullptr, size, MEM_RESERVE | MEM_COMMIT, PAGE_READWRITE);
+#else
+	void* memory = mmap(nullptr, size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+	return (memory == MAP_FAILED) ? nullptr : memory;
+#endif
+}
+
+/**
+ * Makes the pages of the code memory range either writable or executable. They are never both
+ * @return True if the protection was changed
+*/
+static bool protectCode(uint8_t* begin, uint8_t* end, bool writable) {
+#ifdef _WIN32
+	SYSTEM_INFO info;
+	GetSystemInfo(&info);
+	const uintptr_t pageSize = info.dwPageSize;
+#else
+	const uintptr_t pageSize = static_cast<uintptr_t>(sysconf(_SC_PAGESIZE));
+#endif
+	uint8_t* first = reinterpret_cast<uint8_t*>(reinterpret_cast<uintptr_t>(begin) & ~(pageSize - 1));
+#ifdef _WIN32
+	DWORD previous;
+	return VirtualProtect(first, end - first, writable ? PAGE_READWRITE : PAGE_EXECUTE_READ, &previous) != 0;
+#else
+	return mprotect(first, end - first, writable ? (PROT_READ | PROT_WRITE) : (PROT_READ | PROT_EXEC)) == 0;
+#endif
+}
+
+static void freeCode(void* memory, size_t size) {
+#ifdef _WIN32
+	VirtualFree(memory, 0, MEM_RELEASE);
+#else
+	munmap(memory, size);
+#endif
+}
+
+JitCompiler::JitCompiler(NanoVM& vm) : vm(vm), code(static_cast<uint8_t*>(allocateCode(JIT_CODE_SIZE))),
+	codeCapacity(code ? JIT_CODE_SIZE : 0), emitter(code, codeCapacity) {
+	memset(&context, 0x00, sizeof(context));
+	blocks.assign(vm.cpu.codeSize, nullptr);
+	hostFlags = false;
+	if (code) {
+		emitRoutines();
+		// Without executable code memory the VM runs the threaded engine
+		if (!protectCode(code, routinesEnd, false)) {
+			freeCode(code, codeCapacity);
+			code = nullptr;
+		}
+	}
+}
+
+JitCompiler::~JitCompiler() {
+	if (code) {
+		freeCode(code, codeCapacity);
+	}
+}
+
+bool JitCompiler::isValid() const {
+	return code != nullptr;
+}
+
+void JitCompiler::emitRoutines() {
+	// Callee saved registers of the host calling convention
+#ifdef _WIN32
+	const X64Register saved[] = { RBX, RBP, RSI, RDI, R12, R13, R14, R15 };
+#else
+	const X64Register saved[] = { RBX, RBP, R12, R13, R14, R15 };
+#endif
+	enterRoutine = emitter.position();
+	for (X64Register reg : saved) {
+		emitter.push(reg);
+	}
+#ifdef _WIN32
+	emitter.mov(CONTEXT, RCX);
+	emitter.mov(RAX, RDX);
+#else
+	emitter.mov(CONTEXT, RDI);
+	emitter.mov(RAX, RSI);
+#endif
+	emitter.loadDisplacement(MEMORY, CONTEXT, offsetof(JitContext, memory));
+	emitter.loadDisplacement(RDX, CONTEXT, offsetof(JitContext, registers));
+	for (unsigned int reg = Reg0; reg <= esp; reg++) {
+		emitter.loadDisplacement(vmRegister(reg), RDX, reg * sizeof(uint64_t));
+	}
+	emitter.loadDisplacement(FLAGS, RDX, flags * sizeof(uint64_t));
+	emitter.jmp(RAX);
+
+	// Exit stores the registers back to the VM and returns the exit reason in EAX
+	uint8_t* exitRoutine = emitter.position();
+	emitter.loadDisplacement(RDX, CONTEXT, offsetof(JitContext, registers));
+	for (unsigned int reg = Reg0; reg <= esp; reg++) {
+		emitter.storeDisplacement(RDX, reg * sizeof(uint64_t), vmRegister(reg));
+	}
+	emitter.storeDisplacement(RDX, flags * sizeof(uint64_t), FLAGS);
+	emitter.loadDisplacement(RCX, CONTEXT, offsetof(JitContext, exitIp));
+	emitter.storeDisplacement(RDX, ip * sizeof(uint64_t), RCX);
+	for (size_t i = sizeof(saved) / sizeof(saved[0]); i > 0; i--) {
+		emitter.pop(saved[i - 1]);
+	}
+	emitter.ret();
+
+	auto emitExit = [&](JitExit reason) {
+		emitter.storeDisplacement(CONTEXT, offsetof(JitContext, exitIp), RAX);
+		emitter.movImmediate(RAX, static_cast<uint32_t>(reason));
+		emitter.jmp(exitRoutine);
+	};
+	// Dispatch jumps to the compiled block at the offset in RAX without returning to the VM if there is one
+	dispatchRoutine = emitter.position();
+	emitter.aluMemory(AluCmp, RAX, CONTEXT, offsetof(JitContext, codeSize));
+	uint8_t* outOfBounds = emitter.jcc(AboveEqual);
+	emitter.loadDisplacement(RDX, CONTEXT, offsetof(JitContext, blocks));
+	emitter.loadScaled(RDX, RDX, RAX);
+	emitter.alu(AluOr, RDX, RDX);
+	uint8_t* notCompiled = emitter.jcc(Equal);
+	emitter.jmp(RDX);
+	X64Emitter::patch(outOfBounds, emitter.position());
+	X64Emitter::patch(notCompiled, emitter.position());
+	emitExit(JitExit::Dispatch);
+
+	fallbackRoutine = emitter.position();
+	emitExit(JitExit::Fallback);
+
+	haltRoutine = emitter.position();
+	emitExit(JitExit::Halt);
+	routinesEnd = emitter.position();
+}
+
+void JitCompiler::flush() {
+	blocks.assign(vm.cpu.codeSize, nullptr);
+	compiledBlocks.clear();
+	emitter.reset(routinesEnd);
+}
+
+uint8_t* JitCompiler::block(uint64_t offset) {
+	if (offset >= blocks.size()) {
+		return nullptr;
+	}
+	if (!blocks[offset]) {
+		blocks[offset] = compile(offset);
+	}
+	return blocks[offset];
+}
+
+JitExit JitCompiler::enter(uint8_t* block) {
+	context.registers = vm.cpu.registers;
+	context.memory = vm.cpu.codeBase;
+	context.blocks = blocks.data();
+	context.codeSize = vm.cpu.codeSize;
+	// The memory and its size change when the interpreter grows the stack
+	context.accessLimit = vm.cpu.codeSize + vm.cpu.stackSize - sizeof(uint64_t);
+	return static_cast<JitExit>(reinterpret_cast<JitEntry>(enterRoutine)(&context, block));
+}
+
+void JitCompiler::invalidate(uint64_t offset, uint64_t size) {
+	for (size_t i = 0; i < compiledBlocks.size();) {
+		if (compiledBlocks[i].start < offset + size && compiledBlocks[i].end > offset) {
+			// The code of the block is left in the executable memory until the next flush
+			blocks[compiledBlocks[i].start] = nullptr;
+			compiledBlocks[i] = compiledBlocks.back();
+			compiledBlocks.pop_back();
+		}
+		else {
+			i++;
+		}
+	}
+}
+
+bool JitCompiler::usesHostFlags(const Instruction& inst) const {
+	// Memory operand bounds checks overwrite the host flags
+	return hostFlags && inst.opcode >= Opcodes::Jz && inst.opcode <= Opcodes::Js && !inst.isSrcMem;
+}
+
+uint8_t* JitCompiler::compile(uint64_t start) {
+	Instruction inst;
+	vm.decode(start, inst);
+	if (!isCompilable(inst)) {
+		return nullptr;
+	}
+	if (emitter.remaining() < JIT_BLOCK_RESERVE) {
+		flush();
+	}
+	// Only the pages the block is compiled to are writable while compiling
+	uint8_t* entry = emitter.position();
+	if (!protectCode(entry, entry + JIT_BLOCK_RESERVE, true)) {
+		return nullptr;
+	}
+	nativeOffsets.clear();
+	pendingJumps.clear();
+	fallbacks.clear();
+	hostFlags = false;
+	uint64_t offset = start;
+	for (unsigned int count = 0; ; count++) {
+		if (offset >= vm.cpu.codeSize || count == MAX_BLOCK_INSTRUCTIONS) {
+			emitJump(nullptr, offset);
+			break;
+		}
+		vm.decode(offset, inst);
+		if (!isCompilable(inst)) {
+			emitter.movImmediate(RAX, offset);
+			emitter.jmp(fallbackRoutine);
+			break;
+		}
+		// Instructions relying on the host flags of the previous instruction can not be jumped to
+		if (!usesHostFlags(inst)) {
+			uint8_t* native = emitter.position();
+			nativeOffsets.emplace_back(offset, native);
+			for (size_t i = 0; i < pendingJumps.size();) {
+				if (pendingJumps[i].target == offset) {
+					X64Emitter::patch(pendingJumps[i].offset, native);
+					pendingJumps[i] = pendingJumps.back();
+					pendingJumps.pop_back();
+				}
+				else {
+					i++;
+				}
+			}
+		}
+		bool next = compileInstruction(inst, offset);
+		offset += inst.instructionSize;
+		if (!next) {
+			break;
+		}
+	}
+	// Jumps out of the block go through the dispatch routine
+	for (const PendingJump& jump : pendingJumps) {
+		X64Emitter::patch(jump.offset, emitter.position());
+		emitter.movImmediate(RAX, jump.target);
+		emitter.jmp(dispatchRoutine);
+	}
+	for (const PendingJump& jump : fallbacks) {
+		X64Emitter::patch(jump.offset, emitter.position());
+		emitter.movImmediate(RAX, jump.target);
+		emitter.jmp(fallbackRoutine);
+	}
+	// The first page may also hold the end of the previous block, so the whole range is made executable again
+	if (!protectCode(entry, entry + JIT_BLOCK_RESERVE, false)) {
+		return nullptr;
+	}
+	compiledBlocks.push_back({ start, offset });
+	return entry;
+}
+
+void JitCompiler::emitFallback(X64Condition condition, uint64_t offset) {
+	fallbacks.push_back({ emitter.jcc(condition), offset });
+}
+
+void JitCompiler::emitJump(const X64Condition* condition, uint64_t target) {
+	for (const auto& native : nativeOffsets) {
+		if (native.first == target) {
+			if (condition)
+				emitter.jcc(*condition, native.second);
+			else
+				emitter.jmp(native.second);
+			return;
+		}
+	}
+	pendingJumps.push_back({ condition ? emitter.jcc(*condition) : emitter.jmp(), target });
+}
+
+void JitCompiler::emitOperandChecks(const Instruction& inst, uint64_t offset, bool writesDestination, bool writesSource) {
+	// Writes to the code pages are left to the interpreter which invalidates the caches
+	if (inst.isDstMem && accessesDestination(inst.opcode)) {
+		emitter.mov(RDI, vmRegister(inst.dstReg));
+		emitter.aluMemory(AluCmp, RDI, CONTEXT, offsetof(JitContext, accessLimit));
+		emitFallback(Above, offset);
+		if (writesDestination) {
+			emitter.aluMemory(AluCmp, RDI, CONTEXT, offsetof(JitContext, codeSize));
+			emitFallback(Below, offset);
+		}
+	}
+	if (inst.isSrcMem && accessesSource(inst.opcode)) {
+		if (inst.srcType != DataType::Reg)
+			emitter.movImmediate(RCX, inst.immediate);
+		else
+			emitter.mov(RCX, vmRegister(inst.srcReg));
+		emitter.aluMemory(AluCmp, RCX, CONTEXT, offsetof(JitContext, accessLimit));
+		emitFallback(Above, offset);
+		if (writesSource) {
+			emitter.aluMemory(AluCmp, RCX, CONTEXT, offsetof(JitContext, codeSize));
+			emitFallback(Below, offset);
+		}
+	}
+}
+
+void JitCompiler::emitLoadSource(const Instruction& inst) {
+	unsigned int size = 1 << inst.srcSize;
+	if (inst.isSrcMem)
+		emitter.load(RAX, MEMORY, RCX, size);
+	else if (inst.srcType != DataType::Reg)
+		emitter.movImmediate(RAX, inst.immediate);
+	else
+		emitter.zeroExtend(RAX, vmRegister(inst.srcReg), size);
+}
+
+void JitCompiler::emitStoreDestination(const Instruction& inst, X64Register value, unsigned int size) {
+	if (inst.isDstMem)
+		emitter.store(MEMORY, RDI, value, size);
+	else
+		emitStoreRegister(vmRegister(inst.dstReg), value, size);
+}
+
+void JitCompiler::emitStoreRegister(X64Register reg, X64Register value, unsigned int size) {
+	switch (size) {
+	case 8:
+		if (reg != value)
+			emitter.mov(reg, value);
+		break;
+	case 4:
+		// 32 bit writes would zero the upper bits of the host register
+		emitter.mov32(value, value);
+		emitter.shiftImmediate(ShiftRight, reg, 32);
+		emitter.shiftImmediate(ShiftLeft, reg, 32);
+		emitter.alu(AluOr, reg, value);
+		break;
+	default:
+		emitter.movNarrow(reg, value, size);
+	}
+}
+
+void JitCompiler::emitFlags() {
+	// mov does not change the host flags
+	emitter.movImmediate(FLAGS, SMALLER_FLAG);
+	emitter.movImmediate(RCX, GREATER_FLAG);
+	emitter.cmov(Above, FLAGS, RCX);
+	emitter.movImmediate(RCX, ZERO_FLAG);
+	emitter.cmov(Equal, FLAGS, RCX);
+}
+
+bool JitCompiler::compileInstruction(const Instruction& inst, uint64_t offset) {
+	const unsigned int size = 1 << inst.srcSize;
+	const bool isImmediate = inst.srcType != DataType::Reg;
+	// Immediate values are zero extended to the whole destination register
+	const unsigned int dstSize = (isImmediate && !inst.isDstMem) ? sizeof(uint64_t) : size;
+	const X64Register dst = vmRegister(inst.dstReg);
+	const X64Register src = vmRegister(inst.srcReg);
+	const uint64_t nextOffset = offset + inst.instructionSize;
+	const bool hostCondition = usesHostFlags(inst);
+	hostFlags = false;
+
+	switch (inst.opcode) {
+	case Opcodes::Mov:
+	case Opcodes::Add:
+	case Opcodes::Sub:
+	case Opcodes::And:
+	case Opcodes::Or:
+	case Opcodes::Xor:
+	case Opcodes::Sar:
+	case Opcodes::Sal:
+	case Opcodes::Mul:
+	case Opcodes::Div:
+	case Opcodes::Mod: {
+		emitOperandChecks(inst, offset, true, false);
+		const X64Alu alu[] = { AluAdd, AluAdd, AluSub, AluAnd, AluOr, AluXor };
+		// Whole register operands map directly to a host instruction
+		if (!inst.isDstMem && !inst.isSrcMem && dstSize == sizeof(uint64_t) && inst.opcode != Opcodes::Div && inst.opcode != Opcodes::Mod) {
+			bool fitsImmediate = isImmediate && inst.immediate <= INT32_MAX && inst.opcode != Opcodes::Mul;
+			X64Register value = src;
+			if (isImmediate && !fitsImmediate && inst.opcode != Opcodes::Mov && inst.opcode != Opcodes::Sar && inst.opcode != Opcodes::Sal) {
+				emitter.movImmediate(RAX, inst.immediate);
+				value = RAX;
+			}
+			switch (inst.opcode) {
+			case Opcodes::Mov:
+				if (isImmediate)
+					emitter.movImmediate(dst, inst.immediate);
+				else
+					emitter.mov(dst, src);
+				break;
+			case Opcodes::Sar:
+			case Opcodes::Sal:
+				if (isImmediate) {
+					emitter.shiftImmediate(inst.opcode == Opcodes::Sar ? ShiftRight : ShiftLeft, dst, static_cast<uint8_t>(inst.immediate));
+				}
+				else {
+					emitter.mov(RCX, src);
+					emitter.shift(inst.opcode == Opcodes::Sar ? ShiftRight : ShiftLeft, dst, true);
+				}
+				break;
+			case Opcodes::Mul:
+				emitter.imul(dst, value);
+				break;
+			default:
+				if (fitsImmediate)
+					emitter.aluImmediate(alu[inst.opcode], dst, static_cast<int32_t>(inst.immediate));
+				else
+					emitter.alu(alu[inst.opcode], dst, value);
+			}
+			break;
+		}
+		emitLoadSource(inst);
+		if (inst.opcode == Opcodes::Mov) {
+			emitStoreDestination(inst, RAX, dstSize);
+			break;
+		}
+		if (inst.isDstMem)
+			emitter.load(RDX, MEMORY, RDI, dstSize);
+		else
+			emitter.zeroExtend(RDX, dst, dstSize);
+		switch (inst.opcode) {
+		case Opcodes::Sar:
+		case Opcodes::Sal:
+			// Values smaller than 64 bits are shifted as 32 bit integers like in the interpreter
+			emitter.mov(RCX, RAX);
+			emitter.shift(inst.opcode == Opcodes::Sar ? ShiftRight : ShiftLeft, RDX, dstSize == sizeof(uint64_t));
+			break;
+		case Opcodes::Mul:
+			emitter.imul(RDX, RAX);
+			break;
+		case Opcodes::Div:
+		case Opcodes::Mod:
+			emitter.mov(RCX, RAX);
+			emitter.mov(RAX, RDX);
+			emitter.alu(AluXor, RDX, RDX);
+			emitter.div(RCX);
+			if (inst.opcode == Opcodes::Div)
+				emitter.mov(RDX, RAX);
+			break;
+		default:
+			emitter.alu(alu[inst.opcode], RDX, RAX);
+		}
+		emitStoreDestination(inst, RDX, dstSize);
+		break;
+	}
+	case Opcodes::Cmp:
+		emitOperandChecks(inst, offset, false, false);
+		// Values are compared at the source size
+		if (!inst.isDstMem && !inst.isSrcMem && size == sizeof(uint64_t)) {
+			if (isImmediate && inst.immediate <= INT32_MAX) {
+				emitter.aluImmediate(AluCmp, dst, static_cast<int32_t>(inst.immediate));
+			}
+			else {
+				emitLoadSource(inst);
+				emitter.alu(AluCmp, dst, RAX);
+			}
+		}
+		else {
+			emitLoadSource(inst);
+			if (inst.isDstMem)
+				emitter.load(RDX, MEMORY, RDI, size);
+			else
+				emitter.zeroExtend(RDX, dst, size);
+			emitter.alu(AluCmp, RDX, RAX);
+		}
+		emitFlags();
+		hostFlags = true;
+		break;
+	case Opcodes::Jz:
+	case Opcodes::Jnz:
+	case Opcodes::Jg:
+	case Opcodes::Js:
+	case Opcodes::Jmp: {
+		emitOperandChecks(inst, offset, false, false);
+		bool conditional = inst.opcode != Opcodes::Jmp;
+		X64Condition taken = Equal;
+		if (conditional) {
+			if (hostCondition) {
+				const X64Condition conditions[] = { Equal, NotEqual, Above, Below };
+				taken = conditions[inst.opcode - Opcodes::Jz];
+			}
+			else {
+				const uint8_t masks[] = { ZERO_FLAG, ZERO_FLAG, GREATER_FLAG, SMALLER_FLAG };
+				emitter.test32Immediate(FLAGS, masks[inst.opcode - Opcodes::Jz]);
+				taken = (inst.opcode == Opcodes::Jnz) ? Equal : NotEqual;
+			}
+		}
+		// Conditional jumps keep the host flags for the instructions that follow
+		hostFlags = conditional && hostCondition;
+		if (isImmediate && !inst.isSrcMem) {
+			emitJump(conditional ? &taken : nullptr, offset + jumpOffset(inst));
+			return conditional;
+		}
+		// Jump target is known only at runtime
+		uint8_t* notTaken = conditional ? emitter.jcc(static_cast<X64Condition>(taken ^ 1)) : nullptr;
+		emitLoadSource(inst);
+		emitter.signExtend(RAX, RAX, size);
+		emitter.movImmediate(RDX, offset);
+		emitter.alu(AluAdd, RAX, RDX);
+		emitter.jmp(dispatchRoutine);
+		if (notTaken) {
+			X64Emitter::patch(notTaken, emitter.position());
+		}
+		return conditional;
+	}
+	case Opcodes::Inc:
+	case Opcodes::Dec:
+		emitOperandChecks(inst, offset, false, true);
+		if (inst.isSrcMem) {
+			emitter.load(RAX, MEMORY, RCX, size);
+			(inst.opcode == Opcodes::Inc) ? emitter.inc(RAX) : emitter.dec(RAX);
+			emitter.store(MEMORY, RCX, RAX, size);
+		}
+		else if (!isImmediate) {
+			if (size == sizeof(uint64_t)) {
+				(inst.opcode == Opcodes::Inc) ? emitter.inc(src) : emitter.dec(src);
+			}
+			else {
+				emitter.zeroExtend(RAX, src, size);
+				(inst.opcode == Opcodes::Inc) ? emitter.inc(RAX) : emitter.dec(RAX);
+				emitStoreRegister(src, RAX, size);
+			}
+		}
+		// Incrementing an immediate value has no effect
+		break;
+	case Opcodes::Call:
+		emitOperandChecks(inst, offset, false, false);
+		// Push the return address. A full stack is grown by the interpreter which also handles pushes in to the code pages
+		emitter.aluMemory(AluCmp, STACK_POINTER, CONTEXT, offsetof(JitContext, accessLimit));
+		emitFallback(Above, offset);
+		emitter.aluMemory(AluCmp, STACK_POINTER, CONTEXT, offsetof(JitContext, codeSize));
+		emitFallback(Below, offset);
+		emitter.movImmediate(RDX, nextOffset);
+		emitter.store(MEMORY, STACK_POINTER, RDX, sizeof(uint64_t));
+		emitter.aluImmediate(AluAdd, STACK_POINTER, sizeof(uint64_t));
+		if (isImmediate && !inst.isSrcMem) {
+			emitJump(nullptr, offset + jumpOffset(inst));
+		}
+		else {
+			emitLoadSource(inst);
+			emitter.signExtend(RAX, RAX, size);
+			emitter.movImmediate(RDX, offset);
+			emitter.alu(AluAdd, RAX, RDX);
+			emitter.jmp(dispatchRoutine);
+		}
+		return false;
+	case Opcodes::Ret:
+		// Pop the return address with the same check as NanoVM::pop(). A stack pointer below 8 wraps around above the limit
+		emitter.mov(RAX, STACK_POINTER);
+		emitter.aluImmediate(AluSub, RAX, sizeof(uint64_t));
+		emitter.aluMemory(AluCmp, RAX, CONTEXT, offsetof(JitContext, codeSize));
+		emitFallback(Below, offset);
+		emitter.aluMemory(AluCmp, RAX, CONTEXT, offsetof(JitContext, accessLimit));
+		emitFallback(Above, offset);
+		emitter.mov(STACK_POINTER, RAX);
+		emitter.load(RAX, MEMORY, RAX, sizeof(uint64_t));
+		emitter.jmp(dispatchRoutine);
+		return false;
+	case Opcodes::Push:
+		emitOperandChecks(inst, offset, false, false);
+		emitter.aluMemory(AluCmp, STACK_POINTER, CONTEXT, offsetof(JitContext, accessLimit));
+		emitFallback(Above, offset);
+		emitter.aluMemory(AluCmp, STACK_POINTER, CONTEXT, offsetof(JitContext, codeSize));
+		emitFallback(Below, offset);
+		emitLoadSource(inst);
+		emitter.store(MEMORY, STACK_POINTER, RAX, size);
+		emitter.aluImmediate(AluAdd, STACK_POINTER, size);
+		break;
+	case Opcodes::Pop:
+		// Pop stores to the destination register like the interpreter
+		emitOperandChecks(inst, offset, true, false);
+		emitter.mov(RAX, STACK_POINTER);
+		// Same check as NanoVM::pop(). A stack pointer below the size of the value wraps around above the limit
+		emitter.aluImmediate(AluSub, RAX, size);
+		emitter.aluMemory(AluCmp, RAX, CONTEXT, offsetof(JitContext, codeSize));
+		emitFallback(Below, offset);
+		emitter.aluMemory(AluCmp, RAX, CONTEXT, offsetof(JitContext, accessLimit));
+		emitFallback(Above, offset);
+		emitter.mov(STACK_POINTER, RAX);
+		emitter.load(RDX, MEMORY, RAX, size);
+		emitStoreDestination(inst, RDX, size);
+		break;
+	case Opcodes::Halt:
+		emitter.movImmediate(RAX, offset);
+		emitter.jmp(haltRoutine);
+		return false;
+	}
+	return true;
+}
+
+#else
+
+JitCompiler::JitCompiler(NanoVM& vm) : vm(vm), code(nullptr), codeCapacity(0), emitter(nullptr, 0) {}
+JitCompiler::~JitCompiler() {}
+bool JitCompiler::isValid() const { return false; }
+uint8_t* JitCompiler::block(uint64_t offset) { return nullptr; }
+JitExit JitCompiler::enter(uint8_t* block) { return JitExit::Fallback; }
+void JitCompiler::invalidate(uint64_t offset, uint64_t size) {}
+
+#endif // NANOVM_JIT
+
+uint64_t NanoVM::runJit() {
+	if (!jit) {
+		jit.reset(new JitCompiler(*this));
+	}
+	// Hosts without JIT support run the threaded engine
+	if (!jit->isValid()) {
+		return (memoryMode == MemoryMode::Guarded) ? runGuarded(ExecutionMode::Threaded) : runThreaded<false>();
+	}
+	while (true) {
+		uint64_t offset = cpu.registers[ip];
+		if (offset >= cpu.codeSize) {
+			reportIpOutOfBounds();
+			return 3;
+		}
+		uint8_t* block = jit->block(offset);
+		if (block) {
+			JitExit exit = jit->enter(block);
+			if (exit == JitExit::Halt) {
+				return cpu.registers[Reg0];
+			}
+			if (exit == JitExit::Dispatch) {
+				continue;
+			}
+			offset = cpu.registers[ip];
+		}
+		// Instructions the compiled code could not execute are executed with the interpreter
+		Instruction& inst = instructionCache[offset];
+		if (!inst.instructionSize) {
+			decode(offset, inst);
+		}
+		if (inst.opcode == Halt) {
+			return cpu.registers[Reg0];
+		}
+		if (!execute(inst)) {
+			switch (errorFlag) {
+			case MEMORY_ACCESS:
+				return 1;
+			default:
+				return 2;
+			}
+		}
+	}
+}
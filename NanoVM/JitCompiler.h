@@ -0,0 +1,181 @@
+#pragma once
+#include "NanoVM.h"
+#include "X64Emitter.h"
+#include <vector>
+
+#if (defined(__x86_64__) || defined(_M_X64)) && !defined(NANOVM_NO_JIT)
+#define NANOVM_JIT
+#endif
+
+/**
+ * JitExit defines why the compiled code returned to the VM
+*/
+enum class JitExit : uint32_t {
+	Halt, /**< Halt instruction was executed. IP points to the halt instruction */
+	Dispatch, /**< Jumped to an offset that has not been compiled yet. IP points to the jump target */
+	Fallback /**< Instruction has to be executed by the interpreter. IP points to the instruction */
+};
+
+/**
+ * JitContext holds the state the compiled code needs while running. Pointer to it is kept in RBP
+*/
+struct JitContext {
+	uint64_t* registers; /**< Registers of the VM. The compiled code keeps them in host registers while running */
+	unsigned char* memory; /**< Base of the VM memory */
+	uint8_t* const* blocks; /**< Compiled blocks indexed by their offset in the code pages */
+	uint64_t codeSize; /**< Size of the code pages */
+	uint64_t accessLimit; /**< Highest offset where an access of any size fits in the memory. Accesses above it are
+	                           left to the interpreter which checks them exactly and grows the stack */
+	uint64_t exitIp; /**< IP to continue from when the compiled code returns */
+};
+
+/**
+ * \brief JitCompiler translates NanoVM bytecode to native x86-64 code
+ *
+ * JitCompiler compiles the bytecode lazily one block at a time. A block starts from the offset where the execution entered it
+ * and continues over conditional jumps until an unconditional jump, call, ret, halt or an instruction the compiler does not
+ * support. Jumps inside the block are native jumps, jumps out of the block are dispatched through a table of compiled blocks
+ * without returning to the VM. VM registers Reg0 - esp are kept in host registers R8 - R15 while running.
+ * Memory operands and the stack are bounds checked against the current size of the memory. Instructions that would fail
+ * the check, grow the stack or write to the code pages return to the VM which executes them with the interpreter.
+*/
+class JitCompiler {
+public:
+	/**
+	 * Initializes the compiler and allocates executable memory for the compiled code
+	 * @param vm VM whose bytecode is compiled
+	*/
+	JitCompiler(NanoVM& vm);
+
+	/**
+	 * JitCompiler destructor. Frees the compiled code
+	*/
+	~JitCompiler();
+
+	/**
+	 * @return True if the compiler could allocate executable memory
+	*/
+	bool isValid() const;
+
+	/**
+	 * Returns the compiled block starting from the given offset and compiles it if needed
+	 * @param offset Offset of the first instruction of the block
+	 * @return Entry of the compiled block, nullptr if the instruction at the offset can not be compiled
+	*/
+	uint8_t* block(uint64_t offset);
+
+	/**
+	 * Runs compiled code until it returns to the VM. The VM registers are up to date when this returns
+	 * @param block Entry of the block to run
+	 * @return Reason for returning to the VM
+	*/
+	JitExit enter(uint8_t* block);
+
+	/**
+	 * Discards the compiled blocks that were compiled from the given memory range. Called when the VM writes to code pages
+	 * @param offset Offset of the first written byte in the VM memory
+	 * @param size Number of bytes written
+	*/
+	void invalidate(uint64_t offset, uint64_t size);
+private:
+	/**
+	 * JitBlock holds the range of bytecode a block was compiled from
+	*/
+	struct JitBlock {
+		uint64_t start; /**< Offset of the first instruction */
+		uint64_t end; /**< Offset after the last instruction */
+	};
+
+	/**
+	 * Jump out of the block that is not known yet when the jump is emitted
+	*/
+	struct PendingJump {
+		uint8_t* offset; /**< Position of the relative offset to be patched */
+		uint64_t target; /**< Target offset in the VM memory */
+	};
+
+	/**
+	 * Writes the entry and exit routines shared by all blocks to the beginning of the code memory
+	*/
+	void emitRoutines();
+
+	/**
+	 * Discards all compiled blocks. Used when the code memory is full
+	*/
+	void flush();
+
+	/**
+	 * Compiles the block starting from the given offset
+	 * @return Entry of the compiled block, nullptr if the first instruction can not be compiled
+	*/
+	uint8_t* compile(uint64_t offset);
+
+	/**
+	 * Compiles a single instruction
+	 * @param inst Instruction to compile
+	 * @param offset Offset of the instruction
+	 * @return True if the block continues after the instruction, false if the instruction ends the block
+	*/
+	bool compileInstruction(const Instruction& inst, uint64_t offset);
+
+	/**
+	 * Emits the bounds checks of the memory operands. Leaves the destination address in RDI and source address in RCX
+	*/
+	void emitOperandChecks(const Instruction& inst, uint64_t offset, bool writesDestination, bool writesSource);
+
+	/**
+	 * Emits a jump to the interpreter fallback of the instruction if the condition is true
+	*/
+	void emitFallback(X64Condition condition, uint64_t offset);
+
+	/**
+	 * Emits a jump to the given offset. Jumps to code already in this block are native jumps
+	 * @param condition Condition of the jump, nullptr for unconditional jump
+	*/
+	void emitJump(const X64Condition* condition, uint64_t target);
+
+	/**
+	 * Loads the source value zero extended to the source size in to RAX
+	*/
+	void emitLoadSource(const Instruction& inst);
+
+	/**
+	 * Stores the value of the given register to the destination operand
+	 * @param size Number of bytes to store. Register destinations keep their other bytes
+	*/
+	void emitStoreDestination(const Instruction& inst, X64Register value, unsigned int size);
+
+	/**
+	 * Stores the low bytes of value to a VM register keeping the other bytes of the register
+	*/
+	void emitStoreRegister(X64Register reg, X64Register value, unsigned int size);
+
+	/**
+	 * Updates the VM flags from the host flags set by a compare
+	*/
+	void emitFlags();
+
+	/**
+	 * @return True if the instruction is a conditional jump that can use the host flags set by the previous compare
+	*/
+	bool usesHostFlags(const Instruction& inst) const;
+
+	NanoVM& vm; /**< VM whose bytecode is compiled */
+	uint8_t* code; /**< Memory for the compiled code. Executable except while a block is compiled to it */
+	size_t codeCapacity; /**< Size of the executable memory */
+	X64Emitter emitter; /**< Emitter writing to the executable memory */
+	uint8_t* routinesEnd; /**< Position after the shared routines where the blocks begin */
+	uint8_t* enterRoutine; /**< Loads the VM registers and jumps to a block */
+	uint8_t* dispatchRoutine; /**< Jumps to the block at the offset in RAX or returns to the VM */
+	uint8_t* fallbackRoutine; /**< Returns to the VM to interpret the instruction at the offset in RAX */
+	uint8_t* haltRoutine; /**< Returns to the VM after halt at the offset in RAX */
+	std::vector<uint8_t*> blocks; /**< Entries of the compiled blocks indexed by their offset */
+	std::vector<JitBlock> compiledBlocks; /**< Bytecode ranges of the compiled blocks */
+	JitContext context; /**< State passed to the compiled code */
+
+	// State of the block being compiled
+	std::vector<std::pair<uint64_t, uint8_t*>> nativeOffsets; /**< Native code of the instructions compiled to the block */
+	std::vector<PendingJump> pendingJumps; /**< Jumps to instructions not compiled yet */
+	std::vector<PendingJump> fallbacks; /**< Jumps to the interpreter fallbacks */
+	bool hostFlags; /**< Do the host flags hold the result of the previous compare */
+};
@@ -1,12 +1,96 @@
 #include "NanoVM.h"
+#include "BatchRunner.h"
+#include <sstream>
+
+/**
+ * Reads the inputs of the batch jobs. Each line holds the values of reg0 - reg5 separated by whitespace
+ * @param fileName File to read
+ * @param[out] inputs Inputs of each line
+ * @return True if the file could be read
+*/
+static bool readInputs(const std::string& fileName, std::vector<std::array<uint64_t, 6>>& inputs) {
+	std::ifstream file(fileName);
+	if (!file.is_open()) {
+		std::cout << "Unable to open file " << fileName << std::endl;
+		return false;
+	}
+	std::string line;
+	while (std::getline(file, line)) {
+		std::istringstream values(line);
+		std::array<uint64_t, 6> registers = {};
+		for (size_t i = 0; i < registers.size() && values >> registers[i]; i++);
+		inputs.push_back(registers);
+	}
+	return true;
+}
+
+/**
+ * Runs every program once for every input line and prints the output of each job followed by the exit code counts
+ * @return 0 if every job returned 0, 1 otherwise
+*/
+static int runBatch(int argc, char* argv[]) {
+	unsigned int threads = 0;
+	std::vector<std::array<uint64_t, 6>> inputs;
+	std::vector<std::string> files;
+	for (int i = 2; i < argc; i++) {
+		std::string argument = argv[i];
+		if (argument == "-j" && i + 1 < argc) {
+			threads = std::stoul(argv[++i]);
+		}
+		else if (argument == "--inputs" && i + 1 < argc) {
+			if (!readInputs(argv[++i], inputs)) {
+				return 1;
+			}
+		}
+		else {
+			files.push_back(argument);
+		}
+	}
+	if (inputs.empty()) {
+		inputs.push_back({});
+	}
+	std::vector<BatchJob> jobs;
+	for (const std::string& file : files) {
+		// Each program is loaded once and shared by all of its jobs
+		std::shared_ptr<const NanoProgram> program = std::make_shared<NanoProgram>(file);
+		for (const auto& registers : inputs) {
+			jobs.push_back({ program, registers });
+		}
+	}
+	BatchReport report = BatchRunner(threads).Run(jobs);
+	for (size_t i = 0; i < jobs.size(); i++) {
+		std::cout << "== " << files[i / inputs.size()] << " input " << (i % inputs.size()) << ": exit " << report.results[i].exitCode << std::endl;
+		std::cout << report.results[i].output;
+		if (!report.results[i].output.empty() && report.results[i].output.back() != '\n') {
+			std::cout << std::endl;
+		}
+	}
+	for (const auto& exitCode : report.exitCodes) {
+		std::cout << "Exit code " << exitCode.first << ": " << exitCode.second << " jobs" << std::endl;
+	}
+	return (report.exitCodes.size() > report.exitCodes.count(0)) ? 1 : 0;
+}
 
 int main(int argc, char* argv[])
 {
 	if (argc <= 1) {
-		std::cout << "Usage NanoVM.exe [FILE]" << std::endl;
+		std::cout << "Usage NanoVM.exe [--trace TRACE] [FILE]" << std::endl;
+		std::cout << "      NanoVM.exe --batch [-j THREADS] [--inputs FILE] FILE..." << std::endl;
 		return 0;
 	}
+	if (std::string(argv[1]) == "--batch") {
+		return runBatch(argc, argv);
+	}
+	// The execution trace can be replayed with NanoReplay
+	if (std::string(argv[1]) == "--trace" && argc > 3) {
+		NanoVM vm(argv[3]);
+		if (!vm.StartTrace(argv[2])) {
+			std::cout << "Unable to create the trace " << argv[2] << std::endl;
+			return 1;
+		}
+		return vm.Run();
+	}
 	NanoVM vm(argv[1]);
 	// Return the VM's exit code
 	return vm.Run();
-}
\ No newline at end of file
+}
@@ -0,0 +1,331 @@
+#include "NanoProgram.h"
+
+#ifdef NANOVM_MAPPED_FILES
+#include <sys/mman.h>
+#include <fcntl.h>
+#include <unistd.h>
+#endif
+
+NanoProgram::NanoProgram(const unsigned char* code, uint64_t size) :
+	memory(nullptr), mapping(nullptr), mappingSize(0), mappedFile(-1), mappedOffset(0), checksum(0), deferred(false) {
+	initialize(size, size, 0);
+	load(code);
+	predecode();
+}
+
+/**
+ * @return True if the header describes sections that fill the rest of the file
+*/
+static bool isValidHeader(const NanocHeader& header, uint64_t fileSize) {
+	return header.version == NANOC_VERSION && header.headerSize == sizeof(NanocHeader) &&
+		header.codeOffset >= sizeof(NanocHeader) && header.codeOffset % NANOC_SECTION_ALIGNMENT == 0 &&
+		header.codeOffset <= fileSize && header.codeSize <= fileSize - header.codeOffset &&
+		header.dataOffset == header.codeOffset + header.codeSize && header.dataSize == fileSize - header.dataOffset &&
+		(header.entryOffset < header.codeSize || (!header.codeSize && !header.entryOffset));
+}
+
+NanoProgram::NanoProgram(std::string fileName) :
+	memory(nullptr), mapping(nullptr), mappingSize(0), mappedFile(-1), mappedOffset(0), checksum(0), deferred(false) {
+	std::ifstream file(fileName, std::ios::in | std::ios::binary | std::ios::ate);
+	if (!file.is_open()) {
+		std::cout << "Unable to open file";
+		initialize(0, 0, 0);
+		load(nullptr);
+		predecode();
+		return;
+	}
+	uint64_t fileSize = static_cast<uint64_t>(file.tellg());
+	file.seekg(0, std::ios::beg);
+	NanocHeader header;
+	if (fileSize < sizeof(header) || !file.read(reinterpret_cast<char*>(&header), sizeof(header)) ||
+		memcmp(header.magic, NANOC_MAGIC, sizeof(header.magic))) {
+		// Files without the container are raw bytecode
+		std::vector<unsigned char> bytecode(static_cast<size_t>(fileSize));
+		file.clear();
+		file.seekg(0, std::ios::beg);
+		file.read(reinterpret_cast<char*>(bytecode.data()), bytecode.size());
+		initialize(fileSize, fileSize, 0);
+		load(bytecode.data());
+		predecode();
+		return;
+	}
+	if (!isValidHeader(header, fileSize)) {
+		std::cout << "Unsupported or corrupted program file " << fileName << std::endl;
+		initialize(0, 0, 0);
+		load(nullptr);
+		predecode();
+		return;
+	}
+	initialize(header.codeSize + header.dataSize, header.codeSize, header.entryOffset);
+	if (!map(fileName, header.codeOffset)) {
+		std::vector<unsigned char> bytecode(static_cast<size_t>(bytecodeSize));
+		file.seekg(header.codeOffset, std::ios::beg);
+		file.read(reinterpret_cast<char*>(bytecode.data()), bytecode.size());
+		load(bytecode.data());
+	}
+	file.close();
+	// Decoding the instructions or calculating the checksum would read every page of the file. The VMs decode the
+	// instructions they execute and IsValid() verifies the program when it is first called
+	checksum = header.checksum;
+	deferred = true;
+	valid = false;
+}
+
+NanoProgram::~NanoProgram() {
+#ifdef NANOVM_MAPPED_FILES
+	if (mapping) {
+		munmap(mapping, mappingSize);
+	}
+	if (mappedFile >= 0) {
+		close(mappedFile);
+	}
+#endif
+}
+
+bool NanoProgram::IsValid() const {
+	if (deferred) {
+		std::call_once(verification, [this]() { valid = verify(); });
+	}
+	return valid;
+}
+
+bool NanoProgram::verify() const {
+	Instruction inst;
+	uint64_t offset = 0;
+	bool entryFound = false;
+	while (offset < codeSectionSize) {
+		decode(memory, codeSize, offset, inst);
+		entryFound = entryFound || offset == entryOffset;
+		offset += inst.instructionSize;
+	}
+	return codeSectionSize && offset == codeSectionSize && entryFound && nanocChecksum(memory, bytecodeSize) == checksum;
+}
+
+void NanoProgram::initialize(uint64_t size, uint64_t codeSectionSize, uint64_t entryOffset) {
+	bytecodeSize = size;
+	this->codeSectionSize = codeSectionSize;
+	this->entryOffset = entryOffset;
+	codeSize = (NANOVM_PAGE_SIZE * (1 + (size / NANOVM_PAGE_SIZE)));
+}
+
+void NanoProgram::load(const unsigned char* code) {
+	// Padding for instruction fetching which might read more bytes than the instruction size
+	storage.assign(codeSize + MAX_INSTRUCTION_SIZE, 0x00);
+	if (bytecodeSize) {
+		memcpy(storage.data(), code, bytecodeSize);
+	}
+	memory = storage.data();
+}
+
+bool NanoProgram::map(const std::string& fileName, uint64_t offset) {
+#ifdef NANOVM_MAPPED_FILES
+	long hostPageSize = sysconf(_SC_PAGESIZE);
+	// The file is mapped in whole host pages so the bytecode has to start at one
+	if (!bytecodeSize || hostPageSize <= 0 || offset % static_cast<uint64_t>(hostPageSize)) {
+		return false;
+	}
+	int file = open(fileName.c_str(), O_RDONLY | O_CLOEXEC);
+	if (file < 0) {
+		return false;
+	}
+	// Zero pages cover the code pages and the padding and the file is mapped over their beginning. The file ends with
+	// the bytecode so the rest of its last page reads as zero
+	uint64_t size = (codeSize + MAX_INSTRUCTION_SIZE + hostPageSize - 1) / hostPageSize * hostPageSize;
+	void* pages = mmap(nullptr, size, PROT_READ, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+	if (pages == MAP_FAILED) {
+		close(file);
+		return false;
+	}
+	if (mmap(pages, bytecodeSize, PROT_READ, MAP_PRIVATE | MAP_FIXED, file, static_cast<off_t>(offset)) == MAP_FAILED) {
+		munmap(pages, size);
+		close(file);
+		return false;
+	}
+	mapping = static_cast<unsigned char*>(pages);
+	mappingSize = size;
+	mappedFile = file;
+	mappedOffset = offset;
+	memory = mapping;
+	return true;
+#else
+	return false;
+#endif
+}
+
+void NanoProgram::predecode() {
+	instructions.assign(codeSize, Instruction());
+	uint64_t offset = 0;
+	while (offset < codeSectionSize) {
+		Instruction& inst = instructions[offset];
+		decode(memory, codeSize, offset, inst);
+		offset += inst.instructionSize;
+	}
+	// The last instruction must end where the code section ends and the entry has to be one of the instructions
+	valid = codeSectionSize && offset == codeSectionSize && instructions[entryOffset].instructionSize;
+	fusedInstructions = instructions;
+	fuse();
+}
+
+/**
+ * Decodes a vector instruction following EXTENDED_PREFIX
+ * @param value First 8 bytes of the instruction
+ * @param[out] inst Instruction to be updated
+ * @return True if the instruction is a vector instruction. Undefined vector opcodes decode as memcpy with destination register 7
+*/
+static bool decodeVector(uint64_t value, Instruction& inst) {
+	unsigned char vectorOpcode = (value >> 8) & 0xFF;
+	unsigned char registers = (value >> 16) & 0xFF;
+	unsigned int opcode = vectorOpcode & VECTOR_OPCODE_MASK;
+	if ((value & 0xFF) != EXTENDED_PREFIX || opcode > VStore || (vectorOpcode & VECTOR_RESERVED_MASK)) {
+		return false;
+	}
+	bool wide = (vectorOpcode & VECTOR_WIDE_MASK) != 0;
+	inst.opcode = static_cast<unsigned char>(VECTOR_OPCODE_BASE + opcode);
+	inst.dstReg = registers & VECTOR_REG_MASK;
+	inst.srcReg = (registers >> 3) & VECTOR_REG_MASK;
+	inst.srcType = DataType::Reg;
+	inst.srcSize = (vectorOpcode & VECTOR_LANE_MASK) >> 4;
+	inst.isDstMem = opcode == VStore;
+	inst.isSrcMem = opcode == VLoad;
+	inst.immediate = wide ? VECTOR_REGISTER_SIZE : VECTOR_REGISTER_SIZE / 2;
+	inst.instructionSize = VECTOR_INSTRUCTION_SIZE;
+	inst.fusedSize = 0;
+	inst.branchOffset = 0;
+	inst.handler = vectorIndex(opcode, inst.srcSize, wide);
+	return true;
+}
+
+bool NanoProgram::decode(const unsigned char* code, uint64_t codeSize, uint64_t offset, Instruction &inst) {
+	// Read 64bit to try and minimize the required memory reading
+	// This increases the performance
+	if (offset >= codeSize) {
+		return false;
+	}
+	// Parse the instruction
+	const unsigned char* rawIp = code + offset;
+	uint64_t value = *reinterpret_cast<const uint64_t*>(rawIp);
+	if (decodeVector(value, inst)) {
+		return true;
+	}
+	inst.opcode   =  (value & (unsigned char)OPCODE_MASK);
+	inst.dstReg   =  ((value & DST_REG_MASK) >> 5);
+	// Instructions without operands are a single byte. The next byte belongs to the following instruction
+	bool hasOperands = inst.opcode != Opcodes::Halt && inst.opcode != Opcodes::Ret;
+	if (!hasOperands) {
+		value &= 0xFF;
+	}
+	inst.srcType  =  (value >> 8) & SRC_TYPE_MASK;
+	inst.srcReg   =   (value >> 8) & SRC_REG_MASK;
+	inst.srcSize  =  ((value >> 8) & SRC_SIZE_MASK) >> 5;
+	inst.isDstMem =  ((value >> 8) & DST_MEM_MASK);
+	inst.isSrcMem =  ((value >> 8) & SRC_MEM_MASK);
+	inst.handler  =  handlerIndex(inst.opcode, inst.srcSize, inst.isDstMem, inst.isSrcMem, inst.srcType != DataType::Reg);
+	inst.fusedSize = 0;
+	inst.branchOffset = 0;
+	// If source is immediate value, read it to the instruction struct
+	if (inst.srcType) {
+		// If the immediate value fit in the initial value. Parse it with bitshift. It is faster than reading memory again
+		switch (inst.srcSize) {
+		case Byte:
+			inst.immediate = (uint8_t)(value >> 16);
+			inst.instructionSize = 3;
+			break;
+		case Short:
+			inst.immediate = (uint16_t)(value >> 16);
+			inst.instructionSize = 4;
+			break;
+		case Dword:
+			inst.immediate = (uint32_t)(value >> 16);
+			inst.instructionSize = 6;
+			break;
+		case Qword:
+			// In the case of qword we have to perform another read operations
+			inst.immediate = *(const uint64_t*)(rawIp + 2);
+			inst.instructionSize = 10;
+			break;
+		}
+	}
+	else {
+		inst.instructionSize = hasOperands ? 2 : 1;
+	}
+	return true;
+}
+
+/**
+ * @return True if the instruction operates only on registers and immediate values. Register sources must be 64 bits
+*/
+static bool isRegisterOperation(const Instruction& inst) {
+	return !inst.isDstMem && !inst.isSrcMem && (inst.srcType != DataType::Reg || inst.srcSize == Size::Qword);
+}
+
+/**
+ * @return True if the instruction is a conditional jump to an immediate offset which can end a fused sequence
+*/
+static bool isFusableBranch(const Instruction& inst) {
+	return inst.opcode >= Opcodes::Jz && inst.opcode <= Opcodes::Js && inst.srcType != DataType::Reg && !inst.isSrcMem;
+}
+
+/**
+ * @return Jump offset of the branch instruction sign extended from the immediate size
+*/
+static int64_t branchOffset(const Instruction& inst) {
+	switch (inst.srcSize) {
+	case Byte:
+		return static_cast<int8_t>(inst.immediate);
+	case Short:
+		return static_cast<int16_t>(inst.immediate);
+	case Dword:
+		return static_cast<int32_t>(inst.immediate);
+	default:
+		return static_cast<int64_t>(inst.immediate);
+	}
+}
+
+void NanoProgram::fuse() {
+	uint64_t offset = 0;
+	while (offset < codeSectionSize) {
+		fuse(fusedInstructions.data(), codeSize, offset);
+		offset += fusedInstructions[offset].instructionSize;
+	}
+}
+
+void NanoProgram::fuse(Instruction* cache, uint64_t codeSize, uint64_t offset) {
+	Instruction& first = cache[offset];
+	// Offsets of the following instructions relative to the first one. 0 if there is no decoded instruction
+	uint64_t second = first.instructionSize;
+	uint64_t third = 0;
+	if (offset + second >= codeSize || !cache[offset + second].instructionSize) {
+		second = 0;
+	}
+	else if (offset + second + cache[offset + second].instructionSize < codeSize) {
+		third = second + cache[offset + second].instructionSize;
+		if (!cache[offset + third].instructionSize) {
+			third = 0;
+		}
+	}
+	// Compare and branch which may be preceded by inc or dec of a register e.g. "inc reg0; cmp reg0, reg2; js loop"
+	uint64_t compare = 0;
+	uint64_t branch = second;
+	if ((first.opcode == Opcodes::Inc || first.opcode == Opcodes::Dec) && first.srcType == DataType::Reg && isRegisterOperation(first)) {
+		compare = second;
+		branch = third;
+	}
+	if ((compare || first.opcode == Opcodes::Cmp) && branch) {
+		const Instruction& compareInst = cache[offset + compare];
+		const Instruction& branchInst = cache[offset + branch];
+		// The jump offset is relative to the branch instruction
+		int64_t target = static_cast<int64_t>(branch) + branchOffset(branchInst);
+		if (compareInst.opcode == Opcodes::Cmp && isRegisterOperation(compareInst) && isFusableBranch(branchInst) &&
+			target >= INT32_MIN && target <= INT32_MAX) {
+			first.handler = compareBranchIndex(first.opcode, branchInst.opcode, compareInst.srcSize, compareInst.srcType != DataType::Reg);
+			first.fusedSize = static_cast<unsigned char>(branch + branchInst.instructionSize);
+			first.branchOffset = static_cast<int32_t>(target);
+		}
+	}
+	// Mov followed by add e.g. "mov reg2, reg4; add reg2, bp"
+	else if (second && first.opcode == Opcodes::Mov && cache[offset + second].opcode == Opcodes::Add &&
+		isRegisterOperation(first) && isRegisterOperation(cache[offset + second])) {
+		first.handler = moveAddIndex(first.srcType != DataType::Reg, cache[offset + second].srcType != DataType::Reg);
+		first.fusedSize = static_cast<unsigned char>(second + cache[offset + second].instructionSize);
+	}
+}
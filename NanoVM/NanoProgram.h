@@ -0,0 +1,129 @@
+#pragma once
+#include "NanoVM.h"
+#include "NanocFormat.h"
+#include <mutex>
+
+#if (defined(__unix__) || defined(__APPLE__)) && !defined(NANOVM_NO_MAPPED_FILES)
+#define NANOVM_MAPPED_FILES
+#endif
+
+/**
+ * \brief NanoProgram holds loaded and decoded bytecode which is shared by any number of VMs
+ *
+ * The bytecode is loaded, validated and decoded once. The program is immutable after construction so a single
+ * program can be shared between VMs running on different threads. Each VM starts from the code pages and the
+ * instruction cache of the program instead of loading and decoding the bytecode again.
+ * The sections of a .nanoc container (see NanocFormat.h) are mapped read-only from the file on POSIX hosts instead of
+ * being read so loading does not copy the file and programs loaded from the same file share the page cache. Containers
+ * are not decoded when loaded, the VMs decode the instructions they execute, and they are verified on the first IsValid()
+ * call, so loading does not read the pages of the file.
+*/
+class NanoProgram {
+	friend class NanoVM;
+public:
+	/**
+	 * Loads the program from bytecode
+	 * @param code Points to the bytecode to be loaded
+	 * @param size Holds the size of the bytecode to be loaded
+	*/
+	NanoProgram(const unsigned char* code, uint64_t size);
+
+	/**
+	 * Loads the program from a .nanoc container or a raw bytecode file
+	 * @param file File to load the bytecode from
+	*/
+	NanoProgram(std::string file);
+
+	/**
+	 * Unmaps the sections of a mapped container
+	*/
+	~NanoProgram();
+
+	NanoProgram(const NanoProgram&) = delete;
+	NanoProgram& operator=(const NanoProgram&) = delete;
+
+	/**
+	 * A program is valid if the bytecode could be loaded, is not empty, the last instruction does not run past the end of
+	 * the code section, the entry offset is at an instruction and the checksum of a container matches.
+	 * VMs run invalid programs as well, the check is for embedders that load bytecode from untrusted sources. A container is
+	 * verified when this is first called which reads the whole file. Thread safe
+	 * @return True if the program is valid
+	*/
+	bool IsValid() const;
+private:
+	/**
+	 * Sets the sizes of the program
+	 * @param size Size of the bytecode, the code section followed by the data section
+	 * @param codeSectionSize Size of the code section
+	 * @param entryOffset Offset of the first executed instruction
+	*/
+	void initialize(uint64_t size, uint64_t codeSectionSize, uint64_t entryOffset);
+
+	/**
+	 * Copies the bytecode to the code pages
+	 * @param code Points to the bytecode to be loaded. Holds bytecodeSize bytes
+	*/
+	void load(const unsigned char* code);
+
+	/**
+	 * Maps the bytecode of a container to the code pages. The file stays open so VMs can map it as well
+	 * @param fileName Container to map
+	 * @param offset File offset of the bytecode
+	 * @return True if the bytecode was mapped, false if the host or the file offset does not allow mapping it
+	*/
+	bool map(const std::string& fileName, uint64_t offset);
+
+	/**
+	 * Decodes the bytecode to the instruction caches by walking it from the beginning and fuses the instruction sequences
+	 * of the fused cache. Offsets that are not reached are left to be decoded lazily by the VM
+	*/
+	void predecode();
+
+	/**
+	 * Walks the code section of a container that was not decoded when loaded and checks its checksum
+	 * @return True if the program is valid. See IsValid()
+	*/
+	bool verify() const;
+
+	/**
+	 * Replaces the instruction sequences of the fused cache that have a fused handler with a single fused instruction.
+	 * The instructions of the sequence stay in the cache so that jumping in the middle of the sequence still works
+	*/
+	void fuse();
+
+	/**
+	 * Replaces an instruction of a cache with a single fused instruction if it starts an instruction sequence that has a
+	 * fused handler. The following instructions of the sequence have to be decoded in the cache
+	 * @param cache Instruction cache of the code pages
+	 * @param codeSize Size of the code pages
+	 * @param offset Offset of the first instruction of the sequence
+	*/
+	static void fuse(Instruction* cache, uint64_t codeSize, uint64_t offset);
+
+	/**
+	 * Decodes the instruction at the given offset. Note that decode does not check if the instruction is valid
+	 * @param code Code pages to decode from. At least MAX_INSTRUCTION_SIZE bytes must be readable at the offset
+	 * @param codeSize Size of the code pages
+	 * @param offset Offset of the instruction in the code pages
+	 * @param[out] Reference to instruction struct to be updated
+	 * @return True if instruction was decoded successfully, false if the offset is outside of the code pages
+	*/
+	static bool decode(const unsigned char* code, uint64_t codeSize, uint64_t offset, Instruction& instruction);
+
+	const unsigned char* memory; /**< Code pages with the bytecode followed by padding for the instruction fetching */
+	std::vector<unsigned char> storage; /**< Code pages when the bytecode was copied instead of mapped */
+	unsigned char* mapping; /**< Code pages when the bytecode was mapped, nullptr otherwise */
+	uint64_t mappingSize; /**< Size of the mapping */
+	int mappedFile; /**< Descriptor of the mapped container, -1 if the bytecode was not mapped */
+	uint64_t mappedOffset; /**< File offset of the mapped bytecode */
+	uint64_t bytecodeSize; /**< Size of the loaded bytecode */
+	uint64_t codeSectionSize; /**< Size of the code section at the beginning of the bytecode. The data section follows it */
+	uint64_t entryOffset; /**< Offset the VMs start running from */
+	uint64_t codeSize; /**< Size of the code pages */
+	std::vector<Instruction> instructions; /**< Decoded instructions keyed by their offset in the code pages. Empty if the VMs decode the program lazily */
+	std::vector<Instruction> fusedInstructions; /**< Decoded instructions with the common sequences fused */
+	uint64_t checksum; /**< Checksum of a container from its header */
+	bool deferred; /**< Is the program verified on the first IsValid() call instead of when it was loaded */
+	mutable std::once_flag verification; /**< Verifies a deferred program once */
+	mutable bool valid; /**< Is the program valid. See IsValid() */
+};
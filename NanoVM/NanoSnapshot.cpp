@@ -0,0 +1,63 @@
+#include "NanoSnapshot.h"
+
+#ifdef NANOVM_SHARED_SNAPSHOTS
+#include <sys/mman.h>
+#include <unistd.h>
+#endif
+
+NanoSnapshot::NanoSnapshot(std::shared_ptr<const NanoProgram> program, const NanoVMCpu& cpu, uint64_t dirtyBegin, uint64_t dirtyEnd) :
+	program(std::move(program)), cpu(cpu), memory(nullptr), mapping(nullptr), file(-1), dirtyBegin(dirtyBegin), dirtyEnd(dirtyEnd) {
+	this->cpu.codeBase = nullptr;
+	this->cpu.stackBase = nullptr;
+	uint64_t size = cpu.codeSize + cpu.stackSize;
+	if (!share(cpu.codeBase, size)) {
+		storage.assign(cpu.codeBase, cpu.codeBase + size);
+		memory = storage.data();
+	}
+}
+
+NanoSnapshot::~NanoSnapshot() {
+#ifdef NANOVM_SHARED_SNAPSHOTS
+	if (mapping) {
+		munmap(mapping, cpu.codeSize + cpu.stackSize);
+	}
+	if (file >= 0) {
+		close(file);
+	}
+#endif
+}
+
+const std::shared_ptr<const NanoProgram>& NanoSnapshot::GetProgram() const {
+	return program;
+}
+
+uint64_t NanoSnapshot::GetRegister(Register reg) const {
+	return cpu.registers[reg];
+}
+
+bool NanoSnapshot::share(const unsigned char* pages, uint64_t size) {
+#ifdef NANOVM_SHARED_SNAPSHOTS
+	int memoryFile = memfd_create("nanovm-snapshot", MFD_CLOEXEC);
+	if (memoryFile < 0) {
+		return false;
+	}
+	if (ftruncate(memoryFile, static_cast<off_t>(size))) {
+		close(memoryFile);
+		return false;
+	}
+	void* shared = mmap(nullptr, size, PROT_READ | PROT_WRITE, MAP_SHARED, memoryFile, 0);
+	if (shared == MAP_FAILED) {
+		close(memoryFile);
+		return false;
+	}
+	memcpy(shared, pages, size);
+	// The VMs map the file privately so the snapshot itself never changes
+	mprotect(shared, size, PROT_READ);
+	mapping = static_cast<unsigned char*>(shared);
+	file = memoryFile;
+	memory = mapping;
+	return true;
+#else
+	return false;
+#endif
+}
@@ -0,0 +1,64 @@
+#pragma once
+#include "NanoProgram.h"
+
+#if defined(__linux__) && !defined(NANOVM_NO_SHARED_SNAPSHOTS)
+#define NANOVM_SHARED_SNAPSHOTS
+#endif
+
+/**
+ * \brief NanoSnapshot holds the state of a VM between runs so that any number of VMs can continue from it
+ *
+ * A snapshot keeps the registers and a copy of the code pages and the stack of the VM it was taken from. The snapshot is
+ * immutable so it can be shared between VMs running on different threads, e.g. a program initializes its tables once and
+ * every request runs on a VM restored from the snapshot taken after that (see NanoVM::Snapshot()).
+ * On Linux the memory is copied in to a memory file which the VMs in guarded memory map copy-on-write, so restoring a
+ * VM costs only as much as the pages the VM writes afterwards. Other VMs copy the memory.
+*/
+class NanoSnapshot {
+	friend class NanoVM;
+public:
+	/**
+	 * Unmaps and closes the memory file
+	*/
+	~NanoSnapshot();
+
+	NanoSnapshot(const NanoSnapshot&) = delete;
+	NanoSnapshot& operator=(const NanoSnapshot&) = delete;
+
+	/**
+	 * @return Program the snapshot was taken of
+	*/
+	const std::shared_ptr<const NanoProgram>& GetProgram() const;
+
+	/**
+	 * @param reg Register to read
+	 * @return Value of the register when the snapshot was taken
+	*/
+	uint64_t GetRegister(Register reg) const;
+private:
+	/**
+	 * Copies the state of a VM
+	 * @param program Program the VM runs
+	 * @param cpu CPU of the VM. The code pages and the stack are copied from its memory
+	 * @param dirtyBegin Start of the code pages range the VM has written
+	 * @param dirtyEnd End of the code pages range the VM has written
+	*/
+	NanoSnapshot(std::shared_ptr<const NanoProgram> program, const NanoVMCpu& cpu, uint64_t dirtyBegin, uint64_t dirtyEnd);
+
+	/**
+	 * Copies the memory in to a memory file and maps it read-only
+	 * @param pages Code pages and the stack of the VM
+	 * @param size Size of the memory
+	 * @return True if the memory file could be created and mapped
+	*/
+	bool share(const unsigned char* pages, uint64_t size);
+
+	std::shared_ptr<const NanoProgram> program; /**< Program the snapshot was taken of */
+	NanoVMCpu cpu; /**< Registers and the memory sizes. The memory pointers are not set */
+	const unsigned char* memory; /**< Code pages followed by the stack */
+	std::vector<unsigned char> storage; /**< Memory when it was copied instead of shared */
+	unsigned char* mapping; /**< Memory when it was shared, nullptr otherwise */
+	int file; /**< Descriptor of the memory file, -1 if the memory was not shared */
+	uint64_t dirtyBegin; /**< Start of the code pages range that differs from the program. Empty if not below dirtyEnd */
+	uint64_t dirtyEnd; /**< End of the code pages range that differs from the program */
+};
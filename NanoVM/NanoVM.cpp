@@ -1,309 +1,774 @@
 ﻿#include "NanoVM.h"
-#include <inttypes.h>
+#include "Checkpoint.h"
+#include "Handlers.h"
+#include "JitCompiler.h"
+#include "GuardedMemory.h"
+#include "NanoProgram.h"
+#include "NanoSnapshot.h"
+#include "Profile.h"
+#include "Trace.h"
+#include <algorithm>
 
-NanoVM::NanoVM(unsigned char* code, uint64_t size) {
-	cpu.bytecodeSize = size;
+NanoVM::NanoVM(unsigned char* code, uint64_t size, const NanoVMOptions& options) :
+	NanoVM(std::make_shared<NanoProgram>(code, size), options) {}
+
+NanoVM::NanoVM(std::string fileName, const NanoVMOptions& options) :
+	NanoVM(std::make_shared<NanoProgram>(fileName), options) {}
+
+NanoVM::NanoVM(std::shared_ptr<const NanoProgram> program, const NanoVMOptions& options) :
+	program(std::move(program)), stdoutBuffer(StdoutSink::instance()), syscalls(options.syscalls) {
+	errorFlag = 0;
+	breakpointCount = 0;
+	breakpointsArmed = false;
+	instructionCount = 0;
+	instructionLimit = NO_INSTRUCTION_LIMIT;
+	watchedPageCount = 0;
+	watchpointsArmed = false;
+	watchFaultCount = 0;
+	watchedInstruction = 0;
+	snapshotMapped = false;
+	valid = true;
+	checkpointInterval = 0;
+	nextCheckpoint = 0;
+	trackingWrites = false;
+#ifdef NANOVM_PROFILE
+	// Every instruction is counted on its own unless fusion is enabled again
+	fusion = false;
+	profileFile = options.profileFile;
+#else
+	fusion = true;
+#endif
+	output = &stdoutBuffer;
 	// Initialize cpu
 	memset(&cpu, 0x00, sizeof(cpu));
-	// Zero out registers
-	memset(cpu.registers, 0x00, sizeof(cpu.registers));
-	cpu.codeSize = (NANOVM_PAGE_SIZE * (1 + (size / NANOVM_PAGE_SIZE)));
-	cpu.stackSize = NANOVM_PAGE_SIZE;
-	// allocate whole memory, code pages, stack, +10 bytes
-	// +10 bytes is for instruction fetching which might read more bytes than the instruction size
-	// This avoids reading memory out side of the VM
-	cpu.codeBase = (unsigned char*) malloc(cpu.stackSize + 10 + cpu.codeSize);
-	// Set stack base. Stack grows up instead of down like in x86
-	cpu.stackBase = cpu.codeBase + cpu.codeSize;
-	// Zero out stack + the last 10 bytes
-	memset(cpu.stackBase, 0x00, sizeof(cpu.stackSize) + 10);
-	// copy the bytecode to the vm
-	memcpy(cpu.codeBase, code, size);
-	// Set IP to the beginning of code
-	cpu.registers[ip] = 0;
+	cpu.bytecodeSize = this->program->bytecodeSize;
+	allocateMemory(this->program->codeSize, options);
+	// Guarded memory maps the code pages of a container copy-on-write so only the pages the program writes are copied.
+	// Checked memory is moved by realloc when the stack grows so the bytecode is copied in to it
+	if (memoryMode != MemoryMode::Guarded || this->program->mappedFile < 0 ||
+		!GuardedMemory::map(cpu.codeBase, cpu.bytecodeSize, this->program->mappedFile, this->program->mappedOffset)) {
+		memcpy(cpu.codeBase, this->program->memory, cpu.bytecodeSize);
+	}
+	// Set IP to the entry of the program
+	cpu.registers[ip] = this->program->entryOffset;
 	cpu.registers[esp] = cpu.codeSize;
 	cpu.registers[bp] = cpu.codeSize;
+	dirtyBegin = cpu.codeSize;
+	dirtyEnd = 0;
+	predecode();
+#ifdef NANOVM_PROFILE
+	profile.reset(new Profile(cpu.codeSize));
+#endif
 }
 
-NanoVM::NanoVM(std::string fileName) {
-	memset(&cpu, 0x00, sizeof(cpu));
-	// Zero out registers
-	memset(cpu.registers, 0x00, sizeof(cpu.registers));
-
-	std::streampos size;
+NanoVM::NanoVM(std::shared_ptr<const NanoSnapshot> snapshot, const NanoVMOptions& options) :
+	NanoVM(snapshot->program, options) {
+	valid = Restore(*snapshot);
+}
 
-	std::ifstream file(fileName, std::ios::in | std::ios::binary | std::ios::ate);
-	if (file.is_open())
-	{
-		size = file.tellg();
+NanoVM::NanoVM(std::shared_ptr<const NanoProgram> program, const std::string& checkpoint, const NanoVMOptions& options) :
+	NanoVM(std::move(program), options) {
+	valid = Resume(checkpoint);
+}
 
-		cpu.codeSize = (NANOVM_PAGE_SIZE * (1 + (size / NANOVM_PAGE_SIZE)));
-		cpu.stackSize = NANOVM_PAGE_SIZE;
+NanoVM::~NanoVM() {
+	// The pending checkpoint is written before the memory is released
+	checkpoints.reset();
+#ifdef NANOVM_PROFILE
+	if (!profileFile.empty() && !profile->Save(profileFile)) {
+		std::cout << "Unable to save the profile to " << profileFile << std::endl;
+	}
+#endif
+	if (memoryMode == MemoryMode::Guarded) {
+		GuardedMemory::release(cpu.codeBase);
+	}
+	else {
+		free(cpu.codeBase);
+	}
+}
 
-		// allocate whole memory, code pages, stack, +10 bytes
-		// +10 bytes is for instruction fetching which might read more bytes than the instruction size
-		// This avoids reading memory out side of the VM
-		cpu.codeBase = (unsigned char*)malloc(cpu.stackSize + 10 + cpu.codeSize);
+bool NanoVM::IsValid() const {
+	return valid;
+}
 
-		file.seekg(0, std::ios::beg);
-		file.read((char*)cpu.codeBase, size);
-		file.close();
+/**
+ * @return Size rounded up to whole pages
+*/
+static uint64_t roundToPages(uint64_t size) {
+	return (size + NANOVM_PAGE_SIZE - 1) / NANOVM_PAGE_SIZE * NANOVM_PAGE_SIZE;
+}
 
-		cpu.bytecodeSize = size;
-		// Set stack base. Stack grows up instead of down like in x86
-		cpu.stackBase = cpu.codeBase + cpu.codeSize;
-		// Zero out stack + the last 10 bytes
-		memset(cpu.stackBase, 0x00, sizeof(cpu.stackSize) + 10);
-		cpu.registers[esp] = cpu.codeSize;
-		cpu.registers[bp] = cpu.codeSize;
-		// Set IP to the beginning of code
-		cpu.registers[ip] = 0;
+void NanoVM::allocateMemory(uint64_t codeSize, const NanoVMOptions& options) {
+	cpu.codeSize = codeSize;
+	cpu.stackSize = std::max<uint64_t>(roundToPages(options.stackSize), NANOVM_PAGE_SIZE);
+	initialStackSize = cpu.stackSize;
+	cpu.maxStackSize = std::max(roundToPages(options.maxStackSize), cpu.stackSize);
+	memoryMode = MemoryMode::Checked;
+	// The whole stack has to fit in the reserved address space of guarded memory
+	if (options.memoryMode == MemoryMode::Guarded && cpu.codeSize + cpu.maxStackSize <= GUARDED_ADDRESS_SPACE) {
+		// Guarded memory is zeroed and the guard pages follow the stack so no padding is needed
+		cpu.codeBase = GuardedMemory::allocate(cpu.codeSize + cpu.stackSize);
+		if (cpu.codeBase) {
+			memoryMode = MemoryMode::Guarded;
+			cpu.stackBase = cpu.codeBase + cpu.codeSize;
+			return;
+		}
 	}
-	else std::cout << "Unable to open file";
+	// allocate whole memory, code pages, stack, +10 bytes
+	// +10 bytes is for instruction fetching which might read more bytes than the instruction size
+	// This avoids reading memory out side of the VM
+	cpu.codeBase = (unsigned char*) calloc(cpu.stackSize + 10 + cpu.codeSize, 1);
+	// Set stack base. Stack grows up instead of down like in x86
+	cpu.stackBase = cpu.codeBase + cpu.codeSize;
 }
-NanoVM::~NanoVM() {
-	free(cpu.codeBase);
+
+bool NanoVM::growStack(uint64_t offset, uint64_t size) {
+	if (offset > cpu.codeSize + cpu.maxStackSize - size) {
+		return false;
+	}
+	uint64_t stackSize = cpu.stackSize;
+	while (cpu.codeSize + stackSize < offset + size) {
+		stackSize *= 2;
+	}
+	stackSize = std::min(stackSize, cpu.maxStackSize);
+	if (memoryMode == MemoryMode::Guarded) {
+		// Only the new pages are committed so that the watched pages stay protected
+		if (!GuardedMemory::commit(cpu.stackBase + cpu.stackSize, stackSize - cpu.stackSize)) {
+			return false;
+		}
+		if (watchpointsArmed) {
+			armWatchpoints(true, cpu.codeSize + cpu.stackSize, cpu.codeSize + stackSize);
+		}
+	}
+	else {
+		unsigned char* memory = (unsigned char*)realloc(cpu.codeBase, cpu.codeSize + stackSize + 10);
+		if (!memory) {
+			return false;
+		}
+		// Zero out the new part of the stack and the padding after it
+		memset(memory + cpu.codeSize + cpu.stackSize, 0x00, stackSize - cpu.stackSize + 10);
+		cpu.codeBase = memory;
+	}
+	cpu.stackBase = cpu.codeBase + cpu.codeSize;
+	// The new pages are zero and the next checkpoint holds them
+	markWritten(cpu.codeSize + cpu.stackSize, stackSize - cpu.stackSize);
+	cpu.stackSize = stackSize;
+	return true;
 }
 
-template<class T> inline void NanoVM::push(T value) {
-	// Check bounds
-	if (sizeof(value) + cpu.registers[esp] >= reinterpret_cast<uint64_t>(cpu.stackBase) + cpu.stackSize) {
-		// No room in stack.
-		// Throw error or reallocate more pages
-		errorFlag = STACK_ERROR;
+void NanoVM::shrinkStack(uint64_t stackSize) {
+	if (cpu.stackSize <= stackSize) {
 		return;
 	}
-	// push to stack
-	*reinterpret_cast<T*>(cpu.codeBase + cpu.registers[esp]) = value;
-	// update stack pointer
-	cpu.registers[esp] += sizeof(value);
+	if (memoryMode == MemoryMode::Guarded) {
+		GuardedMemory::decommit(cpu.stackBase + stackSize, cpu.stackSize - stackSize);
+	}
+	else {
+		unsigned char* memory = (unsigned char*)realloc(cpu.codeBase, cpu.codeSize + stackSize + 10);
+		// Keep the larger memory if it can not be shrunk
+		if (memory) {
+			cpu.codeBase = memory;
+			cpu.stackBase = cpu.codeBase + cpu.codeSize;
+		}
+		// Zero out the padding after the stack
+		memset(cpu.stackBase + stackSize, 0x00, 10);
+	}
+	cpu.stackSize = stackSize;
 }
 
-template<class T> inline T NanoVM::pop() {
-	// Check bounds
-	if (cpu.registers[esp] - sizeof(T) < cpu.codeSize) {
-		// Reached the bottom of stack
-		errorFlag = STACK_ERROR;
-		return 0;
+uint64_t NanoVM::Run(ExecutionMode mode) {
+	uint64_t result;
+#ifdef NANOVM_PROFILE
+	// The compiled code is not profiled so the JIT is replaced by the threaded engine
+	if (mode == ExecutionMode::Jit) {
+		mode = ExecutionMode::Threaded;
+	}
+	profile->begin(cpu.registers[ip]);
+#endif
+	if (trace) {
+		// The compiled code is not traced
+		if (mode == ExecutionMode::Jit) {
+			mode = ExecutionMode::Threaded;
+		}
+		for (uint8_t i = Reg0; i <= flags; i++) {
+			trace->record(cpu.registers[ip], TraceStart, fusion, i, cpu.registers[i]);
+		}
+	}
+	if (checkpoints) {
+		result = runCheckpointed();
 	}
-	// pop value from stack
-	T value = *reinterpret_cast<T*>(cpu.codeBase + cpu.registers[esp] - sizeof(T));
-	// update esp
-	cpu.registers[esp] -= sizeof(value);
-	return value;
+	else if (mode == ExecutionMode::Jit) {
+		result = runJit();
+	}
+	else if (memoryMode == MemoryMode::Guarded) {
+		result = runGuarded(mode);
+	}
+	else if (mode == ExecutionMode::Threaded) {
+		result = runThreaded<false>();
+	}
+	else {
+		result = runInterpreter<false>();
+	}
+#ifdef NANOVM_PROFILE
+	profile->end();
+#endif
+	if (trace) {
+		trace->record(cpu.registers[ip], TraceEnd, 0, Reg0, result);
+		trace->publish();
+	}
+	// The output is buffered while the program runs
+	output->flush();
+	return result;
 }
 
-uint64_t NanoVM::Run() {
+template<bool Guarded> uint64_t NanoVM::runInterpreter() {
+	const auto& handlers = Guarded ? guardedHandlerTable : handlerTable;
+	TraceRecorder* const tracing = trace.get();
 	while (true) {
-		Instruction inst;
-		if (fetch(inst)) {
-			if (inst.opcode == Halt) {
-				// Return value will be in reg0
-				return cpu.registers[Reg0];
+		uint64_t offset = cpu.registers[ip];
+		if (offset >= cpu.codeSize) {
+			reportIpOutOfBounds();
+			return 3;
+		}
+		Instruction& inst = instructionCache[offset];
+		// Decode lazily if the offset was not reached by predecode or the code was modified
+		if (!inst.instructionSize) {
+			decode(offset, inst);
+		}
+		NANOVM_PROFILE_RECORD(offset, inst);
+		if (inst.opcode == Halt) {
+			// Return value will be in reg0
+			return cpu.registers[Reg0];
+		}
+		if (!handlers[inst.handler](*this, inst)) {
+			// More error flags will be added
+			switch (errorFlag) {
+			case MEMORY_ACCESS:
+				return 1;
+				break;
+			default:
+				return 2;
 			}
-			if (!execute(inst)) {
-				// More error flags will be added
-				switch (errorFlag) {
-				case MEMORY_ACCESS:
-					return 1;
-					break;
-				default:
-					return 2;
-				}
-				return false;
+			return false;
+		}
+		if (tracing) {
+			traceStep(offset, inst);
+		}
+	}
+}
+
+uint64_t NanoVM::runGuarded(ExecutionMode mode) {
+#ifdef NANOVM_GUARDED_MEMORY
+	GuardScope scope(*this);
+	if (sigsetjmp(scope.jump, 1)) {
+		// An access hit the guard pages. The handlers store the IP of the faulting instruction before accessing memory
+		errorFlag = scope.error;
+		return (errorFlag == MEMORY_ACCESS) ? 1 : 2;
+	}
+	return (mode == ExecutionMode::Threaded) ? runThreaded<true>() : runInterpreter<true>();
+#else
+	return (mode == ExecutionMode::Threaded) ? runThreaded<false>() : runInterpreter<false>();
+#endif
+}
+
+uint64_t NanoVM::runCheckpointed() {
+	uint64_t result;
+	do {
+		if (instructionCount >= nextCheckpoint) {
+			checkpoint();
+			nextCheckpoint = instructionCount + checkpointInterval;
+		}
+		// Only the threaded engine stops between the instructions
+		instructionLimit = nextCheckpoint;
+		result = (memoryMode == MemoryMode::Guarded) ? runGuarded(ExecutionMode::Threaded) : runThreaded<false>();
+	} while (!errorFlag && instructionCount >= instructionLimit);
+	instructionLimit = NO_INSTRUCTION_LIMIT;
+	return result;
+}
+
+void NanoVM::checkpoint() {
+	Checkpoint checkpoint;
+	checkpoint.record.instructionCount = instructionCount;
+	memcpy(checkpoint.record.registers, cpu.registers, sizeof(cpu.registers));
+	memcpy(checkpoint.record.vectorRegisters, cpu.vectorRegisters, sizeof(cpu.vectorRegisters));
+	checkpoint.record.stackSize = cpu.stackSize;
+	checkpoint.record.dirtyBegin = dirtyBegin;
+	checkpoint.record.dirtyEnd = dirtyEnd;
+	uint64_t memorySize = cpu.codeSize + cpu.stackSize;
+	// Pages the stack has shrunk from since they were written are dropped
+	for (uint64_t page : writtenPages) {
+		writtenFlags[page] = 0;
+		if (page * NANOVM_PAGE_SIZE < memorySize) {
+			checkpoint.offsets.push_back(page * NANOVM_PAGE_SIZE);
+		}
+	}
+	writtenPages.clear();
+	std::sort(checkpoint.offsets.begin(), checkpoint.offsets.end());
+	checkpoint.record.pageCount = checkpoint.offsets.size();
+	checkpoint.pages.resize(checkpoint.offsets.size() * NANOVM_PAGE_SIZE);
+	for (size_t i = 0; i < checkpoint.offsets.size(); i++) {
+		memcpy(checkpoint.pages.data() + i * NANOVM_PAGE_SIZE, cpu.codeBase + checkpoint.offsets[i], NANOVM_PAGE_SIZE);
+	}
+	if (memoryMode == MemoryMode::Guarded) {
+		// Adjacent pages are protected with a single call
+		for (size_t i = 0; i < checkpoint.offsets.size(); ) {
+			size_t end = i + 1;
+			while (end < checkpoint.offsets.size() && checkpoint.offsets[end] == checkpoint.offsets[end - 1] + NANOVM_PAGE_SIZE) {
+				end++;
 			}
+			GuardedMemory::protect(cpu.codeBase + checkpoint.offsets[i], (end - i) * NANOVM_PAGE_SIZE, PageWatch::Write);
+			i = end;
 		}
-		else {
-			return 3;
+	}
+	checkpoints->submit(std::move(checkpoint));
+}
+
+bool NanoVM::trackWrite(uint64_t offset) {
+	uint64_t page = offset / NANOVM_PAGE_SIZE;
+	if (!trackingWrites || page >= writtenFlags.size() || writtenFlags[page]) {
+		return false;
+	}
+	markWritten(offset, 1);
+	return true;
+}
+
+void NanoVM::markWritten(uint64_t offset, uint64_t size) {
+	if (!trackingWrites || !size) {
+		return;
+	}
+	uint64_t end = std::min<uint64_t>((offset + size - 1) / NANOVM_PAGE_SIZE + 1, writtenFlags.size());
+	for (uint64_t page = offset / NANOVM_PAGE_SIZE; page < end; page++) {
+		if (!writtenFlags[page]) {
+			writtenFlags[page] = 1;
+			writtenPages.push_back(page);
+			if (memoryMode == MemoryMode::Guarded) {
+				GuardedMemory::protect(cpu.codeBase + page * NANOVM_PAGE_SIZE, NANOVM_PAGE_SIZE, PageWatch::None);
+			}
 		}
 	}
 }
 
 bool NanoVM::execute(Instruction &inst) {
-	// set source and destination addresses
-	void *dst, *src;
-	bool isDstReg = false;
-	dst = (inst.isDstMem) ? reinterpret_cast<void*>(cpu.codeBase + cpu.registers[inst.dstReg]) : reinterpret_cast<void*>(&cpu.registers[inst.dstReg]);
-	if (inst.srcType == DataType::Reg) {
-		src = (inst.isSrcMem) ? reinterpret_cast<void*>(cpu.codeBase + cpu.registers[inst.srcReg]) : reinterpret_cast<void*>(&cpu.registers[inst.srcReg]);
-	}
-	else {
-		isDstReg = (inst.isDstMem) ? false : true;
-		src = (inst.isSrcMem) ? reinterpret_cast<void*>(cpu.codeBase + inst.immediate) : reinterpret_cast<void*>(&inst.immediate);
+	return handlerTable[inst.handler](*this, inst);
+}
+
+bool NanoVM::executeWatched(Instruction& inst) {
+#ifdef NANOVM_GUARDED_MEMORY
+	if (watchedPageCount) {
+		GuardScope scope(*this);
+		if (sigsetjmp(scope.jump, 1)) {
+			armWatchpoints(false, 0, cpu.codeSize + cpu.stackSize);
+			errorFlag = scope.error;
+			return false;
+		}
+		armWatchpoints(true, 0, cpu.codeSize + cpu.stackSize);
+		bool success = execute(inst);
+		armWatchpoints(false, 0, cpu.codeSize + cpu.stackSize);
+		return success;
 	}
-	// Do bounds check
-	if ((src != &inst.immediate && src != &cpu.registers[inst.srcReg] && (src < cpu.codeBase || src >= cpu.codeBase + cpu.codeSize + cpu.stackSize)) || (dst != &cpu.registers[inst.dstReg] && (dst < cpu.codeBase || dst > cpu.codeBase + cpu.codeSize + cpu.stackSize))) {
-		// Source or destination is out side of VM memory
-		errorFlag = MEMORY_ACCESS;
+#endif
+	return execute(inst);
+}
+
+void NanoVM::reportIpOutOfBounds() const {
+	output->flush();
+	std::cout << "IP out of bounds" << std::endl;
+}
+
+bool NanoVM::fetch(Instruction &inst) const {
+	// Sanity check the ip that it is within code page
+	if (!decode(cpu.registers[ip], inst)) {
+		reportIpOutOfBounds();
 		return false;
 	}
+	return true;
+}
+
+bool NanoVM::decode(uint64_t offset, Instruction &inst) const {
+	return NanoProgram::decode(cpu.codeBase, cpu.codeSize, offset, inst);
+}
 
-	#define MATHOP(INST, OP, SIZE, DSTSIZE) \
-    case INST: {         \
-		*reinterpret_cast<DSTSIZE*>(dst) OP *reinterpret_cast<SIZE*>(src); \
-		break; \
-    }
-
-	//USIZE is unsigned and SIZE is signed type => e.g. uint8_t and int8_t 
-	#define BRANCH(USIZE, SIZE, DSTSIZE) \
-	switch(inst.opcode) { \
-		MATHOP(Opcodes::Add, +=, USIZE, DSTSIZE) \
-		MATHOP(Opcodes::Mov, =, USIZE, DSTSIZE) \
-		MATHOP(Opcodes::Sub, -=, USIZE, DSTSIZE) \
-		MATHOP(Opcodes::Xor, ^=, USIZE, DSTSIZE) \
-		MATHOP(Opcodes::And, &=, USIZE, DSTSIZE) \
-		MATHOP(Opcodes::Or, |=, USIZE, DSTSIZE) \
-		MATHOP(Opcodes::Sar, >>=, USIZE, DSTSIZE) \
-		MATHOP(Opcodes::Sal, <<=, USIZE, DSTSIZE) \
-		MATHOP(Opcodes::Div, /=, USIZE, DSTSIZE) \
-		MATHOP(Opcodes::Mul, *=, USIZE, DSTSIZE) \
-		MATHOP(Opcodes::Mod, %=, USIZE, DSTSIZE) \
-	case Opcodes::Printi: \
-		std::printf("%" PRIu64 "", *reinterpret_cast<USIZE*>(src)); \
-		break; \
-	case Opcodes::Prints: \
-		std::printf("%s", src); \
-		break; \
-	case Opcodes::Printc: \
-		std::printf("%c", *reinterpret_cast<USIZE*>(src)); \
-		break; \
-	case Opcodes::Inc: \
-		*reinterpret_cast<USIZE*>(src) += 1; \
-		break; \
-	case Opcodes::Dec: \
-		*reinterpret_cast<USIZE*>(src) -= 1; \
-		break; \
-	case Opcodes::Push: \
-		push(*reinterpret_cast<USIZE*>(src)); \
-		break; \
-	case Opcodes::Pop: \
-		*reinterpret_cast<USIZE*>(dst) = pop<USIZE>(); \
-		break; \
-	case Opcodes::Jz: \
-		if (cpu.registers[flags] & ZERO_FLAG) { \
-			cpu.registers[ip] += *reinterpret_cast<SIZE*>(src); \
-			return true; \
-		} \
-		break; \
-	case Opcodes::Jnz: \
-		if (!(cpu.registers[flags] & ZERO_FLAG)) { \
-			cpu.registers[ip] += *reinterpret_cast<SIZE*>(src); \
-			return true; \
-		} \
-		break; \
-	case Opcodes::Jg: \
-		if (cpu.registers[flags] & GREATER_FLAG) { \
-			cpu.registers[ip] += *reinterpret_cast<SIZE*>(src); \
-			return true; \
-		} \
-		break; \
-	case Opcodes::Js: \
-		if (cpu.registers[flags] & SMALLER_FLAG) { \
-			cpu.registers[ip] += *reinterpret_cast<SIZE*>(src); \
-			return true; \
-		} \
-		break; \
-	case Opcodes::Jmp: \
-		cpu.registers[ip] += *reinterpret_cast<SIZE*>(src); \
-		return true; \
-	case Opcodes::Call: \
-		push(cpu.registers[ip] + inst.instructionSize); \
-		cpu.registers[ip] += *reinterpret_cast<SIZE*>(src); \
-		return true; \
-	case Opcodes::Ret: \
-		cpu.registers[ip] = pop<uint64_t>(); \
-		return true; \
-	case Opcodes::Cmp: \
-		if (*reinterpret_cast<USIZE*>(dst) == *reinterpret_cast<USIZE*>(src)) \
-			cpu.registers[flags] = ZERO_FLAG; \
-		else if (*reinterpret_cast<USIZE*>(dst) > *reinterpret_cast<USIZE*>(src)) \
-			cpu.registers[flags] = GREATER_FLAG; \
-		else \
-			cpu.registers[flags] = SMALLER_FLAG; \
-		break; \
-	default: \
-		return false; \
-	}
-
-
-	switch (inst.srcSize) {	
-	case Size::Byte: 
-		if (isDstReg) {
-			BRANCH(uint8_t, int8_t, uint64_t);
+void NanoVM::decodeCached(uint64_t offset, Instruction& inst) {
+	decode(offset, inst);
+	if (breakpointsArmed && isBreakpoint(offset)) {
+		inst.handler = BREAKPOINT_HANDLER;
+		return;
+	}
+	if (!fusion) {
+		return;
+	}
+	// A fused sequence is at most three instructions. Sequences over a breakpoint are split like splitBreakpoint() does
+	uint64_t next = offset;
+	for (int i = 0; i < 2; i++) {
+		next += instructionCache[next].instructionSize;
+		if (next >= cpu.codeSize || isBreakpoint(next)) {
+			return;
 		}
-		else {
-			BRANCH(uint8_t, int8_t, uint8_t);
+		if (!instructionCache[next].instructionSize) {
+			decode(next, instructionCache[next]);
+		}
+	}
+	NanoProgram::fuse(instructionCache.data(), cpu.codeSize, offset);
+}
+
+void NanoVM::predecode() {
+	if (program->instructions.empty()) {
+		// The cache is allocated zeroed so only the entries of the instructions that run are touched
+		instructionCache = InstructionCache(static_cast<size_t>(cpu.codeSize));
+	}
+	else {
+		// The program has decoded the bytecode already. Only the code pages written by the VM have to be decoded again
+		const std::vector<Instruction>& instructions = fusion ? program->fusedInstructions : program->instructions;
+		instructionCache.assign(instructions.begin(), instructions.end());
+		for (uint64_t i = dirtyBegin; i < dirtyEnd; i++) {
+			instructionCache[i].instructionSize = 0;
 		}
-		break; 
-	case Size::Short: 
-		if (isDstReg) {
-			BRANCH(uint16_t, int16_t, uint64_t);
+	}
+	armBreakpoints();
+}
+
+void NanoVM::restoreInstructions(uint64_t begin, uint64_t end) {
+	if (program->instructions.empty()) {
+		std::fill(instructionCache.begin() + begin, instructionCache.begin() + end, Instruction());
+	}
+	else {
+		const std::vector<Instruction>& instructions = fusion ? program->fusedInstructions : program->instructions;
+		std::copy(instructions.begin() + begin, instructions.begin() + end, instructionCache.begin() + begin);
+	}
+}
+
+bool NanoVM::setBreakpoint(uint64_t offset, bool enabled) {
+	if (offset >= cpu.codeSize) {
+		return false;
+	}
+	if (breakpoints.empty()) {
+		breakpoints.resize(cpu.codeSize, false);
+	}
+	if (breakpoints[offset] != enabled) {
+		breakpoints[offset] = enabled;
+		if (enabled) {
+			breakpointCount++;
 		}
 		else {
-			BRANCH(uint16_t, int16_t, uint16_t);
+			breakpointCount--;
 		}
-		break;
-	case Size::Dword: 
-		if (isDstReg) {
-			BRANCH(uint32_t, int32_t, uint64_t);
+		splitBreakpoint(offset);
+	}
+	return true;
+}
+
+bool NanoVM::isBreakpoint(uint64_t offset) const {
+	return offset < breakpoints.size() && breakpoints[offset];
+}
+
+void NanoVM::splitBreakpoint(uint64_t offset) {
+	// Only the fused sequences running over the breakpoint are split so that the code around it stays fused
+	uint64_t begin = (offset >= MAX_FUSED_SIZE - 1) ? offset - (MAX_FUSED_SIZE - 1) : 0;
+	for (uint64_t i = begin; i < offset; i++) {
+		if (instructionCache[i].instructionSize && i + instructionCache[i].fusedSize > offset) {
+			instructionCache[i].instructionSize = 0;
 		}
-		else {
-			BRANCH(uint32_t, int32_t, uint32_t);
+	}
+	instructionCache[offset].instructionSize = 0;
+}
+
+void NanoVM::armBreakpoints() {
+	for (uint64_t offset = 0; breakpointCount && offset < breakpoints.size(); offset++) {
+		if (breakpoints[offset]) {
+			splitBreakpoint(offset);
 		}
-		break;
-	default:
-		BRANCH(uint64_t, int64_t, uint64_t);
-		break;
-	} 
-	cpu.registers[ip] += inst.instructionSize;
+	}
+}
+
+bool NanoVM::runToBreakpoint(uint64_t& result) {
+	if (isBreakpoint(cpu.registers[ip])) {
+		return true;
+	}
+	// The instructions decoded by the other engines since the previous run do not trap
+	armBreakpoints();
+	breakpointsArmed = true;
+	if (watchedPageCount) {
+		armWatchpoints(true, 0, cpu.codeSize + cpu.stackSize);
+	}
+	result = Run(ExecutionMode::Threaded);
+	if (watchpointsArmed) {
+		armWatchpoints(false, 0, cpu.codeSize + cpu.stackSize);
+	}
+	breakpointsArmed = false;
+	// An instruction at a breakpoint is never executed so the run stopped at it unless it failed before
+	return !errorFlag && (isBreakpoint(cpu.registers[ip]) || watchFaultCount);
+}
+
+bool NanoVM::setPageWatch(uint64_t offset, PageWatch watch) {
+	if (memoryMode != MemoryMode::Guarded || offset >= cpu.codeSize + cpu.maxStackSize) {
+		return false;
+	}
+	if (watchedPages.empty()) {
+		watchedPages.resize((cpu.codeSize + cpu.maxStackSize) / NANOVM_PAGE_SIZE, PageWatch::None);
+	}
+	PageWatch& page = watchedPages[offset / NANOVM_PAGE_SIZE];
+	watchedPageCount += (watch != PageWatch::None);
+	watchedPageCount -= (page != PageWatch::None);
+	page = watch;
 	return true;
 }
 
-bool NanoVM::fetch(Instruction &inst) const {
-	// Read 64bit to try and minimize the required memory reading
-	// This increases the performance
+void NanoVM::armWatchpoints(bool armed, uint64_t begin, uint64_t end) {
+	watchpointsArmed = armed;
+	// The pages the stack has not grown to yet are protected when they are committed
+	uint64_t endPage = std::min<uint64_t>(end / NANOVM_PAGE_SIZE, watchedPages.size());
+	for (uint64_t page = begin / NANOVM_PAGE_SIZE; page < endPage; page++) {
+		if (watchedPages[page] != PageWatch::None) {
+			GuardedMemory::protect(cpu.codeBase + page * NANOVM_PAGE_SIZE, NANOVM_PAGE_SIZE, armed ? watchedPages[page] : PageWatch::None);
+		}
+	}
+}
 
-	// Sanity check the ip that it is within code page
-	if (cpu.registers[ip] >= cpu.codeSize) {
-		std::cout << "IP out of bounds" << std::endl;
+bool NanoVM::watchFault(uint64_t offset) {
+	uint64_t page = offset / NANOVM_PAGE_SIZE;
+	if (!watchpointsArmed || page >= watchedPages.size() || watchedPages[page] == PageWatch::None) {
 		return false;
 	}
-	// Parse the instruction
-	unsigned char* rawIp = cpu.codeBase + cpu.registers[ip];
-	uint64_t value = *reinterpret_cast<uint64_t*>(rawIp);
-	inst.opcode   =  (value & (unsigned char)OPCODE_MASK);
-	inst.dstReg   =  ((value & DST_REG_MASK) >> 5);
-	inst.srcType  =  (value >> 8) & SRC_TYPE_MASK;
-	inst.srcReg   =   (value >> 8) & SRC_REG_MASK;
-	inst.srcSize  =  ((value >> 8) & SRC_SIZE_MASK) >> 5;
-	inst.isDstMem =  ((value >> 8) & DST_MEM_MASK);
-	inst.isSrcMem =  ((value >> 8) & SRC_MEM_MASK);
-	// If source is immediate value, read it to the instruction struct
-	if (inst.srcType) {
-		// If the immediate value fit in the initial value. Parse it with bitshift. It is faster than reading memory again
-		switch (inst.srcSize) {
-		case Byte:
-			inst.immediate = (uint8_t)(value >> 16);
-			inst.instructionSize = 3;
-			break;
-		case Short:
-			inst.immediate = (uint16_t)(value >> 16);
-			inst.instructionSize = 4;
-			break;
-		case Dword:
-			inst.immediate = (uint32_t)(value >> 16);
-			inst.instructionSize = 6;
-			break;
-		case Qword:
-			// In the case of qword we have to perform another read operations
-			inst.immediate = *(uint64_t*)(rawIp + 2);
-			inst.instructionSize = 10;
-			break;
+	size_t count = watchFaultCount;
+	if (count < MAX_WATCH_FAULTS) {
+		watchFaults[count] = offset;
+	}
+	watchFaultCount = count + 1;
+	GuardedMemory::protect(cpu.codeBase + page * NANOVM_PAGE_SIZE, NANOVM_PAGE_SIZE, PageWatch::None);
+	return true;
+}
+
+void NanoVM::SetFusion(bool enabled) {
+	fusion = enabled;
+	// Decode again to fuse or split the cached instructions
+	predecode();
+}
+
+void NanoVM::Reset() {
+	markWritten(0, cpu.codeSize + cpu.stackSize);
+	// Restore the code pages written by the previous run and their cached instructions from the program
+	if (dirtyBegin < dirtyEnd) {
+		memcpy(cpu.codeBase + dirtyBegin, program->memory + dirtyBegin, dirtyEnd - dirtyBegin);
+		restoreInstructions(dirtyBegin, dirtyEnd);
+		if (jit) {
+			jit->invalidate(dirtyBegin, dirtyEnd - dirtyBegin);
 		}
+		dirtyBegin = cpu.codeSize;
+		dirtyEnd = 0;
+	}
+	// Shrink the stack back to its initial size and zero it
+	shrinkStack(initialStackSize);
+	if (snapshotMapped) {
+		// Dropped pages of a mapped snapshot would read as the snapshot again
+		GuardedMemory::decommit(cpu.stackBase, initialStackSize);
+		GuardedMemory::commit(cpu.stackBase, initialStackSize);
+		snapshotMapped = false;
+	}
+	else if (memoryMode == MemoryMode::Guarded) {
+		// Dropping the pages costs only as much as the pages the previous run touched
+		GuardedMemory::discard(cpu.stackBase, initialStackSize);
 	}
 	else {
-		inst.instructionSize = 2;
+		// Zero out the stack and the padding after it
+		memset(cpu.stackBase, 0x00, initialStackSize + 10);
+	}
+	// Reset the CPU
+	memset(cpu.registers, 0x00, sizeof(cpu.registers));
+	memset(cpu.vectorRegisters, 0x00, sizeof(cpu.vectorRegisters));
+	cpu.registers[ip] = program->entryOffset;
+	cpu.registers[esp] = cpu.codeSize;
+	cpu.registers[bp] = cpu.codeSize;
+	errorFlag = 0;
+	if (trace) {
+		trace->record(0, TraceReset, 0, TRACE_NO_REGISTER, 0);
 	}
+}
+
+std::shared_ptr<const NanoSnapshot> NanoVM::Snapshot() const {
+	return std::shared_ptr<const NanoSnapshot>(new NanoSnapshot(program, cpu, dirtyBegin, dirtyEnd));
+}
+
+std::unique_ptr<NanoVM> NanoVM::Fork() const {
+	NanoVMOptions options;
+	options.memoryMode = memoryMode;
+	options.stackSize = initialStackSize;
+	options.maxStackSize = cpu.maxStackSize;
+	options.syscalls = syscalls;
+	// The forks would overwrite the profile of this VM
+	options.profileFile.clear();
+	std::unique_ptr<NanoVM> vm = std::make_unique<NanoVM>(Snapshot(), options);
+	vm->SetFusion(fusion);
+	return vm;
+}
+
+bool NanoVM::Restore(const NanoSnapshot& snapshot) {
+	if (snapshot.program != program || snapshot.cpu.stackSize > cpu.maxStackSize) {
+		return false;
+	}
+	// Growing doubles the stack so it may grow past the size of the snapshot
+	if (cpu.stackSize < snapshot.cpu.stackSize && !growStack(cpu.codeSize + snapshot.cpu.stackSize - 1, 1)) {
+		return false;
+	}
+	shrinkStack(snapshot.cpu.stackSize);
+	markWritten(0, cpu.codeSize + cpu.stackSize);
+	uint64_t size = cpu.codeSize + cpu.stackSize;
+	if (memoryMode == MemoryMode::Guarded && snapshot.file >= 0 && GuardedMemory::map(cpu.codeBase, size, snapshot.file, 0)) {
+		snapshotMapped = true;
+	}
+	else {
+		memcpy(cpu.codeBase, snapshot.memory, size);
+	}
+	replaceCode(snapshot.dirtyBegin, snapshot.dirtyEnd);
+	memcpy(cpu.registers, snapshot.cpu.registers, sizeof(cpu.registers));
+	memcpy(cpu.vectorRegisters, snapshot.cpu.vectorRegisters, sizeof(cpu.vectorRegisters));
+	errorFlag = 0;
 	return true;
+}
+
+void NanoVM::replaceCode(uint64_t begin, uint64_t end) {
+	// The cached instructions of the code pages written since the last reset are restored from the program, then the
+	// code pages that differ from the program are decoded again
+	if (dirtyBegin < dirtyEnd) {
+		restoreInstructions(dirtyBegin, dirtyEnd);
+		if (jit) {
+			jit->invalidate(dirtyBegin, dirtyEnd - dirtyBegin);
+		}
+		dirtyBegin = cpu.codeSize;
+		dirtyEnd = 0;
+	}
+	if (begin < end) {
+		invalidate(begin, end - begin);
+	}
+}
 
-}
\ No newline at end of file
+void NanoVM::StartCheckpoints(const std::string& file, uint64_t interval) {
+	checkpoints.reset();
+	CheckpointHeader header = { { 'N', 'A', 'N', 'O', 'C', 'K', 'P', 'T' }, CHECKPOINT_VERSION, NANOVM_PAGE_SIZE, cpu.bytecodeSize, cpu.codeSize,
+		nanocChecksum(program->memory, cpu.bytecodeSize) };
+	checkpoints.reset(new CheckpointWriter(file, header));
+	checkpointInterval = std::max<uint64_t>(interval, 1);
+	nextCheckpoint = instructionCount + checkpointInterval;
+	// Every page is written before the first checkpoint so it holds the whole memory
+	if (!trackingWrites) {
+		uint64_t pageCount = (cpu.codeSize + cpu.maxStackSize) / NANOVM_PAGE_SIZE;
+		writtenFlags.assign(static_cast<size_t>(pageCount), 0);
+		writtenPages.clear();
+		writtenPages.reserve(static_cast<size_t>(pageCount));
+		trackingWrites = true;
+	}
+	markWritten(0, cpu.codeSize + cpu.stackSize);
+}
+
+bool NanoVM::StopCheckpoints() {
+	if (!checkpoints) {
+		return true;
+	}
+	checkpoints->flush();
+	bool written = checkpoints->IsOpen();
+	checkpoints.reset();
+	// The protected pages of guarded memory are made writable again
+	if (trackingWrites) {
+		markWritten(0, cpu.codeSize + cpu.stackSize);
+		trackingWrites = false;
+		writtenFlags.clear();
+		writtenPages.clear();
+	}
+	return written;
+}
+
+bool NanoVM::Resume(const std::string& file) {
+	CheckpointHeader header;
+	uint64_t checksum = nanocChecksum(program->memory, cpu.bytecodeSize);
+	return CheckpointWriter::Read(file, header, [&](const CheckpointRecord& record, const std::vector<uint64_t>& offsets, const std::vector<unsigned char>& pages) {
+		if (header.bytecodeSize != cpu.bytecodeSize || header.codeSize != cpu.codeSize || header.checksum != checksum ||
+			record.stackSize > cpu.maxStackSize || record.stackSize % NANOVM_PAGE_SIZE || record.dirtyEnd > cpu.codeSize) {
+			return false;
+		}
+		for (uint64_t offset : offsets) {
+			if (offset % NANOVM_PAGE_SIZE || offset >= cpu.codeSize + record.stackSize) {
+				return false;
+			}
+		}
+		if (cpu.stackSize < record.stackSize && !growStack(cpu.codeSize + record.stackSize - 1, 1)) {
+			return false;
+		}
+		shrinkStack(record.stackSize);
+		markWritten(0, cpu.codeSize + cpu.stackSize);
+		for (size_t i = 0; i < offsets.size(); i++) {
+			memcpy(cpu.codeBase + offsets[i], pages.data() + i * NANOVM_PAGE_SIZE, NANOVM_PAGE_SIZE);
+		}
+		replaceCode(record.dirtyBegin, record.dirtyEnd);
+		memcpy(cpu.registers, record.registers, sizeof(cpu.registers));
+		memcpy(cpu.vectorRegisters, record.vectorRegisters, sizeof(cpu.vectorRegisters));
+		instructionCount = record.instructionCount;
+		errorFlag = 0;
+		return true;
+	});
+}
+
+void NanoVM::SetOutput(OutputSink& sink) {
+	output->flush();
+	output = &sink;
+}
+
+void NanoVM::SetRegister(Register reg, uint64_t value) {
+	cpu.registers[reg] = value;
+}
+
+uint64_t NanoVM::GetRegister(Register reg) const {
+	return cpu.registers[reg];
+}
+
+unsigned char* NanoVM::GetMemory(uint64_t offset, uint64_t size) {
+	uint64_t memorySize = cpu.codeSize + cpu.stackSize;
+	if (offset > memorySize || size > memorySize - offset) {
+		return nullptr;
+	}
+	// The caller may write to the range
+	markWritten(offset, size);
+	return cpu.codeBase + offset;
+}
+
+bool NanoVM::RegisterSyscall(uint64_t number, SyscallFunction function, void* data) {
+	if (number >= NANOVM_SYSCALL_COUNT) {
+		return false;
+	}
+	syscalls[number].function = function;
+	syscalls[number].data = data;
+	return true;
+}
+
+bool NanoVM::StartTrace(const std::string& file) {
+	trace.reset(new TraceRecorder(file, cpu.bytecodeSize));
+	if (!trace->IsOpen()) {
+		trace.reset();
+		return false;
+	}
+	return true;
+}
+
+void NanoVM::StopTrace() {
+	// The recorder writes the remaining records when destroyed
+	trace.reset();
+}
+
+#ifdef NANOVM_PROFILE
+const Profile& NanoVM::GetProfile() const {
+	return *profile;
+}
+#endif
+
+void NanoVM::invalidate(uint64_t offset, uint64_t size) {
+	// Any instruction sequence starting up to MAX_FUSED_SIZE - 1 bytes before the written range may overlap it
+	uint64_t begin = (offset >= MAX_FUSED_SIZE - 1) ? offset - (MAX_FUSED_SIZE - 1) : 0;
+	uint64_t end = std::min(offset + size, cpu.codeSize);
+	for (uint64_t i = begin; i < end; i++) {
+		instructionCache[i].instructionSize = 0;
+	}
+	// Reset() restores the range from the program
+	dirtyBegin = std::min(dirtyBegin, begin);
+	dirtyEnd = std::max(dirtyEnd, end);
+	if (jit) {
+		jit->invalidate(offset, size);
+	}
+}
@@ -4,9 +4,19 @@
 #include <fstream>
 #include <cstring>
 #include <cstdint>
+#include <vector>
+#include <memory>
+#include <array>
+#include <cstdlib>
+#include <new>
+#include "OutputSink.h"
 
 // VM masks and constants
 constexpr uint32_t NANOVM_PAGE_SIZE	= 4096;
+constexpr uint64_t NANOVM_DEFAULT_MAX_STACK_SIZE = 8 * 1024 * 1024;
+constexpr uint32_t MAX_INSTRUCTION_SIZE = 10;
+constexpr uint32_t MAX_FUSED_SIZE = 3 * MAX_INSTRUCTION_SIZE;
+constexpr uint32_t NANOVM_SYSCALL_COUNT = 256;
 constexpr uint8_t OPCODE_MASK	= 0b00011111;
 constexpr uint8_t DST_REG_MASK	= 0b11100000;
 constexpr uint8_t SRC_TYPE_MASK	= 0b10000000;
@@ -15,10 +25,26 @@ constexpr uint8_t DST_MEM_MASK  = 0b00010000;
 constexpr uint8_t SRC_MEM_MASK  = 0b00001000;
 constexpr uint8_t SRC_REG_MASK  = 0b00000111;
 
+// Size of the address space reserved for guarded VM memory. Offsets below it either hit the VM memory or the guard
+// region after it, so the instruction handlers only have to check that the offset is below this constant
+constexpr uint64_t GUARDED_ADDRESS_SPACE = 1ull << 32;
+
+// Extended instruction encoding. The prefix byte is followed by the vector opcode byte and the register byte
+constexpr uint8_t EXTENDED_PREFIX		= 0xFF;
+constexpr uint8_t VECTOR_OPCODE_MASK	= 0b00001111;
+constexpr uint8_t VECTOR_LANE_MASK		= 0b00110000;
+constexpr uint8_t VECTOR_WIDE_MASK		= 0b01000000;
+constexpr uint8_t VECTOR_RESERVED_MASK	= 0b10000000;
+constexpr uint8_t VECTOR_REG_MASK		= 0b00000111;
+constexpr uint32_t VECTOR_INSTRUCTION_SIZE = 3;
+constexpr uint32_t VECTOR_REGISTER_COUNT = 8;
+constexpr uint32_t VECTOR_REGISTER_SIZE = 32;
+
 // Error flags
 constexpr uint8_t STACK_ERROR	= 0b10000000;
 constexpr uint8_t IP_ERROR		= 0b01000000;
 constexpr uint8_t MEMORY_ACCESS = 0b00100000;
+constexpr uint8_t SYSCALL_ERROR = 0b00010000;
 
 // Comparison flags
 constexpr uint8_t ZERO_FLAG		= 0b10000000;
@@ -81,6 +107,55 @@ enum Opcodes {
 	Memcpy
 };
 
+/**
+ * BulkOperation enum defines the bulk memory operations of the Memcpy opcode. The operation is selected by the destination
+ * register bits of the instruction and the source operand is the number of bytes. The ranges start at the offsets in reg0 and reg1
+*/
+enum BulkOperation {
+	BulkCopy, // memcpy: copies the bytes at offset reg1 to offset reg0. The ranges may overlap
+	BulkFill, // memset: fills the bytes at offset reg0 with the low byte of reg1
+	BulkCompare, // memcmp: compares the bytes at offsets reg0 and reg1 and sets the flags like cmp for the first differing byte
+	BulkSearch // memchr: finds the low byte of reg1 in the bytes at offset reg0. Sets reg0 to the offset and the zero flag if found
+};
+
+/**
+ * VectorOpcodes enum defines the packed vector instructions. Memcpy with destination register 7 is not a bulk operation so
+ * its first byte is used as EXTENDED_PREFIX. The vector opcode byte after the prefix holds the opcode, the lane size (Size)
+ * and whether the instruction is 256 bits wide. The register byte holds the destination register in the low 3 bits and the
+ * source register in the next 3 bits. Load and store address the memory with a general purpose register
+*/
+enum VectorOpcodes {
+	VAdd, // lane wise dst += src
+	VSub, // lane wise dst -= src
+	VAnd, // dst &= src
+	VOr, // dst |= src
+	VXor, // dst ^= src
+	VCmpEq, // lane wise dst = (dst == src) ? all ones : 0
+	VCmpGt, // lane wise dst = (dst > src) ? all ones : 0 comparing signed lanes
+	VLoad, // dst = memory at offset src
+	VStore // memory at offset dst = src
+};
+
+/**
+ * Instruction::opcode of the vector instructions is the vector opcode added to this so they follow the 32 base opcodes
+*/
+constexpr unsigned int VECTOR_OPCODE_BASE = 32;
+
+/**
+ * @return True if the opcode reads or writes its destination operand. Memory destinations of other opcodes are not checked
+*/
+constexpr bool accessesDestination(unsigned int opcode) {
+	return opcode <= Opcodes::Cmp || opcode == Opcodes::Pop;
+}
+
+/**
+ * @return True if the opcode reads or writes its source operand. Memory sources of other opcodes are not checked
+*/
+constexpr bool accessesSource(unsigned int opcode) {
+	return opcode <= Opcodes::Jmp || opcode == Opcodes::Inc || opcode == Opcodes::Dec || opcode == Opcodes::Call ||
+		opcode == Opcodes::Push || (opcode >= Opcodes::Printi && opcode <= Opcodes::Memcpy);
+}
+
 #ifndef TYPE_H
 #define TYPE_H
 
@@ -113,7 +188,9 @@ struct NanoVMCpu{
 	unsigned char* stackBase; /**< Pointer to the base of the stack */
 	uint64_t codeSize; /**< Size of the allocated VM memory including stack */
 	uint64_t stackSize; /**< Size of the allocated stack memory */
+	uint64_t maxStackSize; /**< Size the stack may grow to */
 	uint64_t bytecodeSize; /**< Size of the loaded bytecode */
+	uint8_t vectorRegisters[VECTOR_REGISTER_COUNT][VECTOR_REGISTER_SIZE]; /**< Vector registers. 128 bit instructions use the lower half and zero the upper half */
 };
 
 /**
@@ -127,13 +204,218 @@ struct Instruction {
 	bool isDstMem; /**< Is destination register pointer to memory */
 	bool isSrcMem; /**< Is source value pointer to memory */
 	unsigned char srcSize; /**< Size of the source value (optional) */
-	uint64_t immediate; /**< Immediate value aka source value (optinal) */
-	unsigned char instructionSize; /**< Size of this instruction. This allows the vm to adjust the IP accordingly */
+	uint64_t immediate; /**< Immediate value aka source value (optinal). Width of vector instructions in bytes */
+	unsigned char instructionSize; /**< Size of this instruction. This allows the vm to adjust the IP accordingly. 0 marks a not yet decoded cache entry */
+	unsigned char fusedSize; /**< Size of the whole instruction sequence if this instruction is fused with the following ones, 0 if not fused */
+	uint16_t handler; /**< Index of the handler for this opcode, size and operand kind combination. See handlerIndex() */
+	int32_t branchOffset; /**< Offset of the branch target from this instruction if the fused sequence ends with a branch */
+};
+
+/**
+ * Number of handlers for the threaded execution engine. Each opcode has its own handler for every source size,
+ * destination memory, source memory and source type combination
+*/
+constexpr uint32_t HANDLER_COUNT = 32 * 4 * 2 * 2 * 2;
+
+/**
+ * Calculates the index of the handler that executes the given opcode and operand kind combination
+ * @param opcode Opcode of the instruction
+ * @param size Size of the source value
+ * @param isDstMem Is destination register pointer to memory
+ * @param isSrcMem Is source value pointer to memory
+ * @param isImmediate Is source value an immediate value
+ * @return Index of the handler in range [0, HANDLER_COUNT)
+*/
+constexpr uint16_t handlerIndex(unsigned int opcode, unsigned int size, bool isDstMem, bool isSrcMem, bool isImmediate) {
+	return static_cast<uint16_t>((((opcode * 4 + size) * 2 + isDstMem) * 2 + isSrcMem) * 2 + isImmediate);
+}
+
+/**
+ * Number of handlers for fused instruction sequences. Compare and branch can be preceded by inc or dec and each
+ * compare source size and type has its own handler. Mov followed by add has a handler for each source type combination
+*/
+constexpr uint32_t FUSED_HANDLER_COUNT = 3 * 4 * 4 * 2 + 2 * 2;
+
+/**
+ * Number of handlers for the vector instructions. Each vector opcode has its own handler for every lane size and width
+*/
+constexpr uint32_t VECTOR_HANDLER_COUNT = (VStore + 1) * 4 * 2;
+
+/**
+ * Total number of handlers including the fused and vector ones. The fused handlers follow the single instruction handlers
+ * and the vector handlers follow the fused ones
+*/
+constexpr uint32_t TOTAL_HANDLER_COUNT = HANDLER_COUNT + FUSED_HANDLER_COUNT + VECTOR_HANDLER_COUNT;
+
+/**
+ * Handler index of the cached instructions at breakpoints while NanoVM::runToBreakpoint() runs. Only the threaded engine
+ * dispatches it, the handler tables do not have it
+*/
+constexpr uint16_t BREAKPOINT_HANDLER = TOTAL_HANDLER_COUNT;
+
+/**
+ * NanoVM::instructionLimit when the threaded engine does not count the executed instructions
+*/
+constexpr uint64_t NO_INSTRUCTION_LIMIT = UINT64_MAX;
+
+/**
+ * Number of the faulting accesses to watched pages recorded for an instruction. Bulk memory instructions may fault on more pages
+*/
+constexpr uint32_t MAX_WATCH_FAULTS = 4;
+
+/**
+ * Calculates the index of the handler that executes a fused [inc/dec] + cmp + jz/jnz/jg/js sequence
+ * @param stepOpcode Inc or Dec if the compare is preceded by one, Cmp otherwise
+ * @param branchOpcode Conditional jump following the compare
+ * @param size Size of the compare source value
+ * @param isImmediate Is the compare source value an immediate value
+ * @return Index of the handler in range [HANDLER_COUNT, TOTAL_HANDLER_COUNT)
+*/
+constexpr uint16_t compareBranchIndex(unsigned int stepOpcode, unsigned int branchOpcode, unsigned int size, bool isImmediate) {
+	unsigned int step = (stepOpcode == Opcodes::Inc) ? 1 : (stepOpcode == Opcodes::Dec) ? 2 : 0;
+	return static_cast<uint16_t>(HANDLER_COUNT + ((step * 4 + (branchOpcode - Opcodes::Jz)) * 4 + size) * 2 + isImmediate);
+}
+
+/**
+ * Calculates the index of the handler that executes a fused mov + add sequence
+ * @param isMovImmediate Is the mov source value an immediate value
+ * @param isAddImmediate Is the add source value an immediate value
+ * @return Index of the handler in range [HANDLER_COUNT, TOTAL_HANDLER_COUNT)
+*/
+constexpr uint16_t moveAddIndex(bool isMovImmediate, bool isAddImmediate) {
+	return static_cast<uint16_t>(HANDLER_COUNT + 3 * 4 * 4 * 2 + isMovImmediate * 2 + isAddImmediate);
+}
+
+/**
+ * @param inst Cached instruction
+ * @return Number of instructions the cached instruction executes. Fused sequences execute two or three
+*/
+constexpr uint32_t executedInstructions(const Instruction& inst) {
+	if (!inst.fusedSize) {
+		return 1;
+	}
+	if (inst.handler >= moveAddIndex(false, false)) {
+		return 2;
+	}
+	return (inst.handler < compareBranchIndex(Opcodes::Inc, Opcodes::Jz, Size::Byte, false)) ? 2 : 3;
+}
+
+/**
+ * Calculates the index of the handler that executes a vector instruction
+ * @param opcode Vector opcode of the instruction
+ * @param lane Size of the lanes
+ * @param isWide Is the instruction 256 bits wide
+ * @return Index of the handler in range [HANDLER_COUNT + FUSED_HANDLER_COUNT, TOTAL_HANDLER_COUNT)
+*/
+constexpr uint16_t vectorIndex(unsigned int opcode, unsigned int lane, bool isWide) {
+	return static_cast<uint16_t>(HANDLER_COUNT + FUSED_HANDLER_COUNT + (opcode * 4 + lane) * 2 + isWide);
+}
+
+/**
+ * Allocator of the instruction caches. The memory comes zeroed from calloc and value initializing the elements leaves it
+ * untouched, so the pages of a large cache of lazily decoded instructions are only touched when the code in them runs
+*/
+template<class T> struct ZeroedAllocator {
+	typedef T value_type;
+
+	ZeroedAllocator() = default;
+	template<class U> ZeroedAllocator(const ZeroedAllocator<U>&) {}
+
+	T* allocate(size_t count) {
+		void* memory = calloc(count, sizeof(T));
+		if (!memory) {
+			throw std::bad_alloc();
+		}
+		return static_cast<T*>(memory);
+	}
+
+	void deallocate(T* memory, size_t) {
+		free(memory);
+	}
+
+	// The memory is zero already
+	template<class U> void construct(U*) {}
+
+	template<class U, class... Args> void construct(U* object, Args&&... args) {
+		::new (static_cast<void*>(object)) U(std::forward<Args>(args)...);
+	}
+
+	template<class U> bool operator==(const ZeroedAllocator<U>&) const { return true; }
+	template<class U> bool operator!=(const ZeroedAllocator<U>&) const { return false; }
+};
+
+/**
+ * Instruction cache of a VM keyed by the offsets of the code pages. Zeroed entries are not decoded yet
+*/
+typedef std::vector<Instruction, ZeroedAllocator<Instruction>> InstructionCache;
+
+/**
+ * ExecutionMode defines the available execution engines for running the bytecode
+*/
+enum class ExecutionMode {
+	Interpreter, /**< Decodes the operand kind of each instruction while executing it */
+	Threaded, /**< Dispatches directly to a handler specialized for the opcode and operand kind of each instruction */
+	Jit /**< Compiles the bytecode to native code. Falls back to the threaded engine if the host is not supported */
+};
+
+/**
+ * MemoryMode defines how the accesses to the VM memory are kept inside the memory
+*/
+enum class MemoryMode {
+	Checked, /**< Every memory access is bounds checked by the instruction handlers */
+	Guarded /**< Memory is followed by inaccessible guard pages and out of bounds accesses are caught as faults.
+	             Falls back to Checked if the host is not supported. The JIT always checks the accesses */
+};
+
+/**
+ * PageWatch defines how a page of guarded memory is protected to catch the accesses to it while the program runs to a breakpoint
+*/
+enum class PageWatch : uint8_t {
+	None, /**< Not watched */
+	Write, /**< Read only so that writes fault */
+	Access /**< Inaccessible so that reads and writes fault */
+};
+
+class NanoVM;
+
+/**
+ * Host function called by the syscall instruction. The arguments and the results are passed in reg0 - reg5, larger data
+ * is passed as offsets to the VM memory (see NanoVM::GetMemory())
+ * @param vm VM executing the syscall
+ * @param data Host data registered with the function
+ * @return True to continue running the program, false to stop it with an error
+*/
+typedef bool (*SyscallFunction)(NanoVM& vm, void* data);
+
+/**
+ * SyscallEntry is an entry of the syscall table
+*/
+struct SyscallEntry {
+	SyscallFunction function = nullptr; /**< Host function, nullptr if the number is not registered */
+	void* data = nullptr; /**< Host data passed to the function */
+};
+
+/**
+ * NanoVMOptions holds the settings the VM is created with
+*/
+struct NanoVMOptions {
+	MemoryMode memoryMode = MemoryMode::Checked; /**< How the memory accesses are kept inside the VM memory */
+	uint64_t stackSize = NANOVM_PAGE_SIZE; /**< Initial size of the stack. Rounded up to whole pages */
+	uint64_t maxStackSize = NANOVM_DEFAULT_MAX_STACK_SIZE; /**< Size the stack grows to on demand. Rounded up to whole pages */
+	std::array<SyscallEntry, NANOVM_SYSCALL_COUNT> syscalls = {}; /**< Host functions by syscall number. Pools and batches pass them to every VM */
+	std::string profileFile = "nanovm.profile"; /**< File the profile is saved to when the VM is destroyed. Only used when built with NANOVM_PROFILE, empty to not save */
 };
 
 typedef struct NanoVMCpu NanoVMCpu;
 typedef struct Instruction Instruction;
 
+class CheckpointWriter;
+class JitCompiler;
+class NanoProgram;
+class NanoSnapshot;
+class Profile;
+class TraceRecorder;
+
 /**
  * \brief NanoVM is the VM core which will load and run nano bytecode
  *
@@ -141,42 +423,231 @@ typedef struct Instruction Instruction;
  * It implements feching and executing of instructions, stack memory handling and running of the bytecode
 */
 class NanoVM {
+	friend struct Handlers;
+	friend class JitCompiler;
+	friend struct GuardScope;
 public:
 	/**
 	 * \brief Initializes the NanoVM from bytecode
 	 * @param code Points to the bytecode to be loaded
 	 * @param size Holds the size of the bytecode to be loaded
+	 * @param options Settings of the VM
 	*/
-	NanoVM(unsigned char* code, uint64_t size);
+	NanoVM(unsigned char* code, uint64_t size, const NanoVMOptions& options = NanoVMOptions());
 
 	/**
 	 * Initializes the NanoVM from bytecode file
 	 * @param file File to load the bytecode from
+	 * @param options Settings of the VM
 	*/
-	NanoVM(std::string file);
+	NanoVM(std::string file, const NanoVMOptions& options = NanoVMOptions());
+
+	/**
+	 * Initializes the NanoVM from a loaded program. The VM keeps a reference to the program and starts from its
+	 * decoded instructions. The code pages are copied so the VM may write to them without affecting the other VMs
+	 * @param program Program to run
+	 * @param options Settings of the VM
+	*/
+	NanoVM(std::shared_ptr<const NanoProgram> program, const NanoVMOptions& options = NanoVMOptions());
+
+	/**
+	 * Initializes the NanoVM from a snapshot so that the next Run() continues from where the snapshotted VM was. Reset()
+	 * still starts the program from its entry. See Restore()
+	 * @param snapshot Snapshot to continue from
+	 * @param options Settings of the VM. The stack may not be able to grow to the size of the snapshot if the maximum
+	 * stack size is smaller, the VM then starts from the entry of the program and IsValid() returns false
+	*/
+	NanoVM(std::shared_ptr<const NanoSnapshot> snapshot, const NanoVMOptions& options = NanoVMOptions());
+
+	/**
+	 * Initializes the NanoVM from the latest checkpoint of a file so that the next Run() continues a run that was lost with
+	 * its process. Starts from the entry of the program if the file is missing or holds no checkpoint of it, IsValid()
+	 * returns false then. See Resume()
+	 * @param program Program that was checkpointed
+	 * @param checkpoint File written by StartCheckpoints()
+	 * @param options Settings of the VM
+	*/
+	NanoVM(std::shared_ptr<const NanoProgram> program, const std::string& checkpoint, const NanoVMOptions& options = NanoVMOptions());
 
 	/**
 	 * NanoVM destructor
 	*/
 	~NanoVM();
 
+	/**
+	 * A VM created from a checkpoint or a snapshot it could not be moved to starts the program from its entry instead
+	 * @return False if the VM could not be moved to the checkpoint or the snapshot it was created from, true otherwise
+	*/
+	bool IsValid() const;
+
 	/**
 	 * Runs the whole loaded bytecode program
+	 * @param mode Execution engine used for running the program
 	 * @return Return value of the bytecode program
 	*/
-	uint64_t Run();
+	uint64_t Run(ExecutionMode mode = ExecutionMode::Interpreter);
+
+	/**
+	 * Enables or disables fusing of common instruction sequences in to single handlers. Fusion is enabled by default.
+	 * Fused sequences execute as one step which is not desired when e.g. stepping through the program
+	 * @param enabled True to fuse the instruction sequences, false to execute every instruction separately
+	*/
+	void SetFusion(bool enabled);
+
+	/**
+	 * Resets the VM so that the next Run() starts the program from its entry again. The code pages written by the previous
+	 * run are restored from the program and the stack shrinks back to its initial size and is zeroed. The compiled code
+	 * of the JIT is kept for the parts of the program that were not written
+	*/
+	void Reset();
+
+	/**
+	 * Takes a snapshot of the registers, the code pages and the stack. The snapshot is taken between the runs, e.g. after
+	 * the program has initialized its tables and halted. The VMs continuing from the snapshot start at the IP it holds so
+	 * the embedder moves the IP past the halt instruction with SetRegister() before taking it or before running them
+	 * @return Snapshot which any number of VMs running the same program can be restored from
+	*/
+	std::shared_ptr<const NanoSnapshot> Snapshot() const;
+
+	/**
+	 * Creates a VM continuing from the current state of this one. The fork has the memory mode, the stack sizes, the
+	 * syscalls and the fusion setting of this VM and writes to the default output. To create many VMs from the same state,
+	 * take a Snapshot() once and create the VMs from it instead
+	 * @return New VM
+	*/
+	std::unique_ptr<NanoVM> Fork() const;
+
+	/**
+	 * Moves the VM back to the state of a snapshot. In guarded memory the code pages and the stack are mapped copy-on-write
+	 * from the snapshot where the host supports it, so only the pages written after restoring are copied
+	 * @param snapshot Snapshot of a VM running the same program
+	 * @return True if the VM was restored, false if the snapshot is of another program or its stack does not fit in the
+	 * maximum stack size of this VM. The VM is left unchanged then
+	*/
+	bool Restore(const NanoSnapshot& snapshot);
+
+	/**
+	 * Sets the sink the print instructions write to. The default sink buffers the output and writes it to stdout when the
+	 * buffer is full or Run() returns. The output written to the previous sink is flushed
+	 * @param sink Sink receiving the output. Must outlive the VM or be replaced before it is destroyed
+	*/
+	void SetOutput(OutputSink& sink);
+
+	/**
+	 * Sets a register e.g. to pass input values to the program before it is run
+	 * @param reg Register to set
+	 * @param value New value of the register
+	*/
+	void SetRegister(Register reg, uint64_t value);
+
+	/**
+	 * @param reg Register to read
+	 * @return Current value of the register
+	*/
+	uint64_t GetRegister(Register reg) const;
+
+	/**
+	 * Gives direct access to the VM memory e.g. for syscalls receiving buffers from the program. The pointer is valid until
+	 * the program continues running since growing the stack may move the memory
+	 * @param offset Offset of the range in the VM memory
+	 * @param size Size of the range
+	 * @return Pointer to the range, nullptr if the range is not inside the VM memory
+	*/
+	unsigned char* GetMemory(uint64_t offset, uint64_t size);
+
+	/**
+	 * Registers a host function for a syscall number. Replaces the function registered before
+	 * @param number Syscall number the program passes to the syscall instruction
+	 * @param function Host function, nullptr to remove the registration
+	 * @param data Host data passed to the function
+	 * @return True if registered, false if the number is not below NANOVM_SYSCALL_COUNT
+	*/
+	bool RegisterSyscall(uint64_t number, SyscallFunction function, void* data = nullptr);
+
+	/**
+	 * Starts recording the execution trace of the following runs to a file which NanoReplay can replay. Every executed
+	 * instruction appends a 16 byte record so tracing is meant to be enabled for a sample of the runs. Compiled code is
+	 * not traced so the JIT runs the threaded engine while tracing. Replaces the trace started before
+	 * @param file File to write the trace to
+	 * @return True if the file was created
+	*/
+	bool StartTrace(const std::string& file);
+
+	/**
+	 * Stops recording the trace and waits until it has been written to the file
+	*/
+	void StopTrace();
+
+	/**
+	 * Starts writing checkpoints of the following runs to a file every interval instructions so that a long run can be
+	 * resumed after a crash (see Resume()). A run stops between two instructions, hands the registers and the pages
+	 * written since the previous checkpoint to a writer thread and continues while the checkpoint is written. Guarded memory
+	 * tracks the written pages by write protecting the checkpointed pages and checked memory marks them from the instructions
+	 * writing memory, so a checkpoint pauses the run only as long as copying the written pages takes. The runs use the
+	 * threaded engine since it is the one stopping between the instructions. Replaces the checkpoints started before
+	 * @param file File to write the checkpoints to. An existing file is replaced once the first checkpoint has been written
+	 * @param interval Number of instructions executed between the checkpoints
+	*/
+	void StartCheckpoints(const std::string& file, uint64_t interval);
+
+	/**
+	 * Stops writing checkpoints and waits until the pending checkpoint has been written
+	 * @return True if every checkpoint was written to the file
+	*/
+	bool StopCheckpoints();
+
+	/**
+	 * Moves the VM to the latest checkpoint of a file written by StartCheckpoints()
+	 * @param file Checkpoint file
+	 * @return True if the VM was moved, false if the file holds no checkpoint of the program or it does not fit in the
+	 * maximum stack size of the VM. The VM is left unchanged then
+	*/
+	bool Resume(const std::string& file);
+
+#ifdef NANOVM_PROFILE
+	/**
+	 * @return Execution counters of all the runs since the VM was created. See Profile
+	*/
+	const Profile& GetProfile() const;
+#endif
 protected:
 	/**
 	 * Pops a value from the stack and adjusts the stack pointer
-	 * @return Single value from the stack
+	 * @param[out] value Single value from the stack
+	 * @return True if the value was popped, false if the stack pointer is not above the bottom of the stack or is past its end
 	*/
-	template<class T> T pop();
+	template<class T> bool pop(T& value);
 
 	/**
-	 * Pushes a value to the stack
+	 * Pushes a value to the stack. The stack grows if it is full
 	 * @param value Value to push to the stack
+	 * @tparam Guarded Leave the bounds check to the guard pages
+	 * @return True if the value was pushed, false if the stack can not grow any more
+	*/
+	template<class T, bool Guarded = false> bool push(T value);
+
+	/**
+	 * Allocates the code pages and the stack. Guarded memory falls back to checked memory if it can not be allocated
+	 * @param codeSize Size of the code pages
+	 * @param options Requested memory mode and stack sizes
+	*/
+	void allocateMemory(uint64_t codeSize, const NanoVMOptions& options);
+
+	/**
+	 * Grows the stack so that the given memory range fits in the VM memory. The stack size is doubled until the range fits.
+	 * Checked memory is reallocated which moves the code base, guarded memory commits the pages after the stack
+	 * @param offset Offset of the range in the VM memory
+	 * @param size Size of the range
+	 * @return True if the range fits in the memory, false if it is beyond the maximum stack size
+	*/
+	bool growStack(uint64_t offset, uint64_t size);
+
+	/**
+	 * Shrinks the stack to the given size. Checked memory is reallocated which may move the code base, guarded memory
+	 * decommits the pages after the stack. The remaining stack keeps its contents
+	 * @param stackSize New size of the stack. Does nothing if the stack is not larger
 	*/
-	template<class T> void push(T value);
+	void shrinkStack(uint64_t stackSize);
 
 	/**
 	 * Fetches the next instruction pointed by the instruction pointer (IP). Note that fetch does not check if the instruction is valid
@@ -185,6 +656,60 @@ protected:
 	*/
 	bool fetch(Instruction &instruction) const;
 
+	/**
+	 * Decodes the instruction at the given offset. Note that decode does not check if the instruction is valid
+	 * @param offset Offset of the instruction in the VM memory
+	 * @param[out] Reference to instruction struct to be updated
+	 * @return True if instruction was decoded successfully, false if the offset is outside of the code pages
+	*/
+	bool decode(uint64_t offset, Instruction &instruction) const;
+
+	/**
+	 * Decodes a cached instruction for the threaded engine. While runToBreakpoint() runs the instructions at the breakpoints
+	 * are decoded to BREAKPOINT_HANDLER so that the engine stops before executing them. If fusion is enabled the following
+	 * instructions are decoded as well and the instruction is fused with them like the program fuses the predecoded ones,
+	 * unless the sequence runs over a breakpoint
+	 * @param offset Offset of the instruction in the VM memory
+	 * @param[out] instruction Cache entry to be updated
+	*/
+	void decodeCached(uint64_t offset, Instruction& instruction);
+
+	/**
+	 * Fills the instruction cache from the instructions the program has decoded so that Run() does not have to parse the
+	 * same instructions again. The cache is fused if fusion is enabled. Offsets that are not reached by walking the bytecode
+	 * from the beginning and code pages written by the VM are decoded lazily when executed. Programs loaded from a
+	 * container are not decoded, the cache starts empty and every instruction is decoded lazily
+	*/
+	void predecode();
+
+	/**
+	 * Restores a range of the instruction cache from the instructions the program has decoded, or marks it as not decoded
+	 * if the program is decoded lazily
+	 * @param begin Start of the range
+	 * @param end End of the range
+	*/
+	void restoreInstructions(uint64_t begin, uint64_t end);
+
+	/**
+	 * Marks the cached instructions overlapping the given memory range as not decoded. Called when the VM writes to code pages.
+	 * Fused instructions whose sequence overlaps the range are invalidated as well. The range is restored by Reset()
+	 * @param offset Offset of the first written byte in the VM memory
+	 * @param size Number of bytes written
+	*/
+	void invalidate(uint64_t offset, uint64_t size);
+
+	/**
+	 * Reports that the IP points outside of the code pages. The buffered output is flushed first to keep it in order
+	*/
+	void reportIpOutOfBounds() const;
+
+	/**
+	 * Appends the trace record of an executed instruction. Only called while tracing
+	 * @param offset Offset of the instruction
+	 * @param inst Executed instruction
+	*/
+	inline void traceStep(uint64_t offset, const Instruction& inst);
+
 	/**
 	 * Executes a single instruction and updates the internal state of the VM including IP
 	 * @param instruction Instruction to be executed
@@ -192,6 +717,211 @@ protected:
 	*/
 	bool execute(Instruction &instruction);
 
+	/**
+	 * Runs the loaded bytecode program with the interpreter
+	 * @tparam Guarded Use the handlers which leave the bounds checks to the guard pages
+	 * @return Return value of the bytecode program
+	*/
+	template<bool Guarded> uint64_t runInterpreter();
+
+	/**
+	 * Runs the loaded bytecode program with the threaded execution engine
+	 * @tparam Guarded Use the handlers which leave the bounds checks to the guard pages
+	 * @return Return value of the bytecode program
+	*/
+	template<bool Guarded> uint64_t runThreaded();
+
+	/**
+	 * Runs the loaded bytecode program in guarded memory catching the faults of out of bounds accesses
+	 * @param mode Interpreter or Threaded
+	 * @return Return value of the bytecode program
+	*/
+	uint64_t runGuarded(ExecutionMode mode);
+
+	/**
+	 * Runs the loaded bytecode program with the threaded execution engine stopping for a checkpoint every checkpointInterval instructions
+	 * @return Return value of the bytecode program
+	*/
+	uint64_t runCheckpointed();
+
+	/**
+	 * Hands the registers and the pages written since the previous checkpoint to the checkpoint writer and write protects
+	 * the pages again in guarded memory
+	*/
+	void checkpoint();
+
+	/**
+	 * Records a write to a page that is write protected for the checkpoints and makes the page writable so that the write
+	 * completes when the fault handler returns
+	 * @param offset Offset of the faulting access
+	 * @return True if the page was protected for the checkpoints, false if the fault was not caused by them
+	*/
+	bool trackWrite(uint64_t offset);
+
+	/**
+	 * Marks the pages of a memory range as written so that the next checkpoint holds them and makes them writable in
+	 * guarded memory. Called before the VM writes memory outside of a run and by the instructions writing checked memory
+	 * @param offset Offset of the range
+	 * @param size Size of the range
+	*/
+	void markWritten(uint64_t offset, uint64_t size);
+
+	/**
+	 * Restores the cached instructions of the code pages written since the last reset from the program and marks a range
+	 * of them as not decoded. Called when the code pages are replaced
+	 * @param begin Start of the code pages range that differs from the program
+	 * @param end End of the code pages range that differs from the program
+	*/
+	void replaceCode(uint64_t begin, uint64_t end);
+
+	/**
+	 * Runs the loaded bytecode program with the JIT compiler. Instructions the compiler does not support are interpreted
+	 * @return Return value of the bytecode program
+	*/
+	uint64_t runJit();
+
+	/**
+	 * Sets or clears a breakpoint. The breakpoints are kept in a bitmap of the code pages and only runToBreakpoint() stops at them
+	 * @param offset Offset of the instruction in the code pages
+	 * @param enabled True to set the breakpoint, false to clear it
+	 * @return True if the offset is inside the code pages
+	*/
+	bool setBreakpoint(uint64_t offset, bool enabled);
+
+	/**
+	 * @param offset Offset in the VM memory
+	 * @return True if a breakpoint is set at the offset
+	*/
+	bool isBreakpoint(uint64_t offset) const;
+
+	/**
+	 * Runs the program with the threaded engine until it reaches a breakpoint, halts or fails. The breakpoints trap in the
+	 * instruction cache so the instructions between them run as fast as in Run(). Also an instruction at the IP stops the run
+	 * if it has a breakpoint so a debugger steps over the breakpoint it stopped at before running again
+	 * @param[out] result Return value of the program like from Run() if it did not stop at a breakpoint
+	 * The run also stops after an instruction accessing a watched page, see setPageWatch()
+	 * @return True if the run stopped before the instruction at a breakpoint pointed by the IP or after a watched access.
+	 * Otherwise the program halted with the IP pointing to the halt instruction or stopped with an error
+	*/
+	bool runToBreakpoint(uint64_t& result);
+
+	/**
+	 * Sets how a page is watched. Only guarded memory can be watched. The watched pages are protected while runToBreakpoint()
+	 * or executeWatched() runs and the accesses faulting on them are recorded in watchFaults
+	 * @param offset Offset in the page
+	 * @param watch Protection of the page
+	 * @return True if the memory is guarded and the page is inside the memory the stack can grow to
+	*/
+	bool setPageWatch(uint64_t offset, PageWatch watch);
+
+	/**
+	 * Protects the watched pages of a memory range or makes them accessible again
+	 * @param armed True to protect the pages, false to make them accessible
+	 * @param begin Offset of the first page of the range
+	 * @param end End of the range
+	*/
+	void armWatchpoints(bool armed, uint64_t begin, uint64_t end);
+
+	/**
+	 * Records an access to a watched page and makes the page accessible so that the access completes when the fault handler
+	 * returns. The page faults once per run
+	 * @param offset Offset of the faulting access
+	 * @return True if the page is watched, false if the fault was not caused by a watchpoint
+	*/
+	bool watchFault(uint64_t offset);
+
+	/**
+	 * Executes a single instruction like execute() with the watched pages protected
+	 * @param instruction Instruction to be executed
+	 * @return True if the instruction was executed successfully
+	*/
+	bool executeWatched(Instruction& instruction);
+
+	/**
+	 * Marks the cached instruction at a breakpoint and the fused instruction sequences running over it as not decoded so that
+	 * the threaded engine decodes the instruction to BREAKPOINT_HANDLER when it reaches it
+	 * @param offset Offset of the breakpoint
+	*/
+	void splitBreakpoint(uint64_t offset);
+
+	/**
+	 * Splits the cached instructions at all the breakpoints. The other engines decode the instructions without the trap
+	*/
+	void armBreakpoints();
+
 	unsigned char errorFlag; /**< 8 bit flag that will be set with error masks if an error occurs */
+	bool fusion; /**< Are the common instruction sequences fused when the bytecode is predecoded */
+	MemoryMode memoryMode; /**< How the memory was allocated. Guarded only if the guarded memory could be allocated */
 	NanoVMCpu cpu; /**< Holds the internal state of the CPU */
+	uint64_t initialStackSize; /**< Size of the stack before it has grown. Reset() shrinks the stack back to this size */
+	uint64_t dirtyBegin; /**< Start of the code pages range written since the last reset. Empty if not below dirtyEnd */
+	uint64_t dirtyEnd; /**< End of the code pages range written since the last reset */
+	bool snapshotMapped; /**< Are the code pages and the stack mapped from a snapshot. Reset() replaces the stack with zero pages then */
+	bool valid; /**< Was the VM moved to the checkpoint or the snapshot it was created from. See IsValid() */
+	std::unique_ptr<CheckpointWriter> checkpoints; /**< Writer of the checkpoints, nullptr if not checkpointing */
+	uint64_t checkpointInterval; /**< Number of instructions executed between the checkpoints */
+	uint64_t nextCheckpoint; /**< Value of instructionCount at which the next checkpoint is taken */
+	bool trackingWrites; /**< Are the pages written since the previous checkpoint tracked. Guarded memory write protects the checkpointed pages */
+	std::vector<uint8_t> writtenFlags; /**< Is a page written since the previous checkpoint, for the pages up to the maximum stack size */
+	std::vector<uint64_t> writtenPages; /**< Pages written since the previous checkpoint. Has room for every page so the fault handler does not allocate */
+	std::shared_ptr<const NanoProgram> program; /**< Loaded program the VM was initialized from */
+	BufferedSink stdoutBuffer; /**< Default sink buffering the output written to stdout */
+	OutputSink* output; /**< Sink the print instructions write to */
+	std::array<SyscallEntry, NANOVM_SYSCALL_COUNT> syscalls; /**< Host functions by syscall number */
+	InstructionCache instructionCache; /**< Decoded instructions keyed by their offset in the code pages */
+	std::unique_ptr<JitCompiler> jit; /**< Compiled code. Created on the first run with the JIT */
+	std::unique_ptr<TraceRecorder> trace; /**< Execution trace, nullptr if not tracing */
+	std::vector<bool> breakpoints; /**< Bitmap of the offsets in the code pages with a breakpoint. Empty until a breakpoint is set */
+	size_t breakpointCount; /**< Number of the breakpoints set */
+	bool breakpointsArmed; /**< Does the threaded engine stop at the breakpoints. Only while runToBreakpoint() runs */
+	uint64_t instructionCount; /**< Instructions executed by the threaded engine while counting. Fused sequences count all their instructions. The other engines do not count */
+	uint64_t instructionLimit; /**< The threaded engine stops before the next instruction once instructionCount reaches this. A fused
+	                                sequence may run up to two instructions past it. NO_INSTRUCTION_LIMIT to not count */
+	std::vector<PageWatch> watchedPages; /**< Protection of the pages up to the maximum stack size. Empty until a page is watched */
+	size_t watchedPageCount; /**< Number of the watched pages */
+	bool watchpointsArmed; /**< Are the watched pages protected */
+	std::array<uint64_t, MAX_WATCH_FAULTS> watchFaults; /**< Offsets of the accesses that faulted on the watched pages */
+	volatile size_t watchFaultCount; /**< Number of the accesses that faulted on the watched pages. Cleared by the caller */
+	uint64_t watchedInstruction; /**< Offset of the instruction after which the threaded engine stopped for a watched access */
+#ifdef NANOVM_PROFILE
+	std::unique_ptr<Profile> profile; /**< Execution counters recorded by the interpreter and the threaded engine */
+	std::string profileFile; /**< File the profile is saved to when the VM is destroyed */
+#endif
 };
+
+template<class T, bool Guarded> inline bool NanoVM::push(T value) {
+	// Check bounds. Guard pages after the stack catch the overflow in guarded memory but the stack pointer must stay inside the reservation
+	if (Guarded ? cpu.registers[esp] > GUARDED_ADDRESS_SPACE - sizeof(value) :
+		cpu.registers[esp] > cpu.codeSize + cpu.stackSize - sizeof(value) && !growStack(cpu.registers[esp], sizeof(value))) {
+		// Stack is at its maximum size
+		errorFlag = STACK_ERROR;
+		return false;
+	}
+	// Guarded memory tracks the written pages by write protecting them
+	if (!Guarded && trackingWrites) {
+		markWritten(cpu.registers[esp], sizeof(value));
+	}
+	// push to stack
+	*reinterpret_cast<T*>(cpu.codeBase + cpu.registers[esp]) = value;
+	// The stack pointer may have been moved in to the code pages
+	if (cpu.registers[esp] < cpu.codeSize) {
+		invalidate(cpu.registers[esp], sizeof(value));
+	}
+	// update stack pointer
+	cpu.registers[esp] += sizeof(value);
+	return true;
+}
+
+template<class T> inline bool NanoVM::pop(T& value) {
+	// Check bounds. The value has to be read from between the code pages and the end of the stack
+	if (cpu.registers[esp] < cpu.codeSize + sizeof(T) || cpu.registers[esp] > cpu.codeSize + cpu.stackSize) {
+		// Reached the bottom of stack or the stack pointer is outside of it
+		errorFlag = STACK_ERROR;
+		return false;
+	}
+	// pop value from stack
+	value = *reinterpret_cast<T*>(cpu.codeBase + cpu.registers[esp] - sizeof(T));
+	// update esp
+	cpu.registers[esp] -= sizeof(value);
+	return true;
+}
@@ -0,0 +1,34 @@
+#include "NanoVMPool.h"
+
+NanoVMPool::NanoVMPool(std::shared_ptr<const NanoProgram> program, const NanoVMOptions& options) :
+	program(std::move(program)), options(options) {}
+
+NanoVMPool::NanoVMPool(std::shared_ptr<const NanoSnapshot> snapshot, const NanoVMOptions& options) :
+	program(snapshot->GetProgram()), snapshot(std::move(snapshot)), options(options) {}
+
+std::unique_ptr<NanoVM> NanoVMPool::Acquire() {
+	if (!program->IsValid()) {
+		return nullptr;
+	}
+	{
+		std::lock_guard<std::mutex> lock(mutex);
+		if (!released.empty()) {
+			std::unique_ptr<NanoVM> vm = std::move(released.back());
+			released.pop_back();
+			return vm;
+		}
+	}
+	if (snapshot) {
+		return std::make_unique<NanoVM>(snapshot, options);
+	}
+	return std::make_unique<NanoVM>(program, options);
+}
+
+void NanoVMPool::Release(std::unique_ptr<NanoVM> vm) {
+	// The VM is reset outside of the lock so that releasing threads do not wait for each other
+	if (!snapshot || !vm->Restore(*snapshot)) {
+		vm->Reset();
+	}
+	std::lock_guard<std::mutex> lock(mutex);
+	released.push_back(std::move(vm));
+}
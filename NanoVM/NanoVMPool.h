@@ -0,0 +1,47 @@
+#pragma once
+#include "NanoProgram.h"
+#include "NanoSnapshot.h"
+#include <mutex>
+
+/**
+ * \brief NanoVMPool hands out reusable VMs running a shared program
+ *
+ * Creating a VM allocates its memory and copies the code pages of the program. The pool keeps the released VMs and
+ * resets them instead so that running the same program again costs only as much as the previous run touched.
+ * A pool created from a snapshot hands out VMs continuing from the snapshot and restores the released VMs to it.
+ * The pool can be used from several threads, each acquired VM is used by one thread at a time.
+*/
+class NanoVMPool {
+public:
+	/**
+	 * Creates an empty pool. VMs are created when there are no released ones to hand out
+	 * @param program Program the VMs run
+	 * @param options Settings of the VMs
+	*/
+	NanoVMPool(std::shared_ptr<const NanoProgram> program, const NanoVMOptions& options = NanoVMOptions());
+
+	/**
+	 * Creates an empty pool of VMs continuing from a snapshot, e.g. of a program that has initialized its tables
+	 * @param snapshot Snapshot the VMs start from
+	 * @param options Settings of the VMs
+	*/
+	NanoVMPool(std::shared_ptr<const NanoSnapshot> snapshot, const NanoVMOptions& options = NanoVMOptions());
+
+	/**
+	 * Hands out a VM which runs the program from the beginning
+	 * @return Released VM of the pool or a new one, nullptr if the program is not valid. Runs from the snapshot of the pool if it has one
+	*/
+	std::unique_ptr<NanoVM> Acquire();
+
+	/**
+	 * Resets the VM, or restores it to the snapshot of the pool, and keeps it for the next Acquire()
+	 * @param vm VM acquired from this pool
+	*/
+	void Release(std::unique_ptr<NanoVM> vm);
+private:
+	std::shared_ptr<const NanoProgram> program; /**< Program the VMs run */
+	std::shared_ptr<const NanoSnapshot> snapshot; /**< Snapshot the VMs start from, nullptr to start from the entry of the program */
+	NanoVMOptions options; /**< Settings of the VMs */
+	std::mutex mutex; /**< Guards the released VMs */
+	std::vector<std::unique_ptr<NanoVM>> released; /**< VMs ready to be handed out again */
+};
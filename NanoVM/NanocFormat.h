@@ -0,0 +1,77 @@
+#pragma once
+#include <cstdint>
+#include <cstring>
+
+/**
+ * Definition of the .nanoc container the assembler writes and the VM loads. The file starts with NanocHeader which is
+ * followed by the code section and the read-only data section. The sections are loaded in to the VM memory as one image
+ * starting from offset 0, the data right after the code. The code section starts at a page aligned file offset so that
+ * the image can be mapped directly from the file. All values are little endian.
+ * Files without the magic are loaded as raw bytecode which is how the files of older assemblers are still run.
+*/
+
+/**
+ * Current version of the container. Files with another version are not loaded
+*/
+constexpr uint16_t NANOC_VERSION = 1;
+
+/**
+ * Alignment of the code section in the file. Equal to the page size of the VM
+*/
+constexpr uint64_t NANOC_SECTION_ALIGNMENT = 4096;
+
+/**
+ * NanocHeader is at the beginning of every .nanoc container
+*/
+struct NanocHeader {
+	char magic[8]; /**< "NANOC\0\0\0" */
+	uint16_t version; /**< NANOC_VERSION */
+	uint16_t headerSize; /**< sizeof(NanocHeader) */
+	uint32_t flags; /**< Reserved, always 0 */
+	uint64_t entryOffset; /**< Offset of the first executed instruction in the code section */
+	uint64_t codeOffset; /**< File offset of the code section. Multiple of NANOC_SECTION_ALIGNMENT */
+	uint64_t codeSize; /**< Size of the code section */
+	uint64_t dataOffset; /**< File offset of the read-only data section. Always codeOffset + codeSize */
+	uint64_t dataSize; /**< Size of the read-only data section. The file ends with the section */
+	uint64_t checksum; /**< nanocChecksum() of the code and data sections */
+};
+
+/**
+ * Magic the container starts with
+*/
+constexpr char NANOC_MAGIC[8] = { 'N', 'A', 'N', 'O', 'C', '\0', '\0', '\0' };
+
+/**
+ * Calculates the checksum of the sections with 64 bit FNV-1a
+ * @param data Sections to calculate the checksum of
+ * @param size Size of the sections
+ * @return Checksum of the sections
+*/
+inline uint64_t nanocChecksum(const unsigned char* data, uint64_t size) {
+	uint64_t hash = 0xcbf29ce484222325ull;
+	for (uint64_t i = 0; i < size; i++) {
+		hash = (hash ^ data[i]) * 0x100000001b3ull;
+	}
+	return hash;
+}
+
+/**
+ * Fills the header of a container
+ * @param[out] header Header to fill
+ * @param entryOffset Offset of the first executed instruction in the code section
+ * @param sections Code section followed by the data section
+ * @param codeSize Size of the code section
+ * @param dataSize Size of the data section
+*/
+inline void nanocHeader(NanocHeader& header, uint64_t entryOffset, const unsigned char* sections, uint64_t codeSize, uint64_t dataSize) {
+	memset(&header, 0x00, sizeof(header));
+	memcpy(header.magic, NANOC_MAGIC, sizeof(header.magic));
+	header.version = NANOC_VERSION;
+	header.headerSize = sizeof(NanocHeader);
+	header.entryOffset = entryOffset;
+	header.codeOffset = NANOC_SECTION_ALIGNMENT;
+	header.codeSize = codeSize;
+	header.dataOffset = header.codeOffset + codeSize;
+	header.dataSize = dataSize;
+	header.checksum = nanocChecksum(sections, codeSize + dataSize);
+}
@@ -0,0 +1,95 @@
+#include "OutputSink.h"
+#include <algorithm>
+#include <cstdio>
+#include <cstring>
+#ifdef _WIN32
+#include <io.h>
+#else
+#include <unistd.h>
+#endif
+
+void OutputSink::writeInteger(uint64_t value) {
+	// The digits are written backwards from the end of the buffer. 2^64 has 20 digits
+	char text[20];
+	char* digit = text + sizeof(text);
+	do {
+		*--digit = static_cast<char>('0' + value % 10);
+		value /= 10;
+	} while (value);
+	write(digit, text + sizeof(text) - digit);
+}
+
+void StdoutSink::write(const char* data, size_t size) {
+	std::fwrite(data, 1, size, stdout);
+}
+
+StdoutSink& StdoutSink::instance() {
+	static StdoutSink sink;
+	return sink;
+}
+
+FileDescriptorSink::FileDescriptorSink(int fd) : fd(fd) {}
+
+void FileDescriptorSink::write(const char* data, size_t size) {
+	while (size) {
+#ifdef _WIN32
+		int written = _write(fd, data, static_cast<unsigned int>(std::min<size_t>(size, INT32_MAX)));
+#else
+		ssize_t written = ::write(fd, data, size);
+#endif
+		if (written <= 0) {
+			// The output is dropped if the descriptor can not be written
+			return;
+		}
+		data += written;
+		size -= written;
+	}
+}
+
+void StringSink::write(const char* data, size_t size) {
+	output.append(data, size);
+}
+
+BufferSink::BufferSink(char* buffer, size_t capacity) : buffer(buffer), capacity(capacity), length(0), overflow(false) {}
+
+void BufferSink::write(const char* data, size_t size) {
+	size_t copied = std::min(size, capacity - length);
+	memcpy(buffer + length, data, copied);
+	length += copied;
+	overflow |= copied < size;
+}
+
+size_t BufferSink::size() const {
+	return length;
+}
+
+bool BufferSink::truncated() const {
+	return overflow;
+}
+
+BufferedSink::BufferedSink(OutputSink& target, size_t capacity) : target(target), buffer(std::max<size_t>(capacity, 1)), length(0) {}
+
+BufferedSink::~BufferedSink() {
+	flush();
+}
+
+void BufferedSink::write(const char* data, size_t size) {
+	if (size > buffer.size() - length) {
+		flush();
+		// Output larger than the whole buffer is not copied
+		if (size >= buffer.size()) {
+			target.write(data, size);
+			return;
+		}
+	}
+	memcpy(buffer.data() + length, data, size);
+	length += size;
+}
+
+void BufferedSink::flush() {
+	if (length) {
+		target.write(buffer.data(), length);
+		length = 0;
+	}
+	target.flush();
+}
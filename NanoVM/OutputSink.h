@@ -0,0 +1,130 @@
+#pragma once
+#include <cstddef>
+#include <cstdint>
+#include <string>
+#include <vector>
+
+/**
+ * Size of the output buffer of a VM. Output is written to stdout once the buffer is full or the program stops
+*/
+constexpr size_t NANOVM_OUTPUT_BUFFER_SIZE = 64 * 1024;
+
+/**
+ * \brief OutputSink receives the output of the print instructions of a VM
+ *
+ * Every VM writes to its own sink so the output of VMs running in the same process can be kept apart.
+ * The default sink of a VM buffers the output and writes it to stdout in bulk.
+*/
+class OutputSink {
+public:
+	virtual ~OutputSink() {}
+
+	/**
+	 * Writes printed characters to the sink
+	 * @param data Characters to write. Not null terminated
+	 * @param size Number of characters
+	*/
+	virtual void write(const char* data, size_t size) = 0;
+
+	/**
+	 * Writes any buffered output to its destination. Called when the VM stops running
+	*/
+	virtual void flush() {}
+
+	/**
+	 * Writes an unsigned integer in decimal
+	 * @param value Value to write
+	*/
+	void writeInteger(uint64_t value);
+};
+
+/**
+ * \brief StdoutSink writes the output to the stdout of the process
+*/
+class StdoutSink : public OutputSink {
+public:
+	void write(const char* data, size_t size) override;
+
+	/**
+	 * @return Sink shared by all VMs that write to stdout
+	*/
+	static StdoutSink& instance();
+};
+
+/**
+ * \brief FileDescriptorSink writes the output to a file descriptor, e.g. a pipe or a file opened by the host
+*/
+class FileDescriptorSink : public OutputSink {
+public:
+	/**
+	 * @param fd File descriptor to write to. Not closed by the sink
+	*/
+	FileDescriptorSink(int fd);
+
+	void write(const char* data, size_t size) override;
+private:
+	int fd; /**< File descriptor to write to */
+};
+
+/**
+ * \brief StringSink captures the output in to a string
+*/
+class StringSink : public OutputSink {
+public:
+	void write(const char* data, size_t size) override;
+
+	std::string output; /**< Output captured so far */
+};
+
+/**
+ * \brief BufferSink captures the output in to a buffer supplied by the caller. Output not fitting in the buffer is dropped
+*/
+class BufferSink : public OutputSink {
+public:
+	/**
+	 * @param buffer Buffer to capture the output to. Not null terminated
+	 * @param capacity Size of the buffer
+	*/
+	BufferSink(char* buffer, size_t capacity);
+
+	void write(const char* data, size_t size) override;
+
+	/**
+	 * @return Number of characters captured in to the buffer
+	*/
+	size_t size() const;
+
+	/**
+	 * @return True if output was dropped because the buffer was full
+	*/
+	bool truncated() const;
+private:
+	char* buffer; /**< Buffer to capture the output to */
+	size_t capacity; /**< Size of the buffer */
+	size_t length; /**< Number of characters captured */
+	bool overflow; /**< Was output dropped */
+};
+
+/**
+ * \brief BufferedSink collects the output in a buffer and writes it to another sink in bulk
+ *
+ * The buffer is written when it is full, on flush() and when the sink is destroyed.
+*/
+class BufferedSink : public OutputSink {
+public:
+	/**
+	 * @param target Sink receiving the buffered output
+	 * @param capacity Size of the buffer
+	*/
+	BufferedSink(OutputSink& target, size_t capacity = NANOVM_OUTPUT_BUFFER_SIZE);
+
+	~BufferedSink();
+
+	void write(const char* data, size_t size) override;
+
+	void flush() override;
+private:
+	OutputSink& target; /**< Sink receiving the buffered output */
+	std::vector<char> buffer; /**< Buffered output */
+	size_t length; /**< Number of buffered characters */
+};
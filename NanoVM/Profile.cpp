@@ -0,0 +1,108 @@
+#include "Profile.h"
+#include <sstream>
+
+Profile::Profile(uint64_t codeSize) : instructions(0), opcodeCounts(), hits(codeSize), blockEntries(codeSize), blockTime(codeSize),
+	timeUnit(TimeUnit()), blockStart(0), blockTimestamp(0), nextOffset(0) {}
+
+void Profile::begin(uint64_t offset) {
+	if (offset >= hits.size()) {
+		// The run stops right away with IP out of bounds
+		nextOffset = offset;
+		return;
+	}
+	blockEntries[offset]++;
+	blockStart = offset;
+	nextOffset = offset;
+	blockTimestamp = timestamp();
+}
+
+void Profile::end() {
+	if (blockStart < blockTime.size()) {
+		blockTime[blockStart] += timestamp() - blockTimestamp;
+	}
+}
+
+const char* Profile::TimeUnit() {
+#ifdef NANOVM_PROFILE_RDTSC
+	return "cycles";
+#else
+	return "ns";
+#endif
+}
+
+bool Profile::Save(const std::string& file) const {
+	std::ofstream out(file);
+	if (!out.is_open()) {
+		return false;
+	}
+	// Only the non-zero counters are written, one per line
+	out << "nanoprofile 1\n";
+	out << "unit " << timeUnit << "\n";
+	out << "instructions " << instructions << "\n";
+	for (uint32_t opcode = 0; opcode < PROFILE_OPCODE_COUNT; opcode++) {
+		for (uint32_t size = 0; size < 4; size++) {
+			if (opcodeCounts[opcode][size]) {
+				out << "opcode " << opcode << " " << size << " " << opcodeCounts[opcode][size] << "\n";
+			}
+		}
+	}
+	for (uint64_t offset = 0; offset < hits.size(); offset++) {
+		if (hits[offset]) {
+			out << "hit " << offset << " " << hits[offset] << "\n";
+		}
+	}
+	for (uint64_t offset = 0; offset < blockEntries.size(); offset++) {
+		if (blockEntries[offset]) {
+			out << "block " << offset << " " << blockEntries[offset] << " " << blockTime[offset] << "\n";
+		}
+	}
+	return out.good();
+}
+
+bool Profile::Load(const std::string& file) {
+	std::ifstream in(file);
+	std::string line;
+	if (!std::getline(in, line) || line != "nanoprofile 1") {
+		return false;
+	}
+	*this = Profile();
+	while (std::getline(in, line)) {
+		std::istringstream values(line);
+		std::string key;
+		values >> key;
+		if (key == "unit") {
+			values >> timeUnit;
+		}
+		else if (key == "instructions") {
+			values >> instructions;
+		}
+		else if (key == "opcode") {
+			uint32_t opcode, size;
+			uint64_t count;
+			if (!(values >> opcode >> size >> count) || opcode >= PROFILE_OPCODE_COUNT || size >= 4) {
+				return false;
+			}
+			opcodeCounts[opcode][size] = count;
+		}
+		else if (key == "hit" || key == "block") {
+			uint64_t offset, count, time = 0;
+			if (!(values >> offset >> count) || (key == "block" && !(values >> time))) {
+				return false;
+			}
+			// The offsets are in increasing order so the counters grow to the last one
+			if (offset >= hits.size()) {
+				hits.resize(offset + 1);
+				blockEntries.resize(offset + 1);
+				blockTime.resize(offset + 1);
+			}
+			if (key == "hit") {
+				hits[offset] = count;
+			}
+			else {
+				blockEntries[offset] = count;
+				blockTime[offset] = time;
+			}
+		}
+	}
+	return true;
+}
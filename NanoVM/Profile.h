@@ -0,0 +1,116 @@
+#pragma once
+#include "NanoVM.h"
+#include <string>
+#include <chrono>
+
+#if defined(__x86_64__) || defined(_M_X64)
+#if defined(_MSC_VER)
+#include <intrin.h>
+#else
+#include <x86intrin.h>
+#endif
+#define NANOVM_PROFILE_RDTSC
+#endif
+
+#ifdef NANOVM_PROFILE
+#define NANOVM_PROFILE_RECORD(offset, inst) profile->record(offset, inst)
+#else
+#define NANOVM_PROFILE_RECORD(offset, inst)
+#endif
+
+/**
+ * Number of opcodes the profile counts. The vector opcodes follow the 32 base opcodes
+*/
+constexpr uint32_t PROFILE_OPCODE_COUNT = VECTOR_OPCODE_BASE + VStore + 1;
+
+/**
+ * \brief Profile holds the execution counters of a profiled VM
+ *
+ * The VM records the profile only when built with NANOVM_PROFILE. Every executed instruction is counted by its opcode
+ * and source size (lane size of the vector instructions) and by its offset in the code pages. The time is sampled once
+ * per basic block: a block starts at the target of every taken branch, call or return and its time is read from the
+ * time stamp counter (nanoseconds on hosts without one) when the next block starts. Fused instruction sequences are
+ * counted as their first instruction, which is why the profiled VM does not fuse by default.
+ * The profile is saved as text which NanoDebugger --profile annotates with the disassembly
+*/
+class Profile {
+public:
+	/**
+	 * Initializes an empty profile
+	 * @param codeSize Size of the code pages the offsets are in
+	*/
+	Profile(uint64_t codeSize = 0);
+
+	/**
+	 * Starts a block at the offset the program continues running from
+	*/
+	void begin(uint64_t offset);
+
+	/**
+	 * Counts an instruction about to be executed. Ends the current block and starts a new one if the instruction does
+	 * not follow the previous one
+	 * @param offset Offset of the instruction
+	 * @param inst Decoded instruction
+	*/
+	inline void record(uint64_t offset, const Instruction& inst) {
+		if (offset != nextOffset) {
+			uint64_t now = timestamp();
+			blockTime[blockStart] += now - blockTimestamp;
+			blockEntries[offset]++;
+			blockStart = offset;
+			blockTimestamp = now;
+		}
+		instructions++;
+		opcodeCounts[inst.opcode][inst.srcSize]++;
+		hits[offset]++;
+		nextOffset = offset + (inst.fusedSize ? inst.fusedSize : inst.instructionSize);
+	}
+
+	/**
+	 * Ends the current block when the program stops running
+	*/
+	void end();
+
+	/**
+	 * Saves the profile as text
+	 * @param file File to write
+	 * @return True if the file was written
+	*/
+	bool Save(const std::string& file) const;
+
+	/**
+	 * Loads a profile saved by Save()
+	 * @param file File to read
+	 * @return True if the file was a valid profile
+	*/
+	bool Load(const std::string& file);
+
+	/**
+	 * @return Current time in the unit returned by TimeUnit()
+	*/
+	static inline uint64_t timestamp();
+
+	/**
+	 * @return Unit of the block times: "cycles" or "ns"
+	*/
+	static const char* TimeUnit();
+
+	uint64_t instructions; /**< Number of executed instructions */
+	std::array<std::array<uint64_t, 4>, PROFILE_OPCODE_COUNT> opcodeCounts; /**< Executed instructions by opcode and size */
+	std::vector<uint64_t> hits; /**< Executions of the instruction at each offset */
+	std::vector<uint64_t> blockEntries; /**< Number of times a block started at each offset */
+	std::vector<uint64_t> blockTime; /**< Time spent in the block starting at each offset */
+	std::string timeUnit; /**< Unit of the block times */
+private:
+	uint64_t blockStart; /**< Offset the current block started at */
+	uint64_t blockTimestamp; /**< Time the current block started at */
+	uint64_t nextOffset; /**< Offset of the instruction following the previous one */
+};
+
+inline uint64_t Profile::timestamp() {
+#ifdef NANOVM_PROFILE_RDTSC
+	return __rdtsc();
+#else
+	return static_cast<uint64_t>(std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now().time_since_epoch()).count());
+#endif
+}
@@ -0,0 +1,230 @@
+#include "NanoVM.h"
+#include "Handlers.h"
+#include "Profile.h"
+#include "Trace.h"
+
+/**
+ * Threaded execution engine. Every opcode, source size and operand kind combination has its own handler so the
+ * operand kind is resolved once when the instruction is decoded instead of on every execution.
+ * With GCC and Clang the handlers are dispatched with direct threading (labels as values), other compilers
+ * use a portable switch over the handler index. Define NANOVM_NO_COMPUTED_GOTO to force the switch dispatch.
+ * Fused instruction sequences (see NanoProgram::fuse()) have their own labels after the single instruction handlers
+ * and the vector instructions have theirs after the fused ones. The instructions at breakpoints are decoded to
+ * BREAKPOINT_HANDLER while NanoVM::runToBreakpoint() runs so the engine checks the breakpoints only when it decodes.
+ * The engine is instantiated separately for guarded memory where the handlers leave the bounds checks to the guard pages.
+*/
+
+#if (defined(__GNUC__) || defined(__clang__)) && !defined(NANOVM_NO_COMPUTED_GOTO)
+#define NANOVM_COMPUTED_GOTO
+#endif
+
+// Generates a handler label for every operand kind of the given opcode
+#define THREADED_SIZE_KINDS(X, OP, S) \
+	X(OP, S, 0, 0, 0) X(OP, S, 0, 0, 1) X(OP, S, 0, 1, 0) X(OP, S, 0, 1, 1) \
+	X(OP, S, 1, 0, 0) X(OP, S, 1, 0, 1) X(OP, S, 1, 1, 0) X(OP, S, 1, 1, 1)
+
+#define THREADED_KINDS(X, OP) \
+	THREADED_SIZE_KINDS(X, OP, Byte) \
+	THREADED_SIZE_KINDS(X, OP, Short) \
+	THREADED_SIZE_KINDS(X, OP, Dword) \
+	THREADED_SIZE_KINDS(X, OP, Qword)
+
+// Handlers are listed in the order of handlerIndex()
+#define THREADED_HANDLERS(X) \
+	THREADED_KINDS(X, Mov) THREADED_KINDS(X, Add) THREADED_KINDS(X, Sub) THREADED_KINDS(X, And) \
+	THREADED_KINDS(X, Or) THREADED_KINDS(X, Xor) THREADED_KINDS(X, Sar) THREADED_KINDS(X, Sal) \
+	THREADED_KINDS(X, Ror) THREADED_KINDS(X, Rol) THREADED_KINDS(X, Mul) THREADED_KINDS(X, Div) \
+	THREADED_KINDS(X, Mod) THREADED_KINDS(X, Cmp) THREADED_KINDS(X, Jz) THREADED_KINDS(X, Jnz) \
+	THREADED_KINDS(X, Jg) THREADED_KINDS(X, Js) THREADED_KINDS(X, Jmp) THREADED_KINDS(X, Not) \
+	THREADED_KINDS(X, Inc) THREADED_KINDS(X, Dec) THREADED_KINDS(X, Ret) THREADED_KINDS(X, Call) \
+	THREADED_KINDS(X, Push) THREADED_KINDS(X, Pop) THREADED_KINDS(X, Halt) THREADED_KINDS(X, Printi) \
+	THREADED_KINDS(X, Prints) THREADED_KINDS(X, Printc) THREADED_KINDS(X, Syscall) THREADED_KINDS(X, Memcpy)
+
+// Generates a fused compare and branch label for every compare source kind and branch
+#define THREADED_COMPARE_KINDS(X, STEP, BRANCH) \
+	X(STEP, BRANCH, Byte, 0) X(STEP, BRANCH, Byte, 1) X(STEP, BRANCH, Short, 0) X(STEP, BRANCH, Short, 1) \
+	X(STEP, BRANCH, Dword, 0) X(STEP, BRANCH, Dword, 1) X(STEP, BRANCH, Qword, 0) X(STEP, BRANCH, Qword, 1)
+
+#define THREADED_COMPARE_BRANCHES(X, STEP) \
+	THREADED_COMPARE_KINDS(X, STEP, Jz) THREADED_COMPARE_KINDS(X, STEP, Jnz) \
+	THREADED_COMPARE_KINDS(X, STEP, Jg) THREADED_COMPARE_KINDS(X, STEP, Js)
+
+// Fused handlers are listed in the order of compareBranchIndex() and moveAddIndex()
+#define THREADED_FUSED_HANDLERS(X, Y) \
+	THREADED_COMPARE_BRANCHES(X, Cmp) THREADED_COMPARE_BRANCHES(X, Inc) THREADED_COMPARE_BRANCHES(X, Dec) \
+	Y(0, 0) Y(0, 1) Y(1, 0) Y(1, 1)
+
+// Generates a vector instruction label for every lane size and width
+#define THREADED_VECTOR_LANES(X, OP) \
+	X(OP, Byte, 0) X(OP, Byte, 1) X(OP, Short, 0) X(OP, Short, 1) \
+	X(OP, Dword, 0) X(OP, Dword, 1) X(OP, Qword, 0) X(OP, Qword, 1)
+
+// Vector handlers are listed in the order of vectorIndex()
+#define THREADED_VECTOR_HANDLERS(X) \
+	THREADED_VECTOR_LANES(X, VAdd) THREADED_VECTOR_LANES(X, VSub) THREADED_VECTOR_LANES(X, VAnd) \
+	THREADED_VECTOR_LANES(X, VOr) THREADED_VECTOR_LANES(X, VXor) THREADED_VECTOR_LANES(X, VCmpEq) \
+	THREADED_VECTOR_LANES(X, VCmpGt) THREADED_VECTOR_LANES(X, VLoad) THREADED_VECTOR_LANES(X, VStore)
+
+#ifdef NANOVM_COMPUTED_GOTO
+#define THREADED_LABEL(OP, S, DM, SM, T) handler_##OP##_##S##_##DM##_##SM##_##T:
+#define THREADED_ADDRESS(OP, S, DM, SM, T) &&handler_##OP##_##S##_##DM##_##SM##_##T,
+#define THREADED_COMPARE_BRANCH_LABEL(STEP, BRANCH, S, T) handler_##STEP##_##BRANCH##_##S##_##T:
+#define THREADED_COMPARE_BRANCH_ADDRESS(STEP, BRANCH, S, T) &&handler_##STEP##_##BRANCH##_##S##_##T,
+#define THREADED_MOVE_ADD_LABEL(MT, AT) handler_MovAdd_##MT##_##AT:
+#define THREADED_MOVE_ADD_ADDRESS(MT, AT) &&handler_MovAdd_##MT##_##AT,
+#define THREADED_VECTOR_LABEL(OP, LANE, W) handler_##OP##_##LANE##_##W:
+#define THREADED_VECTOR_ADDRESS(OP, LANE, W) &&handler_##OP##_##LANE##_##W,
+#define THREADED_DISPATCH() goto *handlers[inst->handler]
+#else
+#define THREADED_LABEL(OP, S, DM, SM, T) case handlerIndex(Opcodes::OP, Size::S, DM, SM, T):
+#define THREADED_COMPARE_BRANCH_LABEL(STEP, BRANCH, S, T) case compareBranchIndex(Opcodes::STEP, Opcodes::BRANCH, Size::S, T):
+#define THREADED_MOVE_ADD_LABEL(MT, AT) case moveAddIndex(MT, AT):
+#define THREADED_VECTOR_LABEL(OP, LANE, W) case vectorIndex(OP, Size::LANE, W):
+#define THREADED_DISPATCH() continue
+#endif
+
+// Fetches the cached instruction pointed by IP and jumps to its handler
+#define THREADED_FETCH() \
+	if (pc >= codeSize) { \
+		goto outOfBounds; \
+	} \
+	inst = cache + pc; \
+	if (!inst->instructionSize) { \
+		decodeCached(pc, *inst); \
+	} \
+	NANOVM_PROFILE_RECORD(pc, *inst);
+
+// Records the executed instruction while tracing, counts the COUNT instructions it executed while counting and stops after
+// it if it accessed a watched page. inst still points to it since the next one has not been fetched. A single branch is
+// taken when none of them is enabled
+#define THREADED_OBSERVE(COUNT) \
+	if (observed) { \
+		if (tracing) { \
+			traceStep(inst - cache, *inst); \
+		} \
+		counted += (COUNT); \
+		if (counted >= limit || watchFaultCount) { \
+			goto observedStop; \
+		} \
+	}
+
+#define THREADED_JUMP() { \
+	THREADED_FETCH() \
+	THREADED_DISPATCH(); \
+}
+
+// The handler templates are inlined in to each label so every label is a complete specialized handler
+#define THREADED_HANDLER(OP, S, DM, SM, T) \
+	THREADED_LABEL(OP, S, DM, SM, T) { \
+		if (Opcodes::OP == Opcodes::Halt) { \
+			cpu.registers[ip] = pc; \
+			instructionCount = counted; \
+			return cpu.registers[Reg0]; \
+		} \
+		if (Guarded && observed) { \
+			/* A fault in the guard region jumps out of the engine without writing the count back */ \
+			instructionCount = counted; \
+		} \
+		if (!Handlers::execute<Opcodes::OP, Size::S, DM, SM, T ? DataType::Immediate : DataType::Reg, Guarded>(*this, *inst, pc)) { \
+			goto fail; \
+		} \
+		THREADED_OBSERVE(1) \
+		THREADED_JUMP(); \
+	}
+
+#define THREADED_COMPARE_BRANCH_HANDLER(STEP, BRANCH, S, T) \
+	THREADED_COMPARE_BRANCH_LABEL(STEP, BRANCH, S, T) { \
+		Handlers::executeCompareBranch<Opcodes::STEP, Opcodes::BRANCH, Size::S, T ? DataType::Immediate : DataType::Reg>(*this, *inst, pc); \
+		THREADED_OBSERVE((Opcodes::STEP == Opcodes::Cmp) ? 2 : 3) \
+		THREADED_JUMP(); \
+	}
+
+#define THREADED_MOVE_ADD_HANDLER(MT, AT) \
+	THREADED_MOVE_ADD_LABEL(MT, AT) { \
+		Handlers::executeMoveAdd<MT ? DataType::Immediate : DataType::Reg, AT ? DataType::Immediate : DataType::Reg>(*this, *inst, pc); \
+		THREADED_OBSERVE(2) \
+		THREADED_JUMP(); \
+	}
+
+#define THREADED_VECTOR_HANDLER(OP, LANE, W) \
+	THREADED_VECTOR_LABEL(OP, LANE, W) { \
+		if (Guarded && observed) { \
+			instructionCount = counted; \
+		} \
+		if (!Handlers::executeVector<OP, Size::LANE, W, Guarded>(*this, *inst, pc)) { \
+			goto fail; \
+		} \
+		THREADED_OBSERVE(1) \
+		THREADED_JUMP(); \
+	}
+
+template<bool Guarded> uint64_t NanoVM::runThreaded() {
+#ifdef NANOVM_COMPUTED_GOTO
+	static const void* const handlers[TOTAL_HANDLER_COUNT + 1] = {
+		THREADED_HANDLERS(THREADED_ADDRESS)
+		THREADED_FUSED_HANDLERS(THREADED_COMPARE_BRANCH_ADDRESS, THREADED_MOVE_ADD_ADDRESS)
+		THREADED_VECTOR_HANDLERS(THREADED_VECTOR_ADDRESS)
+		&&breakpoint
+	};
+#endif
+	// The IP is kept in a local variable and written back to the CPU when the execution stops
+	uint64_t pc = cpu.registers[ip];
+	const uint64_t codeSize = cpu.codeSize;
+	Instruction* const cache = instructionCache.data();
+	Instruction* inst;
+	TraceRecorder* const tracing = trace.get();
+	// The count is kept in a local variable as well and written back when the execution stops
+	uint64_t counted = instructionCount;
+	const uint64_t limit = instructionLimit;
+	const bool observed = tracing || limit != NO_INSTRUCTION_LIMIT || watchpointsArmed;
+
+#ifdef NANOVM_COMPUTED_GOTO
+	THREADED_JUMP();
+	THREADED_HANDLERS(THREADED_HANDLER)
+	THREADED_FUSED_HANDLERS(THREADED_COMPARE_BRANCH_HANDLER, THREADED_MOVE_ADD_HANDLER)
+	THREADED_VECTOR_HANDLERS(THREADED_VECTOR_HANDLER)
+#else
+	THREADED_FETCH()
+	while (true) {
+		switch (inst->handler) {
+			THREADED_HANDLERS(THREADED_HANDLER)
+			THREADED_FUSED_HANDLERS(THREADED_COMPARE_BRANCH_HANDLER, THREADED_MOVE_ADD_HANDLER)
+			THREADED_VECTOR_HANDLERS(THREADED_VECTOR_HANDLER)
+		case BREAKPOINT_HANDLER:
+			goto breakpoint;
+		}
+	}
+#endif
+
+breakpoint:
+	// The other engines decode the instruction again without the trap
+	inst->instructionSize = 0;
+	cpu.registers[ip] = pc;
+	instructionCount = counted;
+	return 0;
+
+observedStop:
+	// Counted up to the limit or accessed a watched page. The next instruction has not been fetched
+	cpu.registers[ip] = pc;
+	instructionCount = counted;
+	watchedInstruction = inst - cache;
+	return 0;
+
+outOfBounds:
+	cpu.registers[ip] = pc;
+	instructionCount = counted;
+	reportIpOutOfBounds();
+	return 3;
+fail:
+	cpu.registers[ip] = pc;
+	instructionCount = counted;
+	switch (errorFlag) {
+	case MEMORY_ACCESS:
+		return 1;
+	default:
+		return 2;
+	}
+}
+
+template uint64_t NanoVM::runThreaded<false>();
+template uint64_t NanoVM::runThreaded<true>();
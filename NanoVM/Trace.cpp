@@ -0,0 +1,95 @@
+#include "Trace.h"
+#include <algorithm>
+#include <chrono>
+
+TraceRecorder::TraceRecorder(const std::string& fileName, uint64_t bytecodeSize) :
+	buffer(TRACE_BUFFER_RECORDS), head(0), cachedTail(0), produced(0), consumed(0), stopping(false) {
+	file = fopen(fileName.c_str(), "wb");
+	if (!file) {
+		return;
+	}
+	TraceHeader header = { { 'N', 'A', 'N', 'O', 'T', 'R', 'C', 'E' }, TRACE_VERSION, sizeof(TraceRecord), bytecodeSize };
+	fwrite(&header, sizeof(header), 1, file);
+	writer = std::thread(&TraceRecorder::write, this);
+}
+
+TraceRecorder::~TraceRecorder() {
+	if (!file) {
+		return;
+	}
+	publish();
+	stopping.store(true, std::memory_order_release);
+	writer.join();
+	fclose(file);
+}
+
+bool TraceRecorder::IsOpen() const {
+	return file != nullptr;
+}
+
+void TraceRecorder::publish() {
+	produced.store(head, std::memory_order_release);
+}
+
+void TraceRecorder::flush() {
+	if (!file) {
+		return;
+	}
+	publish();
+	while (consumed.load(std::memory_order_acquire) != head) {
+		std::this_thread::yield();
+	}
+	cachedTail = head;
+	fflush(file);
+}
+
+bool TraceRecorder::waitForSpace() {
+	if (!file) {
+		return false;
+	}
+	// The writer may be waiting for the batch that is not yet full
+	publish();
+	while ((cachedTail = consumed.load(std::memory_order_acquire)) + TRACE_BUFFER_RECORDS <= head) {
+		std::this_thread::yield();
+	}
+	return true;
+}
+
+void TraceRecorder::write() {
+	while (true) {
+		// Records published before stopping was set are written before the thread exits
+		bool stop = stopping.load(std::memory_order_acquire);
+		uint64_t end = produced.load(std::memory_order_acquire);
+		uint64_t begin = consumed.load(std::memory_order_relaxed);
+		if (begin == end) {
+			if (stop) {
+				return;
+			}
+			std::this_thread::sleep_for(std::chrono::microseconds(100));
+			continue;
+		}
+		// The published range may wrap around the end of the ring buffer
+		while (begin < end) {
+			size_t index = begin & (TRACE_BUFFER_RECORDS - 1);
+			size_t count = static_cast<size_t>(std::min<uint64_t>(end - begin, TRACE_BUFFER_RECORDS - index));
+			fwrite(&buffer[index], sizeof(TraceRecord), count, file);
+			begin += count;
+		}
+		consumed.store(end, std::memory_order_release);
+	}
+}
+
+bool TraceRecorder::Read(const std::string& fileName, TraceHeader& header, std::vector<TraceRecord>& records) {
+	std::ifstream file(fileName, std::ios::binary);
+	if (!file.read(reinterpret_cast<char*>(&header), sizeof(header)) || memcmp(header.magic, "NANOTRCE", sizeof(header.magic)) ||
+		header.version != TRACE_VERSION || header.recordSize != sizeof(TraceRecord)) {
+		return false;
+	}
+	// A trace of a process that crashed may end with a partial record which is ignored
+	TraceRecord record;
+	records.clear();
+	while (file.read(reinterpret_cast<char*>(&record), sizeof(record))) {
+		records.push_back(record);
+	}
+	return true;
+}
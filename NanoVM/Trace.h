@@ -0,0 +1,185 @@
+#pragma once
+#include "NanoVM.h"
+#include <atomic>
+#include <cstdio>
+#include <string>
+#include <thread>
+
+/**
+ * Number of records the ring buffer of a trace holds. Must be a power of two
+*/
+constexpr size_t TRACE_BUFFER_RECORDS = 64 * 1024;
+
+/**
+ * Records are handed to the writer thread in batches of this many records. Must be a power of two
+*/
+constexpr uint64_t TRACE_BATCH_RECORDS = 256;
+
+/**
+ * Value of TraceRecord::reg when the instruction did not change a register
+*/
+constexpr uint8_t TRACE_NO_REGISTER = 0xFF;
+
+/**
+ * Current version of the trace file format
+*/
+constexpr uint32_t TRACE_VERSION = 1;
+
+/**
+ * TraceRecordKind defines what a trace record describes
+*/
+enum TraceRecordKind : uint8_t {
+	TraceStep, /**< An instruction or a fused instruction sequence at ip was executed. reg holds the register it changed */
+	TraceSyscallResult, /**< Value of reg after the syscall executed by the preceding step. Syscalls are not replayed */
+	TraceStart, /**< Value of reg when Run() was called. Written for every register, opcode holds 1 if fusion was enabled */
+	TraceReset, /**< The VM was reset */
+	TraceEnd /**< Run() returned the value at ip */
+};
+
+/**
+ * TraceRecord is a single 16 byte record of the trace file
+*/
+struct TraceRecord {
+	uint32_t ip; /**< Offset of the instruction */
+	uint8_t kind; /**< See TraceRecordKind */
+	uint8_t opcode; /**< Opcode of the instruction. The first instruction of a fused sequence */
+	uint8_t reg; /**< Register the record holds the value of, TRACE_NO_REGISTER if none */
+	uint8_t reserved; /**< Always 0 */
+	uint64_t value; /**< Value of the register */
+};
+
+/**
+ * TraceHeader is at the beginning of every trace file and is followed by the records
+*/
+struct TraceHeader {
+	char magic[8]; /**< "NANOTRCE" */
+	uint32_t version; /**< TRACE_VERSION */
+	uint32_t recordSize; /**< sizeof(TraceRecord) */
+	uint64_t bytecodeSize; /**< Size of the traced program. The trace can only be replayed with the same program */
+};
+
+/**
+ * @return Register the instruction changes which the trace records the value of, TRACE_NO_REGISTER if none.
+ * Writes to memory are not recorded, they are rebuilt by replaying the instructions
+*/
+constexpr uint8_t traceRegister(const Instruction& inst) {
+	if (inst.opcode <= Opcodes::Mod) {
+		return inst.isDstMem ? TRACE_NO_REGISTER : inst.dstReg;
+	}
+	switch (inst.opcode) {
+	case Opcodes::Cmp:
+		return flags;
+	case Opcodes::Inc:
+	case Opcodes::Dec:
+		return (inst.isSrcMem || inst.srcType != DataType::Reg) ? TRACE_NO_REGISTER : inst.srcReg;
+	case Opcodes::Pop:
+		return inst.isDstMem ? static_cast<uint8_t>(esp) : inst.dstReg;
+	case Opcodes::Call:
+	case Opcodes::Ret:
+	case Opcodes::Push:
+		return esp;
+	case Opcodes::Memcpy:
+		return (inst.dstReg == BulkOperation::BulkCompare) ? static_cast<uint8_t>(flags) : (inst.dstReg == BulkOperation::BulkSearch) ? static_cast<uint8_t>(Reg0) : TRACE_NO_REGISTER;
+	default:
+		return TRACE_NO_REGISTER;
+	}
+}
+
+/**
+ * \brief TraceRecorder writes the execution trace of a VM to a file
+ *
+ * The VM appends the records to a lock-free single producer single consumer ring buffer and a writer thread writes them
+ * to the file. The records are published to the writer in batches so the VM only touches the shared indices once per
+ * TRACE_BATCH_RECORDS records. If the writer falls behind the VM waits for it rather than dropping records.
+ * The trace is replayed with NanoReplay which executes the program again to rebuild the registers and the memory at any
+ * step. The program is deterministic apart from the syscalls whose results are recorded. Memory written by the host
+ * functions of the syscalls is not recorded
+*/
+class TraceRecorder {
+public:
+	/**
+	 * Creates the trace file and starts the writer thread
+	 * @param file File to write
+	 * @param bytecodeSize Size of the traced program
+	*/
+	TraceRecorder(const std::string& file, uint64_t bytecodeSize);
+
+	/**
+	 * Writes the remaining records and closes the file
+	*/
+	~TraceRecorder();
+
+	/**
+	 * @return True if the file was created
+	*/
+	bool IsOpen() const;
+
+	/**
+	 * Appends a record to the ring buffer
+	*/
+	inline void record(uint64_t offset, uint8_t kind, uint8_t opcode, uint8_t reg, uint64_t value) {
+		if (head - cachedTail >= TRACE_BUFFER_RECORDS && !waitForSpace()) {
+			return;
+		}
+		TraceRecord& record = buffer[head & (TRACE_BUFFER_RECORDS - 1)];
+		record.ip = static_cast<uint32_t>(offset);
+		record.kind = kind;
+		record.opcode = opcode;
+		record.reg = reg;
+		record.reserved = 0;
+		record.value = value;
+		if (!(++head & (TRACE_BATCH_RECORDS - 1))) {
+			produced.store(head, std::memory_order_release);
+		}
+	}
+
+	/**
+	 * Hands the records of an incomplete batch to the writer thread without waiting for them to be written
+	*/
+	void publish();
+
+	/**
+	 * Waits until the writer thread has written every record to the file
+	*/
+	void flush();
+
+	/**
+	 * Reads a trace file
+	 * @param file File to read
+	 * @param[out] header Header of the file
+	 * @param[out] records Records of the file
+	 * @return True if the file is a valid trace
+	*/
+	static bool Read(const std::string& file, TraceHeader& header, std::vector<TraceRecord>& records);
+private:
+	/**
+	 * Waits until the writer thread has made room in the ring buffer
+	 * @return True if there is room, false if the writer has stopped
+	*/
+	bool waitForSpace();
+
+	/**
+	 * Writer thread. Writes the published records to the file until the recorder is destroyed
+	*/
+	void write();
+
+	std::vector<TraceRecord> buffer; /**< Ring buffer of TRACE_BUFFER_RECORDS records */
+	uint64_t head; /**< Number of records appended. Only used by the VM */
+	uint64_t cachedTail; /**< Value of consumed the VM read last. Saves reading the shared index on every record */
+	std::atomic<uint64_t> produced; /**< Number of records published to the writer */
+	std::atomic<uint64_t> consumed; /**< Number of records the writer has written */
+	std::atomic<bool> stopping; /**< Is the recorder being destroyed */
+	FILE* file; /**< Trace file, nullptr if it could not be created */
+	std::thread writer; /**< Thread writing the records to the file */
+};
+
+inline void NanoVM::traceStep(uint64_t offset, const Instruction& inst) {
+	uint8_t reg = traceRegister(inst);
+	trace->record(offset, TraceStep, inst.opcode, reg, (reg == TRACE_NO_REGISTER) ? 0 : cpu.registers[reg]);
+	// The host functions are not available when replaying so their results are recorded after the step
+	if (inst.opcode == Opcodes::Syscall) {
+		for (uint8_t i = Reg0; i <= Reg5; i++) {
+			trace->record(offset, TraceSyscallResult, inst.opcode, i, cpu.registers[i]);
+		}
+	}
+}
@@ -0,0 +1,114 @@
+#include "TraceReplay.h"
+#include <cstdio>
+
+ReplayVM::ReplayVM(const std::string& file) : NanoVM(file), steps(0), runs(0), returnValue(0) {
+	SetOutput(output);
+}
+
+ReplayVM::ReplayVM(std::shared_ptr<const NanoProgram> program) : NanoVM(program), steps(0), runs(0), returnValue(0) {
+	SetOutput(output);
+}
+
+uint64_t ReplayVM::bytecodeSize() const {
+	return cpu.bytecodeSize;
+}
+
+bool ReplayVM::replay(const std::vector<TraceRecord>& records, uint64_t stopStep) {
+	for (const TraceRecord& record : records) {
+		switch (record.kind) {
+		case TraceStart:
+			if (record.reg == Reg0) {
+				// Fused sequences are a single step so the cache has to be fused the same way
+				SetFusion(record.opcode != 0);
+			}
+			cpu.registers[record.reg] = record.value;
+			break;
+		case TraceReset:
+			Reset();
+			break;
+		case TraceSyscallResult:
+			cpu.registers[record.reg] = record.value;
+			break;
+		case TraceEnd:
+			runs++;
+			returnValue = record.value;
+			break;
+		case TraceStep:
+			if (steps == stopStep) {
+				return true;
+			}
+			if (!step(record)) {
+				return false;
+			}
+			steps++;
+			break;
+		default:
+			std::cout << "Unknown record kind " << static_cast<int>(record.kind) << std::endl;
+			return false;
+		}
+	}
+	return true;
+}
+
+void ReplayVM::printState(uint64_t memoryOffset, uint64_t memorySize) {
+	std::cout << "Step " << steps << ", runs completed " << runs << "\n";
+	std::cout << "ip: " << cpu.registers[ip] << "\n";
+	for (int i = Reg0; i <= esp; i++) {
+		std::cout << "reg" << i << ": " << cpu.registers[i] << "\n";
+	}
+	std::cout << "flags: " << cpu.registers[flags] << "\n";
+	for (uint32_t i = 0; i < VECTOR_REGISTER_COUNT; i++) {
+		std::printf("y%u:", i);
+		for (int j = VECTOR_REGISTER_SIZE - 1; j >= 0; j--) {
+			std::printf("%s%02X", (j % 8 == 7) ? " " : "", cpu.vectorRegisters[i][j]);
+		}
+		std::printf("\n");
+	}
+	if (memorySize) {
+		unsigned char* memory = GetMemory(memoryOffset, memorySize);
+		if (!memory) {
+			std::cout << "Memory range is outside of the VM memory" << std::endl;
+			return;
+		}
+		for (uint64_t i = 0; i < memorySize; i++) {
+			if (i % 16 == 0) {
+				std::printf("%s%08llX:", i ? "\n" : "", static_cast<unsigned long long>(memoryOffset + i));
+			}
+			std::printf(" %02X", memory[i]);
+		}
+		std::printf("\n");
+	}
+	std::cout.flush();
+}
+
+bool ReplayVM::step(const TraceRecord& record) {
+	uint64_t offset = cpu.registers[ip];
+	if (offset != record.ip || offset >= cpu.codeSize) {
+		std::cout << "Diverged at step " << steps << ": IP is " << offset << ", trace has " << record.ip << std::endl;
+		return false;
+	}
+	Instruction& inst = instructionCache[offset];
+	if (!inst.instructionSize) {
+		decode(offset, inst);
+	}
+	if (inst.opcode != record.opcode) {
+		std::cout << "Diverged at step " << steps << ": opcode at " << offset << " is " << static_cast<int>(inst.opcode)
+			<< ", trace has " << static_cast<int>(record.opcode) << std::endl;
+		return false;
+	}
+	// The results of the syscall follow the step
+	if (inst.opcode == Opcodes::Syscall) {
+		cpu.registers[ip] += inst.instructionSize;
+		return true;
+	}
+	if (!execute(inst)) {
+		std::cout << "Step " << steps << " at " << offset << " failed when replayed" << std::endl;
+		return false;
+	}
+	if (record.reg != TRACE_NO_REGISTER && cpu.registers[record.reg] != record.value) {
+		std::cout << "Diverged at step " << steps << ": register " << static_cast<int>(record.reg) << " is "
+			<< cpu.registers[record.reg] << ", trace has " << record.value << std::endl;
+		return false;
+	}
+	return true;
+}
@@ -0,0 +1,51 @@
+#pragma once
+#include "NanoVM.h"
+#include "Trace.h"
+
+/**
+ * \brief ReplayVM executes a program following its execution trace
+ *
+ * The program is executed again step by step from the trace and every step is checked against the recorded IP, opcode
+ * and changed register. The syscalls are not executed, their recorded results are written to the registers instead.
+*/
+class ReplayVM : public NanoVM {
+public:
+	/**
+	 * @param file Bytecode file of the traced program
+	*/
+	ReplayVM(const std::string& file);
+
+	/**
+	 * @param program Traced program
+	*/
+	ReplayVM(std::shared_ptr<const NanoProgram> program);
+
+	/**
+	 * @return Size of the loaded bytecode
+	*/
+	uint64_t bytecodeSize() const;
+
+	/**
+	 * Replays the trace until the given step
+	 * @param records Records of the trace
+	 * @param stopStep Number of steps to replay
+	 * @return True if the trace was replayed without the program diverging from it
+	*/
+	bool replay(const std::vector<TraceRecord>& records, uint64_t stopStep);
+
+	/**
+	 * Prints the registers and the given range of the memory
+	*/
+	void printState(uint64_t memoryOffset, uint64_t memorySize);
+
+	uint64_t steps; /**< Number of replayed steps */
+	uint64_t runs; /**< Number of replayed runs that returned */
+	uint64_t returnValue; /**< Value the last replayed run returned */
+	StringSink output; /**< Output of the replayed program */
+private:
+	/**
+	 * Executes the instruction of a step record and checks that the program follows the trace
+	 * @return True if the state of the VM matches the record
+	*/
+	bool step(const TraceRecord& record);
+};
@@ -0,0 +1,194 @@
+#include "VectorUnit.h"
+#include "Handlers.h"
+
+#ifdef NANOVM_VECTOR_INTRINSICS
+#include <immintrin.h>
+#if defined(_MSC_VER)
+#include <intrin.h>
+#define NANOVM_TARGET_AVX2
+#else
+#define NANOVM_TARGET_AVX2 __attribute__((target("avx2")))
+#endif
+#endif
+
+/**
+ * Portable kernel operating on one lane at a time
+*/
+template<VectorOpcodes Op, Size Lane, bool Wide> static void genericKernel(uint8_t* dst, const uint8_t* src) {
+	typedef typename SizeType<Lane>::Unsigned ULANE;
+	typedef typename SizeType<Lane>::Signed LANE;
+	constexpr size_t width = Wide ? 32 : 16;
+	for (size_t i = 0; i < width; i += sizeof(ULANE)) {
+		ULANE a, b, result;
+		memcpy(&a, dst + i, sizeof(a));
+		memcpy(&b, src + i, sizeof(b));
+		if constexpr (Op == VAdd) result = static_cast<ULANE>(a + b);
+		else if constexpr (Op == VSub) result = static_cast<ULANE>(a - b);
+		else if constexpr (Op == VAnd) result = a & b;
+		else if constexpr (Op == VOr) result = a | b;
+		else if constexpr (Op == VXor) result = a ^ b;
+		else if constexpr (Op == VCmpEq) result = (a == b) ? static_cast<ULANE>(~0) : 0;
+		else result = (static_cast<LANE>(a) > static_cast<LANE>(b)) ? static_cast<ULANE>(~0) : 0;
+		memcpy(dst + i, &result, sizeof(result));
+	}
+}
+
+#ifdef NANOVM_VECTOR_INTRINSICS
+/**
+ * @return True if SSE2 has an instruction for the opcode and lane size
+*/
+constexpr bool hasSse2(VectorOpcodes opcode, Size lane) {
+	return !(opcode == VCmpGt && lane == Size::Qword);
+}
+
+/**
+ * Executes the opcode on 128 bits with SSE2 which every x86-64 CPU supports
+*/
+template<VectorOpcodes Op, Size Lane> static NANOVM_INLINE __m128i sse2(__m128i a, __m128i b) {
+	if constexpr (Op == VAdd) {
+		if constexpr (Lane == Size::Byte) return _mm_add_epi8(a, b);
+		else if constexpr (Lane == Size::Short) return _mm_add_epi16(a, b);
+		else if constexpr (Lane == Size::Dword) return _mm_add_epi32(a, b);
+		else return _mm_add_epi64(a, b);
+	}
+	else if constexpr (Op == VSub) {
+		if constexpr (Lane == Size::Byte) return _mm_sub_epi8(a, b);
+		else if constexpr (Lane == Size::Short) return _mm_sub_epi16(a, b);
+		else if constexpr (Lane == Size::Dword) return _mm_sub_epi32(a, b);
+		else return _mm_sub_epi64(a, b);
+	}
+	else if constexpr (Op == VAnd) return _mm_and_si128(a, b);
+	else if constexpr (Op == VOr) return _mm_or_si128(a, b);
+	else if constexpr (Op == VXor) return _mm_xor_si128(a, b);
+	else if constexpr (Op == VCmpEq) {
+		if constexpr (Lane == Size::Byte) return _mm_cmpeq_epi8(a, b);
+		else if constexpr (Lane == Size::Short) return _mm_cmpeq_epi16(a, b);
+		else if constexpr (Lane == Size::Dword) return _mm_cmpeq_epi32(a, b);
+		else {
+			// 64 bit lanes are equal if both of their 32 bit halves are
+			__m128i equal = _mm_cmpeq_epi32(a, b);
+			return _mm_and_si128(equal, _mm_shuffle_epi32(equal, _MM_SHUFFLE(2, 3, 0, 1)));
+		}
+	}
+	else {
+		if constexpr (Lane == Size::Byte) return _mm_cmpgt_epi8(a, b);
+		else if constexpr (Lane == Size::Short) return _mm_cmpgt_epi16(a, b);
+		else return _mm_cmpgt_epi32(a, b);
+	}
+}
+
+/**
+ * Kernel executing 128 bits at a time with SSE2
+*/
+template<VectorOpcodes Op, Size Lane, bool Wide> static void sse2Kernel(uint8_t* dst, const uint8_t* src) {
+	constexpr size_t width = Wide ? 32 : 16;
+	for (size_t i = 0; i < width; i += sizeof(__m128i)) {
+		__m128i a = _mm_loadu_si128(reinterpret_cast<const __m128i*>(dst + i));
+		__m128i b = _mm_loadu_si128(reinterpret_cast<const __m128i*>(src + i));
+		_mm_storeu_si128(reinterpret_cast<__m128i*>(dst + i), sse2<Op, Lane>(a, b));
+	}
+}
+
+#ifndef NANOVM_NO_AVX2
+/**
+ * Kernel executing 256 bits at once with AVX2. Only selected if the CPU supports AVX2
+*/
+template<VectorOpcodes Op, Size Lane> static NANOVM_TARGET_AVX2 void avx2Kernel(uint8_t* dst, const uint8_t* src) {
+	__m256i a = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(dst));
+	__m256i b = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(src));
+	__m256i result;
+	if constexpr (Op == VAdd) {
+		if constexpr (Lane == Size::Byte) result = _mm256_add_epi8(a, b);
+		else if constexpr (Lane == Size::Short) result = _mm256_add_epi16(a, b);
+		else if constexpr (Lane == Size::Dword) result = _mm256_add_epi32(a, b);
+		else result = _mm256_add_epi64(a, b);
+	}
+	else if constexpr (Op == VSub) {
+		if constexpr (Lane == Size::Byte) result = _mm256_sub_epi8(a, b);
+		else if constexpr (Lane == Size::Short) result = _mm256_sub_epi16(a, b);
+		else if constexpr (Lane == Size::Dword) result = _mm256_sub_epi32(a, b);
+		else result = _mm256_sub_epi64(a, b);
+	}
+	else if constexpr (Op == VAnd) result = _mm256_and_si256(a, b);
+	else if constexpr (Op == VOr) result = _mm256_or_si256(a, b);
+	else if constexpr (Op == VXor) result = _mm256_xor_si256(a, b);
+	else if constexpr (Op == VCmpEq) {
+		if constexpr (Lane == Size::Byte) result = _mm256_cmpeq_epi8(a, b);
+		else if constexpr (Lane == Size::Short) result = _mm256_cmpeq_epi16(a, b);
+		else if constexpr (Lane == Size::Dword) result = _mm256_cmpeq_epi32(a, b);
+		else result = _mm256_cmpeq_epi64(a, b);
+	}
+	else {
+		if constexpr (Lane == Size::Byte) result = _mm256_cmpgt_epi8(a, b);
+		else if constexpr (Lane == Size::Short) result = _mm256_cmpgt_epi16(a, b);
+		else if constexpr (Lane == Size::Dword) result = _mm256_cmpgt_epi32(a, b);
+		else result = _mm256_cmpgt_epi64(a, b);
+	}
+	_mm256_storeu_si256(reinterpret_cast<__m256i*>(dst), result);
+}
+#endif
+#endif
+
+/**
+ * @return True if the host CPU and the operating system support AVX2
+*/
+static bool hasAvx2() {
+#if defined(NANOVM_VECTOR_INTRINSICS) && !defined(NANOVM_NO_AVX2)
+#if defined(_MSC_VER)
+	int info[4];
+	__cpuid(info, 0);
+	if (info[0] < 7) {
+		return false;
+	}
+	// The OS has to save the upper halves of the registers (OSXSAVE, AVX and the XMM and YMM state in XCR0)
+	__cpuid(info, 1);
+	if (!(info[2] & (1 << 27)) || !(info[2] & (1 << 28)) || (_xgetbv(0) & 6) != 6) {
+		return false;
+	}
+	__cpuidex(info, 7, 0);
+	return (info[1] & (1 << 5)) != 0;
+#else
+	// The kernels are selected by a static initializer which may run before the CPU model has been initialized
+	__builtin_cpu_init();
+	return __builtin_cpu_supports("avx2");
+#endif
+#else
+	return false;
+#endif
+}
+
+static const bool avx2Supported = hasAvx2();
+
+/**
+ * @return Kernel for the opcode, lane size and width encoded in the given vectorKernelIndex()
+*/
+template<size_t Index> static VectorKernel selectKernel() {
+	constexpr VectorOpcodes opcode = static_cast<VectorOpcodes>(Index >> 3);
+	constexpr Size lane = static_cast<Size>((Index >> 1) & 3);
+	constexpr bool wide = (Index & 1) != 0;
+#ifdef NANOVM_VECTOR_INTRINSICS
+#ifndef NANOVM_NO_AVX2
+	if (wide && avx2Supported) {
+		return &avx2Kernel<opcode, lane>;
+	}
+#endif
+	if constexpr (hasSse2(opcode, lane)) {
+		return &sse2Kernel<opcode, lane, wide>;
+	}
+#endif
+	return &genericKernel<opcode, lane, wide>;
+}
+
+template<size_t... Index> static std::array<VectorKernel, VECTOR_KERNEL_COUNT> selectKernels(std::index_sequence<Index...>) {
+	return { { selectKernel<Index>()... } };
+}
+
+const std::array<VectorKernel, VECTOR_KERNEL_COUNT> VectorUnit::kernels = selectKernels(std::make_index_sequence<VECTOR_KERNEL_COUNT>());
+
+const char* VectorUnit::InstructionSet() {
+#ifdef NANOVM_VECTOR_INTRINSICS
+	return avx2Supported ? "avx2" : "sse2";
+#else
+	return "generic";
+#endif
+}
@@ -0,0 +1,43 @@
+#pragma once
+#include "NanoVM.h"
+
+#if (defined(__x86_64__) || defined(_M_X64)) && !defined(NANOVM_NO_VECTOR_INTRINSICS)
+#define NANOVM_VECTOR_INTRINSICS
+#endif
+
+/**
+ * Kernel of a packed arithmetic vector instruction. Combines the lanes of the source register in to the destination register
+ * @param dst Destination vector register
+ * @param src Source vector register
+*/
+typedef void (*VectorKernel)(uint8_t* dst, const uint8_t* src);
+
+/**
+ * Number of kernels. Every arithmetic vector opcode has its own kernel for every lane size and width
+*/
+constexpr uint32_t VECTOR_KERNEL_COUNT = (VCmpGt + 1) * 4 * 2;
+
+/**
+ * @return Index of the kernel executing the given arithmetic vector opcode, lane size and width
+*/
+constexpr uint32_t vectorKernelIndex(unsigned int opcode, unsigned int lane, bool isWide) {
+	return (opcode * 4 + lane) * 2 + isWide;
+}
+
+/**
+ * \brief VectorUnit holds the host implementations of the packed arithmetic vector instructions
+ *
+ * The kernels are selected once for the host CPU when the program starts. On x86-64 the 128 bit instructions use SSE2
+ * and the 256 bit instructions use AVX2 if the CPU supports it, otherwise two SSE2 halves. Other hosts and the lane sizes
+ * SSE2 has no instruction for use portable loops over the lanes. Define NANOVM_NO_VECTOR_INTRINSICS to always use the
+ * loops and NANOVM_NO_AVX2 to never use AVX2.
+*/
+class VectorUnit {
+public:
+	/**
+	 * @return Name of the instruction set the 256 bit kernels use: "avx2", "sse2" or "generic"
+	*/
+	static const char* InstructionSet();
+
+	static const std::array<VectorKernel, VECTOR_KERNEL_COUNT> kernels; /**< Kernels indexed by vectorKernelIndex() */
+};
@@ -0,0 +1,368 @@
+#pragma once
+#include <cstdint>
+#include <cstddef>
+#include <cstring>
+
+/**
+ * X64Register defines the x86-64 general purpose registers in the order of their encoding
+*/
+enum X64Register : uint8_t {
+	RAX, RCX, RDX, RBX, RSP, RBP, RSI, RDI,
+	R8, R9, R10, R11, R12, R13, R14, R15
+};
+
+/**
+ * X64Condition defines the used condition codes of the conditional x86-64 instructions
+*/
+enum X64Condition : uint8_t {
+	Below = 0x2,
+	AboveEqual = 0x3,
+	Equal = 0x4,
+	NotEqual = 0x5,
+	BelowEqual = 0x6,
+	Above = 0x7
+};
+
+/**
+ * X64Alu defines the arithmetic and logic operations sharing the same encoding. The value is the /digit of the immediate form
+*/
+enum X64Alu : uint8_t {
+	AluAdd = 0,
+	AluOr = 1,
+	AluAnd = 4,
+	AluSub = 5,
+	AluXor = 6,
+	AluCmp = 7
+};
+
+/**
+ * X64Shift defines the shift operations. The value is the /digit of the instruction
+*/
+enum X64Shift : uint8_t {
+	ShiftLeft = 4,
+	ShiftRight = 5
+};
+
+/**
+ * \brief X64Emitter writes x86-64 machine code to a buffer
+ *
+ * X64Emitter implements encoding of the small subset of x86-64 instructions the JIT compiler uses. Operations are 64 bit
+ * unless the size is given. Memory operands are either [base + disp32] or [base + index * scale].
+ * Jumps return the position of their 32 bit relative offset so that they can be patched once the target is known.
+*/
+class X64Emitter {
+public:
+	/**
+	 * Initializes the emitter
+	 * @param code Buffer to write the machine code to
+	 * @param capacity Size of the buffer
+	*/
+	X64Emitter(uint8_t* code, size_t capacity) : begin(code), current(code), end(code + capacity) {}
+
+	/**
+	 * @return Position where the next instruction will be written
+	*/
+	uint8_t* position() const { return current; }
+
+	/**
+	 * @return Number of bytes left in the buffer
+	*/
+	size_t remaining() const { return end - current; }
+
+	/**
+	 * Moves the write position back to the given position discarding everything written after it
+	*/
+	void reset(uint8_t* position) { current = position; }
+
+	void mov(X64Register dst, X64Register src) { rex(true, src, 0, dst); byte(0x89); modrm(src, dst); }
+
+	/**
+	 * Moves the low 32 bits of src to dst zeroing the upper 32 bits of dst
+	*/
+	void mov32(X64Register dst, X64Register src) { rex(false, src, 0, dst); byte(0x89); modrm(src, dst); }
+
+	void movImmediate(X64Register dst, uint64_t value) {
+		if (value <= UINT32_MAX) {
+			// mov r32, imm32 zero extends
+			rex(false, 0, 0, dst);
+			byte(0xB8 + (dst & 7));
+			dword(static_cast<uint32_t>(value));
+		}
+		else if (static_cast<int64_t>(value) >= INT32_MIN && static_cast<int64_t>(value) < 0) {
+			// mov r64, imm32 sign extends
+			rex(true, 0, 0, dst);
+			byte(0xC7);
+			modrm(0, dst);
+			dword(static_cast<uint32_t>(value));
+		}
+		else {
+			rex(true, 0, 0, dst);
+			byte(0xB8 + (dst & 7));
+			qword(value);
+		}
+	}
+
+	void alu(X64Alu op, X64Register dst, X64Register src) { rex(true, src, 0, dst); byte((op << 3) | 1); modrm(src, dst); }
+
+	/**
+	 * ALU operation with a sign extended 32 bit immediate value
+	*/
+	void aluImmediate(X64Alu op, X64Register dst, int32_t value) {
+		rex(true, 0, 0, dst);
+		if (value >= INT8_MIN && value <= INT8_MAX) {
+			byte(0x83);
+			modrm(op, dst);
+			byte(static_cast<uint8_t>(value));
+		}
+		else {
+			byte(0x81);
+			modrm(op, dst);
+			dword(static_cast<uint32_t>(value));
+		}
+	}
+
+	/**
+	 * ALU operation with the 64 bit value at [base + disp] as the source
+	*/
+	void aluMemory(X64Alu op, X64Register dst, X64Register base, int32_t disp) {
+		rex(true, dst, 0, base);
+		byte((op << 3) | 3);
+		modrmDisplacement(dst, base, disp);
+	}
+
+	void test32Immediate(X64Register dst, uint32_t value) { rex(false, 0, 0, dst); byte(0xF7); modrm(0, dst); dword(value); }
+
+	void imul(X64Register dst, X64Register src) { rex(true, dst, 0, src); byte(0x0F); byte(0xAF); modrm(dst, src); }
+
+	/**
+	 * Unsigned division of RDX:RAX. Quotient is stored to RAX and remainder to RDX
+	*/
+	void div(X64Register src) { rex(true, 0, 0, src); byte(0xF7); modrm(6, src); }
+
+	void inc(X64Register dst) { rex(true, 0, 0, dst); byte(0xFF); modrm(0, dst); }
+
+	void dec(X64Register dst) { rex(true, 0, 0, dst); byte(0xFF); modrm(1, dst); }
+
+	/**
+	 * Shifts by CL. 32 bit shifts use the low 5 bits of CL, 64 bit shifts the low 6 bits
+	*/
+	void shift(X64Shift op, X64Register dst, bool is64) { rex(is64, 0, 0, dst); byte(0xD3); modrm(op, dst); }
+
+	void shiftImmediate(X64Shift op, X64Register dst, uint8_t count) { rex(true, 0, 0, dst); byte(0xC1); modrm(op, dst); byte(count); }
+
+	void cmov(X64Condition condition, X64Register dst, X64Register src) {
+		rex(true, dst, 0, src);
+		byte(0x0F);
+		byte(0x40 + condition);
+		modrm(dst, src);
+	}
+
+	/**
+	 * Zero extends the low size bytes of src to dst
+	*/
+	void zeroExtend(X64Register dst, X64Register src, unsigned int size) {
+		switch (size) {
+		case 1:
+			// REX is required so that e.g. SIL is not encoded as DH
+			rex(false, dst, 0, src, true);
+			byte(0x0F);
+			byte(0xB6);
+			modrm(dst, src);
+			break;
+		case 2:
+			rex(false, dst, 0, src);
+			byte(0x0F);
+			byte(0xB7);
+			modrm(dst, src);
+			break;
+		case 4:
+			mov32(dst, src);
+			break;
+		default:
+			if (dst != src)
+				mov(dst, src);
+		}
+	}
+
+	/**
+	 * Sign extends the low size bytes of src to dst
+	*/
+	void signExtend(X64Register dst, X64Register src, unsigned int size) {
+		switch (size) {
+		case 1:
+			rex(true, dst, 0, src);
+			byte(0x0F);
+			byte(0xBE);
+			modrm(dst, src);
+			break;
+		case 2:
+			rex(true, dst, 0, src);
+			byte(0x0F);
+			byte(0xBF);
+			modrm(dst, src);
+			break;
+		case 4:
+			rex(true, dst, 0, src);
+			byte(0x63);
+			modrm(dst, src);
+			break;
+		default:
+			if (dst != src)
+				mov(dst, src);
+		}
+	}
+
+	/**
+	 * Moves the low 1 or 2 bytes of src to dst keeping the rest of dst
+	*/
+	void movNarrow(X64Register dst, X64Register src, unsigned int size) {
+		if (size == 2)
+			byte(0x66);
+		rex(false, src, 0, dst, true);
+		byte(size == 1 ? 0x88 : 0x89);
+		modrm(src, dst);
+	}
+
+	/**
+	 * Loads size bytes from [base + index] zero extended to dst
+	*/
+	void load(X64Register dst, X64Register base, X64Register index, unsigned int size) {
+		switch (size) {
+		case 1:
+			rex(false, dst, index, base);
+			byte(0x0F);
+			byte(0xB6);
+			break;
+		case 2:
+			rex(false, dst, index, base);
+			byte(0x0F);
+			byte(0xB7);
+			break;
+		case 4:
+			rex(false, dst, index, base);
+			byte(0x8B);
+			break;
+		default:
+			rex(true, dst, index, base);
+			byte(0x8B);
+		}
+		modrmIndexed(dst, base, index, 0);
+	}
+
+	/**
+	 * Stores the low size bytes of src to [base + index]
+	*/
+	void store(X64Register base, X64Register index, X64Register src, unsigned int size) {
+		if (size == 2)
+			byte(0x66);
+		rex(size == 8, src, index, base, size == 1);
+		byte(size == 1 ? 0x88 : 0x89);
+		modrmIndexed(src, base, index, 0);
+	}
+
+	/**
+	 * Loads 64 bits from [base + index * 8]
+	*/
+	void loadScaled(X64Register dst, X64Register base, X64Register index) {
+		rex(true, dst, index, base);
+		byte(0x8B);
+		modrmIndexed(dst, base, index, 3);
+	}
+
+	/**
+	 * Loads 64 bits from [base + disp]
+	*/
+	void loadDisplacement(X64Register dst, X64Register base, int32_t disp) {
+		rex(true, dst, 0, base);
+		byte(0x8B);
+		modrmDisplacement(dst, base, disp);
+	}
+
+	/**
+	 * Stores 64 bits to [base + disp]
+	*/
+	void storeDisplacement(X64Register base, int32_t disp, X64Register src) {
+		rex(true, src, 0, base);
+		byte(0x89);
+		modrmDisplacement(src, base, disp);
+	}
+
+	void lea(X64Register dst, X64Register base, int32_t disp) {
+		rex(true, dst, 0, base);
+		byte(0x8D);
+		modrmDisplacement(dst, base, disp);
+	}
+
+	void push(X64Register reg) { rex(false, 0, 0, reg); byte(0x50 + (reg & 7)); }
+
+	void pop(X64Register reg) { rex(false, 0, 0, reg); byte(0x58 + (reg & 7)); }
+
+	void ret() { byte(0xC3); }
+
+	void jmp(X64Register target) { rex(false, 0, 0, target); byte(0xFF); modrm(4, target); }
+
+	/**
+	 * @return Position of the relative offset to be patched
+	*/
+	uint8_t* jmp() { byte(0xE9); dword(0); return current - 4; }
+
+	/**
+	 * @return Position of the relative offset to be patched
+	*/
+	uint8_t* jcc(X64Condition condition) { byte(0x0F); byte(0x80 + condition); dword(0); return current - 4; }
+
+	void jmp(uint8_t* target) { patch(jmp(), target); }
+
+	void jcc(X64Condition condition, uint8_t* target) { patch(jcc(condition), target); }
+
+	/**
+	 * Sets the relative offset of a jump to point to the target
+	 * @param offset Position of the relative offset returned by jmp() or jcc()
+	 * @param target Jump target
+	*/
+	static void patch(uint8_t* offset, uint8_t* target) {
+		int32_t relative = static_cast<int32_t>(target - (offset + 4));
+		memcpy(offset, &relative, sizeof(relative));
+	}
+
+private:
+	void byte(uint8_t value) { *current++ = value; }
+	void dword(uint32_t value) { memcpy(current, &value, sizeof(value)); current += sizeof(value); }
+	void qword(uint64_t value) { memcpy(current, &value, sizeof(value)); current += sizeof(value); }
+
+	/**
+	 * Writes the REX prefix if it is needed
+	 * @param wide Is the operand size 64 bits
+	 * @param reg Register in the ModRM reg field
+	 * @param index Register in the SIB index field
+	 * @param base Register in the ModRM rm field or SIB base field
+	 * @param byteRegisters Force the prefix so that byte registers are SPL, BPL, SIL and DIL instead of AH, CH, DH and BH
+	*/
+	void rex(bool wide, unsigned int reg, unsigned int index, unsigned int base, bool byteRegisters = false) {
+		uint8_t value = 0x40 | (wide << 3) | ((reg >> 3) << 2) | ((index >> 3) << 1) | (base >> 3);
+		if (value != 0x40 || (byteRegisters && ((reg & 7) >= 4 || (base & 7) >= 4)))
+			byte(value);
+	}
+
+	void modrm(unsigned int reg, unsigned int rm) { byte(0xC0 | ((reg & 7) << 3) | (rm & 7)); }
+
+	void modrmDisplacement(unsigned int reg, unsigned int base, int32_t disp) {
+		byte(0x80 | ((reg & 7) << 3) | (base & 7));
+		if ((base & 7) == RSP)
+			byte(0x24);
+		dword(static_cast<uint32_t>(disp));
+	}
+
+	void modrmIndexed(unsigned int reg, unsigned int base, unsigned int index, unsigned int scale) {
+		// RBP and R13 as base require a displacement
+		bool displacement = (base & 7) == RBP;
+		byte((displacement ? 0x40 : 0x00) | ((reg & 7) << 3) | 0x04);
+		byte((scale << 6) | ((index & 7) << 3) | (base & 7));
+		if (displacement)
+			byte(0);
+	}
+
+	uint8_t* begin;
+	uint8_t* current;
+	uint8_t* end;
+};